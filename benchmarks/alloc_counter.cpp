@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2022, NVIDIA CORPORATION.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Counts heap allocations made on each thread, for
+// benchmarks/bench_allocations.py, which loads it with LD_PRELOAD. malloc
+// and its relatives, and operator new, are replaced with versions that
+// count the call and forward it to the C library. Allocations whose caller
+// is in the address range set with alloc_counter_set_range (the extension's
+// code) are also counted separately. Requires glibc.
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static uintptr_t range_start = 0;
+static uintptr_t range_end = 0;
+static thread_local unsigned long long thread_allocations = 0;
+static thread_local unsigned long long thread_range_allocations = 0;
+
+static inline void count(void *caller) {
+  thread_allocations++;
+  uintptr_t address = reinterpret_cast<uintptr_t>(caller);
+  if (address >= range_start && address < range_end)
+    thread_range_allocations++;
+}
+
+extern "C" {
+
+void alloc_counter_set_range(uintptr_t start, uintptr_t end) {
+  range_start = start;
+  range_end = end;
+}
+
+unsigned long long alloc_counter_thread_allocations() {
+  return thread_allocations;
+}
+
+unsigned long long alloc_counter_thread_range_allocations() {
+  return thread_range_allocations;
+}
+
+void *malloc(size_t size) {
+  count(__builtin_return_address(0));
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  count(__builtin_return_address(0));
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  count(__builtin_return_address(0));
+  return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  count(__builtin_return_address(0));
+  return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  count(__builtin_return_address(0));
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  count(__builtin_return_address(0));
+  void *p = __libc_memalign(alignment, size);
+  if (p == nullptr)
+    return 12; // ENOMEM
+  *ptr = p;
+  return 0;
+}
+
+} // extern "C"
+
+// operator new is counted where it is called, rather than where it calls
+// malloc inside the C++ library
+static void *allocate(size_t size, void *caller) {
+  count(caller);
+  void *p = __libc_malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+static void *allocate(size_t size, const std::nothrow_t &, void *caller) {
+  count(caller);
+  return __libc_malloc(size ? size : 1);
+}
+
+void *operator new(size_t size) {
+  return allocate(size, __builtin_return_address(0));
+}
+
+void *operator new[](size_t size) {
+  return allocate(size, __builtin_return_address(0));
+}
+
+void *operator new(size_t size, const std::nothrow_t &tag) noexcept {
+  return allocate(size, tag, __builtin_return_address(0));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return allocate(size, tag, __builtin_return_address(0));
+}
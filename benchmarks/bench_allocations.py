@@ -0,0 +1,215 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Check that steady-state compiles make no heap allocations in the
+extension, and compare their latency with the handle-based API.
+
+The extension counts each time a thread's scratch buffers grow. After a
+warm-up compile, the count should not change however many compiles follow.
+
+The heap allocations themselves are counted by re-running the benchmark with
+a counting allocator (alloc_counter.cpp, built with g++) in LD_PRELOAD. It
+counts every allocation made by the compiling thread, and separately those
+called from the extension's own code (excluding the compiler library linked
+into it); the latter should be zero in steady state for ``compile_ptx``. The
+rest are made by the compiler library and by Python for the objects
+returned. Run with:
+
+    python benchmarks/bench_allocations.py
+"""
+
+import argparse
+import ctypes
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from ptxcompiler import _ptxcompilerlib
+from ptxcompiler.tests.test_lib import PTX_CODE
+
+
+def legacy_compile(ptx, options):
+    handle = _ptxcompilerlib.create(ptx)
+    try:
+        _ptxcompilerlib.compile(handle, options)
+        return (_ptxcompilerlib.get_compiled_program(handle),
+                _ptxcompilerlib.get_info_log(handle))
+    finally:
+        _ptxcompilerlib.destroy(handle)
+
+
+def time_compiles(fn, ptx, options, compiles):
+    times = []
+    for _ in range(compiles):
+        start = time.perf_counter()
+        fn(ptx, options)
+        times.append(time.perf_counter() - start)
+    return statistics.median(times)
+
+
+def count_growth(ptx, options, compiles, threads):
+    """Warm up each thread's scratch buffers, then return how many times
+    they grew over ``compiles`` further compiles per thread."""
+    warm = threading.Barrier(threads + 1)
+    done = threading.Barrier(threads + 1)
+
+    def worker():
+        _ptxcompilerlib.compile_ptx(ptx, options)
+        warm.wait()
+        warm.wait()
+        for _ in range(compiles):
+            _ptxcompilerlib.compile_ptx(ptx, options)
+        done.wait()
+
+    workers = [threading.Thread(target=worker) for _ in range(threads)]
+    for t in workers:
+        t.start()
+    warm.wait()
+    before = _ptxcompilerlib.get_scratch_stats()
+    warm.wait()
+    done.wait()
+    after = _ptxcompilerlib.get_scratch_stats()
+    for t in workers:
+        t.join()
+    return after['allocations'] - before['allocations']
+
+
+def build_counter(directory):
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          'alloc_counter.cpp')
+    library = os.path.join(directory, 'liballoc_counter.so')
+    subprocess.run(['g++', '-shared', '-fPIC', '-O2', source, '-o',
+                    library], check=True)
+    return library
+
+
+COMPILER_API = ('nvPTXCompilerCreate', 'nvPTXCompilerCompile',
+                'nvPTXCompilerDestroy', 'nvPTXCompilerGetCompiledProgram',
+                'nvPTXCompilerGetCompiledProgramSize',
+                'nvPTXCompilerGetInfoLog', 'nvPTXCompilerGetInfoLogSize',
+                'nvPTXCompilerGetErrorLog', 'nvPTXCompilerGetErrorLogSize',
+                'nvPTXCompilerGetVersion')
+
+
+def extension_range():
+    """Return the start and end addresses of the extension's own code. The
+    static compiler library is linked into the same file after it, so the
+    range ends at the library's first function."""
+    path = os.path.realpath(_ptxcompilerlib.__file__)
+    start, end = None, None
+    with open('/proc/self/maps') as f:
+        for line in f:
+            fields = line.split()
+            if (len(fields) >= 6 and 'x' in fields[1] and
+                    os.path.realpath(fields[5]) == path):
+                low, high = (int(a, 16) for a in fields[0].split('-'))
+                start = low if start is None else min(start, low)
+                end = high if end is None else max(end, high)
+
+    library = ctypes.CDLL(path)
+    for name in COMPILER_API:
+        try:
+            address = ctypes.cast(getattr(library, name),
+                                  ctypes.c_void_p).value
+        except AttributeError:
+            continue
+        if start <= address < end:
+            end = address
+    return start, end
+
+
+def count_allocations(fn, ptx, options, compiles):
+    """Return the heap allocations per compile made by this thread, and by
+    the extension's code, after a warm-up compile. Requires the counting
+    allocator to be preloaded."""
+    counter = ctypes.CDLL(None)
+    total = counter.alloc_counter_thread_allocations
+    extension = counter.alloc_counter_thread_range_allocations
+    total.restype = extension.restype = ctypes.c_ulonglong
+    counter.alloc_counter_set_range(*(ctypes.c_size_t(a)
+                                      for a in extension_range()))
+
+    fn(ptx, options)
+    before = total(), extension()
+    for _ in range(compiles):
+        fn(ptx, options)
+    return ((total() - before[0]) / compiles,
+            (extension() - before[1]) / compiles)
+
+
+def run_counted(args):
+    """Re-run this script with the counting allocator preloaded, returning
+    its exit status."""
+    with tempfile.TemporaryDirectory() as tmp:
+        try:
+            library = build_counter(tmp)
+        except (OSError, subprocess.CalledProcessError) as e:
+            print(f'Could not build the allocation counter: {e}')
+            return 0
+        env = dict(os.environ, LD_PRELOAD=library)
+        cmd = [sys.executable, os.path.abspath(__file__), '--counted',
+               '--compiles', str(args.compiles), '--arch', args.arch]
+        return subprocess.run(cmd, env=env).returncode
+
+
+def counted_main(args):
+    options = (f'--gpu-name={args.arch}',)
+    failed = False
+    for name, fn in (('handle API', legacy_compile),
+                     ('compile_ptx', _ptxcompilerlib.compile_ptx)):
+        total, extension = count_allocations(fn, PTX_CODE, options,
+                                             args.compiles)
+        print(f'{name:>12}: {total:.1f} heap allocations per compile, '
+              f'{extension:.1f} by the extension')
+        failed |= name == 'compile_ptx' and extension > 0
+    if failed:
+        sys.exit('Steady-state compiles allocated in the extension')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--compiles', type=int, default=1000)
+    parser.add_argument('--threads', type=int, default=4)
+    parser.add_argument('--arch', default='sm_75')
+    parser.add_argument('--counted', action='store_true',
+                        help=argparse.SUPPRESS)
+    args = parser.parse_args()
+    if args.counted:
+        counted_main(args)
+        return
+
+    options = (f'--gpu-name={args.arch}',)
+    growth = count_growth(PTX_CODE, options, args.compiles, args.threads)
+    stats = _ptxcompilerlib.get_scratch_stats()
+    print(f'{args.threads} threads x {args.compiles} compiles: {growth} '
+          f'scratch allocations after warm-up '
+          f'({stats["allocations"]} in total, {stats["bytes"]} bytes)')
+
+    for name, fn in (('handle API', legacy_compile),
+                     ('compile_ptx', _ptxcompilerlib.compile_ptx)):
+        median = time_compiles(fn, PTX_CODE, options, args.compiles)
+        print(f'{name:>12}: median {median * 1e6:.1f} us per compile')
+
+    if growth:
+        sys.exit('Steady-state compiles allocated scratch space')
+    if run_counted(args):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
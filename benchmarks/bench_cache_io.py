@@ -0,0 +1,104 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measure disk cache hit throughput at 1-64 concurrent requests, with
+blocking reads from that many threads and with batched reads of that many
+entries through each batch I/O backend.
+
+The cache is filled with --entries entries of --size bytes in --dir (by
+default a temporary directory). With --cold, the entries are evicted from
+the page cache before each measurement, so that reads go to the device; use
+a directory on the device of interest, e.g. an NVMe drive. Run with:
+
+    python benchmarks/bench_cache_io.py [--cold] [--dir /mnt/nvme/cache]
+"""
+
+import argparse
+import os
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from ptxcompiler.cache import DiskCache
+from ptxcompiler.cacheio import ThreadPoolIO, UringIO
+from ptxcompiler.keys import CompileKey
+
+
+def make_keys(n):
+    return [CompileKey(ptx_hash=f'{i:064x}', options=(), arch='sm_80',
+                       compiler_version=(11, 6)) for i in range(n)]
+
+
+def evict(cache):
+    for digest in cache.digests():
+        fd = os.open(cache.entry_path(digest), os.O_RDONLY)
+        try:
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        finally:
+            os.close(fd)
+
+
+def blocking(cache, keys, concurrency):
+    with ThreadPoolExecutor(concurrency) as executor:
+        results = list(executor.map(cache.get, keys))
+    assert all(results)
+
+
+def batched(cache, keys, concurrency):
+    for start in range(0, len(keys), concurrency):
+        results = cache.get_many(keys[start:start + concurrency])
+        assert all(results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--entries', type=int, default=4096)
+    parser.add_argument('--size', type=int, default=64 * 1024)
+    parser.add_argument('--dir')
+    parser.add_argument('--cold', action='store_true',
+                        help='Evict entries from the page cache first')
+    parser.add_argument('--concurrency', type=int, nargs='+',
+                        default=[1, 2, 4, 8, 16, 32, 64])
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(dir=args.dir) as directory:
+        keys = make_keys(args.entries)
+        filler = DiskCache(directory)
+        program = os.urandom(args.size)
+        filler.put_many([(key, program, '') for key in keys])
+        os.sync()
+
+        backends = [('blocking', blocking, None),
+                    ('threads', batched, ThreadPoolIO(64))]
+        if UringIO.available():
+            backends.append(('io_uring', batched, UringIO()))
+
+        print(f'{"concurrency":>11}' +
+              ''.join(f'{name:>16}' for name, _, _ in backends) +
+              '   (entries/s)')
+        for concurrency in args.concurrency:
+            row = f'{concurrency:>11}'
+            for name, run, io in backends:
+                cache = DiskCache(directory, io=io)
+                if args.cold:
+                    evict(cache)
+                start = time.perf_counter()
+                run(cache, keys, concurrency)
+                rate = len(keys) / (time.perf_counter() - start)
+                row += f'{rate:>16,.0f}'
+            print(row)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,108 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measure the cold-start time of CuPy kernels - from defining them to their
+first launch completing - with the driver compiling the PTX from NVRTC and
+with ``ptxcompiler.cupy_patch``.
+
+Each measurement runs in a fresh process with CuPy's kernel cache kept in
+memory, so that CuPy compiles every kernel. With the patch, the first run
+starts with an empty ptxcompiler disk cache and later runs find the cubins
+in it. Requires CuPy and a GPU, with a driver older than NVRTC (otherwise
+NVRTC produces cubins and the patch has nothing to do). Run with:
+
+    python benchmarks/bench_cupy_cold_start.py [--kernels 16]
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+CHILD = """\
+import json
+import sys
+import time
+
+start = time.perf_counter()
+import cupy
+if {patch}:
+    from ptxcompiler.cupy_patch import patch_cupy
+    patch_cupy()
+import_time = time.perf_counter() - start
+
+x = cupy.arange(1024, dtype=cupy.float32)
+cupy.cuda.Device().synchronize()
+
+start = time.perf_counter()
+for i in range({kernels}):
+    kernel = cupy.RawKernel(r'''
+extern "C" __global__ void kernel_%d(float *x, int n) {{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    for (int j = 0; j < {work}; j++) {{
+        if (i < n) x[i] = x[i] * 0.5f + %d.0f;
+    }}
+}}''' % (i, i), f'kernel_{{i}}')
+    kernel((4,), (256,), (x, cupy.int32(x.size)))
+cupy.cuda.Device().synchronize()
+json.dump({{'import': import_time, 'kernels': time.perf_counter() - start}},
+          sys.stdout)
+"""
+
+
+def run(patch, args, cache_dir):
+    env = dict(os.environ, CUPY_CACHE_IN_MEMORY='1',
+               PTXCOMPILER_CACHE_DIR=cache_dir)
+    cmd = CHILD.format(patch=patch, kernels=args.kernels, work=args.work)
+    cp = subprocess.run([sys.executable, '-c', cmd], env=env,
+                        capture_output=True, check=True)
+    return json.loads(cp.stdout)
+
+
+def report(name, results, n_kernels):
+    kernels = statistics.median(r['kernels'] for r in results)
+    imports = statistics.median(r['import'] for r in results)
+    print(f'{name:>24}: {kernels * 1e3:8.1f} ms for {n_kernels} kernels '
+          f'({kernels / n_kernels * 1e3:.2f} ms each), import '
+          f'{imports * 1e3:.1f} ms')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--kernels', type=int, default=16)
+    parser.add_argument('--work', type=int, default=64,
+                        help='Loop iterations in each kernel')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        baseline = [run(False, args, os.path.join(tmp, 'unused'))
+                    for _ in range(args.runs)]
+        report('driver JIT', baseline, args.kernels)
+
+        cold = []
+        for i in range(args.runs):
+            cold.append(run(True, args, os.path.join(tmp, f'cold{i}')))
+        report('ptxcompiler, cold cache', cold, args.kernels)
+
+        warm = [run(True, args, os.path.join(tmp, 'cold0'))
+                for _ in range(args.runs)]
+        report('ptxcompiler, warm cache', warm, args.kernels)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,118 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measure the latency of the first compile in a process against steady-state
+compiles, with and without background pre-initialization, for each compiler
+that is loaded (the built-in one and any in ``PTXCOMPILER_COMPILERS``).
+
+Each measurement runs in a fresh process. With pre-initialization, the
+process sleeps for --startup seconds before its first compile, standing in
+for the application's own start-up work. Pre-initialization only covers the
+built-in compiler, so loaded compilers are measured without it. Each
+compiler is given the test PTX at an ISA version it supports. Run with:
+
+    python benchmarks/bench_first_compile.py
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+
+from ptxcompiler.compilers import PTX_ISA_CUDA_VERSIONS, get_compilers
+
+CHILD = """\
+import json
+import sys
+import time
+
+t0 = time.perf_counter()
+import ptxcompiler
+from ptxcompiler import _ptxcompilerlib
+from ptxcompiler.compilers import get_compilers
+from ptxcompiler.tests.test_lib import PTX_CODE
+import_time = time.perf_counter() - t0
+
+compiler = get_compilers()[{index}]
+ptx = PTX_CODE.replace('.version 7.4', '.version {isa}')
+
+time.sleep({startup})
+
+options = ('--gpu-name={arch}',)
+times = []
+for _ in range({compiles}):
+    start = time.perf_counter()
+    _ptxcompilerlib.compile_ptx(ptx, options, None, compiler.index)
+    times.append(time.perf_counter() - start)
+
+json.dump({{'version': compiler.version,
+           'import': import_time,
+           'times': times,
+           'preinit': _ptxcompilerlib.wait_for_preinitialization()}},
+          sys.stdout)
+"""
+
+
+def isa_version(compiler):
+    """Return the ISA version to give ``compiler``: that of the test PTX, or
+    the newest it supports if it is older."""
+    supported = [isa for isa, cuda in PTX_ISA_CUDA_VERSIONS.items()
+                 if cuda <= compiler.version]
+    major, minor = min(max(supported, default=(7, 0)), (7, 4))
+    return f'{major}.{minor}'
+
+
+def run(compiler, preinit, args):
+    env = dict(os.environ, PTXCOMPILER_PREINITIALIZE=str(int(preinit)))
+    startup = args.startup if preinit else 0
+    cmd = CHILD.format(index=compiler.index, isa=isa_version(compiler),
+                       startup=startup, arch=args.arch,
+                       compiles=args.compiles)
+    cp = subprocess.run([sys.executable, '-c', cmd], env=env,
+                        capture_output=True, check=True)
+    return json.loads(cp.stdout)
+
+
+def report(compiler, preinit, args):
+    results = [run(compiler, preinit, args) for _ in range(args.runs)]
+    first = statistics.median(r['times'][0] for r in results)
+    steady = statistics.median(t for r in results for t in r['times'][1:])
+    major, minor = results[0]['version']
+    mode = 'pre-initialized' if preinit else 'default'
+    print(f'compiler {major}.{minor}, {mode}: first compile '
+          f'{first * 1e3:.2f} ms, steady state {steady * 1e3:.2f} ms, '
+          f'ratio {first / steady:.1f}x')
+    if preinit:
+        background = statistics.median(r['preinit'] for r in results)
+        print(f'  background pre-initialization took '
+              f'{background * 1e3:.2f} ms')
+
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--compiles', type=int, default=20)
+    parser.add_argument('--startup', type=float, default=0.5)
+    parser.add_argument('--arch', default='sm_75')
+    args = parser.parse_args()
+
+    for compiler in get_compilers():
+        for preinit in (False, True) if compiler.index == 0 else (False,):
+            report(compiler, preinit, args)
+
+if __name__ == '__main__':
+    main()
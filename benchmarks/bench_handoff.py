@@ -0,0 +1,114 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compare handing buffers from a helper process to its parent by pickling
+them through a pipe against passing sealed memfds over a Unix socket.
+
+The helper produces each buffer and sends it; the parent times from
+requesting it to having a usable object, and optionally to having read every
+byte (mapped pages are faulted in on first access). Run with:
+
+    python benchmarks/bench_handoff.py [--sizes 1 8 64]
+"""
+
+import argparse
+import multiprocessing
+import os
+import socket
+import statistics
+import time
+import zlib
+
+from ptxcompiler.handoff import (map_sealed, recv_message, seal_buffer,
+                                 send_message)
+
+
+def pickle_server(conn):
+    while True:
+        size = conn.recv()
+        if size is None:
+            return
+        conn.send(b'\x7f' * size)
+
+
+def memfd_server(sock):
+    while True:
+        _, size, _ = recv_message(sock)
+        if size is None:
+            return
+        fd = seal_buffer(b'\x7f' * size)
+        send_message(sock, 0, None, fd)
+        os.close(fd)
+
+
+def pickle_fetch(conn, size):
+    conn.send(size)
+    return conn.recv()
+
+
+def memfd_fetch(sock, size):
+    send_message(sock, 0, size)
+    _, _, fd = recv_message(sock)
+    return map_sealed(fd)
+
+
+def measure(fetch, channel, size, repeat, touch):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        data = fetch(channel, size)
+        if touch:
+            zlib.crc32(data)
+        times.append(time.perf_counter() - start)
+        del data
+    return statistics.median(times)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--sizes', type=int, nargs='+', default=[1, 8, 64],
+                        help='Buffer sizes in MB')
+    parser.add_argument('--repeat', type=int, default=20)
+    args = parser.parse_args()
+
+    parent_conn, child_conn = multiprocessing.Pipe()
+    pickle_process = multiprocessing.Process(target=pickle_server,
+                                             args=(child_conn,))
+    parent_sock, child_sock = socket.socketpair()
+    memfd_process = multiprocessing.Process(target=memfd_server,
+                                            args=(child_sock,))
+    pickle_process.start()
+    memfd_process.start()
+
+    print(f'{"MB":>4} {"read":>5} {"pickle (ms)":>12} {"memfd (ms)":>11} '
+          f'{"speedup":>8}')
+    for mb in args.sizes:
+        size = mb * 1024 * 1024
+        for touch in (False, True):
+            pickled = measure(pickle_fetch, parent_conn, size, args.repeat,
+                              touch)
+            memfd = measure(memfd_fetch, parent_sock, size, args.repeat,
+                            touch)
+            print(f'{mb:>4} {"yes" if touch else "no":>5} '
+                  f'{pickled * 1e3:>12.3f} {memfd * 1e3:>11.3f} '
+                  f'{pickled / memfd:>7.1f}x')
+
+    parent_conn.send(None)
+    send_message(parent_sock, 0, None)
+    pickle_process.join()
+    memfd_process.join()
+
+
+if __name__ == '__main__':
+    main()
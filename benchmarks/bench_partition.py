@@ -0,0 +1,129 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compare the wall-clock time of compiling large PTX modules with a single
+call to compile_ptx against partitioned compilation.
+
+Requires nvlink on the PATH or in $CUDA_HOME/bin. Run with:
+
+    python benchmarks/bench_partition.py [--kernels 64 128 ...]
+"""
+
+import argparse
+import os
+import time
+
+from ptxcompiler.api import compile_ptx
+from ptxcompiler.partition import compile_ptx_partitioned
+
+HEADER = """\
+.version 7.4
+.target sm_52
+.address_size 64
+
+"""
+
+HELPER = """\
+.func (.param .b32 func_retval0) {name}(.param .b32 {name}_p0)
+{{
+        .reg .f32 %f<{n_regs}>;
+        .reg .b32 %r<2>;
+        ld.param.b32 %r1, [{name}_p0];
+        mov.b32 %f1, %r1;
+{body}
+        mov.b32 %r1, %f{last};
+        st.param.b32 [func_retval0+0], %r1;
+        ret;
+}}
+
+"""
+
+KERNEL = """\
+.visible .entry {name}(.param .u64 {name}_p0)
+{{
+        .reg .b32 %r<4>;
+        .reg .b64 %rd<3>;
+        ld.param.u64 %rd1, [{name}_p0];
+        cvta.to.global.u64 %rd2, %rd1;
+        ld.global.u32 %r1, [%rd2];
+        {{
+        .param .b32 param0;
+        st.param.b32 [param0+0], %r1;
+        .param .b32 retval0;
+        call.uni (retval0), {helper}, (param0);
+        ld.param.b32 %r2, [retval0+0];
+        }}
+        {{
+        .param .b32 param0;
+        st.param.b32 [param0+0], %r2;
+        .param .b32 retval0;
+        call.uni (retval0), common_helper, (param0);
+        ld.param.b32 %r3, [retval0+0];
+        }}
+        st.global.u32 [%rd2], %r3;
+        ret;
+}}
+
+"""
+
+
+def helper(name, n_instructions):
+    body = '\n'.join(f'        fma.rn.f32 %f{i + 2}, %f{i + 1}, %f{i + 1}, '
+                     f'%f{i + 1};' for i in range(n_instructions))
+    return HELPER.format(name=name, n_regs=n_instructions + 2, body=body,
+                         last=n_instructions + 1)
+
+
+def make_module(n_kernels, n_instructions):
+    parts = [HEADER, helper('common_helper', n_instructions)]
+    for i in range(n_kernels):
+        parts.append(helper(f'helper_{i}', n_instructions))
+        parts.append(KERNEL.format(name=f'kernel_{i}', helper=f'helper_{i}'))
+    return ''.join(parts)
+
+
+def best_of(repeat, fn):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        fn()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--kernels', type=int, nargs='+',
+                        default=[64, 256, 1024])
+    parser.add_argument('--instructions', type=int, default=200,
+                        help='Instructions per device function')
+    parser.add_argument('--units', type=int, default=os.cpu_count())
+    parser.add_argument('--arch', default='sm_75')
+    parser.add_argument('--repeat', type=int, default=3)
+    args = parser.parse_args()
+
+    options = (f'--gpu-name={args.arch}',)
+    print(f'{"kernels":>8} {"PTX MB":>8} {"single (s)":>11} '
+          f'{"partitioned (s)":>16} {"speedup":>8}')
+    for n_kernels in args.kernels:
+        ptx = make_module(n_kernels, args.instructions)
+        single = best_of(args.repeat, lambda: compile_ptx(ptx, options))
+        partitioned = best_of(args.repeat, lambda: compile_ptx_partitioned(
+            ptx, options, units=args.units, min_size=0))
+        print(f'{n_kernels:>8} {len(ptx) / 1e6:>8.2f} {single:>11.3f} '
+              f'{partitioned:>16.3f} {single / partitioned:>7.2f}x')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,107 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compare the time to produce a cubin from Numba-generated PTX with the
+driver's linker (Numba's default) against the static compiler, with a cold
+and a warm compile cache.
+
+This is the choice made by PTXCOMPILER_STATIC_COMPILE_MODE=always. Requires
+Numba and a GPU. Run with:
+
+    python benchmarks/bench_time_to_cubin.py
+"""
+
+import argparse
+import os
+import statistics
+import tempfile
+import time
+
+os.environ['PTXCOMPILER_CACHE_TIERS'] = 'memory,disk'
+os.environ['PTXCOMPILER_CACHE_DIR'] = tempfile.mkdtemp()
+os.environ['PTXCOMPILER_CACHE_PROMOTE'] = '0'
+
+from numba import cuda  # noqa: E402
+from numba.cuda.cudadrv.driver import Linker  # noqa: E402
+from ptxcompiler import cache  # noqa: E402
+from ptxcompiler.api import compile_ptx  # noqa: E402
+
+KERNEL = """\
+def kernel_{i}(r, x, y):
+    i = cuda.grid(1)
+    if i < len(r):
+        r[i] = x[i] * {i} + y[i]
+"""
+
+
+def make_ptxes(n, cc):
+    ptxes = []
+    for i in range(n):
+        namespace = {'cuda': cuda}
+        exec(KERNEL.format(i=i), namespace)
+        fn = namespace[f'kernel_{i}']
+        ptx, _ = cuda.compile_ptx(fn, 'void(float32[:], float32[:], '
+                                  'float32[:])', cc=cc)
+        ptxes.append(ptx)
+    return ptxes
+
+
+def driver_link(ptx, cc):
+    if hasattr(Linker, 'new'):
+        linker = Linker.new(max_registers=0, cc=cc)
+    else:
+        linker = Linker(max_registers=0)
+    linker.add_ptx(ptx.encode())
+    return linker.complete()
+
+
+def static_compile(ptx, cc):
+    return compile_ptx(ptx, [f'--gpu-name=sm_{cc[0]}{cc[1]}'])
+
+
+def time_each(fn, ptxes, cc):
+    times = []
+    for ptx in ptxes:
+        start = time.perf_counter()
+        fn(ptx, cc)
+        times.append(time.perf_counter() - start)
+    return statistics.median(times)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--kernels', type=int, default=50)
+    args = parser.parse_args()
+
+    cc = cuda.get_current_device().compute_capability
+    ptxes = make_ptxes(args.kernels, cc)
+
+    driver = time_each(driver_link, ptxes, cc)
+    cold = time_each(static_compile, ptxes, cc)
+    warm = time_each(static_compile, ptxes, cc)
+    # Empty the memory tier, so that lookups are served from disk
+    cache.get_cache().tiers[0] = cache.MemoryCache()
+    disk = time_each(static_compile, ptxes, cc)
+
+    print(f'Median time to cubin over {args.kernels} kernels for '
+          f'sm_{cc[0]}{cc[1]}:')
+    for name, t in (('driver linker', driver),
+                    ('static, cold cache', cold),
+                    ('static, memory cache', warm),
+                    ('static, disk cache', disk)):
+        print(f'{name:>21}: {t * 1e3:8.3f} ms ({driver / t:6.1f}x)')
+
+
+if __name__ == '__main__':
+    main()
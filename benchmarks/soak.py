@@ -0,0 +1,224 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Soak test the extension for memory leaks.
+
+Runs a large number of successful and failing compiles through the one-shot
+and handle-based APIs, sampling the process's RSS and malloc's in-use bytes
+as it goes. After a warm-up, a straight line is fitted to each; if the growth
+it predicts over the run exceeds the tolerance, the soak fails.
+
+The one-shot scenarios use a stub compiler library (stub_compiler.cpp, built
+with g++ against $CUDA_HOME/include) so that millions of compiles are quick
+and failures of each API call can be injected. The handle API scenarios use
+the built-in compiler. The stub is loaded in a link namespace of its own,
+with its own copy of the C library, so its allocations show up in the RSS
+but not in malloc's statistics. Run with:
+
+    python benchmarks/soak.py [--iterations 1000000] [--output soak.json]
+
+``--scenarios stub_leak`` runs a deliberately leaking stub, which should
+fail.
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from ptxcompiler import _ptxcompilerlib
+from ptxcompiler.api import compile_ptx
+
+PTX = """\
+.version 7.0
+.target sm_52
+.address_size 64
+
+.visible .entry soak()
+{
+        ret;
+}
+"""
+BAD_PTX = '.target sm_52\n'
+OPTIONS = ('--gpu-name=sm_52',)
+
+
+class _MallInfo2(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_size_t) for name in (
+        'arena', 'ordblks', 'smblks', 'hblks', 'hblkhd', 'usmblks',
+        'fsmblks', 'uordblks', 'fordblks', 'keepcost')]
+
+
+def _mallinfo():
+    """Return a function giving malloc's in-use bytes, or ``None`` if the C
+    library does not provide mallinfo2."""
+    try:
+        mallinfo2 = ctypes.CDLL(None).mallinfo2
+    except AttributeError:
+        return None
+    mallinfo2.restype = _MallInfo2
+
+    def in_use():
+        info = mallinfo2()
+        return info.uordblks + info.hblkhd
+
+    return in_use
+
+
+def rss():
+    with open('/proc/self/statm') as f:
+        return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+
+def build_stub(directory):
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          'stub_compiler.cpp')
+    library = os.path.join(directory, 'libstub_compiler.so')
+    include = os.path.join(os.environ.get('CUDA_HOME', '/usr/local/cuda'),
+                           'include')
+    subprocess.run(['g++', '-shared', '-fPIC', '-O2', f'-I{include}', source,
+                    '-o', library], check=True)
+    return _ptxcompilerlib.load_compiler(library)
+
+
+def expect_error(fn, *args):
+    try:
+        fn(*args)
+    except RuntimeError:
+        return
+    raise AssertionError('Expected a RuntimeError')
+
+
+def make_scenarios(stub, leak_bytes):
+    def stub_compile(ptx, *options):
+        return _ptxcompilerlib.compile_ptx(ptx, OPTIONS + options, 'soak',
+                                           stub)
+
+    def handle_success():
+        handle = _ptxcompilerlib.create(PTX)
+        try:
+            _ptxcompilerlib.compile(handle, OPTIONS, 'soak')
+            _ptxcompilerlib.get_compiled_program(handle)
+            _ptxcompilerlib.get_info_log(handle)
+        finally:
+            _ptxcompilerlib.destroy(handle)
+
+    def handle_failure():
+        handle = _ptxcompilerlib.create(BAD_PTX)
+        try:
+            expect_error(_ptxcompilerlib.compile, handle, OPTIONS, 'soak')
+            _ptxcompilerlib.get_error_log(handle)
+            # Fetching a program that was never compiled fails
+            expect_error(_ptxcompilerlib.get_compiled_program, handle)
+        finally:
+            _ptxcompilerlib.destroy(handle)
+
+    return {
+        'stub_success': lambda: stub_compile(PTX),
+        'stub_failure': lambda: expect_error(stub_compile, BAD_PTX),
+        'stub_error_log_failure': lambda: expect_error(
+            stub_compile, BAD_PTX, '--stub-fail=error-log'),
+        'stub_info_log_failure': lambda: expect_error(
+            stub_compile, PTX, '--stub-fail=info-log'),
+        'stub_program_failure': lambda: expect_error(
+            stub_compile, PTX, '--stub-fail=program'),
+        'stub_leak': lambda: stub_compile(PTX, f'--stub-leak={leak_bytes}'),
+        'handle_success': handle_success,
+        'handle_failure': handle_failure,
+        'api_success': lambda: compile_ptx(PTX, OPTIONS),
+        'api_failure': lambda: expect_error(compile_ptx, BAD_PTX, OPTIONS),
+    }
+
+
+def slope(xs, ys):
+    n = len(xs)
+    mean_x = sum(xs) / n
+    mean_y = sum(ys) / n
+    var = sum((x - mean_x) ** 2 for x in xs)
+    if var == 0:
+        return 0.0
+    return sum((x - mean_x) * (y - mean_y) for x, y in zip(xs, ys)) / var
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--iterations', type=int, default=1000000,
+                        help='Total number of calls, over all scenarios')
+    parser.add_argument('--samples', type=int, default=100)
+    parser.add_argument('--warmup', type=float, default=0.2,
+                        help='Fraction of samples to ignore at the start')
+    parser.add_argument('--tolerance', type=float, default=4.0,
+                        help='Largest growth allowed over the run, in MiB')
+    parser.add_argument('--scenarios', nargs='+')
+    parser.add_argument('--leak-bytes', type=int, default=64)
+    parser.add_argument('--output', help='Write the samples to a JSON file')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        stub = build_stub(tmp)
+
+    scenarios = make_scenarios(stub, args.leak_bytes)
+    names = args.scenarios or [name for name in scenarios
+                               if name != 'stub_leak']
+    calls = [scenarios[name] for name in names]
+    in_use = _mallinfo()
+    metrics = {'rss': rss}
+    if in_use is not None:
+        metrics['malloc_in_use'] = in_use
+
+    sample_every = max(args.iterations // args.samples, 1)
+    samples = []
+    start = time.perf_counter()
+    for i in range(args.iterations):
+        calls[i % len(calls)]()
+        if (i + 1) % sample_every == 0:
+            sample = {'iteration': i + 1,
+                      'seconds': time.perf_counter() - start}
+            sample.update((name, fn()) for name, fn in metrics.items())
+            samples.append(sample)
+    elapsed = time.perf_counter() - start
+
+    print(f'{args.iterations} calls over {", ".join(names)} in '
+          f'{elapsed:.1f} s ({args.iterations / elapsed:.0f} calls/s)')
+
+    measured = samples[int(len(samples) * args.warmup):]
+    xs = [s['iteration'] for s in measured]
+    span = xs[-1] - xs[0] if xs else 0
+    failed = False
+    results = {}
+    for name in metrics:
+        ys = [s[name] for s in measured]
+        growth = slope(xs, ys) * span if len(xs) > 1 else 0.0
+        results[name] = {'start': ys[0], 'end': ys[-1], 'growth': growth}
+        leaking = growth > args.tolerance * 2 ** 20
+        failed |= leaking
+        print(f'{name:>14}: {ys[0] / 2 ** 20:9.2f} MiB -> '
+              f'{ys[-1] / 2 ** 20:9.2f} MiB, fitted growth '
+              f'{growth / 2 ** 20:8.3f} MiB{"  LEAK" if leaking else ""}')
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump({'scenarios': names, 'iterations': args.iterations,
+                       'results': results, 'samples': samples}, f, indent=1)
+
+    if failed:
+        sys.exit('Memory grew by more than the tolerance')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2022, NVIDIA CORPORATION.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A stand-in for the PTX compiler library, for exercising the extension
+// quickly and without a GPU toolchain. It is loaded with
+// ptxcompiler.compilers.load_compiler by benchmarks/soak.py.
+//
+// Compiling "succeeds" if the PTX has a .version directive, producing an ELF
+// magic number followed by the PTX. Failures of later API calls can be
+// injected with the option --stub-fail=<name>, where <name> is one of
+// error-log, info-log or program, and a leak of <n> bytes per compile with
+// --stub-leak=<n>, to check that the soak harness detects leaks.
+
+#include <nvPTXCompiler.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+struct nvPTXCompiler {
+  std::string ptx;
+  std::string program;
+  std::string error_log;
+  std::string info_log;
+  std::string fail;
+  bool compiled = false;
+};
+
+static const char fail_option[] = "--stub-fail=";
+static const char leak_option[] = "--stub-leak=";
+static void *volatile leaked;
+
+extern "C" {
+
+nvPTXCompileResult nvPTXCompilerGetVersion(unsigned int *major,
+                                           unsigned int *minor) {
+  *major = 0;
+  *minor = 0;
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerCreate(nvPTXCompilerHandle *compiler,
+                                       size_t ptxCodeLen,
+                                       const char *ptxCode) {
+  if (compiler == nullptr || ptxCode == nullptr)
+    return NVPTXCOMPILE_ERROR_INVALID_INPUT;
+  *compiler = new nvPTXCompiler;
+  (*compiler)->ptx.assign(ptxCode, ptxCodeLen);
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerDestroy(nvPTXCompilerHandle *compiler) {
+  if (compiler == nullptr || *compiler == nullptr)
+    return NVPTXCOMPILE_ERROR_INVALID_COMPILER_HANDLE;
+  delete *compiler;
+  *compiler = nullptr;
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerCompile(nvPTXCompilerHandle compiler,
+                                        int numCompileOptions,
+                                        const char *const *compileOptions) {
+  if (compiler == nullptr)
+    return NVPTXCOMPILE_ERROR_INVALID_COMPILER_HANDLE;
+
+  for (int i = 0; i < numCompileOptions; i++) {
+    const char *option = compileOptions[i];
+    if (strncmp(option, fail_option, sizeof(fail_option) - 1) == 0)
+      compiler->fail = option + sizeof(fail_option) - 1;
+    if (strncmp(option, leak_option, sizeof(leak_option) - 1) == 0) {
+      size_t size = strtoull(option + sizeof(leak_option) - 1, nullptr, 10);
+      // Touch the memory so that it counts towards the RSS, and keep a
+      // pointer to it so that the allocation is not optimized away
+      leaked = malloc(size);
+      if (leaked != nullptr)
+        memset(leaked, 0, size);
+    }
+  }
+
+  if (compiler->ptx.find(".version") == std::string::npos) {
+    compiler->error_log = "stub: missing .version directive";
+    return NVPTXCOMPILE_ERROR_COMPILATION_FAILURE;
+  }
+
+  compiler->program = "\x7f" "ELF" + compiler->ptx;
+  compiler->info_log = "stub: compiled " +
+                       std::to_string(compiler->ptx.size()) + " bytes";
+  compiler->compiled = true;
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult
+nvPTXCompilerGetCompiledProgramSize(nvPTXCompilerHandle compiler,
+                                    size_t *binaryImageSize) {
+  if (!compiler->compiled)
+    return NVPTXCOMPILE_ERROR_COMPILER_INVOCATION_INCOMPLETE;
+  *binaryImageSize = compiler->program.size();
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerGetCompiledProgram(nvPTXCompilerHandle compiler,
+                                                   void *binaryImage) {
+  if (compiler->fail == "program")
+    return NVPTXCOMPILE_ERROR_INTERNAL;
+  memcpy(binaryImage, compiler->program.data(), compiler->program.size());
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerGetErrorLogSize(nvPTXCompilerHandle compiler,
+                                                size_t *errorLogSize) {
+  *errorLogSize = compiler->error_log.size();
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerGetErrorLog(nvPTXCompilerHandle compiler,
+                                            char *errorLog) {
+  if (compiler->fail == "error-log")
+    return NVPTXCOMPILE_ERROR_INTERNAL;
+  memcpy(errorLog, compiler->error_log.c_str(),
+         compiler->error_log.size() + 1);
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerGetInfoLogSize(nvPTXCompilerHandle compiler,
+                                               size_t *infoLogSize) {
+  *infoLogSize = compiler->info_log.size();
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+nvPTXCompileResult nvPTXCompilerGetInfoLog(nvPTXCompilerHandle compiler,
+                                           char *infoLog) {
+  if (compiler->fail == "info-log")
+    return NVPTXCOMPILE_ERROR_INTERNAL;
+  memcpy(infoLog, compiler->info_log.c_str(), compiler->info_log.size() + 1);
+  return NVPTXCOMPILE_SUCCESS;
+}
+
+}
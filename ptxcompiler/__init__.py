@@ -12,7 +12,17 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import os
+
 from ptxcompiler.api import compile_ptx  # noqa: F401
+from ptxcompiler.api import compile_ptxes, submit_compile_ptx  # noqa: F401
+from ptxcompiler.api import preinitialize
 
 from . import _version
 __version__ = _version.get_versions()['version']
+
+try:
+    if int(os.getenv('PTXCOMPILER_PREINITIALIZE', '0')):
+        preinitialize()
+except ValueError:
+    pass
@@ -16,9 +16,29 @@
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <new>
 #include <nvPTXCompiler.h>
 #include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 static const char *nvPTXGetErrorEnum(nvPTXCompileResult error) {
   switch (error) {
@@ -60,6 +80,147 @@ void set_exception(PyObject *exception_type,
     PyErr_SetString(exception_type, exception_message);
 }
 
+// CPU time spent compiling, aggregated by the label passed to compile. The
+// table is only accessed while holding the GIL, so it needs no lock of its
+// own. The transparent comparator lets labels be looked up as C strings, so
+// that only the first compile with a label allocates.
+struct CPUTime {
+  unsigned long long compiles;
+  unsigned long long nanoseconds;
+};
+
+static std::map<std::string, CPUTime, std::less<>> cpu_times;
+
+static const char *default_label = "default";
+
+// Compile requests aggregated by the Python call site that made them, as a
+// folded stack string. Also only accessed while holding the GIL.
+enum CallSiteOutcome { OUTCOME_COMPILED, OUTCOME_CACHE, OUTCOME_BUNDLE };
+
+struct CallSite {
+  unsigned long long requests[3];
+  unsigned long long nanoseconds;
+  unsigned long long ptx_bytes;
+  unsigned long long cubin_bytes;
+};
+
+static std::unordered_map<std::string, CallSite> call_sites;
+
+static unsigned long long thread_cpu_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The first compile in a process is much slower than later ones, because of
+// one-time initialization inside the compiler library. Pre-initialization
+// moves that cost to a background thread by compiling a trivial kernel, and
+// compiler creation waits for it to finish if it is still in progress.
+enum PreinitState { PREINIT_NOT_STARTED, PREINIT_RUNNING, PREINIT_DONE };
+
+static std::mutex preinit_mutex;
+static std::condition_variable preinit_done;
+static PreinitState preinit_state = PREINIT_NOT_STARTED;
+static double preinit_seconds = 0.0;
+
+static const char preinit_ptx[] = ".version 7.0\n"
+                                  ".target sm_52\n"
+                                  ".address_size 64\n"
+                                  ".visible .entry ptxcompiler_preinit()\n"
+                                  "{\n"
+                                  "ret;\n"
+                                  "}\n";
+
+static void preinitialize_compiler() {
+  auto start = std::chrono::steady_clock::now();
+
+  // Errors are ignored - a failure here will be reported by the first real
+  // compile instead.
+  nvPTXCompilerHandle compiler;
+  if (nvPTXCompilerCreate(&compiler, strlen(preinit_ptx), preinit_ptx) ==
+      NVPTXCOMPILE_SUCCESS) {
+    const char *options[] = {"--gpu-name=sm_52"};
+    nvPTXCompilerCompile(compiler, 1, options);
+    nvPTXCompilerDestroy(&compiler);
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::lock_guard<std::mutex> lock(preinit_mutex);
+  preinit_seconds = elapsed.count();
+  preinit_state = PREINIT_DONE;
+  preinit_done.notify_all();
+}
+
+// Block until pre-initialization finishes, if it is in progress. Must be
+// called with the GIL held; the GIL is released while waiting. The mutex is
+// only ever held with the GIL released, or briefly without blocking on the
+// GIL, so a thread never waits for the GIL while holding it.
+static void wait_for_preinit() {
+  {
+    std::lock_guard<std::mutex> lock(preinit_mutex);
+    if (preinit_state != PREINIT_RUNNING)
+      return;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::unique_lock<std::mutex> lock(preinit_mutex);
+    preinit_done.wait(lock, [] { return preinit_state != PREINIT_RUNNING; });
+  }
+  Py_END_ALLOW_THREADS
+}
+
+static PyObject *preinitialize(PyObject *self) {
+  {
+    std::lock_guard<std::mutex> lock(preinit_mutex);
+    if (preinit_state != PREINIT_NOT_STARTED)
+      Py_RETURN_FALSE;
+    preinit_state = PREINIT_RUNNING;
+  }
+
+  try {
+    std::thread(preinitialize_compiler).detach();
+  } catch (const std::system_error &) {
+    std::lock_guard<std::mutex> lock(preinit_mutex);
+    preinit_state = PREINIT_NOT_STARTED;
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Could not start pre-initialization thread");
+    return nullptr;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+static PyObject *wait_for_preinitialization(PyObject *self) {
+  wait_for_preinit();
+
+  std::lock_guard<std::mutex> lock(preinit_mutex);
+  if (preinit_state != PREINIT_DONE)
+    Py_RETURN_NONE;
+  return PyFloat_FromDouble(preinit_seconds);
+}
+
+// Add CPU time to the total for a label. Must be called with the GIL held.
+static bool record_cpu_time(const char *label, unsigned long long ns) {
+  if (label == nullptr)
+    label = default_label;
+
+  auto it = cpu_times.find(label);
+  if (it == cpu_times.end()) {
+    try {
+      it = cpu_times.emplace(label, CPUTime{0, 0}).first;
+    } catch (const std::bad_alloc &) {
+      PyErr_NoMemory();
+      return false;
+    }
+  }
+  it->second.compiles++;
+  it->second.nanoseconds += ns;
+  return true;
+}
+
 static PyObject *get_version(PyObject *self) {
   unsigned int major, minor;
 
@@ -75,51 +236,51 @@ static PyObject *get_version(PyObject *self) {
 }
 
 static PyObject *create(PyObject *self, PyObject *args) {
-  PyObject *ret = nullptr;
   char *ptx_code;
-  nvPTXCompilerHandle *compiler;
 
   if (!PyArg_ParseTuple(args, "s", &ptx_code))
     return nullptr;
 
-  try {
-    compiler = new nvPTXCompilerHandle;
-  } catch (const std::bad_alloc &) {
-    PyErr_NoMemory();
-    return nullptr;
-  }
+  wait_for_preinit();
+
+  std::unique_ptr<nvPTXCompilerHandle> compiler(new (std::nothrow)
+                                                    nvPTXCompilerHandle);
+  if (!compiler)
+    return PyErr_NoMemory();
 
   nvPTXCompileResult res =
-      nvPTXCompilerCreate(compiler, strlen(ptx_code), ptx_code);
+      nvPTXCompilerCreate(compiler.get(), strlen(ptx_code), ptx_code);
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
                   "%s error when calling nvPTXCompilerCreate",
                   res);
-    goto error;
+    return nullptr;
   }
 
-  if ((ret = PyLong_FromUnsignedLongLong((unsigned long long)compiler)) ==
-      nullptr) {
+  PyObject *ret =
+      PyLong_FromUnsignedLongLong((unsigned long long)compiler.get());
+  if (ret == nullptr) {
     // Attempt to destroy the compiler - since we're already in an error
     // condition, there's no point in checking the return code and taking any
     // further action based on it though.
-    nvPTXCompilerDestroy(compiler);
-    goto error;
+    nvPTXCompilerDestroy(compiler.get());
+    return nullptr;
   }
 
+  // The handle is now owned by the caller, until it is passed to destroy
+  compiler.release();
   return ret;
-
-error:
-  delete compiler;
-  return nullptr;
 }
 
 static PyObject *destroy(PyObject *self, PyObject *args) {
-  nvPTXCompilerHandle *compiler;
-  if (!PyArg_ParseTuple(args, "K", &compiler))
+  nvPTXCompilerHandle *handle;
+  if (!PyArg_ParseTuple(args, "K", &handle))
     return nullptr;
 
-  nvPTXCompileResult res = nvPTXCompilerDestroy(compiler);
+  // The handle is freed even if destroying the compiler fails, since it
+  // cannot be used again either way.
+  std::unique_ptr<nvPTXCompilerHandle> compiler(handle);
+  nvPTXCompileResult res = nvPTXCompilerDestroy(compiler.get());
 
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
@@ -128,28 +289,42 @@ static PyObject *destroy(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  delete compiler;
-
   Py_RETURN_NONE;
 }
 
 static PyObject *compile(PyObject *self, PyObject *args) {
   nvPTXCompilerHandle *compiler;
   PyObject *options;
-  if (!PyArg_ParseTuple(args, "KO!", &compiler, &PyTuple_Type, &options))
+  const char *label = nullptr;
+  if (!PyArg_ParseTuple(args, "KO!|z", &compiler, &PyTuple_Type, &options,
+                        &label))
     return nullptr;
 
   Py_ssize_t n_options = PyTuple_Size(options);
-  const char **compile_options = new char const *[n_options];
+  std::unique_ptr<const char *[]> compile_options(
+      new (std::nothrow) const char *[n_options]);
+  if (!compile_options)
+    return PyErr_NoMemory();
+
   for (Py_ssize_t i = 0; i < n_options; i++) {
     PyObject *item = PyTuple_GetItem(options, i);
     compile_options[i] = PyUnicode_AsUTF8AndSize(item, nullptr);
+    if (compile_options[i] == nullptr)
+      return nullptr;
   }
 
-  nvPTXCompileResult res =
-      nvPTXCompilerCompile(*compiler, n_options, compile_options);
+  // Compilation can take a long time, so allow other threads to run (and
+  // compile concurrently) while it is in progress.
+  nvPTXCompileResult res;
+  unsigned long long start, end;
+  Py_BEGIN_ALLOW_THREADS
+  start = thread_cpu_time_ns();
+  res = nvPTXCompilerCompile(*compiler, n_options, compile_options.get());
+  end = thread_cpu_time_ns();
+  Py_END_ALLOW_THREADS
 
-  delete[] compile_options;
+  if (!record_cpu_time(label, end - start))
+    return nullptr;
 
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
@@ -177,8 +352,12 @@ static PyObject *get_error_log(PyObject *self, PyObject *args) {
   }
 
   // The size returned doesn't include a trailing null byte
-  char *error_log = new char[error_log_size + 1];
-  res = nvPTXCompilerGetErrorLog(*compiler, error_log);
+  std::unique_ptr<char[]> error_log(new (std::nothrow)
+                                        char[error_log_size + 1]);
+  if (!error_log)
+    return PyErr_NoMemory();
+
+  res = nvPTXCompilerGetErrorLog(*compiler, error_log.get());
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
                   "%s error when calling nvPTXCompilerGetErrorLog",
@@ -186,13 +365,7 @@ static PyObject *get_error_log(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  PyObject *py_log = PyUnicode_FromStringAndSize(error_log, error_log_size);
-  // Once we've copied the log to a Python object we can delete it - we don't
-  // need to check whether creation of the Unicode object succeeded, because we
-  // delete the log either way.
-  delete[] error_log;
-
-  return py_log;
+  return PyUnicode_FromStringAndSize(error_log.get(), error_log_size);
 }
 
 static PyObject *get_info_log(PyObject *self, PyObject *args) {
@@ -211,8 +384,12 @@ static PyObject *get_info_log(PyObject *self, PyObject *args) {
   }
 
   // The size returned doesn't include a trailing null byte
-  char *info_log = new char[info_log_size + 1];
-  res = nvPTXCompilerGetInfoLog(*compiler, info_log);
+  std::unique_ptr<char[]> info_log(new (std::nothrow)
+                                       char[info_log_size + 1]);
+  if (!info_log)
+    return PyErr_NoMemory();
+
+  res = nvPTXCompilerGetInfoLog(*compiler, info_log.get());
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
                   "%s error when calling nvPTXCompilerGetInfoLog",
@@ -220,13 +397,7 @@ static PyObject *get_info_log(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  PyObject *py_log = PyUnicode_FromStringAndSize(info_log, info_log_size);
-  // Once we've copied the log to a Python object we can delete it - we don't
-  // need to check whether creation of the Unicode object succeeded, because we
-  // delete the log either way.
-  delete[] info_log;
-
-  return py_log;
+  return PyUnicode_FromStringAndSize(info_log.get(), info_log_size);
 }
 
 static PyObject *get_compiled_program(PyObject *self, PyObject *args) {
@@ -244,8 +415,12 @@ static PyObject *get_compiled_program(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  char *compiled_program = new char[compiled_program_size];
-  res = nvPTXCompilerGetCompiledProgram(*compiler, compiled_program);
+  std::unique_ptr<char[]> compiled_program(new (std::nothrow)
+                                               char[compiled_program_size]);
+  if (!compiled_program)
+    return PyErr_NoMemory();
+
+  res = nvPTXCompilerGetCompiledProgram(*compiler, compiled_program.get());
   if (res != NVPTXCOMPILE_SUCCESS) {
     set_exception(PyExc_RuntimeError,
                   "%s error when calling nvPTXCompilerGetCompiledProgram",
@@ -253,14 +428,1005 @@ static PyObject *get_compiled_program(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  PyObject *py_prog =
-      PyBytes_FromStringAndSize(compiled_program, compiled_program_size);
-  // Once we've copied the compiled program to a Python object we can delete it
-  // - we don't need to check whether creation of the Unicode object succeeded,
-  // because we delete the compiled program either way.
-  delete[] compiled_program;
+  return PyBytes_FromStringAndSize(compiled_program.get(),
+                                   compiled_program_size);
+}
+
+static PyObject *get_cpu_times(PyObject *self) {
+  PyObject *times = PyDict_New();
+  if (times == nullptr)
+    return nullptr;
+
+  for (const auto &item : cpu_times) {
+    PyObject *value = Py_BuildValue("(KK)", item.second.compiles,
+                                    item.second.nanoseconds);
+    if (value == nullptr ||
+        PyDict_SetItemString(times, item.first.c_str(), value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(times);
+      return nullptr;
+    }
+    Py_DECREF(value);
+  }
+
+  return times;
+}
+
+static PyObject *reset_cpu_times(PyObject *self) {
+  cpu_times.clear();
+  Py_RETURN_NONE;
+}
+
+static PyObject *record_call_site(PyObject *self, PyObject *args) {
+  const char *site;
+  int outcome;
+  unsigned long long ns, ptx_bytes, cubin_bytes;
+  if (!PyArg_ParseTuple(args, "siKKK", &site, &outcome, &ns, &ptx_bytes,
+                        &cubin_bytes))
+    return nullptr;
+  if (outcome < OUTCOME_COMPILED || outcome > OUTCOME_BUNDLE) {
+    PyErr_SetString(PyExc_ValueError, "Unknown call site outcome");
+    return nullptr;
+  }
+
+  try {
+    CallSite &call_site = call_sites[site];
+    call_site.requests[outcome]++;
+    call_site.nanoseconds += ns;
+    call_site.ptx_bytes += ptx_bytes;
+    call_site.cubin_bytes += cubin_bytes;
+  } catch (const std::bad_alloc &) {
+    return PyErr_NoMemory();
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *get_call_sites(PyObject *self) {
+  PyObject *sites = PyDict_New();
+  if (sites == nullptr)
+    return nullptr;
+
+  for (const auto &item : call_sites) {
+    const CallSite &site = item.second;
+    PyObject *value = Py_BuildValue(
+        "(KKKKKK)", site.requests[OUTCOME_COMPILED],
+        site.requests[OUTCOME_CACHE], site.requests[OUTCOME_BUNDLE],
+        site.nanoseconds, site.ptx_bytes, site.cubin_bytes);
+    if (value == nullptr ||
+        PyDict_SetItemString(sites, item.first.c_str(), value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(sites);
+      return nullptr;
+    }
+    Py_DECREF(value);
+  }
+
+  return sites;
+}
+
+static PyObject *reset_call_sites(PyObject *self) {
+  call_sites.clear();
+  Py_RETURN_NONE;
+}
+
+// Scratch space for compile_ptx, kept per thread and grown geometrically.
+// Buffers are never shrunk, so once they have grown to fit the largest
+// compile a thread performs, compiles make no heap allocations in the
+// extension. The counters track growth across all threads.
+static std::atomic<unsigned long long> scratch_allocations(0);
+static std::atomic<unsigned long long> scratch_bytes(0);
+
+class ScratchBuffer {
+public:
+  // Returns a buffer of at least size bytes, or nullptr if it could not be
+  // allocated. The contents are not preserved when the buffer grows.
+  char *reserve(size_t size) {
+    if (size > capacity_) {
+      size_t capacity = capacity_ ? capacity_ : 4096;
+      while (capacity < size)
+        capacity *= 2;
+      char *data = new (std::nothrow) char[capacity];
+      if (data == nullptr)
+        return nullptr;
+      data_.reset(data);
+      scratch_allocations++;
+      scratch_bytes += capacity - capacity_;
+      capacity_ = capacity;
+    }
+    return data_.get();
+  }
+
+private:
+  std::unique_ptr<char[]> data_;
+  size_t capacity_ = 0;
+};
+
+static thread_local ScratchBuffer log_scratch;
+static thread_local std::vector<const char *> options_scratch;
+
+// The compilers compile_ptx can use. Index 0 is the compiler linked into the
+// extension; others are compiler libraries loaded with load_compiler, each in
+// a link namespace of its own (see dlmopen(3)) so that their symbols clash
+// neither with the built-in compiler nor with each other. Compilers are never
+// unloaded, so an entry stays valid after the GIL is released. The table and
+// the counters are only modified with the GIL held.
+struct Compiler {
+  std::string path;
+  unsigned int major = 0;
+  unsigned int minor = 0;
+
+  decltype(&nvPTXCompilerGetVersion) get_version;
+  decltype(&nvPTXCompilerCreate) create;
+  decltype(&nvPTXCompilerDestroy) destroy;
+  decltype(&nvPTXCompilerCompile) compile;
+  decltype(&nvPTXCompilerGetCompiledProgramSize) get_compiled_program_size;
+  decltype(&nvPTXCompilerGetCompiledProgram) get_compiled_program;
+  decltype(&nvPTXCompilerGetErrorLogSize) get_error_log_size;
+  decltype(&nvPTXCompilerGetErrorLog) get_error_log;
+  decltype(&nvPTXCompilerGetInfoLogSize) get_info_log_size;
+  decltype(&nvPTXCompilerGetInfoLog) get_info_log;
+
+  unsigned long long compiles = 0;
+  unsigned long long failures = 0;
+  unsigned long long nanoseconds = 0;
+};
+
+static std::vector<std::unique_ptr<Compiler>> compilers;
+
+// Returns the compiler with the given index, or sets an exception and returns
+// nullptr if there is none.
+static Compiler *get_compiler(Py_ssize_t index) {
+  if (compilers.empty()) {
+    std::unique_ptr<Compiler> builtin(new (std::nothrow) Compiler);
+    if (!builtin) {
+      PyErr_NoMemory();
+      return nullptr;
+    }
+    builtin->get_version = nvPTXCompilerGetVersion;
+    builtin->create = nvPTXCompilerCreate;
+    builtin->destroy = nvPTXCompilerDestroy;
+    builtin->compile = nvPTXCompilerCompile;
+    builtin->get_compiled_program_size = nvPTXCompilerGetCompiledProgramSize;
+    builtin->get_compiled_program = nvPTXCompilerGetCompiledProgram;
+    builtin->get_error_log_size = nvPTXCompilerGetErrorLogSize;
+    builtin->get_error_log = nvPTXCompilerGetErrorLog;
+    builtin->get_info_log_size = nvPTXCompilerGetInfoLogSize;
+    builtin->get_info_log = nvPTXCompilerGetInfoLog;
+    nvPTXCompilerGetVersion(&builtin->major, &builtin->minor);
+    try {
+      compilers.push_back(std::move(builtin));
+    } catch (const std::bad_alloc &) {
+      PyErr_NoMemory();
+      return nullptr;
+    }
+  }
+
+  if (index < 0 || (size_t)index >= compilers.size()) {
+    PyErr_Format(PyExc_IndexError, "No compiler with index %zd", index);
+    return nullptr;
+  }
+  return compilers[index].get();
+}
+
+template <typename Function>
+static bool load_symbol(void *library, const char *name, Function &function) {
+  function = reinterpret_cast<Function>(dlsym(library, name));
+  if (function == nullptr) {
+    PyErr_Format(PyExc_OSError, "Compiler library has no symbol %s", name);
+    return false;
+  }
+  return true;
+}
+
+static PyObject *load_compiler(PyObject *self, PyObject *args) {
+  const char *path;
+  if (!PyArg_ParseTuple(args, "s", &path))
+    return nullptr;
+
+  if (get_compiler(0) == nullptr)
+    return nullptr;
+
+  void *library;
+  Py_BEGIN_ALLOW_THREADS
+  library = dlmopen(LM_ID_NEWLM, path, RTLD_NOW | RTLD_LOCAL);
+  Py_END_ALLOW_THREADS
+  if (library == nullptr) {
+    PyErr_Format(PyExc_OSError, "Could not load compiler library: %s",
+                 dlerror());
+    return nullptr;
+  }
+
+  std::unique_ptr<Compiler> compiler(new (std::nothrow) Compiler);
+  if (!compiler)
+    return PyErr_NoMemory();
+
+  // The library stays loaded even if it turns out not to be usable, since a
+  // namespace cannot always be unloaded cleanly.
+  if (!load_symbol(library, "nvPTXCompilerGetVersion",
+                   compiler->get_version) ||
+      !load_symbol(library, "nvPTXCompilerCreate", compiler->create) ||
+      !load_symbol(library, "nvPTXCompilerDestroy", compiler->destroy) ||
+      !load_symbol(library, "nvPTXCompilerCompile", compiler->compile) ||
+      !load_symbol(library, "nvPTXCompilerGetCompiledProgramSize",
+                   compiler->get_compiled_program_size) ||
+      !load_symbol(library, "nvPTXCompilerGetCompiledProgram",
+                   compiler->get_compiled_program) ||
+      !load_symbol(library, "nvPTXCompilerGetErrorLogSize",
+                   compiler->get_error_log_size) ||
+      !load_symbol(library, "nvPTXCompilerGetErrorLog",
+                   compiler->get_error_log) ||
+      !load_symbol(library, "nvPTXCompilerGetInfoLogSize",
+                   compiler->get_info_log_size) ||
+      !load_symbol(library, "nvPTXCompilerGetInfoLog",
+                   compiler->get_info_log))
+    return nullptr;
+
+  nvPTXCompileResult res = compiler->get_version(&compiler->major,
+                                                 &compiler->minor);
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    set_exception(PyExc_RuntimeError,
+                  "%s error when calling nvPTXCompilerGetVersion",
+                  res);
+    return nullptr;
+  }
+
+  try {
+    compiler->path = path;
+    compilers.push_back(std::move(compiler));
+  } catch (const std::bad_alloc &) {
+    return PyErr_NoMemory();
+  }
+  return PyLong_FromSsize_t(compilers.size() - 1);
+}
+
+static PyObject *get_compilers(PyObject *self) {
+  if (get_compiler(0) == nullptr)
+    return nullptr;
+
+  PyObject *list = PyList_New(compilers.size());
+  if (list == nullptr)
+    return nullptr;
+
+  for (size_t i = 0; i < compilers.size(); i++) {
+    const Compiler &compiler = *compilers[i];
+    PyObject *path = Py_None;
+    if (i > 0) {
+      path = PyUnicode_DecodeFSDefault(compiler.path.c_str());
+      if (path == nullptr) {
+        Py_DECREF(list);
+        return nullptr;
+      }
+    } else {
+      Py_INCREF(path);
+    }
+    PyObject *item = Py_BuildValue(
+        "{sNs(II)sKsKsK}", "path", path, "version", compiler.major,
+        compiler.minor, "compiles", compiler.compiles, "failures",
+        compiler.failures, "nanoseconds", compiler.nanoseconds);
+    if (item == nullptr) {
+      Py_DECREF(list);
+      return nullptr;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+// Destroys a compiler handle when it goes out of scope.
+struct CompilerHandle {
+  Compiler *compiler;
+  nvPTXCompilerHandle handle = nullptr;
 
-  return py_prog;
+  explicit CompilerHandle(Compiler *compiler) : compiler(compiler) {}
+
+  ~CompilerHandle() {
+    if (handle != nullptr)
+      compiler->destroy(&handle);
+  }
+};
+
+// Fetch a log into scratch space and return it as a str. get_size and get_log
+// are the pair of API functions for the log to fetch.
+template <typename GetSize, typename GetLog>
+static PyObject *fetch_log(nvPTXCompilerHandle compiler, GetSize get_size,
+                           GetLog get_log, const char *size_name,
+                           const char *log_name) {
+  char message_format[128];
+  size_t log_size;
+  nvPTXCompileResult res = get_size(compiler, &log_size);
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    snprintf(message_format, sizeof(message_format),
+             "%%s error when calling %s", size_name);
+    set_exception(PyExc_RuntimeError, message_format, res);
+    return nullptr;
+  }
+
+  // The size returned doesn't include a trailing null byte
+  char *log = log_scratch.reserve(log_size + 1);
+  if (log == nullptr)
+    return PyErr_NoMemory();
+
+  res = get_log(compiler, log);
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    snprintf(message_format, sizeof(message_format),
+             "%%s error when calling %s", log_name);
+    set_exception(PyExc_RuntimeError, message_format, res);
+    return nullptr;
+  }
+
+  return PyUnicode_FromStringAndSize(log, log_size);
+}
+
+// Create, compile, fetch the results and destroy in one call, using the
+// compiler with the given index. Returns a tuple of the compiled program and
+// the info log. If compilation fails, the exception message is the error log.
+static PyObject *compile_ptx(PyObject *self, PyObject *args) {
+  const char *ptx_code;
+  Py_ssize_t ptx_size;
+  PyObject *options;
+  const char *label = nullptr;
+  Py_ssize_t index = 0;
+  if (!PyArg_ParseTuple(args, "s#O!|zn", &ptx_code, &ptx_size, &PyTuple_Type,
+                        &options, &label, &index))
+    return nullptr;
+
+  Compiler *compiler = get_compiler(index);
+  if (compiler == nullptr)
+    return nullptr;
+
+  Py_ssize_t n_options = PyTuple_GET_SIZE(options);
+  std::vector<const char *> &compile_options = options_scratch;
+  if (compile_options.capacity() < (size_t)n_options) {
+    try {
+      compile_options.reserve(n_options * 2);
+    } catch (const std::bad_alloc &) {
+      return PyErr_NoMemory();
+    }
+    scratch_allocations++;
+  }
+  compile_options.resize(n_options);
+  for (Py_ssize_t i = 0; i < n_options; i++) {
+    PyObject *item = PyTuple_GET_ITEM(options, i);
+    compile_options[i] = PyUnicode_AsUTF8AndSize(item, nullptr);
+    if (compile_options[i] == nullptr)
+      return nullptr;
+  }
+
+  if (index == 0)
+    wait_for_preinit();
+
+  CompilerHandle handle(compiler);
+  nvPTXCompileResult res =
+      compiler->create(&handle.handle, ptx_size, ptx_code);
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    handle.handle = nullptr;
+    set_exception(PyExc_RuntimeError,
+                  "%s error when calling nvPTXCompilerCreate",
+                  res);
+    return nullptr;
+  }
+
+  unsigned long long start, end;
+  Py_BEGIN_ALLOW_THREADS
+  start = thread_cpu_time_ns();
+  res = compiler->compile(handle.handle, n_options, compile_options.data());
+  end = thread_cpu_time_ns();
+  Py_END_ALLOW_THREADS
+
+  compiler->compiles++;
+  compiler->nanoseconds += end - start;
+  if (!record_cpu_time(label, end - start))
+    return nullptr;
+
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    compiler->failures++;
+    PyObject *error_log = fetch_log(
+        handle.handle, compiler->get_error_log_size, compiler->get_error_log,
+        "nvPTXCompilerGetErrorLogSize", "nvPTXCompilerGetErrorLog");
+    if (error_log != nullptr) {
+      PyErr_SetObject(PyExc_RuntimeError, error_log);
+      Py_DECREF(error_log);
+    }
+    return nullptr;
+  }
+
+  size_t compiled_program_size;
+  res = compiler->get_compiled_program_size(handle.handle,
+                                            &compiled_program_size);
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    set_exception(PyExc_RuntimeError,
+                  "%s error when calling nvPTXCompilerGetCompiledProgramSize",
+                  res);
+    return nullptr;
+  }
+
+  // Write the compiled program straight into the bytes object, rather than
+  // copying it there from a temporary buffer
+  PyObject *py_prog = PyBytes_FromStringAndSize(nullptr,
+                                                compiled_program_size);
+  if (py_prog == nullptr)
+    return nullptr;
+
+  res = compiler->get_compiled_program(handle.handle,
+                                       PyBytes_AS_STRING(py_prog));
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    Py_DECREF(py_prog);
+    set_exception(PyExc_RuntimeError,
+                  "%s error when calling nvPTXCompilerGetCompiledProgram",
+                  res);
+    return nullptr;
+  }
+
+  PyObject *py_log = fetch_log(handle.handle, compiler->get_info_log_size,
+                               compiler->get_info_log,
+                               "nvPTXCompilerGetInfoLogSize",
+                               "nvPTXCompilerGetInfoLog");
+  if (py_log == nullptr) {
+    Py_DECREF(py_prog);
+    return nullptr;
+  }
+
+  return Py_BuildValue("(NN)", py_prog, py_log);
+}
+
+static PyObject *get_scratch_stats(PyObject *self) {
+  return Py_BuildValue("{sKsK}", "allocations", scratch_allocations.load(),
+                       "bytes", scratch_bytes.load());
+}
+
+// Batched file I/O for the disk cache tiers, through io_uring. Each thread
+// keeps a ring of its own, created on first use. The ring is used directly
+// through the system calls rather than through liburing, which is not
+// available everywhere the extension is built.
+class Ring {
+public:
+  ~Ring() {
+    if (sqes_ != MAP_FAILED)
+      munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+      munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // Returns 0, or an errno value if the ring could not be set up
+  int init(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0)
+      return errno;
+    entries_ = p.sq_entries;
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+      return errno;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED)
+        return errno;
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+      return errno;
+
+    char *sq = static_cast<char *>(sq_ring_);
+    char *cq = static_cast<char *>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    tail_ = *sq_tail_;
+    return 0;
+  }
+
+  unsigned entries() const { return entries_; }
+
+  // Returns whether the kernel supports the operation
+  bool supports(unsigned op) {
+    size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> buffer(new (std::nothrow) char[size]());
+    if (!buffer)
+      return false;
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.get());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                256) < 0)
+      return false;
+    return op <= probe->last_op &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  // Returns the next submission queue entry, cleared. At most entries()
+  // entries may be queued between calls to submit.
+  io_uring_sqe *queue(unsigned char opcode, int fd, unsigned long long data) {
+    unsigned index = tail_ & sq_mask_;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes_) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    sq_array_[index] = index;
+    tail_++;
+    queued_++;
+    return sqe;
+  }
+
+  // Submit the queued entries and wait for all of them to complete, calling
+  // complete(user_data, res) for each. Returns 0, or an errno value if not
+  // all of them could be submitted, after waiting for the ones that were.
+  // Entries the kernel did not take are left queued, so after an error the
+  // ring must be dropped with discard_ring rather than used again.
+  template <typename Complete>
+  int submit(Complete complete) {
+    __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = queued_, pending = queued_;
+    queued_ = 0;
+    int err = 0;
+    while (pending > 0) {
+      int n = syscall(__NR_io_uring_enter, fd_, to_submit, 1,
+                      IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n < 0) {
+        if (errno == EINTR ||
+            (err != 0 && (errno == EAGAIN || errno == EBUSY)))
+          continue;
+        if (err != 0) {
+          // The completions cannot be reaped, so entries that were
+          // submitted may still be using their buffers
+          in_flight_ = true;
+          return err;
+        }
+        err = errno;
+        pending -= to_submit;
+        to_submit = 0;
+        continue;
+      }
+      to_submit -= n;
+
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++, pending--) {
+        io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+        complete(cqe->user_data, cqe->res);
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    return err;
+  }
+
+  // Returns whether a failed submit left entries that may still be running
+  bool in_flight() const { return in_flight_; }
+
+private:
+  int fd_ = -1;
+  unsigned entries_ = 0;
+  void *sq_ring_ = MAP_FAILED;
+  void *cq_ring_ = MAP_FAILED;
+  void *sqes_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned tail_ = 0;
+  unsigned queued_ = 0;
+  bool in_flight_ = false;
+};
+
+// Ring size, which bounds the number of files in flight per batch
+static const unsigned ring_entries = 64;
+static thread_local std::unique_ptr<Ring> thread_ring;
+static bool have_renameat = false;
+
+// Returns the calling thread's ring, or nullptr with errno set
+static Ring *get_ring() {
+  if (!thread_ring) {
+    std::unique_ptr<Ring> ring(new (std::nothrow) Ring);
+    if (!ring) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    int err = ring->init(ring_entries);
+    if (err != 0) {
+      errno = err;
+      return nullptr;
+    }
+    thread_ring = std::move(ring);
+  }
+  return thread_ring.get();
+}
+
+// Drops the calling thread's ring after a failed submit, so that the next
+// batch starts with a new one. Returns whether entries may still be in
+// flight, in which case the ring is leaked rather than closed, and the
+// caller must keep the memory they use alive.
+static bool discard_ring() {
+  bool in_flight = thread_ring->in_flight();
+  if (in_flight)
+    thread_ring.release();
+  else
+    thread_ring.reset();
+  return in_flight;
+}
+
+// Returns whether io_uring can be used for batched I/O: the kernel must
+// allow rings to be created and support the operations used
+static PyObject *uring_available(PyObject *self) {
+  static int available = -1;
+  if (available < 0) {
+    Ring *ring = get_ring();
+    available = ring != nullptr && ring->supports(IORING_OP_OPENAT) &&
+                ring->supports(IORING_OP_READ) &&
+                ring->supports(IORING_OP_WRITE) &&
+                ring->supports(IORING_OP_CLOSE);
+    have_renameat = available && ring->supports(IORING_OP_RENAMEAT);
+  }
+  return PyBool_FromLong(available);
+}
+
+// Returns whether the calling thread has a ring, setting one up if needed.
+// This can fail on a thread other than the first, e.g. once the locked
+// memory limit is reached.
+static PyObject *uring_thread_ready(PyObject *self) {
+  return PyBool_FromLong(get_ring() != nullptr);
+}
+
+static bool fs_paths(PyObject *list, std::vector<PyObject *> &encoded,
+                     std::vector<const char *> &paths) {
+  Py_ssize_t n = PyList_GET_SIZE(list);
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *path = nullptr;
+    if (!PyUnicode_FSConverter(PyList_GET_ITEM(list, i), &path))
+      return false;
+    encoded.push_back(path);
+    paths.push_back(PyBytes_AS_STRING(path));
+  }
+  return true;
+}
+
+struct DecRefAll {
+  std::vector<PyObject *> &objects;
+  ~DecRefAll() {
+    for (PyObject *o : objects)
+      Py_DECREF(o);
+  }
+};
+
+// Read whole files, a batch of up to ring_entries at a time: the files are
+// opened in one round trip through the ring, then read and closed in
+// another. Returns a list holding, for each path, the file's contents as
+// bytes or the errno value of the failure as an int.
+static PyObject *read_files(PyObject *self, PyObject *args) {
+  PyObject *list;
+  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list))
+    return nullptr;
+
+  std::vector<PyObject *> encoded;
+  DecRefAll release_paths{encoded};
+  std::vector<const char *> paths;
+  if (!fs_paths(list, encoded, paths))
+    return nullptr;
+
+  Ring *ring = get_ring();
+  if (ring == nullptr)
+    return PyErr_SetFromErrno(PyExc_OSError);
+
+  size_t n = paths.size();
+  PyObject *results = PyList_New(n);
+  if (results == nullptr)
+    return nullptr;
+
+  const unsigned long long close_flag = 1ULL << 63;
+  unsigned batch = ring->entries() / 2;
+  std::vector<int> fds(batch), errors(batch);
+  std::vector<size_t> sizes(batch);
+  std::vector<PyObject *> buffers(batch);
+  std::vector<char> closed(batch);
+
+  for (size_t start = 0; start < n; start += batch) {
+    size_t count = std::min<size_t>(batch, n - start);
+    int err;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (size_t i = 0; i < count; i++) {
+      fds[i] = -1;
+      closed[i] = false;
+      io_uring_sqe *sqe = ring->queue(IORING_OP_OPENAT, AT_FDCWD, i);
+      sqe->addr = (unsigned long long)paths[start + i];
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    err = ring->submit([&](unsigned long long i, int res) { fds[i] = res; });
+    for (size_t i = 0; err == 0 && i < count; i++) {
+      // The size is needed before the read can be queued; fstat does not
+      // touch the device, so it is done directly
+      struct stat st;
+      errors[i] = fds[i] < 0 ? -fds[i] : fstat(fds[i], &st) < 0 ? errno : 0;
+      sizes[i] = errors[i] == 0 ? st.st_size : 0;
+      if (sizes[i] > INT_MAX)
+        errors[i] = EFBIG;
+      if (errors[i] != 0 && fds[i] >= 0) {
+        close(fds[i]);
+        fds[i] = -1;
+      }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (err != 0) {
+      if (discard_ring()) {
+        // Opens still running read their paths
+        encoded.clear();
+      } else {
+        for (size_t i = 0; i < count; i++)
+          if (fds[i] >= 0)
+            close(fds[i]);
+      }
+      Py_DECREF(results);
+      errno = err;
+      return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    // Allocate the bytes objects to read into, then read without the GIL
+    for (size_t i = 0; i < count; i++) {
+      buffers[i] = nullptr;
+      if (errors[i] == 0) {
+        buffers[i] = PyBytes_FromStringAndSize(nullptr, sizes[i]);
+        if (buffers[i] == nullptr)
+          errors[i] = ENOMEM;
+      }
+    }
+    PyErr_Clear();
+
+    Py_BEGIN_ALLOW_THREADS
+    for (size_t i = 0; i < count; i++) {
+      if (fds[i] < 0)
+        continue;
+      if (errors[i] == 0) {
+        io_uring_sqe *sqe = ring->queue(IORING_OP_READ, fds[i], i);
+        sqe->addr = (unsigned long long)PyBytes_AS_STRING(buffers[i]);
+        sqe->len = sizes[i];
+        sqe->flags = IOSQE_IO_LINK;
+      }
+      ring->queue(IORING_OP_CLOSE, fds[i], i | close_flag);
+    }
+    err = ring->submit([&](unsigned long long data, int res) {
+      size_t i = data & ~close_flag;
+      if (data & close_flag) {
+        // A close linked to a failed read is cancelled
+        if (res == -ECANCELED)
+          close(fds[i]);
+        closed[i] = true;
+      } else if (res < 0) {
+        errors[i] = -res;
+      } else if ((size_t)res != sizes[i]) {
+        // The file was truncated while it was being read
+        errors[i] = EIO;
+      }
+    });
+    Py_END_ALLOW_THREADS
+
+    if (err != 0) {
+      // Reads still running write into the buffers, which are leaked
+      bool in_flight = discard_ring();
+      for (size_t i = 0; i < count; i++) {
+        if (in_flight)
+          continue;
+        if (fds[i] >= 0 && !closed[i])
+          close(fds[i]);
+        Py_XDECREF(buffers[i]);
+      }
+      Py_DECREF(results);
+      errno = err;
+      return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      PyObject *result = buffers[i];
+      if (errors[i] != 0) {
+        Py_XDECREF(result);
+        result = PyLong_FromLong(errors[i]);
+      }
+      if (result == nullptr) {
+        for (size_t j = i + 1; j < count; j++)
+          Py_XDECREF(buffers[j]);
+        Py_DECREF(results);
+        return nullptr;
+      }
+      PyList_SET_ITEM(results, start + i, result);
+    }
+  }
+  return results;
+}
+
+// Write files atomically, a batch of up to ring_entries at a time: each is
+// written to a temporary file in the same directory, which is then renamed
+// into place. Returns a list holding 0 or the errno value of the failure for
+// each file.
+static PyObject *write_files(PyObject *self, PyObject *args) {
+  PyObject *list;
+  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list))
+    return nullptr;
+
+  Py_ssize_t n = PyList_GET_SIZE(list);
+  std::vector<PyObject *> encoded;
+  DecRefAll release_paths{encoded};
+  std::vector<Py_buffer> views;
+  std::vector<const char *> paths;
+  // Held by pointer so that it can be leaked along with the other buffers
+  // if a failed batch leaves entries in flight
+  std::unique_ptr<std::vector<std::string>> tmp_paths_holder(
+      new std::vector<std::string>);
+  std::vector<std::string> &tmp_paths = *tmp_paths_holder;
+  struct ReleaseViews {
+    std::vector<Py_buffer> &views;
+    ~ReleaseViews() {
+      for (Py_buffer &view : views)
+        PyBuffer_Release(&view);
+    }
+  } release_views{views};
+
+  static std::atomic<unsigned long long> tmp_counter(0);
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *path = nullptr;
+    Py_buffer view;
+    if (!PyArg_ParseTuple(PyList_GET_ITEM(list, i), "O&y*",
+                          PyUnicode_FSConverter, &path, &view)) {
+      Py_XDECREF(path);
+      return nullptr;
+    }
+    encoded.push_back(path);
+    views.push_back(view);
+    paths.push_back(PyBytes_AS_STRING(path));
+
+    // A name starting with "." is skipped by readers listing the directory
+    std::string tmp = paths.back();
+    size_t slash = tmp.rfind('/');
+    tmp.insert(slash == std::string::npos ? 0 : slash + 1, ".");
+    tmp += "." + std::to_string(getpid()) + "." +
+           std::to_string(tmp_counter++);
+    tmp_paths.push_back(tmp);
+  }
+
+  Ring *ring = get_ring();
+  if (ring == nullptr)
+    return PyErr_SetFromErrno(PyExc_OSError);
+
+  const unsigned long long close_flag = 1ULL << 63;
+  unsigned batch = ring->entries() / 2;
+  std::vector<int> fds(batch), errors(n);
+  std::vector<char> closed(batch);
+  int err = 0;
+  bool in_flight = false;
+
+  Py_BEGIN_ALLOW_THREADS
+  for (size_t start = 0; start < (size_t)n; start += batch) {
+    size_t count = std::min<size_t>(batch, n - start);
+    int *e = &errors[start];
+
+    for (size_t i = 0; i < count; i++) {
+      fds[i] = -1;
+      closed[i] = false;
+      io_uring_sqe *sqe = ring->queue(IORING_OP_OPENAT, AT_FDCWD, i);
+      sqe->addr = (unsigned long long)tmp_paths[start + i].c_str();
+      sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+      sqe->len = 0600;
+    }
+    err = ring->submit([&](unsigned long long i, int res) {
+      fds[i] = res;
+      e[i] = res < 0 ? -res : 0;
+    });
+
+    for (size_t i = 0; err == 0 && i < count; i++) {
+      if (fds[i] < 0)
+        continue;
+      io_uring_sqe *sqe = ring->queue(IORING_OP_WRITE, fds[i], i);
+      sqe->addr = (unsigned long long)views[start + i].buf;
+      sqe->len = views[start + i].len;
+      sqe->flags = IOSQE_IO_LINK;
+      ring->queue(IORING_OP_CLOSE, fds[i], i | close_flag);
+    }
+    if (err == 0)
+      err = ring->submit([&](unsigned long long data, int res) {
+        size_t i = data & ~close_flag;
+        if (data & close_flag) {
+          if (res == -ECANCELED)
+            close(fds[i]);
+          else if (res < 0 && e[i] == 0)
+            e[i] = -res;
+          closed[i] = true;
+        } else if (res < 0) {
+          e[i] = -res;
+        } else if ((size_t)res != (size_t)views[start + i].len) {
+          e[i] = ENOSPC;
+        }
+      });
+
+    if (err != 0) {
+      // Remove the temporary files of the failed batch, unless entries
+      // still running may use them
+      in_flight = discard_ring();
+      for (size_t i = 0; !in_flight && i < count; i++) {
+        if (fds[i] < 0)
+          continue;
+        if (!closed[i])
+          close(fds[i]);
+        unlink(tmp_paths[start + i].c_str());
+      }
+      break;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      if (e[i] != 0 || fds[i] < 0) {
+        continue;
+      } else if (have_renameat) {
+        io_uring_sqe *sqe = ring->queue(IORING_OP_RENAMEAT, AT_FDCWD, i);
+        sqe->addr = (unsigned long long)tmp_paths[start + i].c_str();
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (unsigned long long)paths[start + i];
+      } else if (rename(tmp_paths[start + i].c_str(), paths[start + i]) < 0) {
+        e[i] = errno;
+      }
+    }
+    if (have_renameat)
+      err = ring->submit([&](unsigned long long i, int res) {
+        e[i] = res < 0 ? -res : 0;
+      });
+    if (err != 0) {
+      // Renames that were not submitted leave their temporary files
+      in_flight = discard_ring();
+      for (size_t i = 0; !in_flight && i < count; i++)
+        if (fds[i] >= 0)
+          unlink(tmp_paths[start + i].c_str());
+      break;
+    }
+
+    for (size_t i = 0; i < count; i++)
+      if (e[i] != 0 && fds[i] >= 0)
+        unlink(tmp_paths[start + i].c_str());
+  }
+  Py_END_ALLOW_THREADS
+
+  if (err != 0) {
+    if (in_flight) {
+      // Keep the paths and data that entries still running may use
+      tmp_paths_holder.release();
+      encoded.clear();
+      views.clear();
+    }
+    errno = err;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+
+  PyObject *results = PyList_New(n);
+  if (results == nullptr)
+    return nullptr;
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *result = PyLong_FromLong(errors[i]);
+    if (result == nullptr) {
+      Py_DECREF(results);
+      return nullptr;
+    }
+    PyList_SET_ITEM(results, i, result);
+  }
+  return results;
 }
 
 static PyMethodDef ext_methods[] = {
@@ -278,6 +1444,37 @@ static PyMethodDef ext_methods[] = {
      "Given a handle, return the info log"},
     {"get_compiled_program", (PyCFunction)get_compiled_program, METH_VARARGS,
      "Given a handle, return the compiled program"},
+    {"compile_ptx", (PyCFunction)compile_ptx, METH_VARARGS,
+     "Compile PTX, returning the compiled program and info log"},
+    {"load_compiler", (PyCFunction)load_compiler, METH_VARARGS,
+     "Load a compiler library in its own link namespace, returning its index"},
+    {"get_compilers", (PyCFunction)get_compilers, METH_NOARGS,
+     "Returns the path, version and usage counts of each compiler"},
+    {"get_scratch_stats", (PyCFunction)get_scratch_stats, METH_NOARGS,
+     "Returns the number and total size of scratch buffer allocations"},
+    {"uring_available", (PyCFunction)uring_available, METH_NOARGS,
+     "Returns whether io_uring can be used for batched file I/O"},
+    {"uring_thread_ready", (PyCFunction)uring_thread_ready, METH_NOARGS,
+     "Returns whether the calling thread can use io_uring"},
+    {"read_files", (PyCFunction)read_files, METH_VARARGS,
+     "Reads whole files through io_uring, returning bytes or errno values"},
+    {"write_files", (PyCFunction)write_files, METH_VARARGS,
+     "Writes files atomically through io_uring, returning errno values"},
+    {"preinitialize", (PyCFunction)preinitialize, METH_NOARGS,
+     "Starts pre-initializing the compiler on a background thread"},
+    {"wait_for_preinitialization", (PyCFunction)wait_for_preinitialization,
+     METH_NOARGS,
+     "Waits for pre-initialization and returns its duration in seconds"},
+    {"get_cpu_times", (PyCFunction)get_cpu_times, METH_NOARGS,
+     "Returns a dict mapping labels to (compiles, CPU time in ns)"},
+    {"reset_cpu_times", (PyCFunction)reset_cpu_times, METH_NOARGS,
+     "Clears the CPU time totals"},
+    {"record_call_site", (PyCFunction)record_call_site, METH_VARARGS,
+     "Adds a compile request to the totals for a call site"},
+    {"get_call_sites", (PyCFunction)get_call_sites, METH_NOARGS,
+     "Returns a dict mapping call sites to their request totals"},
+    {"reset_call_sites", (PyCFunction)reset_call_sites, METH_NOARGS,
+     "Clears the call site totals"},
     {nullptr}};
 
 static struct PyModuleDef moduledef = {
@@ -0,0 +1,94 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Accounting of the CPU time spent compiling.
+
+The extension measures the thread CPU time of every compile and adds it to a
+total for the compile's label. The label is the one passed to
+``compile_ptx``, or if none is passed, the one set by ``charge_to`` in the
+current context:
+
+    with charge_to('team-a'):
+        compile_ptx(ptx, options)
+
+Jobs submitted to the compile pool run in a copy of the submitter's context,
+so they are charged to the submitter's label.
+"""
+
+import json
+from contextlib import contextmanager
+from contextvars import ContextVar
+
+from ptxcompiler import _ptxcompilerlib
+
+compile_label = ContextVar('ptxcompiler_compile_label', default=None)
+
+
+@contextmanager
+def charge_to(label):
+    """Charge compiles in this context to ``label``."""
+    token = compile_label.set(label)
+    try:
+        yield
+    finally:
+        compile_label.reset(token)
+
+
+def current_label(label=None):
+    return label if label is not None else compile_label.get()
+
+
+def cpu_times():
+    """Return a dict mapping each label to the number of compiles charged to
+    it and their total CPU time in seconds."""
+    return {
+        label: {'compiles': compiles, 'cpu_seconds': nanoseconds / 1e9}
+        for label, (compiles, nanoseconds)
+        in _ptxcompilerlib.get_cpu_times().items()
+    }
+
+
+def reset():
+    _ptxcompilerlib.reset_cpu_times()
+
+
+def export_json(f):
+    """Write the CPU time totals to the file object ``f`` as JSON."""
+    json.dump(cpu_times(), f, indent=2, sort_keys=True)
+
+
+def _escape(label):
+    return label.replace('\\', r'\\').replace('"', r'\"').replace('\n', r'\n')
+
+
+def export_prometheus():
+    """Return the CPU time totals in the Prometheus text exposition
+    format."""
+    lines = [
+        '# HELP ptxcompiler_compile_cpu_seconds_total CPU time spent '
+        'compiling PTX.',
+        '# TYPE ptxcompiler_compile_cpu_seconds_total counter',
+    ]
+    times = sorted(cpu_times().items())
+    for label, t in times:
+        lines.append('ptxcompiler_compile_cpu_seconds_total'
+                     f'{{label="{_escape(label)}"}} {t["cpu_seconds"]}')
+    lines += [
+        '# HELP ptxcompiler_compiles_total Number of PTX compiles.',
+        '# TYPE ptxcompiler_compiles_total counter',
+    ]
+    for label, t in times:
+        lines.append(f'ptxcompiler_compiles_total{{label="{_escape(label)}"}}'
+                     f' {t["compiles"]}')
+    return '\n'.join(lines) + '\n'
@@ -0,0 +1,162 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Frequency-based admission of new cache entries (TinyLFU).
+
+Ad-hoc work compiles many kernels exactly once. Stored in an LRU cache, they
+push out the kernels that are actually reused. An ``AdmissionFilter`` keeps
+an approximate count of how often each key has been looked up, in a
+count-min sketch, and only lets a new entry into a full cache if its key has
+been looked up more often than the key of the entry it would evict.
+
+The sketch has four rows of small saturating counters, indexed by disjoint
+words of the (already uniformly distributed) key digest. Increments only
+raise the smallest of a key's counters, which reduces overestimates. Every
+``sample_size`` increments all counters are halved, so that frequencies
+reflect recent use and keys that were once hot eventually age out.
+
+A sketch can live in a file that is mapped read-write and updated in place,
+so that counts persist across processes and runs, in the same way as the
+Bloom filters in ``ptxcompiler.bloom``. Concurrent writers can occasionally
+lose an increment, which only makes an estimate slightly low.
+"""
+
+import os
+import struct
+import threading
+
+from ptxcompiler.bloom import map_shared
+
+MAGIC = b'PTXCMSKT'
+FORMAT_VERSION = 1
+
+ROWS = 4
+# Counters saturate at this value
+MAX_COUNT = 15
+DEFAULT_WIDTH = 1 << 16
+# Increments between halvings, per counter in a row
+SAMPLE_FACTOR = 10
+
+# magic, format version, width, increments since the last halving
+_HEADER = struct.Struct('<8sIIQ')
+_INDEXES = struct.Struct(f'<{ROWS}I')
+_HALVE = bytes(i >> 1 for i in range(256))
+
+
+class FrequencySketch:
+    """A count-min sketch of key digest frequencies with rows of ``width``
+    counters (rounded up to a power of two), kept in memory or, if ``path``
+    is given, in the file at ``path``. The file is replaced if it is not a
+    valid sketch of the same width."""
+
+    def __init__(self, width=DEFAULT_WIDTH, path=None):
+        width = 1 << max(4, (width - 1).bit_length())
+        self.width = width
+        self.sample_size = SAMPLE_FACTOR * width
+        self.path = path
+        self._lock = threading.Lock()
+
+        size = _HEADER.size + ROWS * width
+        if path is None:
+            self._buffer = bytearray(size)
+            _HEADER.pack_into(self._buffer, 0, MAGIC, FORMAT_VERSION, width,
+                              0)
+            return
+
+        self._buffer, _ = map_shared(
+            path, size, _HEADER.pack(MAGIC, FORMAT_VERSION, width, 0),
+            lambda fd: self._valid(fd, width, size))
+
+    @staticmethod
+    def _valid(fd, width, size):
+        if os.fstat(fd).st_size != size:
+            return False
+        magic, version, file_width, _ = _HEADER.unpack(
+            os.pread(fd, _HEADER.size, 0))
+        return (magic == MAGIC and version == FORMAT_VERSION and
+                file_width == width)
+
+    def _offsets(self, digest):
+        mask = self.width - 1
+        return [_HEADER.size + row * self.width + (h & mask)
+                for row, h in enumerate(_INDEXES.unpack_from(digest))]
+
+    def increment(self, digest):
+        """Record one occurrence of ``digest``."""
+        buffer = self._buffer
+        offsets = self._offsets(digest)
+        with self._lock:
+            smallest = min(buffer[i] for i in offsets)
+            if smallest < MAX_COUNT:
+                for i in offsets:
+                    if buffer[i] == smallest:
+                        buffer[i] = smallest + 1
+
+            *_, additions = _HEADER.unpack_from(buffer)
+            additions += 1
+            if additions >= self.sample_size:
+                self._age()
+                additions //= 2
+            struct.pack_into('<Q', buffer, _HEADER.size - 8, additions)
+
+    def _age(self):
+        buffer = self._buffer
+        buffer[_HEADER.size:] = buffer[_HEADER.size:].translate(_HALVE)
+
+    def estimate(self, digest):
+        """Return the estimated number of recent occurrences of
+        ``digest``."""
+        buffer = self._buffer
+        return min(buffer[i] for i in self._offsets(digest))
+
+    def close(self):
+        if self.path is not None:
+            self._buffer.close()
+
+
+class AdmissionFilter:
+    """Decides whether new entries are admitted to a cache, from the lookup
+    frequencies of their keys recorded in ``sketch``. Without an eviction
+    victim to compare against, an entry is admitted if its key has been
+    looked up at least ``min_frequency`` times."""
+
+    def __init__(self, sketch, min_frequency=0):
+        self.sketch = sketch
+        self.min_frequency = min_frequency
+        self.admitted = 0
+        self.rejected = 0
+
+    def record(self, digest):
+        """Record a lookup of ``digest``."""
+        self.sketch.increment(digest)
+
+    def admit(self, digest, victim=None):
+        """Return whether to admit an entry for ``digest``, evicting the
+        entry for ``victim`` if it is not ``None``."""
+        frequency = self.sketch.estimate(digest)
+        if victim is None:
+            admitted = frequency >= self.min_frequency
+        else:
+            admitted = frequency > self.sketch.estimate(victim)
+        if admitted:
+            self.admitted += 1
+        else:
+            self.rejected += 1
+        return admitted
+
+    def stats(self):
+        decisions = self.admitted + self.rejected
+        return {'admitted': self.admitted, 'rejected': self.rejected,
+                'admission_rate': (self.admitted / decisions
+                                   if decisions else 0.0)}
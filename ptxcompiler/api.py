@@ -12,7 +12,19 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-from ptxcompiler import _ptxcompilerlib
+import atexit
+import time
+from concurrent.futures import Future
+from queue import SimpleQueue
+
+from ptxcompiler import _ptxcompilerlib, callsites
+from ptxcompiler.accounting import current_label
+from ptxcompiler.cache import get_cache
+from ptxcompiler.columnar import ColumnarResults
+from ptxcompiler.compilers import select_compiler
+from ptxcompiler.dispatch import get_inline_policy
+from ptxcompiler.keys import make_key
+from ptxcompiler.pool import get_pool
 from collections import namedtuple
 
 
@@ -22,21 +34,171 @@ PTXCompilerResult = namedtuple(
 )
 
 
-def compile_ptx(ptx, options):
-    options = tuple(options)
-    handle = _ptxcompilerlib.create(ptx)
-    try:
-        _ptxcompilerlib.compile(handle, options)
-    except RuntimeError:
-        error_log = _ptxcompilerlib.get_error_log(handle)
-        _ptxcompilerlib.destroy(handle)
-        raise RuntimeError(error_log)
+def preinitialize():
+    """Start initializing the compiler on a background thread, so that the
+    first compile does not pay for it. Compiles started before it finishes
+    wait for it. Returns ``False`` if it was already started."""
+    started = _ptxcompilerlib.preinitialize()
+    if started:
+        # Don't exit while the background thread is inside the compiler
+        atexit.register(_ptxcompilerlib.wait_for_preinitialization)
+    return started
 
+
+def compile_ptx(ptx, options, label=None):
+    """Compile PTX to a cubin with the given options. The CPU time spent
+    compiling is charged to ``label``, or if it is ``None``, to the label
+    set with ``ptxcompiler.accounting.charge_to``. If several compilers are
+    loaded, one is chosen by ``ptxcompiler.compilers.select_compiler``."""
+    token = callsites.enter()
     try:
-        compiled_program = _ptxcompilerlib.get_compiled_program(handle)
-        info_log = _ptxcompilerlib.get_info_log(handle)
+        return _compile_ptx(ptx, tuple(options), label)
     finally:
-        _ptxcompilerlib.destroy(handle)
+        callsites.leave(token)
+
+
+def _compile_ptx(ptx, options, label, start=0):
+    begin = time.perf_counter()
+    compiler = select_compiler(ptx)
+    # Resolve the label here, as the compile may run on another thread
+    label = current_label(label)
+
+    compiled = False
+
+    def compile():
+        nonlocal compiled
+        compiled = True
+        compile_start = time.perf_counter()
+        entry = _ptxcompilerlib.compile_ptx(ptx, options, label,
+                                            compiler.index)
+        get_inline_policy().observe_compile(
+            len(ptx), time.perf_counter() - compile_start)
+        return entry
+
+    cache = get_cache()
+    if cache is None:
+        entry = compile()
+    else:
+        key = make_key(ptx, options, version=compiler.version)
+        entry = cache.get_or_compile(key, compile, start)
+    compiled_program, info_log = entry
+
+    outcome = callsites.COMPILED if compiled else callsites.CACHE
+    callsites.record(outcome, time.perf_counter() - begin, len(ptx),
+                     len(compiled_program))
 
     return PTXCompilerResult(compiled_program=compiled_program,
                              info_log=info_log)
+
+
+def _compile_submitted(submitted, ptx, options, label, start):
+    if submitted is not None:
+        get_inline_policy().observe_handoff(time.perf_counter() - submitted)
+    return _compile_ptx(ptx, options, label, start)
+
+
+def _done(result):
+    future = Future()
+    future.set_result(result)
+    return future
+
+
+def submit_compile_ptx(ptx, options, tag=None, label=None, inline=True):
+    """Schedule a compile on the shared compile pool, returning a future for
+    its ``PTXCompilerResult``. ``tag`` names the caller, for sharing the pool
+    fairly between callers - see ``ptxcompiler.pool``. Small modules are
+    compiled on the calling thread instead, and the future returned is
+    already done - see ``ptxcompiler.dispatch``. Pass ``inline=False`` when
+    submitting one of several compiles, so that they all run concurrently
+    rather than the small ones one after another on the calling thread."""
+    token = callsites.enter()
+    try:
+        return _submit_compile_ptx(ptx, tuple(options), tag, label,
+                                   inline=inline)
+    finally:
+        callsites.leave(token)
+
+
+def _submit_compile_ptx(ptx, options, tag, label, start=0, inline=True):
+    if inline and get_inline_policy().run_inline(len(ptx)):
+        future = Future()
+        try:
+            future.set_result(_compile_ptx(ptx, options, label, start))
+        except Exception as e:
+            future.set_exception(e)
+        return future
+
+    # The handoff latency is only measured for jobs that go straight to an
+    # idle worker, since time spent queued behind other jobs is not a cost
+    # of handing off
+    pool = get_pool()
+    submitted = time.perf_counter() if pool.idle() else None
+    return pool.submit(_compile_submitted, submitted, ptx, options, label,
+                       start, tag=tag, cost=len(ptx))
+
+
+def compile_ptxes(ptxes, options, tag=None, label=None, columnar=False):
+    """Compile several PTX sources with the same options concurrently on the
+    shared compile pool, returning a list of ``PTXCompilerResult``s. With
+    ``columnar=True``, the results are instead gathered into a
+    ``ColumnarResults`` holding all the programs in one buffer and all the
+    info logs in another. If caching is enabled, the cache is searched for
+    all the sources in one batch before any are compiled."""
+    token = callsites.enter()
+    try:
+        return _compile_ptxes(list(ptxes), tuple(options), tag, label,
+                              columnar)
+    finally:
+        callsites.leave(token)
+
+
+def _compile_ptxes(ptxes, options, tag, label, columnar):
+    # Compiling inline would compile the batch one module at a time, so only
+    # a single module may be
+    inline = len(ptxes) == 1
+    cache = get_cache()
+    if cache is not None:
+        keys = [make_key(ptx, options, version=select_compiler(ptx).version)
+                for ptx in ptxes]
+        # Hedged tiers are searched separately for each miss, so that a
+        # slow tier does not hold up the whole batch
+        begin = time.perf_counter()
+        entries = cache.get_many(keys, stop=cache.hedged_tier)
+        seconds = (time.perf_counter() - begin) / max(1, len(keys))
+        for ptx, entry in zip(ptxes, entries):
+            if entry is not None:
+                callsites.record(callsites.CACHE, seconds, len(ptx),
+                                 len(entry[0]))
+        futures = [_done(PTXCompilerResult(*entry)) if entry is not None
+                   else _submit_compile_ptx(ptx, options, tag, label,
+                                            start=cache.hedged_tier,
+                                            inline=inline)
+                   for ptx, entry in zip(ptxes, entries)]
+    else:
+        futures = [_submit_compile_ptx(ptx, options, tag, label,
+                                       inline=inline)
+                   for ptx in ptxes]
+    if not columnar:
+        return [future.result() for future in futures]
+
+    # Copy each result in as soon as it completes, so that it can be freed
+    # straight away rather than once all those before it have completed,
+    # then put the results back in input order. Identical PTX shares one
+    # future, so it is copied once and taken for each of its indices. The
+    # queue, unlike as_completed(), only holds the futures that have
+    # completed and not been copied yet.
+    indices = {}
+    for i, future in enumerate(futures):
+        indices.setdefault(future, []).append(i)
+    order = [None] * len(futures)
+    futures.clear()
+    completed = SimpleQueue()
+    for future in indices:
+        future.add_done_callback(completed.put)
+    results = ColumnarResults()
+    for _ in range(len(indices)):
+        future = completed.get()
+        for i in indices.pop(future):
+            order[i] = len(results)
+        results.append(*future.result())
+    return results.take(order)
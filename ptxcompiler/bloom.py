@@ -0,0 +1,133 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Memory-mapped Bloom filters over key digests.
+
+A filter in front of a slow cache tier answers "definitely not present"
+without touching the tier. Filters live in a file that is mapped read-write
+and updated in place as keys are added, so they persist across processes and
+runs. Concurrent writers can occasionally lose a bit; that only causes a
+false negative, which costs an unnecessary compile but never a wrong result.
+"""
+
+import math
+import mmap
+import os
+import struct
+import tempfile
+
+MAGIC = b'PTXBLOOM'
+FORMAT_VERSION = 1
+
+# magic, format version, number of hash functions, number of bits
+_HEADER = struct.Struct('<8sIIQ')
+_HASH = struct.Struct('<QQ')
+
+
+def filter_size(capacity, error_rate):
+    """Return the number of bits and hash functions for a filter holding
+    ``capacity`` keys with a false positive rate of ``error_rate``."""
+    bits = math.ceil(-capacity * math.log(error_rate) / math.log(2) ** 2)
+    bits = max(64, (bits + 7) // 8 * 8)
+    n_hashes = max(1, round(bits / capacity * math.log(2)))
+    return bits, n_hashes
+
+
+def map_shared(path, size, header, valid):
+    """Map the file at ``path`` read-write, returning ``(mmap, created)``.
+    If there is no file, or ``valid(fd)`` rejects it, a new file of ``size``
+    bytes starting with ``header`` is built under a temporary name and
+    renamed into place. A file is never truncated in place, since another
+    process may have it mapped and would fault on the truncated pages."""
+    try:
+        fd = os.open(path, os.O_RDWR)
+    except FileNotFoundError:
+        fd = None
+    if fd is not None and not valid(fd):
+        os.close(fd)
+        fd = None
+
+    created = fd is None
+    if created:
+        directory = os.path.dirname(os.path.abspath(path))
+        fd, tmp = tempfile.mkstemp(dir=directory, prefix='.')
+        try:
+            os.fchmod(fd, 0o644)
+            os.ftruncate(fd, size)
+            os.pwrite(fd, header, 0)
+            os.replace(tmp, path)
+        except BaseException:
+            os.close(fd)
+            os.unlink(tmp)
+            raise
+
+    try:
+        return mmap.mmap(fd, 0), created
+    finally:
+        os.close(fd)
+
+
+class BloomFilter:
+    """A Bloom filter backed by the file at ``path``, which is created with
+    room for ``capacity`` keys at ``error_rate`` if it does not exist or is
+    not a valid filter."""
+
+    def __init__(self, path, capacity=100000, error_rate=0.01):
+        self.path = path
+
+        bits, n_hashes = filter_size(capacity, error_rate)
+        self._mmap, self.created = map_shared(
+            path, _HEADER.size + bits // 8,
+            _HEADER.pack(MAGIC, FORMAT_VERSION, n_hashes, bits), self._valid)
+        _, _, self._n_hashes, self._bits = _HEADER.unpack_from(self._mmap)
+
+        self.lookups = 0
+        self.negatives = 0
+
+    @staticmethod
+    def _valid(fd):
+        size = os.fstat(fd).st_size
+        if size < _HEADER.size:
+            return False
+        magic, version, n_hashes, bits = _HEADER.unpack(
+            os.pread(fd, _HEADER.size, 0))
+        return (magic == MAGIC and version == FORMAT_VERSION and
+                n_hashes > 0 and size == _HEADER.size + bits // 8)
+
+    def _positions(self, digest):
+        # Double hashing over the (already uniformly distributed) digest
+        h1, h2 = _HASH.unpack_from(digest)
+        for i in range(self._n_hashes):
+            yield (h1 + i * h2) % self._bits
+
+    def add(self, digest):
+        m = self._mmap
+        for bit in self._positions(digest):
+            offset = _HEADER.size + (bit >> 3)
+            m[offset] |= 1 << (bit & 7)
+
+    def __contains__(self, digest):
+        m = self._mmap
+        self.lookups += 1
+        for bit in self._positions(digest):
+            if not m[_HEADER.size + (bit >> 3)] & (1 << (bit & 7)):
+                self.negatives += 1
+                return False
+        return True
+
+    def clear(self):
+        self._mmap[_HEADER.size:] = bytes(self._bits // 8)
+
+    def close(self):
+        self._mmap.close()
@@ -0,0 +1,420 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Read-only bundles of precompiled cubins.
+
+A bundle is a single file that is opened with one ``mmap`` and never written
+after it is built, so it can be shared between processes without locking.
+Its layout is:
+
+- A header page, holding the header and the index.
+- The index: a minimal perfect hash over the key digests, made up of a
+  displacement per bucket followed by one slot per entry. Each slot holds the
+  full key digest, so lookups of keys not in the bundle are rejected.
+- The cubin payloads, each starting on a page boundary.
+
+Bundles are built from a directory of compile results, where each result is
+a ``<name>.cubin`` file next to a ``<name>.json`` file describing its key -
+see ``save_result``.
+
+Bundles are found in ``PTXCOMPILER_CUBIN_BUNDLES`` and, unless
+``PTXCOMPILER_BUNDLE_PLUGINS=0``, through the ``ptxcompiler.cubin_bundles``
+entry point group, so that installed packages can ship prebuilt cubins for
+their kernels. Each entry point refers to a bundle path, a list of paths or
+a callable returning either, e.g. in a package's ``pyproject.toml``::
+
+    [project.entry-points."ptxcompiler.cubin_bundles"]
+    mypackage = "mypackage._kernels:cubin_bundles"
+"""
+
+import argparse
+import importlib.metadata
+import json
+import logging
+import mmap
+import os
+import struct
+import sys
+import tempfile
+import threading
+
+from ptxcompiler.keys import CompileKey
+
+MAGIC = b'PTXCBNDL'
+FORMAT_VERSION = 1
+PAGE_SIZE = 4096
+
+# magic, format version, payload alignment, entry count, bucket count,
+# displacement table offset, slot table offset
+_HEADER = struct.Struct('<8sIIIIQQ')
+# key digest, payload offset, payload length
+_SLOT = struct.Struct('<32sQQ')
+_DISP = struct.Struct('<I')
+_HASH = struct.Struct('<QQQ')
+_MASK = 2 ** 64 - 1
+
+# Average number of keys per bucket - larger values give a smaller index at
+# the cost of a slower build.
+_BUCKET_SIZE = 4
+
+BUNDLES_ENV = 'PTXCOMPILER_CUBIN_BUNDLES'
+PLUGINS_ENV = 'PTXCOMPILER_BUNDLE_PLUGINS'
+PLUGIN_GROUP = 'ptxcompiler.cubin_bundles'
+
+_bundles = None
+_index = None
+_lock = threading.Lock()
+
+logger = logging.getLogger(__name__)
+
+
+def _align(n, alignment=PAGE_SIZE):
+    return (n + alignment - 1) // alignment * alignment
+
+
+def _slot_of(h1, h2, displacement, n):
+    # Mix the displacement into the key's hash with the splitmix64 finalizer,
+    # so that each displacement gives an independent slot for every key.
+    z = h1 ^ ((h2 + displacement * 0x9e3779b97f4a7c15) & _MASK)
+    z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & _MASK
+    z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & _MASK
+    return (z ^ (z >> 31)) % n
+
+
+def build_index(digests):
+    """Build a minimal perfect hash over distinct key digests using hash and
+    displace. Returns the per-bucket displacements and, for each slot, the
+    position of the digest in ``digests`` that it holds."""
+    n = len(digests)
+    n_buckets = max(1, (n + _BUCKET_SIZE - 1) // _BUCKET_SIZE)
+    buckets = [[] for _ in range(n_buckets)]
+    for i, digest in enumerate(digests):
+        h0, h1, h2 = _HASH.unpack_from(digest)
+        buckets[h0 % n_buckets].append((i, h1, h2))
+
+    displacements = [0] * n_buckets
+    slots = [None] * n
+
+    # Place the largest buckets first, while there are most free slots
+    for b in sorted(range(n_buckets), key=lambda b: -len(buckets[b])):
+        bucket = buckets[b]
+        if not bucket:
+            break
+        for displacement in range(2 ** 32):
+            positions = {_slot_of(h1, h2, displacement, n)
+                         for _, h1, h2 in bucket}
+            if (len(positions) == len(bucket) and
+                    all(slots[p] is None for p in positions)):
+                break
+        else:
+            raise RuntimeError('Could not build perfect hash index')
+
+        displacements[b] = displacement
+        for i, h1, h2 in bucket:
+            slots[_slot_of(h1, h2, displacement, n)] = i
+
+    return displacements, slots
+
+
+def write_bundle(path, entries, alignment=PAGE_SIZE):
+    """Write a bundle to ``path`` from an iterable of ``(digest, cubin)``
+    pairs. Later duplicates of a digest are ignored. Payloads start on
+    multiples of ``alignment`` bytes. The bundle is written to a temporary
+    file and moved into place, so readers never see a partially written
+    bundle."""
+    unique = {}
+    for digest, cubin in entries:
+        unique.setdefault(bytes(digest), cubin)
+    digests = list(unique)
+    displacements, slots = build_index(digests) if digests else ([0], [])
+
+    disp_offset = _align(_HEADER.size, 8)
+    slots_offset = disp_offset + _DISP.size * len(displacements)
+    offset = _align(slots_offset + _SLOT.size * len(slots), alignment)
+
+    layout = []
+    for i in slots:
+        cubin = unique[digests[i]]
+        layout.append((digests[i], offset, len(cubin)))
+        offset = _align(offset + len(cubin), alignment)
+
+    directory = os.path.dirname(os.path.abspath(path))
+    fd, tmp = tempfile.mkstemp(dir=directory, prefix='.bundle-')
+    try:
+        with os.fdopen(fd, 'wb') as f:
+            f.write(_HEADER.pack(MAGIC, FORMAT_VERSION, alignment, len(slots),
+                                 len(displacements), disp_offset,
+                                 slots_offset))
+            f.seek(disp_offset)
+            f.write(b''.join(_DISP.pack(d) for d in displacements))
+            f.write(b''.join(_SLOT.pack(*slot) for slot in layout))
+            for digest, payload_offset, _ in layout:
+                f.seek(payload_offset)
+                f.write(unique[digest])
+            # Pad the file so that the last payload ends on an alignment
+            # boundary
+            f.truncate(max(offset, _align(_HEADER.size, alignment)))
+        os.replace(tmp, path)
+    except BaseException:
+        os.unlink(tmp)
+        raise
+
+
+class CubinBundle:
+    """A read-only bundle of cubins, mapped into memory. ``source`` names
+    where it was found: the environment, or the entry point that registered
+    it."""
+
+    source = BUNDLES_ENV
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            self._mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        self._view = memoryview(self._mmap)
+
+        if len(self._mmap) < _HEADER.size:
+            self.close()
+            raise ValueError(f'{path} is not a cubin bundle')
+        (magic, version, _, self._n_entries, self._n_buckets,
+         self._disp_offset, self._slots_offset) = \
+            _HEADER.unpack_from(self._mmap)
+        if magic != MAGIC:
+            self.close()
+            raise ValueError(f'{path} is not a cubin bundle')
+        if version != FORMAT_VERSION:
+            self.close()
+            raise ValueError(f'{path} has unsupported format version '
+                             f'{version}')
+
+    def __len__(self):
+        return self._n_entries
+
+    def _slot(self, digest):
+        h0, h1, h2 = _HASH.unpack_from(digest)
+        disp_offset = self._disp_offset + (h0 % self._n_buckets) * _DISP.size
+        displacement, = _DISP.unpack_from(self._mmap, disp_offset)
+        slot = _slot_of(h1, h2, displacement, self._n_entries)
+        return self._slots_offset + slot * _SLOT.size
+
+    def lookup(self, key):
+        """Return a zero-copy view of the cubin for ``key`` (a ``CompileKey``
+        or its digest), or ``None`` if the bundle does not contain it."""
+        if not self._n_entries:
+            return None
+        digest = key.digest() if isinstance(key, CompileKey) else key
+        stored, offset, length = _SLOT.unpack_from(self._mmap,
+                                                   self._slot(digest))
+        if stored != digest:
+            return None
+        return self._view[offset:offset + length]
+
+    def __contains__(self, key):
+        return self.lookup(key) is not None
+
+    def digests(self):
+        for i in range(self._n_entries):
+            offset = self._slots_offset + i * _SLOT.size
+            yield _SLOT.unpack_from(self._mmap, offset)[0]
+
+    def close(self):
+        # Views handed out by lookup() keep the mapping alive, in which case
+        # it is unmapped when they are released.
+        self._view.release()
+        try:
+            self._mmap.close()
+        except BufferError:
+            pass
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+def save_result(directory, key, cubin):
+    """Save a compile result into ``directory`` in the form consumed by
+    ``build_bundle``."""
+    name = os.path.join(directory, key.hexdigest())
+    with open(name + '.cubin', 'wb') as f:
+        f.write(cubin)
+    with open(name + '.json', 'w') as f:
+        json.dump(key._asdict(), f)
+
+
+def _load_result(json_path):
+    with open(json_path) as f:
+        key = CompileKey.from_dict(json.load(f))
+    with open(json_path[:-len('.json')] + '.cubin', 'rb') as f:
+        return key, f.read()
+
+
+def build_bundle(directory, path):
+    """Build a bundle at ``path`` from the compile results in ``directory``.
+    Returns the number of entries in the bundle."""
+    results = sorted(f for f in os.listdir(directory) if f.endswith('.json'))
+    entries = []
+    for name in results:
+        key, cubin = _load_result(os.path.join(directory, name))
+        entries.append((key.digest(), cubin))
+    write_bundle(path, entries)
+    with CubinBundle(path) as bundle:
+        return len(bundle)
+
+
+def _plugin_paths(entry_point):
+    """Return the bundle paths registered by an entry point, which refers to
+    a path, a list of paths or a callable returning either."""
+    paths = entry_point.load()
+    if callable(paths):
+        paths = paths()
+    if isinstance(paths, (str, os.PathLike)):
+        paths = [paths]
+    return [os.fspath(path) for path in paths]
+
+
+def _entry_points():
+    # EntryPoints.select() is only available from Python 3.10; before that,
+    # entry_points() returns a dict of groups
+    eps = importlib.metadata.entry_points()
+    if hasattr(eps, 'select'):
+        return eps.select(group=PLUGIN_GROUP)
+    return eps.get(PLUGIN_GROUP, [])
+
+
+def discover_plugin_bundles():
+    """Return ``(entry point name, path)`` for each bundle registered by an
+    installed package in the ``ptxcompiler.cubin_bundles`` entry point
+    group, in order of entry point name. Entry points that fail to load are
+    logged and skipped."""
+    found = []
+    try:
+        eps = sorted(_entry_points(), key=lambda ep: ep.name)
+    except Exception as e:
+        logger.warning('Could not list cubin bundle entry points: %s', e)
+        return found
+    for ep in eps:
+        try:
+            found.extend((ep.name, path) for path in _plugin_paths(ep))
+        except Exception as e:
+            logger.warning('Could not load cubin bundles from entry point '
+                           '%s (%s): %s', ep.name, ep.value, e)
+    return found
+
+
+def _open_bundles():
+    bundles = []
+    for path in os.getenv(BUNDLES_ENV, '').split(os.pathsep):
+        if not path:
+            continue
+        try:
+            bundles.append(CubinBundle(path))
+        except (OSError, ValueError) as e:
+            logger.warning('Could not open cubin bundle %s from %s: %s',
+                           path, BUNDLES_ENV, e)
+    if os.getenv(PLUGINS_ENV, '1') == '0':
+        return bundles
+
+    # A broken package must not stop anything from being compiled
+    try:
+        plugins = discover_plugin_bundles()
+    except Exception as e:
+        logger.warning('Could not discover cubin bundles: %s', e)
+        return bundles
+
+    for source, path in plugins:
+        try:
+            bundle = CubinBundle(path)
+        except (OSError, ValueError) as e:
+            logger.warning('Could not open cubin bundle %s from entry point '
+                           '%s: %s', path, source, e)
+            continue
+        bundle.source = source
+        bundles.append(bundle)
+    return bundles
+
+
+def get_bundles():
+    """Return the bundles named in the PTXCOMPILER_CUBIN_BUNDLES environment
+    variable, followed by those registered by installed packages, opening
+    them on first use."""
+    global _bundles
+
+    if _bundles is None:
+        with _lock:
+            if _bundles is None:
+                _bundles = _open_bundles()
+    return _bundles
+
+
+def _get_index():
+    """Return a dict mapping each key digest in any bundle to the first
+    bundle holding it, building it on first use."""
+    global _index
+
+    if _index is None:
+        bundles = get_bundles()
+        with _lock:
+            if _index is None:
+                index = {}
+                for bundle in reversed(bundles):
+                    index.update(dict.fromkeys(bundle.digests(), bundle))
+                _index = index
+    return _index
+
+
+def lookup(key):
+    """Return a view of the cubin for ``key`` from the first bundle holding
+    it, or ``None``. Bundles are searched through a merged index of all
+    their digests."""
+    digest = key.digest()
+    bundle = _get_index().get(digest)
+    return bundle.lookup(digest) if bundle is not None else None
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog='python -m ptxcompiler.bundle',
+                                     description='Manage cubin bundles')
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    build = subparsers.add_parser(
+        'build', help='Build a bundle from a directory of compile results')
+    build.add_argument('directory')
+    build.add_argument('bundle')
+
+    info = subparsers.add_parser('info', help='Describe a bundle')
+    info.add_argument('bundle')
+
+    subparsers.add_parser(
+        'list', help='List the bundles in the environment and registered by '
+                     'installed packages')
+
+    args = parser.parse_args(argv)
+
+    if args.command == 'build':
+        n = build_bundle(args.directory, args.bundle)
+        print(f'Wrote {n} entries to {args.bundle}')
+    elif args.command == 'list':
+        for bundle in get_bundles():
+            print(f'{bundle.source}: {bundle.path} ({len(bundle)} entries)')
+    else:
+        with CubinBundle(args.bundle) as bundle:
+            size = os.path.getsize(args.bundle)
+            print(f'{args.bundle}: {len(bundle)} entries, {size} bytes')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,950 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Multi-level cache of compile results.
+
+A ``CacheManager`` looks keys up in a list of tiers, ordered from fastest to
+slowest, and stores new results in them. The available tiers are:
+
+- ``memory``: an in-process LRU cache bounded by size.
+- ``shm``: entry files in shared memory, shared by processes on the host.
+- ``disk``: entry files in a persistent directory, fronted by a Bloom filter.
+- ``remote``: entries fetched from and stored to an HTTP server.
+
+Every tier uses the same key (see ``ptxcompiler.keys``) and, outside the
+memory tier, the same entry encoding. Each entry holds a small header
+describing the key, followed by the info log and the compiled program.
+Entry files are written to a temporary name and renamed into place, so
+readers never see partial entries.
+
+The tiers in use are configured with environment variables:
+
+- ``PTXCOMPILER_CACHE_TIERS``: comma-separated tier names, in order. Defaults
+  to ``disk`` if ``PTXCOMPILER_CACHE_DIR`` is set, and no caching otherwise.
+- ``PTXCOMPILER_CACHE_MEMORY_SIZE``: size limit of the memory tier in bytes.
+- ``PTXCOMPILER_CACHE_SHM_DIR``: directory for the shm tier.
+- ``PTXCOMPILER_CACHE_SHM_SIZE``: size limit of the shm tier in bytes, or 0
+  for no limit.
+- ``PTXCOMPILER_CACHE_DIR``: directory for the disk tier.
+- ``PTXCOMPILER_CACHE_DISK_SIZE``: size limit of the disk tier in bytes, or
+  0 for no limit.
+- ``PTXCOMPILER_CACHE_REMOTE_URL``: base URL of the remote tier.
+- ``PTXCOMPILER_CACHE_REMOTE_TIMEOUT``: timeout of remote requests, in
+  seconds.
+- ``PTXCOMPILER_CACHE_PROMOTE``: if true (the default), entries found in a
+  tier are copied into the faster tiers above it.
+- ``PTXCOMPILER_CACHE_WRITE_POLICY``: ``through`` (the default) to store new
+  entries in every tier, or ``back`` to store them only in the first tier and
+  demote them to the next tier when they are evicted, or when the process
+  exits.
+
+When the shm or disk tier grows past its size limit, the least recently used
+entry files are removed until it is back under ``EVICT_TARGET`` of the limit.
+
+Several keys can be looked up or stored at once with ``get_many`` and
+``put_many``. The shm and disk tiers then read and write the entry files in
+batches, through ``ptxcompiler.cacheio``.
+
+``get_or_compile`` looks a key up and compiles it on a miss. If hedging is
+enabled (see ``ptxcompiler.hedge``), lookups in the remote tier that take
+too long are abandoned for a local compile.
+
+The memory and disk tiers can be given an ``AdmissionFilter`` (see
+``ptxcompiler.admission``), so that kernels compiled only once do not push
+out frequently used ones. It is enabled for both with
+``PTXCOMPILER_CACHE_ADMISSION=1``.
+"""
+
+import atexit
+import fcntl
+import json
+import logging
+import os
+import stat
+import struct
+import tempfile
+import threading
+import time
+import urllib.error
+import urllib.request
+from collections import OrderedDict
+
+from ptxcompiler.admission import AdmissionFilter, FrequencySketch
+from ptxcompiler.bloom import BloomFilter
+from ptxcompiler.cacheio import get_io
+from ptxcompiler.hedge import hedge_from_env
+from ptxcompiler.keys import CompileKey
+
+CACHE_DIR_ENV = 'PTXCOMPILER_CACHE_DIR'
+
+DEFAULT_MEMORY_SIZE = 256 * 1024 * 1024
+DEFAULT_SHM_SIZE = 1024 * 1024 * 1024
+DEFAULT_DISK_SIZE = 10 * 1024 * 1024 * 1024
+# Fraction of its size limit a file tier is trimmed to when it exceeds it
+EVICT_TARGET = 0.9
+DEFAULT_REMOTE_TIMEOUT = 1.0
+
+ENTRY_MAGIC = b'PTXCENTR'
+ENTRY_VERSION = 1
+
+# magic, format version, metadata length, info log length, program length
+_ENTRY_HEADER = struct.Struct('<8sIIIQ')
+
+FILTER_NAME = 'filter.bloom'
+EVICT_LOCK_NAME = 'evict.lock'
+SKETCH_NAME = 'admission.sketch'
+# Lookups of a key before a disk tier without a size limit admits an entry
+# for it
+DISK_MIN_FREQUENCY = 2
+
+_cache = None
+
+logger = logging.getLogger(__name__)
+
+
+def encode_entry(key, compiled_program, info_log=''):
+    metadata = json.dumps(key._asdict()).encode()
+    info_log = info_log.encode()
+    header = _ENTRY_HEADER.pack(ENTRY_MAGIC, ENTRY_VERSION, len(metadata),
+                                len(info_log), len(compiled_program))
+    return b''.join((header, metadata, info_log, compiled_program))
+
+
+def decode_entry(data):
+    """Decode an entry, returning its key, compiled program and info log, or
+    ``None`` if the entry is not valid."""
+    if len(data) < _ENTRY_HEADER.size:
+        return None
+    magic, version, n_metadata, n_info_log, n_program = \
+        _ENTRY_HEADER.unpack_from(data)
+    start = _ENTRY_HEADER.size
+    if (magic != ENTRY_MAGIC or version != ENTRY_VERSION or
+            len(data) != start + n_metadata + n_info_log + n_program):
+        return None
+
+    key = CompileKey.from_dict(json.loads(bytes(data[start:start +
+                                                     n_metadata])))
+    start += n_metadata
+    info_log = bytes(data[start:start + n_info_log]).decode()
+    start += n_info_log
+    return key, bytes(data[start:]), info_log
+
+
+class MemoryCache:
+    """An in-process LRU cache of compile results holding at most
+    ``capacity`` bytes of compiled programs and logs. Evicted entries are
+    passed to ``on_evict``, if it is set, unless they were stored with
+    ``promote`` (i.e. copied from a lower tier that still holds them). With
+    an ``admission`` filter, a new entry that would evict others is only
+    stored if its key has been looked up more often than the least recently
+    used entry's."""
+
+    name = 'memory'
+
+    def __init__(self, capacity=DEFAULT_MEMORY_SIZE, admission=None):
+        self.capacity = capacity
+        self.size = 0
+        self.on_evict = None
+        self.admission = admission
+        self._entries = OrderedDict()
+        # Keys of entries stored with put, which no lower tier holds yet
+        self._dirty = set()
+        self._lock = threading.Lock()
+
+        self.hits = 0
+        self.misses = 0
+
+    @staticmethod
+    def _entry_size(entry):
+        compiled_program, info_log = entry
+        return len(compiled_program) + len(info_log)
+
+    def get(self, key):
+        if self.admission is not None:
+            self.admission.record(key.digest())
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is None:
+                self.misses += 1
+                return None
+            self._entries.move_to_end(key)
+            self.hits += 1
+            return entry
+
+    def get_many(self, keys):
+        return [self.get(key) for key in keys]
+
+    def put(self, key, compiled_program, info_log=''):
+        self._put(key, (compiled_program, info_log), True)
+
+    def promote(self, key, compiled_program, info_log=''):
+        """Store an entry copied from a lower tier, which is dropped rather
+        than passed to ``on_evict`` when it is evicted."""
+        self._put(key, (compiled_program, info_log), False)
+
+    def _put(self, key, entry, dirty):
+        evicted = []
+        with self._lock:
+            old = self._entries.pop(key, None)
+            if old is not None:
+                self.size -= self._entry_size(old)
+            elif (self.admission is not None and self._entries and
+                  self.size + self._entry_size(entry) > self.capacity):
+                victim = next(iter(self._entries))
+                if not self.admission.admit(key.digest(), victim.digest()):
+                    # A rejected entry is treated as evicted straight away
+                    if dirty:
+                        evicted.append((key, entry))
+                    entry = None
+            if entry is not None:
+                self._entries[key] = entry
+                self.size += self._entry_size(entry)
+                if dirty:
+                    self._dirty.add(key)
+            while self.size > self.capacity and len(self._entries) > 1:
+                old_key, old = self._entries.popitem(last=False)
+                self.size -= self._entry_size(old)
+                if old_key in self._dirty:
+                    self._dirty.discard(old_key)
+                    evicted.append((old_key, old))
+
+        if self.on_evict is not None:
+            for old_key, (compiled_program, info_log) in evicted:
+                self.on_evict(old_key, compiled_program, info_log)
+
+    def take_dirty(self):
+        """Return the ``(key, compiled_program, info_log)`` items no lower
+        tier holds yet, and consider them held from now on."""
+        with self._lock:
+            items = [(key, *self._entries[key]) for key in self._dirty]
+            self._dirty.clear()
+        return items
+
+    def __len__(self):
+        return len(self._entries)
+
+    def stats(self):
+        stats = {'hits': self.hits, 'misses': self.misses,
+                 'entries': len(self._entries), 'bytes': self.size}
+        if self.admission is not None:
+            stats.update(self.admission.stats())
+        return stats
+
+
+class DiskCache:
+    """A cache of compile results in ``directory``, optionally fronted by a
+    Bloom filter so that keys which were never stored are rejected without
+    touching the file system. Batched lookups and stores use the batch I/O
+    backend ``io``, by default the one chosen by ``cacheio.get_io()``.
+
+    With ``max_size``, the entry files are kept to about that many bytes:
+    when a process's stores take the total over it, the least recently used
+    entries (by modification time, which hits refresh) are removed, and
+    passed to ``on_evict`` if it is set, unless this process stored them
+    with ``promote``. Removed keys stay in the Bloom filter, so looking them
+    up costs a read. Without ``max_size``, nothing is ever evicted.
+
+    With ``admission=True``, key lookups are counted in a sketch kept in the
+    directory. With ``max_size``, a new result that takes the tier over it
+    is then only kept if its key has been looked up more often than that of
+    the least recently used entry it would replace; otherwise it is removed
+    instead. Without ``max_size``, there is no entry to compare against, so
+    new results are only stored once their key has been looked up
+    ``DISK_MIN_FREQUENCY`` times, so that kernels compiled only once are not
+    written at all. Entries stored explicitly with ``put_entry`` and
+    ``put_entries`` (e.g. by snapshot imports) are always admitted.
+
+    Errors from the file system in ``get``, ``get_many``, ``put`` and
+    ``put_many``, such as a full or read-only device, are logged and
+    treated as misses or dropped stores. If the directory cannot be set up,
+    the tier is disabled: it misses on every lookup and stores nothing."""
+
+    name = 'disk'
+
+    def __init__(self, directory, use_filter=True, name=None, io=None,
+                 admission=False, max_size=None):
+        if name is not None:
+            self.name = name
+        self.directory = directory
+        self.max_size = max_size
+        self.on_evict = None
+        self._io = io
+
+        # Bytes of entries, counted on first store if there is a size limit
+        self._size = None
+        self._size_lock = threading.Lock()
+        # Digests of entries this process promoted from a lower tier
+        self._clean = set()
+        # Digests of new results to be admitted against eviction victims
+        self._incoming = set()
+        self.evictions = 0
+
+        self.hits = 0
+        self.misses = 0
+        self.errors = 0
+        self.filter_false_positives = 0
+
+        self.admission = None
+        self._filter = None
+        # Setting a bit in the filter is not atomic
+        self._filter_lock = threading.Lock()
+        self.enabled = True
+        try:
+            os.makedirs(directory, exist_ok=True)
+            if admission:
+                sketch = FrequencySketch(
+                    path=os.path.join(directory, SKETCH_NAME))
+                self.admission = AdmissionFilter(sketch, DISK_MIN_FREQUENCY)
+            if use_filter:
+                self._filter = BloomFilter(
+                    os.path.join(directory, FILTER_NAME))
+                if self._filter.created:
+                    # Seed a new filter from any entries already in the cache
+                    for digest in self.digests():
+                        self._filter.add(digest)
+        except OSError as e:
+            self._error('setup', e)
+            self.enabled = False
+
+    def _error(self, action, error):
+        self.errors += 1
+        logger.warning('%s cache %s failed: %s', self.name.capitalize(),
+                       action, error)
+
+    def entry_path(self, digest):
+        name = digest.hex()
+        return os.path.join(self.directory, name[:2], name)
+
+    def digests(self):
+        for prefix in os.listdir(self.directory):
+            subdir = os.path.join(self.directory, prefix)
+            if len(prefix) != 2 or not os.path.isdir(subdir):
+                continue
+            for name in os.listdir(subdir):
+                if not name.startswith('.'):
+                    yield bytes.fromhex(name)
+
+    def get(self, key):
+        """Return the compiled program and info log for ``key``, or ``None``
+        if it is not in the cache."""
+        if not self.enabled:
+            self.misses += 1
+            return None
+        digest = key.digest()
+        if self.admission is not None:
+            self.admission.record(digest)
+        if self._filter is not None and digest not in self._filter:
+            self.misses += 1
+            return None
+
+        try:
+            data = self.read_entry(digest)
+        except OSError as e:
+            self._error('lookup', e)
+            data = None
+        entry = decode_entry(data) if data is not None else None
+
+        if entry is None or entry[0] != key:
+            self.misses += 1
+            if self._filter is not None:
+                self.filter_false_positives += 1
+            return None
+
+        self.hits += 1
+        self._touch(self.entry_path(digest))
+        return entry[1:]
+
+    def get_many(self, keys):
+        """Look up several keys at once, returning a list holding the
+        compiled program and info log for each key, or ``None`` for keys not
+        in the cache."""
+        if not self.enabled:
+            self.misses += len(keys)
+            return [None] * len(keys)
+        digests = [key.digest() for key in keys]
+        if self.admission is not None:
+            for digest in digests:
+                self.admission.record(digest)
+        if self._filter is not None:
+            wanted = [i for i, digest in enumerate(digests)
+                      if digest in self._filter]
+        else:
+            wanted = list(range(len(keys)))
+        self.misses += len(keys) - len(wanted)
+
+        results = [None] * len(keys)
+        paths = [self.entry_path(digests[i]) for i in wanted]
+        try:
+            data = self.io.read_files(paths)
+        except OSError as e:
+            self._error('lookup', e)
+            data = [None] * len(paths)
+        for i, data in zip(wanted, data):
+            entry = decode_entry(data) if data is not None else None
+            if entry is None or entry[0] != keys[i]:
+                self.misses += 1
+                if self._filter is not None:
+                    self.filter_false_positives += 1
+            else:
+                self.hits += 1
+                self._touch(self.entry_path(digests[i]))
+                results[i] = entry[1:]
+        return results
+
+    def _touch(self, path):
+        # Mark an entry as recently used, for eviction
+        if self.max_size:
+            try:
+                os.utime(path)
+            except OSError:
+                pass
+
+    def put(self, key, compiled_program, info_log=''):
+        if not self.enabled:
+            return
+        digest = key.digest()
+        if self._admit(digest):
+            try:
+                self.put_entry(digest,
+                               encode_entry(key, compiled_program, info_log),
+                               incoming=self.admission is not None)
+            except OSError as e:
+                self._error('store', e)
+
+    def _admit(self, digest):
+        # With a size limit, new results are admitted against the entries
+        # they would evict, once they are stored
+        return (self.admission is None or bool(self.max_size) or
+                self.admission.admit(digest))
+
+    def promote(self, key, compiled_program, info_log=''):
+        """Store an entry copied from a lower tier, which is not passed to
+        ``on_evict`` if this process evicts it."""
+        self.promote_many([(key, compiled_program, info_log)])
+
+    def promote_many(self, items):
+        if self.max_size:
+            self._clean.update(key.digest() for key, *_ in items)
+        self.put_many(items)
+
+    def put_many(self, items):
+        """Store several ``(key, compiled_program, info_log)`` items at
+        once."""
+        if not self.enabled:
+            return
+        entries = [(key.digest(), key, entry) for key, *entry in items]
+        try:
+            self.put_entries([(digest, encode_entry(key, *entry))
+                              for digest, key, entry in entries
+                              if self._admit(digest)],
+                             incoming=self.admission is not None)
+        except OSError as e:
+            self._error('store', e)
+
+    @property
+    def io(self):
+        if self._io is None:
+            self._io = get_io()
+        return self._io
+
+    def read_entry(self, digest):
+        """Return the encoded entry stored under ``digest``, or ``None``."""
+        try:
+            with open(self.entry_path(digest), 'rb') as f:
+                return f.read()
+        except (FileNotFoundError, NotADirectoryError):
+            return None
+
+    def put_entry(self, digest, data, incoming=False):
+        """Store an already encoded entry under ``digest``. With
+        ``incoming``, it is a new result that, with an admission filter,
+        must beat the entry it would evict to be kept."""
+        path = self.entry_path(digest)
+        directory = os.path.dirname(path)
+        os.makedirs(directory, exist_ok=True)
+
+        fd, tmp = tempfile.mkstemp(dir=directory, prefix='.')
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(data)
+            os.replace(tmp, path)
+        except BaseException:
+            os.unlink(tmp)
+            raise
+
+        if self._filter is not None:
+            with self._filter_lock:
+                self._filter.add(digest)
+        self._grow(len(data), [digest] if incoming else ())
+
+    def put_entries(self, entries, incoming=False):
+        """Store several already encoded entries, given as ``(digest,
+        data)`` pairs, writing them in a batch. If any cannot be written, the
+        others are still stored and the first error is raised. ``incoming``
+        is as for ``put_entry``."""
+        paths = [self.entry_path(digest) for digest, _ in entries]
+        for directory in {os.path.dirname(path) for path in paths}:
+            os.makedirs(directory, exist_ok=True)
+
+        errors = self.io.write_files([(path, data) for path, (_, data) in
+                                      zip(paths, entries)])
+        if self._filter is not None:
+            with self._filter_lock:
+                for (digest, _), error in zip(entries, errors):
+                    if error is None:
+                        self._filter.add(digest)
+        self._grow(sum(len(data) for (_, data), error in zip(entries, errors)
+                       if error is None),
+                   [digest for (digest, _), error in zip(entries, errors)
+                    if incoming and error is None])
+        for error in errors:
+            if error is not None:
+                raise error
+
+    def _entry_files(self):
+        """Return ``(modification time, size, digest, path)`` for each entry
+        file."""
+        files = []
+        for digest in self.digests():
+            path = self.entry_path(digest)
+            try:
+                st = os.stat(path)
+            except FileNotFoundError:
+                continue
+            files.append((st.st_mtime, st.st_size, digest, path))
+        return files
+
+    def _grow(self, size, incoming=()):
+        if not self.max_size:
+            return
+        with self._size_lock:
+            if self._size is None:
+                self._size = sum(f[1] for f in self._entry_files())
+            else:
+                self._size += size
+            if self._size <= self.max_size:
+                # There was room, so nothing is evicted for them
+                self._incoming.clear()
+                return
+            self._incoming.update(incoming)
+        self.evict()
+
+    def evict(self):
+        """Remove the least recently used entries until the entry files take
+        at most ``EVICT_TARGET`` of ``max_size``. With an admission filter,
+        each new result that took the tier over the limit is first compared
+        with the least recently used entry, and whichever key was looked up
+        less often is removed. Only one process evicts from a directory at a
+        time; others skip eviction meanwhile."""
+        path = os.path.join(self.directory, EVICT_LOCK_NAME)
+        with open(path, 'a') as lock:
+            try:
+                fcntl.flock(lock, fcntl.LOCK_EX | fcntl.LOCK_NB)
+            except BlockingIOError:
+                return
+            with self._size_lock:
+                incoming, self._incoming = self._incoming, set()
+            files = sorted(self._entry_files())
+            size = sum(f[1] for f in files)
+            target = self.max_size * EVICT_TARGET
+
+            victims = [f for f in files if f[2] not in incoming]
+            new = [f for f in files if f[2] in incoming]
+            if self.admission is not None:
+                kept = []
+                for entry in new:
+                    if size <= target or not victims:
+                        kept.append(entry)
+                    elif self.admission.admit(entry[2], victims[0][2]):
+                        size -= self._remove(*victims.pop(0)[1:])
+                        kept.append(entry)
+                    else:
+                        size -= self._remove(*entry[1:])
+                new = kept
+            for _, file_size, digest, file_path in victims + new:
+                if size <= target:
+                    break
+                size -= self._remove(file_size, digest, file_path)
+        with self._size_lock:
+            self._size = size
+
+    def _remove(self, size, digest, path):
+        """Remove an entry file, returning its size."""
+        if self.on_evict is not None and digest not in self._clean:
+            self._demote(path)
+        try:
+            os.unlink(path)
+        except FileNotFoundError:
+            pass
+        self._clean.discard(digest)
+        self.evictions += 1
+        return size
+
+    def _demote(self, path):
+        try:
+            with open(path, 'rb') as f:
+                entry = decode_entry(f.read())
+        except FileNotFoundError:
+            return
+        if entry is not None:
+            self.on_evict(*entry)
+
+    def stats(self):
+        stats = {'hits': self.hits, 'misses': self.misses,
+                 'errors': self.errors}
+        if self.max_size:
+            stats['evictions'] = self.evictions
+        if self.admission is not None:
+            stats.update(self.admission.stats())
+        if self._filter is not None:
+            # The false positive rate is the fraction of keys not in the cache
+            # that the filter failed to reject.
+            negatives = self._filter.negatives
+            false_positives = self.filter_false_positives
+            absent = negatives + false_positives
+            stats.update(
+                filter_lookups=self._filter.lookups,
+                filter_negatives=negatives,
+                filter_false_positives=false_positives,
+                filter_false_positive_rate=(false_positives / absent
+                                            if absent else 0.0))
+        return stats
+
+
+class RemoteCache:
+    """A cache of compile results on an HTTP server, which serves each entry
+    at ``<url>/<key digest>`` in response to GET and stores it in response to
+    PUT. Failures to reach the server are logged and treated as misses."""
+
+    name = 'remote'
+    # Slow lookups are abandoned for local compiles, if hedging is enabled
+    hedged = True
+
+    def __init__(self, url, timeout=DEFAULT_REMOTE_TIMEOUT):
+        self.url = url.rstrip('/')
+        self.timeout = timeout
+
+        self.hits = 0
+        self.misses = 0
+        self.errors = 0
+
+    def _request(self, key, **kwargs):
+        url = f'{self.url}/{key.hexdigest()}'
+        return urllib.request.Request(url, **kwargs)
+
+    def get(self, key):
+        try:
+            request = self._request(key)
+            with urllib.request.urlopen(request, timeout=self.timeout) as r:
+                entry = decode_entry(r.read())
+        except urllib.error.HTTPError as e:
+            if e.code != 404:
+                self.errors += 1
+                logger.warning('Remote cache lookup failed: %s', e)
+            entry = None
+        except (OSError, ValueError) as e:
+            self.errors += 1
+            logger.warning('Remote cache lookup failed: %s', e)
+            entry = None
+
+        if entry is None or entry[0] != key:
+            self.misses += 1
+            return None
+
+        self.hits += 1
+        return entry[1:]
+
+    def get_many(self, keys):
+        return [self.get(key) for key in keys]
+
+    def put(self, key, compiled_program, info_log=''):
+        data = encode_entry(key, compiled_program, info_log)
+        request = self._request(key, data=data, method='PUT')
+        try:
+            urllib.request.urlopen(request, timeout=self.timeout).close()
+        except (OSError, ValueError) as e:
+            self.errors += 1
+            logger.warning('Remote cache store failed: %s', e)
+
+    def stats(self):
+        return {'hits': self.hits, 'misses': self.misses,
+                'errors': self.errors}
+
+
+class CacheManager:
+    """Looks up and stores compile results in a list of cache tiers, ordered
+    from fastest to slowest."""
+
+    def __init__(self, tiers, promote=True, write_back=False, hedge=None):
+        self.tiers = list(tiers)
+        self.promote = promote
+        self.write_back = write_back
+        self.hedge = hedge
+
+        # Tiers from this index on are hedged against local compiles
+        self.hedged_tier = len(self.tiers)
+        if hedge is not None:
+            for i, tier in enumerate(self.tiers):
+                if getattr(tier, 'hedged', False):
+                    self.hedged_tier = i
+                    break
+
+        self._lookups = {tier.name: 0 for tier in self.tiers}
+        self._lookup_time = {tier.name: 0.0 for tier in self.tiers}
+
+        if write_back:
+            # Entries evicted from a tier are demoted to the one below it
+            for upper, lower in zip(self.tiers, self.tiers[1:]):
+                if hasattr(upper, 'on_evict'):
+                    upper.on_evict = lower.put
+
+    def get(self, key, start=0, stop=None):
+        """Return the compiled program and info log for ``key`` from the
+        fastest tier holding it, or ``None`` if no tier holds it. Only the
+        tiers ``start`` to ``stop`` are searched."""
+        stop = len(self.tiers) if stop is None else stop
+        for i in range(start, stop):
+            tier = self.tiers[i]
+            begin = time.perf_counter()
+            entry = tier.get(key)
+            self._lookups[tier.name] += 1
+            self._lookup_time[tier.name] += time.perf_counter() - begin
+
+            if entry is not None:
+                if self.promote:
+                    for upper in self.tiers[:i]:
+                        _promote_many(upper, [(key, *entry)])
+                return entry
+        return None
+
+    def get_many(self, keys, stop=None):
+        """Look up several keys at once, returning a list holding the
+        compiled program and info log for each key, or ``None`` for keys no
+        tier holds. Each tier is asked for the keys not found in the tiers
+        above it in one batch. Only the tiers before ``stop`` are
+        searched."""
+        results = [None] * len(keys)
+        missing = list(range(len(keys)))
+        for i, tier in enumerate(self.tiers[:stop]):
+            if not missing:
+                break
+            tier_keys = [keys[j] for j in missing]
+            start = time.perf_counter()
+            if hasattr(tier, 'get_many'):
+                entries = tier.get_many(tier_keys)
+            else:
+                entries = [tier.get(key) for key in tier_keys]
+            self._lookups[tier.name] += len(tier_keys)
+            self._lookup_time[tier.name] += time.perf_counter() - start
+
+            found = [(j, entry) for j, entry in zip(missing, entries)
+                     if entry is not None]
+            if self.promote and found:
+                for upper in self.tiers[:i]:
+                    _promote_many(upper, [(keys[j], *entry)
+                                          for j, entry in found])
+            for j, entry in found:
+                results[j] = entry
+            missing = [j for j, entry in zip(missing, entries)
+                       if entry is None]
+        return results
+
+    def get_or_compile(self, key, compile, start=0):
+        """Return the compiled program and info log for ``key`` from the
+        cache, searching the tiers from ``start`` on, or if no tier holds it,
+        from ``compile()``, storing its result. Once lookups in hedged tiers
+        take longer than the hedge's delay, ``compile()`` is called
+        instead."""
+        entry = self.get(key, start, max(start, self.hedged_tier))
+        if entry is not None:
+            return entry
+
+        if start <= self.hedged_tier < len(self.tiers):
+            entry, compiled = self.hedge.run(
+                lambda: self.get(key, self.hedged_tier), compile)
+        else:
+            entry, compiled = compile(), True
+        if compiled:
+            self.put(key, *entry)
+        return entry
+
+    def put(self, key, compiled_program, info_log=''):
+        tiers = self.tiers[:1] if self.write_back else self.tiers
+        for tier in tiers:
+            tier.put(key, compiled_program, info_log)
+
+    def put_many(self, items):
+        """Store several ``(key, compiled_program, info_log)`` items at
+        once."""
+        tiers = self.tiers[:1] if self.write_back else self.tiers
+        for tier in tiers:
+            _put_many(tier, items)
+
+    def flush(self):
+        """With write-back, store the entries in each tier that no lower
+        tier holds yet in the tier below it."""
+        if not self.write_back:
+            return
+        for upper, lower in zip(self.tiers, self.tiers[1:]):
+            if hasattr(upper, 'take_dirty'):
+                items = upper.take_dirty()
+                if items:
+                    _put_many(lower, items)
+
+    def stats(self):
+        """Return a dict of statistics for each tier, keyed by tier name."""
+        stats = {}
+        for tier in self.tiers:
+            tier_stats = tier.stats()
+            lookups = self._lookups[tier.name]
+            tier_stats['hit_rate'] = (tier_stats['hits'] / lookups
+                                      if lookups else 0.0)
+            tier_stats['mean_lookup_time'] = (
+                self._lookup_time[tier.name] / lookups if lookups else 0.0)
+            stats[tier.name] = tier_stats
+        if self.hedged_tier < len(self.tiers):
+            stats[self.tiers[self.hedged_tier].name]['hedge'] = \
+                self.hedge.stats()
+        return stats
+
+
+def _put_many(tier, items):
+    if hasattr(tier, 'put_many'):
+        tier.put_many(items)
+    else:
+        for item in items:
+            tier.put(*item)
+
+
+def _promote_many(tier, items):
+    # Promoted entries are already held by the tier they came from, so
+    # tiers that demote evicted entries must not write them back there
+    if hasattr(tier, 'promote_many'):
+        tier.promote_many(items)
+    elif hasattr(tier, 'promote'):
+        for item in items:
+            tier.promote(*item)
+    else:
+        _put_many(tier, items)
+
+
+def _env_flag(name, default):
+    value = os.getenv(name)
+    if value is None:
+        return default
+    try:
+        return bool(int(value))
+    except ValueError:
+        return False
+
+
+def _size_from_env(name, default):
+    size = os.getenv(name)
+    return int(size) if size else default
+
+
+def _private_directory(directory):
+    """Create ``directory`` if needed, and return whether it is a directory
+    that only the current user can write to. A directory in a shared
+    location such as ``/dev/shm`` could otherwise have been created by
+    another user, who could plant entries in it."""
+    try:
+        os.makedirs(directory, mode=0o700, exist_ok=True)
+        st = os.lstat(directory)
+    except OSError as e:
+        logger.warning('Could not create cache directory %s: %s',
+                       directory, e)
+        return False
+    if (not stat.S_ISDIR(st.st_mode) or st.st_uid != os.getuid() or
+            st.st_mode & (stat.S_IWGRP | stat.S_IWOTH)):
+        logger.warning('Not using cache directory %s: it must be a directory '
+                       'owned by the current user that others cannot write '
+                       'to', directory)
+        return False
+    return True
+
+
+def _make_tier(name):
+    """Create the cache tier ``name``, or return ``None`` if it cannot be
+    used safely."""
+    admission = _env_flag('PTXCOMPILER_CACHE_ADMISSION', False)
+    if name == 'memory':
+        size = os.getenv('PTXCOMPILER_CACHE_MEMORY_SIZE')
+        return MemoryCache(int(size) if size else DEFAULT_MEMORY_SIZE,
+                           admission=AdmissionFilter(FrequencySketch())
+                           if admission else None)
+    elif name == 'shm':
+        directory = os.getenv('PTXCOMPILER_CACHE_SHM_DIR',
+                              f'/dev/shm/ptxcompiler-{os.getuid()}')
+        if not _private_directory(directory):
+            return None
+        # Shared memory is as fast to probe as the filter would be
+        return DiskCache(directory, use_filter=False, name='shm',
+                         max_size=_size_from_env('PTXCOMPILER_CACHE_SHM_SIZE',
+                                                 DEFAULT_SHM_SIZE))
+    elif name == 'disk':
+        directory = os.getenv(CACHE_DIR_ENV)
+        if not directory:
+            raise ValueError(f'The disk cache tier requires {CACHE_DIR_ENV} '
+                             'to be set')
+        return DiskCache(directory, admission=admission,
+                         max_size=_size_from_env('PTXCOMPILER_CACHE_DISK_SIZE',
+                                                 DEFAULT_DISK_SIZE))
+    elif name == 'remote':
+        url = os.getenv('PTXCOMPILER_CACHE_REMOTE_URL')
+        if not url:
+            raise ValueError('The remote cache tier requires '
+                             'PTXCOMPILER_CACHE_REMOTE_URL to be set')
+        timeout = os.getenv('PTXCOMPILER_CACHE_REMOTE_TIMEOUT')
+        return RemoteCache(url, float(timeout) if timeout
+                           else DEFAULT_REMOTE_TIMEOUT)
+    raise ValueError(f'Unknown cache tier {name!r}')
+
+
+def cache_from_env():
+    """Create a cache manager as configured by the environment, or return
+    ``None`` if no cache tiers are enabled."""
+    names = os.getenv('PTXCOMPILER_CACHE_TIERS')
+    if names is None:
+        names = 'disk' if os.getenv(CACHE_DIR_ENV) else ''
+    names = [name.strip() for name in names.split(',') if name.strip()]
+    if not names:
+        return None
+
+    policy = os.getenv('PTXCOMPILER_CACHE_WRITE_POLICY', 'through')
+    if policy not in ('through', 'back'):
+        raise ValueError(f'Unknown cache write policy {policy!r}')
+
+    # Tiers that cannot be used are left out, rather than retried and
+    # reported again on every compile
+    tiers = [tier for tier in map(_make_tier, names) if tier is not None]
+    manager = CacheManager(tiers,
+                           promote=_env_flag('PTXCOMPILER_CACHE_PROMOTE',
+                                             True),
+                           write_back=policy == 'back',
+                           hedge=hedge_from_env())
+    if manager.write_back:
+        # Results still only held in memory would otherwise be lost
+        atexit.register(manager.flush)
+    return manager
+
+
+def get_cache():
+    """Return the cache manager configured by the environment, or ``None``
+    if caching is not enabled."""
+    global _cache
+
+    if _cache is None:
+        _cache = cache_from_env()
+    return _cache
@@ -0,0 +1,203 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Batched file I/O for the disk cache tiers.
+
+Looking up or storing many entries one file at a time leaves the device
+idle between requests, which matters most on NVMe drives, whose throughput
+depends on having many requests in flight. A batch I/O backend reads or
+writes a list of files with many requests in flight at once:
+
+- ``io_uring``: submits the opens, reads, writes and renames for a batch
+  through an io_uring ring in a few round trips, from the calling thread.
+- ``threads``: runs blocking I/O for each file on a shared thread pool. It is
+  used where io_uring is not available, e.g. on older kernels or where it is
+  disabled by a seccomp policy, and by threads that cannot set up a ring of
+  their own, e.g. once the locked memory limit is reached.
+
+Writes are atomic: each file is written to a temporary name in the same
+directory, starting with ``.``, and renamed into place.
+
+The backend is chosen with ``PTXCOMPILER_CACHE_IO``, which is ``auto`` (the
+default, to use io_uring if it is available), ``io_uring`` or ``threads``.
+"""
+
+import errno
+import os
+import tempfile
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+from ptxcompiler import _ptxcompilerlib
+
+IO_ENV = 'PTXCOMPILER_CACHE_IO'
+
+DEFAULT_THREADS = 16
+
+_io = None
+_io_lock = threading.Lock()
+
+
+def _read_result(path, result):
+    """Convert the result of reading a file to its contents, or ``None`` if
+    it does not exist, raising other errors."""
+    if not isinstance(result, int):
+        return result
+    if result in (errno.ENOENT, errno.ENOTDIR):
+        return None
+    raise OSError(result, os.strerror(result), path)
+
+
+def _write_error(path, result):
+    return OSError(result, os.strerror(result), path) if result else None
+
+
+class UringIO:
+    """Batched I/O through io_uring."""
+
+    name = 'io_uring'
+
+    def __init__(self):
+        self._local = threading.local()
+        self._fallback = None
+        self._fallback_lock = threading.Lock()
+
+    @staticmethod
+    def available():
+        return _ptxcompilerlib.uring_available()
+
+    def _thread_io(self):
+        """Return ``None`` if the calling thread has a ring, and otherwise the
+        ``ThreadPoolIO`` to use instead."""
+        ready = getattr(self._local, 'ready', None)
+        if ready is None:
+            ready = self._local.ready = _ptxcompilerlib.uring_thread_ready()
+        return None if ready else self._threads()
+
+    def _threads(self):
+        if self._fallback is None:
+            with self._fallback_lock:
+                if self._fallback is None:
+                    self._fallback = ThreadPoolIO()
+        return self._fallback
+
+    def read_files(self, paths):
+        """Return the contents of each file as bytes, or ``None`` for files
+        that do not exist."""
+        paths = [os.fspath(path) for path in paths]
+        fallback = self._thread_io()
+        if fallback is None:
+            try:
+                results = _ptxcompilerlib.read_files(paths)
+            except OSError:
+                # The ring failed part way through, and has been replaced
+                fallback = self._threads()
+            else:
+                return [_read_result(path, result) for path, result in
+                        zip(paths, results)]
+        return fallback.read_files(paths)
+
+    def write_files(self, items):
+        """Atomically write each ``(path, data)`` item, returning a list of
+        ``None`` for each file written and an ``OSError`` for each failure.
+        The directories must already exist."""
+        items = [(os.fspath(path), data) for path, data in items]
+        fallback = self._thread_io()
+        if fallback is None:
+            try:
+                results = _ptxcompilerlib.write_files(items)
+            except OSError:
+                fallback = self._threads()
+            else:
+                return [_write_error(path, result) for (path, _), result in
+                        zip(items, results)]
+        return fallback.write_files(items)
+
+    def shutdown(self):
+        if self._fallback is not None:
+            self._fallback.shutdown()
+
+
+class ThreadPoolIO:
+    """Batched I/O with blocking calls on a pool of ``threads`` threads."""
+
+    name = 'threads'
+
+    def __init__(self, threads=DEFAULT_THREADS):
+        self._executor = ThreadPoolExecutor(threads,
+                                            thread_name_prefix='cacheio')
+
+    @staticmethod
+    def _read(path):
+        try:
+            with open(path, 'rb') as f:
+                return f.read()
+        except (FileNotFoundError, NotADirectoryError):
+            return None
+
+    @staticmethod
+    def _write(item):
+        path, data = item
+        try:
+            fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path) or '.',
+                                       prefix='.')
+        except OSError as e:
+            return e
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(data)
+            os.replace(tmp, path)
+        except OSError as e:
+            os.unlink(tmp)
+            return e
+        except BaseException:
+            os.unlink(tmp)
+            raise
+        return None
+
+    def read_files(self, paths):
+        if len(paths) == 1:
+            return [self._read(paths[0])]
+        return list(self._executor.map(self._read, paths))
+
+    def write_files(self, items):
+        if len(items) == 1:
+            return [self._write(items[0])]
+        return list(self._executor.map(self._write, items))
+
+    def shutdown(self):
+        self._executor.shutdown()
+
+
+def io_from_env():
+    """Create the batch I/O backend selected by the environment."""
+    name = os.getenv(IO_ENV, 'auto')
+    if name not in ('auto', UringIO.name, ThreadPoolIO.name):
+        raise ValueError(f'Unknown cache I/O backend {name!r}')
+    if name != ThreadPoolIO.name and UringIO.available():
+        return UringIO()
+    if name == UringIO.name:
+        raise OSError(f'{IO_ENV} is io_uring, but io_uring is not available')
+    return ThreadPoolIO()
+
+
+def get_io():
+    """Return the batch I/O backend shared by the disk cache tiers."""
+    global _io
+
+    if _io is None:
+        with _io_lock:
+            if _io is None:
+                _io = io_from_env()
+    return _io
@@ -0,0 +1,167 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Attribution of compile requests to the Python code that made them.
+
+When call site tracking is enabled, each request to ``compile_ptx``,
+``submit_compile_ptx``, ``compile_ptxes`` and Numba's patched ``get_cubin``
+is tagged with a short signature of the Python stack that made it: the
+innermost ``depth`` frames outside ``ptxcompiler`` and the libraries that
+call it on behalf of user code (Numba, CuPy and the standard library's
+threading and futures modules). The time taken, the bytes of PTX and cubin,
+and whether the result was compiled or came from a cache or bundle are added
+to totals for the signature, kept in the extension.
+
+The signature is captured once, where the request enters ``ptxcompiler``,
+and held in a context variable, so compiles run on the compile pool or
+reached through nested calls are attributed to the original caller.
+
+Tracking is enabled with ``enable()`` or by setting
+``PTXCOMPILER_CALL_SITES`` to the number of frames to keep. The totals are
+available from ``call_sites()``, as a table from ``report()``, and as folded
+stacks for flame graph tools from ``export_folded()``.
+"""
+
+import os
+import sys
+from contextvars import ContextVar
+
+from ptxcompiler import _ptxcompilerlib
+
+CALL_SITES_ENV = 'PTXCOMPILER_CALL_SITES'
+DEFAULT_DEPTH = 8
+
+# Packages whose frames are never part of a call site, in addition to
+# ptxcompiler itself (other than its tests)
+SKIPPED_PACKAGES = frozenset(('numba', 'llvmlite', 'cupy', 'cupyx',
+                              'concurrent', 'threading', 'contextlib',
+                              'functools'))
+
+COMPILED, CACHE, BUNDLE = range(3)
+OUTCOMES = ('compiled', 'cache', 'bundle')
+
+call_site = ContextVar('ptxcompiler_call_site', default=None)
+
+
+def _depth_from_env():
+    try:
+        return max(0, int(os.getenv(CALL_SITES_ENV, '0')))
+    except ValueError:
+        return 0
+
+
+_depth = _depth_from_env()
+
+
+def enable(depth=DEFAULT_DEPTH):
+    """Start attributing compile requests to the innermost ``depth`` frames
+    of user code."""
+    global _depth
+    _depth = depth
+
+
+def disable():
+    global _depth
+    _depth = 0
+
+
+def _skipped(module):
+    root = module.partition('.')[0]
+    if root == 'ptxcompiler':
+        return not module.startswith('ptxcompiler.tests')
+    return root in SKIPPED_PACKAGES
+
+
+def capture(depth=None):
+    """Return the signature of the current stack, outermost frame first,
+    with frames separated by ``;``."""
+    depth = _depth if depth is None else depth
+    frames = []
+    frame = sys._getframe(1)
+    while frame is not None and len(frames) < depth:
+        module = frame.f_globals.get('__name__') or '?'
+        if not _skipped(module):
+            code = frame.f_code
+            frames.append(f'{module}.{code.co_name}:{frame.f_lineno}')
+        frame = frame.f_back
+    frames.reverse()
+    return ';'.join(frames).replace(' ', '_') or '?'
+
+
+def enter():
+    """Set the call site for requests made in this context, if tracking is
+    enabled and it is not already set. Returns a token for ``leave``."""
+    if not _depth or call_site.get() is not None:
+        return None
+    return call_site.set(capture())
+
+
+def leave(token):
+    if token is not None:
+        call_site.reset(token)
+
+
+def record(outcome, seconds, ptx_bytes, cubin_bytes):
+    """Add a request with ``outcome`` (``COMPILED``, ``CACHE`` or
+    ``BUNDLE``) to the totals of the current call site, if there is one."""
+    site = call_site.get()
+    if site is not None:
+        _ptxcompilerlib.record_call_site(site, outcome,
+                                         int(seconds * 1e9), ptx_bytes,
+                                         cubin_bytes)
+
+
+def call_sites():
+    """Return a dict mapping each call site to its request counts by
+    outcome, total time in seconds, and bytes of PTX and cubin."""
+    sites = {}
+    for site, (compiled, cached, bundled, ns, ptx_bytes, cubin_bytes) in \
+            _ptxcompilerlib.get_call_sites().items():
+        sites[site] = {'compiled': compiled, 'cache': cached,
+                       'bundle': bundled,
+                       'requests': compiled + cached + bundled,
+                       'seconds': ns / 1e9, 'ptx_bytes': ptx_bytes,
+                       'cubin_bytes': cubin_bytes}
+    return sites
+
+
+def reset():
+    _ptxcompilerlib.reset_call_sites()
+
+
+def report(limit=None):
+    """Return a table of the call sites taking the most time, slowest
+    first, showing the innermost frame of each."""
+    sites = sorted(call_sites().items(),
+                   key=lambda item: item[1]['seconds'], reverse=True)
+    lines = [f'{"seconds":>10} {"requests":>9} {"compiled":>9} '
+             f'{"cache":>7} {"bundle":>7} {"PTX MB":>8}  call site']
+    for site, t in sites[:limit]:
+        lines.append(f'{t["seconds"]:>10.3f} {t["requests"]:>9} '
+                     f'{t["compiled"]:>9} {t["cache"]:>7} {t["bundle"]:>7} '
+                     f'{t["ptx_bytes"] / 1e6:>8.2f}  '
+                     f'{site.rsplit(";", 1)[-1]}')
+    return '\n'.join(lines) + '\n'
+
+
+def export_folded(f, weight='seconds'):
+    """Write the totals to the file object ``f`` as folded stacks, one
+    ``frame;frame;... value`` line per call site, for flame graph tools.
+    ``weight`` is ``seconds`` (written in microseconds), ``requests``,
+    ``compiled``, ``ptx_bytes`` or ``cubin_bytes``."""
+    scale = 1e6 if weight == 'seconds' else 1
+    for site, t in sorted(call_sites().items()):
+        value = round(t[weight] * scale)
+        if value:
+            f.write(f'{site} {value}\n')
@@ -0,0 +1,128 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Columnar storage for the results of a batch of compiles.
+
+The compiled programs are stored back to back in one buffer, and the UTF-8
+encoded info logs in another. Each has an array of ``n + 1`` 64-bit offsets,
+where result ``i`` occupies ``offsets[i]:offsets[i + 1]``. This is the layout
+of an Arrow ``large_binary`` / ``large_string`` column, so the buffers can be
+handed to Arrow without copying.
+"""
+
+from array import array
+
+
+class ColumnarResults:
+    """The results of a batch of compiles, in input order.
+
+    ``programs`` and ``info_logs`` are read-only memoryviews over the data
+    buffers, and ``program_offsets`` and ``info_log_offsets`` are the offset
+    arrays. Indexing returns a ``PTXCompilerResult`` whose program is a
+    memoryview slice of ``programs``."""
+
+    def __init__(self):
+        self._programs = bytearray()
+        self._info_logs = bytearray()
+        self.program_offsets = array('q', [0])
+        self.info_log_offsets = array('q', [0])
+
+    def append(self, compiled_program, info_log):
+        self._programs += compiled_program
+        self.program_offsets.append(len(self._programs))
+        self._info_logs += info_log.encode()
+        self.info_log_offsets.append(len(self._info_logs))
+
+    def take(self, order):
+        """Return the results at the indices in ``order``, as a new
+        ``ColumnarResults``, or this one if ``order`` is already in order."""
+        if all(i == j for i, j in enumerate(order)):
+            return self
+        results = ColumnarResults()
+        programs = memoryview(self._programs)
+        info_logs = memoryview(self._info_logs)
+        for i in order:
+            results._programs += programs[self.program_offsets[i]:
+                                          self.program_offsets[i + 1]]
+            results.program_offsets.append(len(results._programs))
+            results._info_logs += info_logs[self.info_log_offsets[i]:
+                                            self.info_log_offsets[i + 1]]
+            results.info_log_offsets.append(len(results._info_logs))
+        programs.release()
+        info_logs.release()
+        return results
+
+    @property
+    def programs(self):
+        return memoryview(self._programs).toreadonly()
+
+    @property
+    def info_logs(self):
+        return memoryview(self._info_logs).toreadonly()
+
+    @staticmethod
+    def _lengths(offsets):
+        return array('q', (offsets[i + 1] - offsets[i]
+                           for i in range(len(offsets) - 1)))
+
+    @property
+    def program_lengths(self):
+        return self._lengths(self.program_offsets)
+
+    @property
+    def info_log_lengths(self):
+        return self._lengths(self.info_log_offsets)
+
+    def __len__(self):
+        return len(self.program_offsets) - 1
+
+    def program(self, i):
+        """Return the compiled program of result ``i`` as a memoryview."""
+        start, end = self.program_offsets[i], self.program_offsets[i + 1]
+        return self.programs[start:end]
+
+    def info_log(self, i):
+        start, end = self.info_log_offsets[i], self.info_log_offsets[i + 1]
+        return self.info_logs[start:end].tobytes().decode()
+
+    def __getitem__(self, i):
+        from ptxcompiler.api import PTXCompilerResult
+
+        if i < 0:
+            i += len(self)
+        if not 0 <= i < len(self):
+            raise IndexError('result index out of range')
+        return PTXCompilerResult(compiled_program=self.program(i),
+                                 info_log=self.info_log(i))
+
+    def __iter__(self):
+        return (self[i] for i in range(len(self)))
+
+    def to_arrow(self):
+        """Return the results as a ``pyarrow.RecordBatch`` with
+        ``compiled_program`` and ``info_log`` columns, sharing this object's
+        buffers. Requires pyarrow."""
+        import pyarrow as pa
+
+        n = len(self)
+        programs = pa.Array.from_buffers(
+            pa.large_binary(), n,
+            [None, pa.py_buffer(self.program_offsets),
+             pa.py_buffer(self._programs)])
+        info_logs = pa.Array.from_buffers(
+            pa.large_string(), n,
+            [None, pa.py_buffer(self.info_log_offsets),
+             pa.py_buffer(self._info_logs)])
+        return pa.RecordBatch.from_arrays([programs, info_logs],
+                                          ['compiled_program', 'info_log'])
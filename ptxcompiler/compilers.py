@@ -0,0 +1,176 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Hosting several PTX compiler versions in one process.
+
+Besides the compiler linked into the extension, compiler libraries can be
+loaded with ``load_compiler``, each in a link namespace of its own so that
+their symbols do not clash. The nvPTXCompiler library is only distributed as
+a static archive; a loadable library can be built from it with, e.g.::
+
+    g++ -shared -o libnvptxcompiler.so -Wl,--whole-archive \\
+        libnvptxcompiler_static.a -Wl,--no-whole-archive
+
+Each compile is routed to a compiler by the ISA version in the PTX's
+``.version`` directive, according to a policy:
+
+- ``'matching'`` (the default) uses the oldest compiler that supports the
+  ISA version, i.e. the one closest to the toolchain that produced the PTX.
+- ``'newest'`` uses the newest compiler for everything.
+
+A callable can also be given as the policy; it is called with the PTX's ISA
+version and the list of ``Compiler``s and returns the one to use. PTX that
+no compiler supports goes to the newest one.
+
+Libraries listed in ``PTXCOMPILER_COMPILERS`` (separated by ``os.pathsep``)
+are loaded on first use, and the policy can be set with
+``PTXCOMPILER_COMPILER_POLICY``. Compile results are cached under the
+version of the compiler that produced them.
+"""
+
+import os
+import re
+import threading
+from collections import namedtuple
+
+from ptxcompiler import _ptxcompilerlib
+
+Compiler = namedtuple('Compiler', ('index', 'path', 'version'))
+
+# The first CUDA release whose compiler supports each PTX ISA version
+PTX_ISA_CUDA_VERSIONS = {
+    (6, 0): (9, 0), (6, 1): (9, 1), (6, 2): (9, 2), (6, 3): (10, 0),
+    (6, 4): (10, 1), (6, 5): (10, 2),
+    (7, 0): (11, 0), (7, 1): (11, 1), (7, 2): (11, 2), (7, 3): (11, 3),
+    (7, 4): (11, 4), (7, 5): (11, 5), (7, 6): (11, 6), (7, 7): (11, 7),
+    (7, 8): (11, 8),
+    (8, 0): (12, 0), (8, 1): (12, 1), (8, 2): (12, 2), (8, 3): (12, 3),
+    (8, 4): (12, 4), (8, 5): (12, 5), (8, 6): (12, 7), (8, 7): (12, 8),
+    (8, 8): (12, 9),
+}
+
+POLICIES = ('matching', 'newest')
+
+_VERSION_RE = re.compile(r'^\s*\.version\s+(\d+)\.(\d+)', re.M)
+
+_compilers = None
+_policy = None
+_lock = threading.Lock()
+
+
+def ptx_isa_version(ptx):
+    """Return the ISA version from the PTX's ``.version`` directive as a
+    tuple, or ``None`` if it has none."""
+    match = _VERSION_RE.search(ptx)
+    if match is None:
+        return None
+    return int(match.group(1)), int(match.group(2))
+
+
+def required_compiler_version(isa_version):
+    """Return the oldest compiler version that supports a PTX ISA version,
+    or ``None`` if it is not known."""
+    return PTX_ISA_CUDA_VERSIONS.get(isa_version)
+
+
+def _load(path):
+    index = _ptxcompilerlib.load_compiler(path)
+    version = tuple(_ptxcompilerlib.get_compilers()[index]['version'])
+    return Compiler(index, path, version)
+
+
+def _initialize():
+    global _compilers, _policy
+
+    with _lock:
+        if _compilers is not None:
+            return
+        compilers = [Compiler(0, None, _ptxcompilerlib.get_version())]
+        paths = os.getenv('PTXCOMPILER_COMPILERS', '')
+        compilers.extend(_load(path) for path in paths.split(os.pathsep)
+                         if path)
+        if _policy is None:
+            _policy = _check_policy(
+                os.getenv('PTXCOMPILER_COMPILER_POLICY', 'matching'))
+        _compilers = compilers
+
+
+def load_compiler(path):
+    """Load a compiler library and make it available for routing. Returns
+    its ``Compiler``."""
+    global _compilers
+
+    _initialize()
+    with _lock:
+        compiler = _load(path)
+        _compilers = _compilers + [compiler]
+    return compiler
+
+
+def get_compilers():
+    """Return the list of available ``Compiler``s. The built-in compiler has
+    index 0 and path ``None``."""
+    _initialize()
+    return _compilers
+
+
+def _check_policy(policy):
+    if not callable(policy) and policy not in POLICIES:
+        raise ValueError(f'Unknown compiler policy {policy!r}')
+    return policy
+
+
+def set_compiler_policy(policy):
+    global _policy
+
+    _policy = _check_policy(policy)
+
+
+def select_compiler(ptx):
+    """Return the ``Compiler`` to compile the PTX with."""
+    _initialize()
+    compilers = _compilers
+    if len(compilers) == 1:
+        return compilers[0]
+
+    isa_version = ptx_isa_version(ptx)
+    if callable(_policy):
+        return _policy(isa_version, compilers)
+
+    newest = max(compilers, key=lambda c: (c.version, -c.index))
+    if _policy == 'newest':
+        return newest
+
+    required = required_compiler_version(isa_version)
+    if required is None:
+        return newest
+    supporting = [c for c in compilers if c.version >= required]
+    if not supporting:
+        return newest
+    return min(supporting, key=lambda c: (c.version, c.index))
+
+
+def compiler_stats():
+    """Return the number of compiles and failures and the CPU time in
+    seconds spent in each compiler, keyed by its index."""
+    return {
+        index: {
+            'path': c['path'],
+            'version': tuple(c['version']),
+            'compiles': c['compiles'],
+            'failures': c['failures'],
+            'cpu_seconds': c['nanoseconds'] / 1e9,
+        }
+        for index, c in enumerate(_ptxcompilerlib.get_compilers())
+    }
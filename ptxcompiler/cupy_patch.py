@@ -0,0 +1,166 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Serving CuPy's PTX to cubin step with ``compile_ptx``.
+
+CuPy compiles ``RawKernel``, ``RawModule`` and elementwise and reduction
+kernels with NVRTC in ``cupy.cuda.compiler._compile_with_cache_cuda``. When
+the driver is older than NVRTC, NVRTC produces PTX rather than a cubin, and
+CuPy loads it with ``cupy.cuda.function.Module.load``, leaving the driver to
+JIT compile it (the PTX is also what CuPy stores in its kernel cache).
+``patch_cupy()`` gives ``cupy.cuda.compiler`` a ``Module`` whose ``load``
+compiles PTX with ``compile_ptx`` first, so that CuPy kernels get the same
+compile caches, cubin bundles, tuned options and forward compatibility as
+Numba kernels. Cubins, and the output of links with ``cudadevrt``, are
+loaded unchanged, and PTX the static compiler rejects is passed on to the
+driver.
+
+PTX that is loaded directly rather than compiled by CuPy can be turned into
+a ``RawModule`` with ``raw_module_from_ptx()``.
+"""
+
+import atexit
+import hashlib
+import logging
+import os
+import shutil
+import tempfile
+
+from ptxcompiler import bundle, tuning
+from ptxcompiler.api import compile_ptx
+from ptxcompiler.compilers import select_compiler
+from ptxcompiler.keys import make_key, ptx_hash
+
+logger = logging.getLogger(__name__)
+
+_cubin_dir = None
+
+
+def _current_arch():
+    from cupy.cuda import device
+    return f'sm_{device.Device().compute_capability}'
+
+
+def compile_ptx_to_cubin(ptx, options=(), arch=None):
+    """Compile ``ptx`` to a cubin for ``arch`` (by default, the current
+    device's), using a bundled cubin or tuned options if there are any."""
+    if isinstance(ptx, (bytes, bytearray)):
+        ptx = ptx.decode()
+    arch = arch or _current_arch()
+    options = [f'--gpu-name={arch}', *options]
+    hashed = ptx_hash(ptx)
+
+    tuned = tuning.lookup(ptx, arch, hashed)
+    if tuned:
+        options = tuning.merge_options(options, tuned)
+
+    version = select_compiler(ptx).version
+    cubin = bundle.lookup(make_key(ptx, options, version=version,
+                                   hashed=hashed))
+    if cubin is not None:
+        return bytes(cubin)
+    return compile_ptx(ptx, options).compiled_program
+
+
+def is_ptx(image):
+    """Return whether a module image passed to the driver is PTX, rather
+    than a cubin (an ELF file) or a fatbin."""
+    return (isinstance(image, (bytes, bytearray)) and
+            not image.startswith(b'\x7fELF') and b'.version' in image)
+
+
+def _static_cubin(ptx):
+    # Returns None if the driver should compile the PTX instead
+    try:
+        return compile_ptx_to_cubin(ptx)
+    except Exception as e:
+        logger.warning('Static compilation failed, loading PTX with the '
+                       'driver instead: %s', e)
+        return None
+
+
+def _module_class(base):
+    class Module(base):
+        """``cupy.cuda.function.Module``, compiling PTX with
+        ``compile_ptx`` before it is loaded."""
+
+        def load(self, image):
+            if is_ptx(image):
+                cubin = _static_cubin(image)
+                if cubin is not None:
+                    image = cubin
+            return super().load(image)
+
+        def load_file(self, path):
+            if os.fspath(path).endswith('.ptx'):
+                with open(path, 'rb') as f:
+                    cubin = _static_cubin(f.read())
+                if cubin is not None:
+                    return super().load(cubin)
+            return super().load_file(path)
+
+    return Module
+
+
+class _FunctionModule:
+    """Stands in for ``cupy.cuda.function`` inside ``cupy.cuda.compiler``,
+    with ``Module`` replaced, so that the rest of CuPy is unaffected."""
+
+    def __init__(self, module):
+        self._module = module
+        self.Module = _module_class(module.Module)
+
+    def __getattr__(self, name):
+        return getattr(self._module, name)
+
+
+def patch_cupy():
+    """Make CuPy compile the PTX it generates with ``compile_ptx``. Returns
+    ``False`` if CuPy was already patched."""
+    from cupy.cuda import compiler
+
+    if isinstance(compiler.function, _FunctionModule):
+        return False
+    compiler.function = _FunctionModule(compiler.function)
+    logger.debug('Patched CuPy to compile PTX with the static compiler')
+    return True
+
+
+def _cubin_path(cubin):
+    global _cubin_dir
+
+    if _cubin_dir is None:
+        _cubin_dir = tempfile.mkdtemp(prefix='ptxcompiler-cupy-')
+        atexit.register(shutil.rmtree, _cubin_dir, ignore_errors=True)
+    path = os.path.join(_cubin_dir,
+                        hashlib.sha256(cubin).hexdigest() + '.cubin')
+    if not os.path.exists(path):
+        fd, tmp = tempfile.mkstemp(dir=_cubin_dir)
+        with os.fdopen(fd, 'wb') as f:
+            f.write(cubin)
+        os.replace(tmp, path)
+    return path
+
+
+def raw_module_from_ptx(ptx, options=(), **kwargs):
+    """Compile ``ptx`` with ``compile_ptx`` for the current device and
+    return it as a ``cupy.RawModule``, instead of having the driver compile
+    it when a module is loaded from a PTX file. Other keyword arguments are
+    passed to ``RawModule``."""
+    import cupy
+
+    # RawModule only loads cubins from files, which it may read lazily, so
+    # they are kept until the process exits
+    path = _cubin_path(compile_ptx_to_cubin(ptx, options))
+    return cupy.RawModule(path=path, **kwargs)
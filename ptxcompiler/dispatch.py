@@ -0,0 +1,150 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Choosing between compiling on the calling thread and on the compile pool.
+
+Handing a compile to the pool costs a queue insertion, a thread switch and
+the wait for a free worker. For small modules that can take longer than the
+compile itself, so ``submit_compile_ptx`` runs them on the calling thread
+instead (the GIL is released while the compiler runs) and returns a future
+that is already done. Large modules still go to the pool, so that the caller
+is not blocked, as do the modules of batches: inlining them would compile
+them one after another, which the per-module comparison does not account
+for.
+
+The choice is made from the size of the PTX: the policy keeps moving averages
+of the compile time per byte of PTX, measured from actual compiles, and of
+the handoff latency, measured from submission to the job starting for jobs
+submitted while a worker is idle (so that time spent queued behind other
+jobs is not counted) and capped at ``MAX_HANDOFF`` seconds. A module
+is compiled inline if its predicted compile time is less than
+``factor * handoff latency``. Until both have been observed, compiles go to
+the pool, and one in every ``PROBE_INTERVAL`` compiles that would run inline
+goes to the pool anyway, so that the handoff latency stays current.
+
+The mode can be set with ``PTXCOMPILER_INLINE_MODE``: ``auto`` (the default),
+``always`` or ``never``, and the factor with ``PTXCOMPILER_INLINE_FACTOR``.
+"""
+
+import os
+import threading
+
+MODES = ('auto', 'always', 'never')
+DEFAULT_FACTOR = 1.0
+# Weight of each new observation in the moving averages
+DEFAULT_SMOOTHING = 0.1
+PROBE_INTERVAL = 100
+# Longest handoff latency observed, so that a stall (e.g. waiting for the
+# GIL) cannot make much larger modules run inline
+MAX_HANDOFF = 0.005
+
+_policy = None
+_policy_lock = threading.Lock()
+
+
+class InlinePolicy:
+    def __init__(self, mode='auto', factor=DEFAULT_FACTOR,
+                 smoothing=DEFAULT_SMOOTHING):
+        if mode not in MODES:
+            raise ValueError(f'Unknown inline mode {mode!r}')
+        self.mode = mode
+        self.factor = factor
+        self.smoothing = smoothing
+
+        self._lock = threading.Lock()
+        self._seconds_per_byte = None
+        self._handoff = None
+        self._inline_run = 0
+        self._counts = {'inline': 0, 'pool': 0}
+        self._bytes = {'inline': 0, 'pool': 0}
+
+    def _average(self, current, value):
+        if current is None:
+            return value
+        return current + self.smoothing * (value - current)
+
+    def observe_compile(self, size, seconds):
+        """Record that compiling ``size`` bytes of PTX took ``seconds``."""
+        if size <= 0:
+            return
+        with self._lock:
+            self._seconds_per_byte = self._average(self._seconds_per_byte,
+                                                   seconds / size)
+
+    def observe_handoff(self, seconds):
+        """Record the time from submitting a job to an idle pool to its
+        starting."""
+        with self._lock:
+            self._handoff = self._average(self._handoff,
+                                          min(seconds, MAX_HANDOFF))
+
+    def threshold(self):
+        """Return the PTX size in bytes below which compiles run inline in
+        auto mode, or ``None`` if it is not yet known."""
+        with self._lock:
+            return self._threshold()
+
+    def _threshold(self):
+        if self._seconds_per_byte is None or self._handoff is None:
+            return None
+        if self._seconds_per_byte == 0:
+            return float('inf')
+        return self.factor * self._handoff / self._seconds_per_byte
+
+    def run_inline(self, size):
+        """Decide whether to compile ``size`` bytes of PTX on the calling
+        thread, and count the decision."""
+        with self._lock:
+            if self.mode == 'auto':
+                threshold = self._threshold()
+                inline = (threshold is not None and size < threshold and
+                          self._inline_run < PROBE_INTERVAL - 1)
+                self._inline_run = self._inline_run + 1 if inline else 0
+            else:
+                inline = self.mode == 'always'
+            where = 'inline' if inline else 'pool'
+            self._counts[where] += 1
+            self._bytes[where] += size
+            return inline
+
+    def stats(self):
+        """Return the number and total PTX size of compiles run inline and
+        on the pool, and the current estimates behind the decision."""
+        with self._lock:
+            return {
+                'mode': self.mode,
+                'inline': self._counts['inline'],
+                'pool': self._counts['pool'],
+                'inline_bytes': self._bytes['inline'],
+                'pool_bytes': self._bytes['pool'],
+                'seconds_per_byte': self._seconds_per_byte,
+                'handoff_latency': self._handoff,
+                'threshold': self._threshold(),
+            }
+
+
+def policy_from_env():
+    mode = os.getenv('PTXCOMPILER_INLINE_MODE', 'auto').lower()
+    factor = os.getenv('PTXCOMPILER_INLINE_FACTOR')
+    return InlinePolicy(mode, float(factor) if factor else DEFAULT_FACTOR)
+
+
+def get_inline_policy():
+    """Return the shared inline policy, creating it on first use."""
+    global _policy
+
+    with _policy_lock:
+        if _policy is None:
+            _policy = policy_from_env()
+    return _policy
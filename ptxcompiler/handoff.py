@@ -0,0 +1,209 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Handing compile results between processes without copying them.
+
+A helper process compiles PTX and places each compiled program in a sealed
+memfd, which it passes back over a Unix socket with ``SCM_RIGHTS``. The
+requester maps it read-only, so the program arrives as a memoryview over the
+shared pages rather than being pickled through a pipe. The seals prevent the
+helper from changing or resizing the file after it has been sent.
+
+Messages on the socket are a fixed-size header, optionally carrying one file
+descriptor, followed by a pickled payload:
+
+    header = struct.pack('<IQ', status, len(payload))
+
+Requires Linux.
+"""
+
+import array
+import fcntl
+import mmap
+import os
+import pickle
+import socket
+import struct
+import subprocess
+import sys
+import threading
+
+from ptxcompiler.api import PTXCompilerResult, compile_ptx
+
+_HEADER = struct.Struct('<IQ')
+_SEALS = (fcntl.F_SEAL_SEAL | fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW |
+          fcntl.F_SEAL_WRITE)
+
+STATUS_OK = 0
+STATUS_ERROR = 1
+
+
+def seal_buffer(data, name='ptxcompiler'):
+    """Copy ``data`` into a new memfd, seal it against modification and
+    return its file descriptor."""
+    fd = os.memfd_create(name, os.MFD_CLOEXEC | os.MFD_ALLOW_SEALING)
+    try:
+        view = memoryview(data).cast('B')
+        while view:
+            view = view[os.write(fd, view):]
+        fcntl.fcntl(fd, fcntl.F_ADD_SEALS, _SEALS)
+    except BaseException:
+        os.close(fd)
+        raise
+    return fd
+
+
+def map_sealed(fd):
+    """Map a sealed memfd read-only and return a memoryview of it. The file
+    descriptor is closed; the mapping stays valid while the view is alive."""
+    try:
+        seals = fcntl.fcntl(fd, fcntl.F_GET_SEALS)
+        if seals & _SEALS != _SEALS:
+            raise ValueError('Received a file that is not sealed')
+        size = os.fstat(fd).st_size
+        if size == 0:
+            return memoryview(b'')
+        return memoryview(mmap.mmap(fd, size, prot=mmap.PROT_READ))
+    finally:
+        os.close(fd)
+
+
+def _recv_exactly(sock, size):
+    data = bytearray(size)
+    view = memoryview(data)
+    while view:
+        n = sock.recv_into(view)
+        if n == 0:
+            raise EOFError('Connection closed')
+        view = view[n:]
+    return data
+
+
+# socket.send_fds() and recv_fds() are only available from Python 3.9, so
+# file descriptors are passed with sendmsg() and recvmsg() directly.
+def _send_fd(sock, data, fd):
+    fds = array.array('i', [fd])
+    return sock.sendmsg([data], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, fds)])
+
+
+def _recv_fd(sock, size):
+    """Receive up to ``size`` bytes and at most one file descriptor,
+    returning ``(data, fd)``."""
+    fds = array.array('i')
+    data, ancdata, flags, _ = sock.recvmsg(
+        size, socket.CMSG_SPACE(fds.itemsize), socket.MSG_CMSG_CLOEXEC)
+    for level, kind, cmsg_data in ancdata:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+            fds.frombytes(cmsg_data[:len(cmsg_data) -
+                                    len(cmsg_data) % fds.itemsize])
+    for extra in fds[1:]:
+        os.close(extra)
+    if flags & socket.MSG_CTRUNC:
+        for fd in fds[:1]:
+            os.close(fd)
+        raise OSError('File descriptor was truncated in transit')
+    return data, fds[0] if fds else None
+
+
+def send_message(sock, status, payload, fd=None):
+    """Send a pickled ``payload`` and optionally a file descriptor."""
+    data = pickle.dumps(payload, protocol=pickle.HIGHEST_PROTOCOL)
+    header = _HEADER.pack(status, len(data))
+    if fd is None:
+        sock.sendall(header)
+    else:
+        sent = _send_fd(sock, header, fd)
+        sock.sendall(header[sent:])
+    sock.sendall(data)
+
+
+def recv_message(sock):
+    """Receive a message, returning ``(status, payload, fd)``, where ``fd``
+    is ``None`` if no file descriptor was sent."""
+    header, fd = _recv_fd(sock, _HEADER.size)
+    if not header:
+        if fd is not None:
+            os.close(fd)
+        raise EOFError('Connection closed')
+    if len(header) < _HEADER.size:
+        header += _recv_exactly(sock, _HEADER.size - len(header))
+    status, size = _HEADER.unpack(header)
+    payload = pickle.loads(_recv_exactly(sock, size))
+    return status, payload, fd
+
+
+def serve(sock):
+    """Compile requests received on ``sock`` until it is closed. Each
+    request is a pickled ``(ptx, options, label)``."""
+    while True:
+        try:
+            _, (ptx, options, label), _ = recv_message(sock)
+        except EOFError:
+            return
+        try:
+            result = compile_ptx(ptx, options, label)
+        except Exception as e:
+            send_message(sock, STATUS_ERROR, e)
+            continue
+        fd = seal_buffer(result.compiled_program)
+        try:
+            send_message(sock, STATUS_OK, result.info_log, fd)
+        finally:
+            os.close(fd)
+
+
+class CompileWorker:
+    """A helper process that compiles PTX and returns compiled programs in
+    shared memory. ``compile_ptx`` returns a ``PTXCompilerResult`` whose
+    program is a read-only memoryview. Requests from several threads are
+    serialized."""
+
+    def __init__(self):
+        self._sock, child = socket.socketpair()
+        try:
+            cmd = [sys.executable, '-m', 'ptxcompiler.handoff',
+                   str(child.fileno())]
+            self._process = subprocess.Popen(cmd,
+                                             pass_fds=(child.fileno(),))
+        finally:
+            child.close()
+        self._lock = threading.Lock()
+
+    def compile_ptx(self, ptx, options, label=None):
+        with self._lock:
+            send_message(self._sock, STATUS_OK, (ptx, tuple(options), label))
+            status, payload, fd = recv_message(self._sock)
+
+        if status == STATUS_ERROR:
+            if fd is not None:
+                os.close(fd)
+            raise payload
+        if fd is None:
+            raise RuntimeError('Compile worker did not return a program')
+        return PTXCompilerResult(compiled_program=map_sealed(fd),
+                                 info_log=payload)
+
+    def close(self):
+        self._sock.close()
+        self._process.wait()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+if __name__ == '__main__':
+    serve(socket.socket(fileno=int(sys.argv[1])))
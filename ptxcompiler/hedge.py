@@ -0,0 +1,147 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Hedging slow cache lookups against compiling locally.
+
+A lookup in the remote cache tier usually takes a few milliseconds, but when
+the server is slow or degraded it can take up to the request timeout, which
+makes every miss far slower than simply compiling. A ``Hedge`` bounds that:
+the lookup is started on a background thread, and if it has not answered
+within a delay, the calling thread compiles locally instead. A lookup still
+waiting for a free fetch thread is cancelled, so that a degraded server is
+not sent requests whose results no longer matter; one already running is
+left to finish in the background and its result is discarded. The compile
+runs on the caller's thread, as it would without a cache, so hedging adds no
+compile threads of its own. Lookups that hit after the compile started are
+counted, as a sign that the delay is too short.
+
+The delay adapts to the tier: it is a percentile (by default the 95th) of
+the latencies of recent lookups, so that only the slowest lookups are
+hedged, clamped between a minimum and a maximum. Until enough lookups have
+been observed, a fixed initial delay is used.
+
+Hedging is enabled with ``PTXCOMPILER_CACHE_HEDGE=1``, and the percentile is
+set with ``PTXCOMPILER_CACHE_HEDGE_PERCENTILE``.
+"""
+
+import os
+import threading
+import time
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor, TimeoutError
+
+DEFAULT_PERCENTILE = 95.0
+DEFAULT_WINDOW = 256
+# Lookups observed before the percentile is trusted
+MIN_SAMPLES = 16
+DEFAULT_INITIAL_DELAY = 0.05
+DEFAULT_MIN_DELAY = 0.001
+DEFAULT_MAX_DELAY = 1.0
+# Lookups in flight at once, including those left running once hedged
+DEFAULT_FETCH_THREADS = 32
+
+
+class Hedge:
+    def __init__(self, percentile=DEFAULT_PERCENTILE, window=DEFAULT_WINDOW,
+                 initial_delay=DEFAULT_INITIAL_DELAY,
+                 min_delay=DEFAULT_MIN_DELAY, max_delay=DEFAULT_MAX_DELAY,
+                 fetch_threads=DEFAULT_FETCH_THREADS):
+        if not 0 < percentile <= 100:
+            raise ValueError(f'Invalid hedge percentile {percentile}')
+        self.percentile = percentile
+        self.initial_delay = initial_delay
+        self.min_delay = min_delay
+        self.max_delay = max_delay
+
+        self._lock = threading.Lock()
+        self._latencies = deque(maxlen=window)
+        self._fetch_executor = ThreadPoolExecutor(
+            fetch_threads, thread_name_prefix='ptxcompiler-fetch')
+        self._counts = {'lookups': 0, 'hedged': 0, 'cancelled_fetches': 0,
+                        'late_hits': 0}
+
+    def _count(self, name):
+        with self._lock:
+            self._counts[name] += 1
+
+    def delay(self):
+        """Return how long to wait for a lookup before compiling locally."""
+        with self._lock:
+            latencies = sorted(self._latencies)
+        if len(latencies) < MIN_SAMPLES:
+            delay = self.initial_delay
+        else:
+            index = round(self.percentile / 100 * (len(latencies) - 1))
+            delay = latencies[index]
+        return min(max(delay, self.min_delay), self.max_delay)
+
+    def observe(self, seconds):
+        """Record that a lookup took ``seconds``."""
+        with self._lock:
+            self._latencies.append(seconds)
+
+    def _fetch(self, fetch):
+        start = time.perf_counter()
+        try:
+            return fetch()
+        finally:
+            self.observe(time.perf_counter() - start)
+
+    def _late(self, fetched):
+        if fetched.exception() is None and fetched.result() is not None:
+            self._count('late_hits')
+
+    def run(self, fetch, compile):
+        """Return ``(entry, compiled)``: the result of ``fetch()`` if it is
+        not ``None`` and it finishes within the delay, and otherwise the
+        result of ``compile()``, which is called on the calling thread.
+        ``compiled`` is whether the result came from ``compile``."""
+        self._count('lookups')
+        fetched = self._fetch_executor.submit(self._fetch, fetch)
+        try:
+            entry = fetched.result(timeout=self.delay())
+        except TimeoutError:
+            pass
+        else:
+            if entry is not None:
+                return entry, False
+            return compile(), True
+
+        self._count('hedged')
+        if fetched.cancel():
+            self._count('cancelled_fetches')
+        else:
+            fetched.add_done_callback(self._late)
+        return compile(), True
+
+    def stats(self):
+        with self._lock:
+            stats = dict(self._counts)
+        lookups = stats['lookups']
+        stats['hedge_rate'] = stats['hedged'] / lookups if lookups else 0.0
+        stats['delay'] = self.delay()
+        return stats
+
+
+def hedge_from_env():
+    """Create a ``Hedge`` as configured by the environment, or return
+    ``None`` if hedging is not enabled."""
+    try:
+        enabled = int(os.getenv('PTXCOMPILER_CACHE_HEDGE', '0'))
+    except ValueError:
+        enabled = False
+    if not enabled:
+        return None
+    percentile = os.getenv('PTXCOMPILER_CACHE_HEDGE_PERCENTILE')
+    return Hedge(float(percentile) if percentile else DEFAULT_PERCENTILE)
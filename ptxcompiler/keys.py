@@ -0,0 +1,106 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import hashlib
+import re
+from collections import namedtuple
+
+from ptxcompiler import _ptxcompilerlib
+
+# Matches string literals (which are kept as-is) and comments (which are
+# removed) so that comment markers inside e.g. .file paths are left alone.
+_COMMENT_RE = re.compile(r'("(?:\\.|[^"\\])*")|//[^\n]*|/\*.*?\*/', re.S)
+
+_ARCH_OPTIONS = ('--gpu-name', '-arch', '--arch')
+
+_compiler_version = None
+
+
+def canonicalize_ptx(ptx):
+    """Return the PTX source with comments, trailing whitespace and blank
+    lines removed, so that cosmetic differences do not change its hash."""
+    ptx = _COMMENT_RE.sub(lambda m: m.group(1) or '', ptx)
+    lines = (line.rstrip() for line in ptx.splitlines())
+    return '\n'.join(line for line in lines if line)
+
+
+def ptx_hash(ptx):
+    return hashlib.sha256(canonicalize_ptx(ptx).encode()).hexdigest()
+
+
+def compiler_version():
+    global _compiler_version
+
+    if _compiler_version is None:
+        _compiler_version = _ptxcompilerlib.get_version()
+    return _compiler_version
+
+
+def split_arch(options):
+    """Split the target architecture out of a sequence of compile options,
+    returning the architecture and a tuple of the remaining options."""
+    arch = None
+    rest = []
+    options = iter(options)
+    for option in options:
+        name, sep, value = option.partition('=')
+        if name in _ARCH_OPTIONS:
+            arch = value if sep else next(options, None)
+        else:
+            rest.append(option)
+    return arch, tuple(rest)
+
+
+class CompileKey(namedtuple('CompileKey',
+                            ('ptx_hash', 'options', 'arch',
+                             'compiler_version'))):
+    """Identifies a compile result by the canonical hash of its PTX, the
+    options (other than the architecture) it was compiled with, the target
+    architecture and the compiler version."""
+    __slots__ = ()
+
+    def digest(self):
+        h = hashlib.sha256()
+        h.update(self.ptx_hash.encode())
+        h.update(b'\0')
+        h.update('\x1f'.join(self.options).encode())
+        h.update(b'\0')
+        h.update((self.arch or '').encode())
+        h.update(b'\0')
+        h.update(('%d.%d' % tuple(self.compiler_version)).encode())
+        return h.digest()
+
+    def hexdigest(self):
+        return self.digest().hex()
+
+    @classmethod
+    def from_dict(cls, fields):
+        """Construct a key from the result of ``_asdict()``, e.g. after a
+        round trip through JSON."""
+        return cls(ptx_hash=fields['ptx_hash'],
+                   options=tuple(fields['options']),
+                   arch=fields['arch'],
+                   compiler_version=tuple(fields['compiler_version']))
+
+
+def make_key(ptx, options, version=None, hashed=None):
+    """Make the key for compiling ``ptx`` with ``options``. ``hashed`` may
+    give the PTX's ``ptx_hash``, if it has already been computed."""
+    arch, options = split_arch(options)
+    if version is None:
+        version = compiler_version()
+    if hashed is None:
+        hashed = ptx_hash(ptx)
+    return CompileKey(ptx_hash=hashed, options=options, arch=arch,
+                      compiler_version=tuple(version))
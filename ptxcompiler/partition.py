@@ -0,0 +1,387 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Parallel compilation of large PTX modules.
+
+A module is partitioned along its call graph into units that are compiled
+concurrently into relocatable objects, which are then linked into a single
+cubin. Functions are grouped into clusters that must stay together:
+
+- A function called from only one other function stays with its caller.
+- Functions referring to the same module-scope variable stay together, so
+  variables never need to be shared between units.
+
+Clusters are then spread over the units so that their sizes are balanced.
+Functions called from another unit are given external linkage, and declared
+``.extern`` in the units that call them.
+
+Modules with debug sections are not partitioned, and neither is anything
+if ``nvlink`` cannot be found to link the units. Linked cubins are cached
+under the key of the whole module, so that a module found in the cache is
+not linked again.
+"""
+
+import logging
+import os
+import re
+import shutil
+import subprocess
+import tempfile
+
+from ptxcompiler.api import (PTXCompilerResult, compile_ptx,
+                             submit_compile_ptx)
+from ptxcompiler.cache import get_cache
+from ptxcompiler.compilers import select_compiler
+from ptxcompiler.keys import canonicalize_ptx, make_key, split_arch
+
+logger = logging.getLogger(__name__)
+
+# Modules smaller than this (in bytes of PTX) are not worth partitioning
+DEFAULT_MIN_SIZE = 256 * 1024
+
+_warned_no_nvlink = False
+
+_LINE_DIRECTIVES = ('.version', '.target', '.address_size', '.file')
+_LINKAGE_RE = re.compile(r'^\s*(?:\.(?:visible|weak|extern|common)\s+)*')
+_FUNCTION_RE = re.compile(r'\.(?:entry|func)\b')
+_FUNCTION_NAME_RE = re.compile(
+    r'\.(?:entry|func)\s*(?:\([^)]*\)\s*)?([A-Za-z_$%][\w$]*)')
+_IDENTIFIER_RE = re.compile(r'[A-Za-z_$%][\w$]*')
+_NON_SPACE_RE = re.compile(r'\S')
+_DELIMITER_RE = re.compile(r'["{};]')
+_STRING_RE = re.compile(r'"(?:\\.|[^"\\])*"')
+_VARIABLE_RE = re.compile(
+    r'^\s*(?:\.(?:visible|weak|extern|common)\s+)*'
+    r'\.(?:global|const|shared|tex|texref|surfref|samplerref)\b')
+
+
+class PartitionError(Exception):
+    pass
+
+
+class _Statement:
+    __slots__ = ('index', 'text', 'kind', 'name', 'linkage', 'refs')
+
+    def __init__(self, index, text, kind, name=None, linkage=''):
+        self.index = index
+        self.text = text
+        self.kind = kind
+        self.name = name
+        self.linkage = linkage
+        self.refs = set()
+
+
+def _split_statements(text):
+    """Split module-scope PTX into statements: line directives, declarations
+    ending in ``;`` and function definitions ending in ``}``."""
+    statements = []
+    start = None
+    depth = 0
+    is_function = False
+    i = 0
+    n = len(text)
+
+    while i < n:
+        if start is None:
+            match = _NON_SPACE_RE.search(text, i)
+            if match is None:
+                break
+            i = start = match.start()
+            is_function = False
+            if text.startswith(_LINE_DIRECTIVES, i):
+                end = text.find('\n', i)
+                end = n if end < 0 else end
+                statements.append(text[i:end].strip())
+                start = None
+                i = end
+                continue
+
+        match = _DELIMITER_RE.search(text, i)
+        if match is None:
+            break
+        i = match.start()
+        c = text[i]
+        if c == '"':
+            match = _STRING_RE.match(text, i)
+            if match is None:
+                break
+            i = match.end()
+            continue
+        elif c == '{':
+            if depth == 0 and _FUNCTION_RE.search(text, start, i):
+                is_function = True
+            depth += 1
+        elif c == '}':
+            depth -= 1
+            if depth == 0 and is_function:
+                statements.append(text[start:i + 1])
+                start = None
+        elif depth == 0:
+            statements.append(text[start:i + 1])
+            start = None
+        i += 1
+
+    if start is not None:
+        raise PartitionError('Unterminated statement at end of module')
+    return statements
+
+
+def _linkage(text):
+    return _LINKAGE_RE.match(text).group(0).split()
+
+
+def _with_linkage(text, linkage):
+    text = _LINKAGE_RE.sub('', text, count=1)
+    return f'{linkage} {text}' if linkage else text
+
+
+def _variable_name(text):
+    declarator = text.split('=', 1)[0].rstrip(' ;\n\t')
+    declarator = re.sub(r'(\s*\[[^\]]*\])+$', '', declarator)
+    names = _IDENTIFIER_RE.findall(declarator)
+    if not names:
+        raise PartitionError(f'Cannot find variable name in {text!r}')
+    return names[-1]
+
+
+def _parse(ptx):
+    statements = []
+    for i, text in enumerate(_split_statements(canonicalize_ptx(ptx))):
+        linkage = ' '.join(_linkage(text))
+        if text.startswith(_LINE_DIRECTIVES):
+            statements.append(_Statement(i, text, 'directive'))
+        elif text.startswith('.section'):
+            raise PartitionError('Modules with debug sections cannot be '
+                                 'partitioned')
+        elif _FUNCTION_RE.search(text.split('{', 1)[0]):
+            match = _FUNCTION_NAME_RE.search(text)
+            if match is None:
+                raise PartitionError(f'Cannot find function name in {text!r}')
+            kind = 'function' if text.endswith('}') else 'function_decl'
+            statements.append(_Statement(i, text, kind, match.group(1),
+                                         linkage))
+        elif _VARIABLE_RE.match(text):
+            kind = 'variable_decl' if '.extern' in linkage else 'variable'
+            statements.append(_Statement(i, text, kind, _variable_name(text),
+                                         linkage))
+        else:
+            statements.append(_Statement(i, text, 'other'))
+    return statements
+
+
+class _UnionFind:
+    def __init__(self):
+        self.parent = {}
+
+    def find(self, x):
+        root = self.parent.setdefault(x, x)
+        while self.parent[root] != root:
+            root = self.parent[root]
+        while x != root:
+            self.parent[x], x = root, self.parent[x]
+        return root
+
+    def union(self, x, y):
+        self.parent[self.find(x)] = self.find(y)
+
+
+def partition_ptx(ptx, units):
+    """Partition a PTX module into at most ``units`` modules that can be
+    compiled separately and linked together. Returns a list of the modules'
+    PTX, which has a single element if the module cannot be usefully
+    partitioned."""
+    statements = _parse(ptx)
+    functions = {s.name: s for s in statements if s.kind == 'function'}
+    variables = {s.name: s for s in statements if s.kind == 'variable'}
+    symbols = set(functions) | set(variables)
+    # Definitions in module order, so that partitioning is deterministic
+    definitions = [s for s in statements if s.kind in ('function',
+                                                       'variable')]
+
+    for s in definitions:
+        body = s.text.split('{', 1)[1] if s.kind == 'function' else \
+            s.text.partition('=')[2]
+        s.refs = set(_IDENTIFIER_RE.findall(body)) & symbols
+        s.refs.discard(s.name)
+
+    # Group functions and variables into clusters that must stay together
+    clusters = _UnionFind()
+    callers = {name: set() for name in functions}
+    for s in definitions:
+        clusters.find(s.name)
+        for ref in sorted(s.refs):
+            if ref in variables or s.kind == 'variable':
+                clusters.union(s.name, ref)
+            else:
+                callers[ref].add(s.name)
+    for name, function_callers in callers.items():
+        if len(function_callers) == 1:
+            clusters.union(name, next(iter(function_callers)))
+
+    groups = {}
+    for s in definitions:
+        groups.setdefault(clusters.find(s.name), []).append(s.name)
+    n_function_groups = sum(any(name in functions for name in group)
+                            for group in groups.values())
+    if n_function_groups < 2 or units < 2:
+        return [ptx]
+
+    # Balance clusters over units, placing the largest first
+    def size(group):
+        return sum(len((functions.get(n) or variables[n]).text)
+                   for n in group)
+
+    loads = [0] * min(units, len(groups))
+    unit_of = {}
+    for group in sorted(groups.values(), key=size, reverse=True):
+        unit = loads.index(min(loads))
+        loads[unit] += size(group)
+        for name in group:
+            unit_of[name] = unit
+
+    # Functions called from other units need external linkage
+    linkage = {name: s.linkage for name, s in functions.items()}
+    for s in functions.values():
+        for ref in s.refs:
+            if (ref in functions and unit_of[ref] != unit_of[s.name] and
+                    not linkage[ref]):
+                linkage[ref] = '.visible'
+
+    return [_emit_unit(statements, unit, unit_of, functions, linkage)
+            for unit in range(len(loads))]
+
+
+def _extern_declaration(s):
+    prototype = s.text.split('{', 1)[0] if s.kind == 'function' else \
+        s.text[:-1]
+    return _with_linkage(prototype.rstrip(), '.extern') + ';'
+
+
+def _emit_unit(statements, unit, unit_of, functions, linkage):
+    refs = set()
+    for name, s in functions.items():
+        if unit_of[name] == unit:
+            refs |= s.refs
+
+    lines = []
+    declared = set()
+    for s in statements:
+        if s.kind in ('directive', 'other', 'variable_decl'):
+            lines.append(s.text)
+        elif s.kind == 'variable':
+            if unit_of[s.name] == unit:
+                lines.append(s.text)
+        elif s.name not in functions:
+            # A declaration of a function defined outside the module
+            lines.append(s.text)
+        elif unit_of[s.name] == unit:
+            lines.append(_with_linkage(s.text, linkage[s.name]))
+        elif s.name in refs and s.name not in declared:
+            lines.append(_extern_declaration(s))
+            declared.add(s.name)
+    return '\n'.join(lines) + '\n'
+
+
+def find_nvlink():
+    """Return the path of ``nvlink``, or ``None`` if it cannot be found on
+    the ``PATH`` or in ``$CUDA_HOME/bin``."""
+    nvlink = shutil.which('nvlink')
+    if nvlink is None and os.getenv('CUDA_HOME'):
+        nvlink = os.path.join(os.getenv('CUDA_HOME'), 'bin', 'nvlink')
+    if nvlink is None or not os.path.exists(nvlink):
+        return None
+    return nvlink
+
+
+def _find_nvlink():
+    nvlink = find_nvlink()
+    if nvlink is None:
+        raise RuntimeError('Could not find nvlink to link partitioned '
+                           'modules')
+    return nvlink
+
+
+def _can_link(linker):
+    global _warned_no_nvlink
+
+    if linker is not link_with_nvlink or find_nvlink() is not None:
+        return True
+    if not _warned_no_nvlink:
+        logger.warning('Not partitioning modules: nvlink was not found')
+        _warned_no_nvlink = True
+    return False
+
+
+def link_with_nvlink(objects, arch):
+    """Link relocatable cubins into an executable cubin with nvlink."""
+    with tempfile.TemporaryDirectory() as tmp:
+        inputs = []
+        for i, data in enumerate(objects):
+            path = os.path.join(tmp, f'unit{i}.cubin')
+            with open(path, 'wb') as f:
+                f.write(data)
+            inputs.append(path)
+        output = os.path.join(tmp, 'linked.cubin')
+        cmd = [_find_nvlink(), f'--arch={arch}', '-o', output] + inputs
+        cp = subprocess.run(cmd, capture_output=True)
+        if cp.returncode:
+            raise RuntimeError(f'nvlink failed:\n{cp.stderr.decode()}')
+        with open(output, 'rb') as f:
+            return f.read()
+
+
+def compile_ptx_partitioned(ptx, options, units=None, tag=None, label=None,
+                            linker=link_with_nvlink,
+                            min_size=DEFAULT_MIN_SIZE):
+    """Compile a large PTX module by partitioning it into ``units`` units
+    (by default, one per CPU) that are compiled concurrently on the compile
+    pool and then linked with ``linker``. Modules smaller than ``min_size``
+    or that cannot be partitioned, and all modules if ``linker`` is
+    ``link_with_nvlink`` and ``nvlink`` is not found, are compiled with
+    ``compile_ptx``. Linked cubins are stored in and looked up from the
+    compile cache."""
+    options = tuple(options)
+    if units is None:
+        units = os.cpu_count() or 1
+
+    parts = [ptx]
+    if len(ptx) >= min_size and _can_link(linker):
+        try:
+            parts = partition_ptx(ptx, units)
+        except PartitionError as e:
+            logger.debug('Not partitioning module: %s', e)
+    if len(parts) < 2:
+        return compile_ptx(ptx, options, label=label)
+
+    arch, _ = split_arch(options)
+    if arch is None:
+        raise ValueError('Partitioned compilation requires --gpu-name')
+
+    def compile():
+        futures = [submit_compile_ptx(part, options + ('--compile-only',),
+                                      tag=tag, label=label, inline=False)
+                   for part in parts]
+        results = [future.result() for future in futures]
+        cubin = linker([r.compiled_program for r in results], arch)
+        return cubin, ''.join(r.info_log for r in results)
+
+    cache = get_cache()
+    if cache is None:
+        cubin, info_log = compile()
+    else:
+        # The linked cubin is cached under the same key as a compile of the
+        # whole module would be
+        key = make_key(ptx, options, version=select_compiler(ptx).version)
+        cubin, info_log = cache.get_or_compile(key, compile)
+    return PTXCompilerResult(compiled_program=cubin, info_log=info_log)
@@ -16,11 +16,16 @@ import logging
 import os
 import subprocess
 import sys
+import time
 
 from numba import config
 from numba.cuda import codegen
 from numba.cuda.cudadrv import devices
+from ptxcompiler import bundle, callsites, precodegen, speculate, tuning
 from ptxcompiler.api import compile_ptx
+from ptxcompiler.compilers import select_compiler
+from ptxcompiler.keys import make_key, ptx_hash
+from ptxcompiler.partition import compile_ptx_partitioned
 
 _logger = None
 
@@ -62,8 +67,26 @@ def get_logger():
     return logger
 
 
+def _env_flag(name):
+    value = os.getenv(name)
+    try:
+        return bool(int(value)) if value is not None else False
+    except ValueError:
+        return False
+
+
 class PTXStaticCompileCodeLibrary(codegen.CUDACodeLibrary):
+    # Whether the driver can link code the static compiler cannot handle
+    _driver_fallback = False
+
     def get_cubin(self, cc=None):
+        token = callsites.enter()
+        try:
+            return self._get_cubin(cc)
+        finally:
+            callsites.leave(token)
+
+    def _get_cubin(self, cc):
         if cc is None:
             ctx = devices.get_context()
             device = ctx.device
@@ -74,6 +97,10 @@ class PTXStaticCompileCodeLibrary(codegen.CUDACodeLibrary):
             return cubin
 
         ptxes = self._get_ptxes(cc=cc)
+        if self._driver_fallback and (len(ptxes) > 1 or self._linking_files):
+            get_logger().debug("Linking with the driver for %s", cc)
+            return super().get_cubin(cc=cc)
+
         if len(ptxes) > 1:
             msg = "Cannot link multiple PTX files with forward compatibility"
             raise RuntimeError(msg)
@@ -84,14 +111,42 @@ class PTXStaticCompileCodeLibrary(codegen.CUDACodeLibrary):
         if self._max_registers:
             options.append(f'--maxrregcount={self._max_registers}')
 
-        # Compile PTX to cubin
         ptx = ptxes[0]
-        res = compile_ptx(ptx, options)
-        cubin = res.compiled_program
+        hashed = ptx_hash(ptx)
+
+        tuned = tuning.lookup(ptx, arch, hashed)
+        if tuned:
+            get_logger().debug("Using tuned options %s", tuned)
+            options = tuning.merge_options(options, tuned)
+
+        # Use a precompiled cubin from a bundle if there is one. Numba's
+        # module loader only accepts bytes, so the view is copied here.
+        start = time.perf_counter()
+        version = select_compiler(ptx).version
+        cubin = bundle.lookup(make_key(ptx, options, version=version,
+                                       hashed=hashed))
+        if cubin is not None:
+            get_logger().debug("Using cubin from bundle for %s", arch)
+            cubin = bytes(cubin)
+            callsites.record(callsites.BUNDLE, time.perf_counter() - start,
+                             len(ptx), len(cubin))
+        elif _env_flag("PTXCOMPILER_PARTITIONED_COMPILE"):
+            cubin = compile_ptx_partitioned(ptx, options).compiled_program
+        else:
+            cubin = compile_ptx(ptx, options).compiled_program
 
+        self._cubin_cache[cc] = cubin
         return cubin
 
 
+class PTXStaticCompileAlwaysCodeLibrary(PTXStaticCompileCodeLibrary):
+    """Used when static compilation is enabled with a driver that is new
+    enough to link itself, so that modules the static compiler cannot
+    produce alone (several PTX files, or linked-in files) are left to the
+    driver."""
+    _driver_fallback = True
+
+
 CMD = """\
 from ctypes import c_int, byref
 from numba import cuda
@@ -126,8 +181,33 @@ def patch_needed():
     return driver_version < runtime_version
 
 
+def static_compile_mode():
+    """Return the mode set with ``PTXCOMPILER_STATIC_COMPILE_MODE``:
+    ``'if-needed'`` (the default) to compile with the static compiler only
+    when the driver is too old for the runtime, or ``'always'`` to compile
+    with it regardless, so that the compile caches and bundles are used."""
+    mode = os.getenv("PTXCOMPILER_STATIC_COMPILE_MODE", "if-needed").lower()
+    if mode not in ("if-needed", "always"):
+        get_logger().warning("Unknown PTXCOMPILER_STATIC_COMPILE_MODE %r, "
+                             "using 'if-needed'", mode)
+        mode = "if-needed"
+    return mode
+
+
 def patch_numba_codegen_if_needed():
     logger = get_logger()
+    if os.getenv(precodegen.PRECODEGEN_CACHE_ENV):
+        precodegen.install()
+    if os.getenv(speculate.SPECULATE_MODEL_ENV):
+        speculate.install()
+
+    if static_compile_mode() == "always":
+        logger.debug("Patching Numba codegen to always use the static "
+                     "compiler")
+        library_class = PTXStaticCompileAlwaysCodeLibrary
+        codegen.JITCUDACodegen._library_class = library_class
+        return
+
     check = os.getenv("PTXCOMPILER_CHECK_NUMBA_CODEGEN_PATCH_NEEDED")
     apply = os.getenv("PTXCOMPILER_APPLY_NUMBA_CODEGEN_PATCH")
     if check is not None:
@@ -0,0 +1,232 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""A pool of threads for compiling PTX concurrently.
+
+The extension releases the GIL while the compiler runs, so compiles on
+separate threads proceed in parallel. Jobs are submitted with a tag naming
+the caller, and the pool shares its workers between tags with weighted fair
+queueing: each job is stamped with a virtual finish time, advanced by the
+job's cost (the size of its PTX) divided by its tag's weight, and the job
+with the earliest finish time runs next. A tag that submits many jobs
+therefore cannot starve one that submits few.
+
+Tag weights default to 1, and can be set with ``set_tag_weight`` or with the
+``PTXCOMPILER_TAG_WEIGHTS`` environment variable, e.g. ``etl=4,adhoc=1``.
+Weights must be finite and greater than 0.
+The number of workers defaults to the number of CPUs, and can be set with
+``PTXCOMPILER_POOL_WORKERS``.
+"""
+
+import contextvars
+import heapq
+import itertools
+import math
+import os
+import threading
+import time
+from concurrent.futures import Future
+
+DEFAULT_TAG = 'default'
+TAG_WEIGHTS_ENV = 'PTXCOMPILER_TAG_WEIGHTS'
+
+_pool = None
+_pool_lock = threading.Lock()
+
+
+class _TagStats:
+    __slots__ = ('weight', 'last_finish', 'queued', 'submitted', 'completed',
+                 'total_wait', 'max_wait')
+
+    def __init__(self, weight):
+        self.weight = weight
+        self.last_finish = 0.0
+        self.queued = 0
+        self.submitted = 0
+        self.completed = 0
+        self.total_wait = 0.0
+        self.max_wait = 0.0
+
+
+class CompilePool:
+    def __init__(self, workers=None, weights=None):
+        if workers is None:
+            workers = os.cpu_count() or 1
+        self.workers = workers
+
+        self._cond = threading.Condition()
+        self._queue = []
+        self._sequence = itertools.count()
+        self._virtual_time = 0.0
+        self._tags = {}
+        self._weights = dict(weights or {})
+        for tag, weight in self._weights.items():
+            _check_weight(tag, weight)
+        self._shutdown = False
+        # Workers waiting for a job
+        self._idle = 0
+
+        self._threads = [threading.Thread(target=self._worker, daemon=True,
+                                          name=f'ptxcompiler-pool-{i}')
+                         for i in range(workers)]
+        for thread in self._threads:
+            thread.start()
+
+    def set_tag_weight(self, tag, weight):
+        _check_weight(tag, weight)
+        with self._cond:
+            self._weights[tag] = weight
+            if tag in self._tags:
+                self._tags[tag].weight = weight
+
+    def _tag(self, tag):
+        stats = self._tags.get(tag)
+        if stats is None:
+            stats = _TagStats(self._weights.get(tag, 1))
+            self._tags[tag] = stats
+        return stats
+
+    def submit(self, fn, *args, tag=None, cost=1):
+        """Schedule ``fn(*args)`` to run on a worker under ``tag``, returning
+        a future for its result. ``cost`` is the job's expected cost relative
+        to other jobs. The job runs in a copy of the caller's context."""
+        if tag is None:
+            tag = DEFAULT_TAG
+        future = Future()
+        context = contextvars.copy_context()
+
+        with self._cond:
+            if self._shutdown:
+                raise RuntimeError('Cannot submit to a pool after shutdown')
+            stats = self._tag(tag)
+            start = max(self._virtual_time, stats.last_finish)
+            stats.last_finish = start + max(cost, 1) / stats.weight
+            stats.queued += 1
+            stats.submitted += 1
+            job = (context, fn, args, future, tag, time.perf_counter())
+            heapq.heappush(self._queue,
+                           (stats.last_finish, next(self._sequence), job))
+            self._cond.notify()
+
+        return future
+
+    def _next_job(self):
+        with self._cond:
+            while not self._queue and not self._shutdown:
+                self._idle += 1
+                self._cond.wait()
+                self._idle -= 1
+            if not self._queue:
+                return None
+
+            finish, _, job = heapq.heappop(self._queue)
+            # Self-clocked fair queueing: virtual time follows the finish
+            # time of the job most recently taken into service.
+            self._virtual_time = finish
+
+            _, _, _, _, tag, submitted = job
+            wait = time.perf_counter() - submitted
+            stats = self._tags[tag]
+            stats.queued -= 1
+            stats.total_wait += wait
+            stats.max_wait = max(stats.max_wait, wait)
+            return job
+
+    def _worker(self):
+        while True:
+            job = self._next_job()
+            if job is None:
+                return
+
+            context, fn, args, future, tag, _ = job
+            if future.set_running_or_notify_cancel():
+                try:
+                    result = context.run(fn, *args)
+                except BaseException as e:
+                    future.set_exception(e)
+                else:
+                    future.set_result(result)
+
+            with self._cond:
+                self._tags[tag].completed += 1
+
+    def idle(self):
+        """Return whether a job submitted now would start straight away,
+        without waiting behind other jobs for a worker."""
+        with self._cond:
+            return not self._queue and self._idle > 0
+
+    def stats(self):
+        """Return queue depth, job counts and wait times in seconds for each
+        tag."""
+        with self._cond:
+            return {
+                tag: {
+                    'weight': s.weight,
+                    'queue_depth': s.queued,
+                    'submitted': s.submitted,
+                    'completed': s.completed,
+                    'total_wait': s.total_wait,
+                    'mean_wait': (s.total_wait / (s.submitted - s.queued)
+                                  if s.submitted > s.queued else 0.0),
+                    'max_wait': s.max_wait,
+                }
+                for tag, s in self._tags.items()
+            }
+
+    def shutdown(self, wait=True):
+        with self._cond:
+            self._shutdown = True
+            self._cond.notify_all()
+        if wait:
+            for thread in self._threads:
+                thread.join()
+
+
+def _check_weight(tag, weight, source=None):
+    if not (isinstance(weight, (int, float)) and math.isfinite(weight) and
+            weight > 0):
+        where = f' in {source}' if source else ''
+        raise ValueError(f'Invalid weight {weight!r} for tag {tag!r}{where}: '
+                         'weights must be finite numbers greater than 0')
+
+
+def _weights_from_env():
+    weights = {}
+    for item in os.getenv(TAG_WEIGHTS_ENV, '').split(','):
+        tag, sep, weight = item.partition('=')
+        if sep:
+            tag = tag.strip()
+            try:
+                weights[tag] = float(weight)
+            except ValueError:
+                weights[tag] = weight.strip()
+            _check_weight(tag, weights[tag], TAG_WEIGHTS_ENV)
+    return weights
+
+
+def get_pool():
+    """Return the shared compile pool, creating it on first use."""
+    global _pool
+
+    with _pool_lock:
+        if _pool is None:
+            workers = os.getenv('PTXCOMPILER_POOL_WORKERS')
+            _pool = CompilePool(int(workers) if workers else None,
+                                _weights_from_env())
+    return _pool
+
+
+def set_tag_weight(tag, weight):
+    get_pool().set_tag_weight(tag, weight)
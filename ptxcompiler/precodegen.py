@@ -0,0 +1,373 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""A cache of compiled Numba kernels keyed on the Python function.
+
+The compile caches are keyed on PTX, so every new process still runs Numba's
+Python to LLVM IR to PTX pipeline for each kernel before it can look one up.
+This cache is consulted before any of that: its key is a hash of
+
+- the function's bytecode, constants and default arguments, recursively
+  through nested functions,
+- the values of its closure variables and of the globals it refers to,
+  recursively through the device functions it calls,
+- the argument types, the target compute capability and the target options,
+- the versions of Python, Numba, the PTX compiler and this package.
+
+On a hit, the kernel is rebuilt from its pickled state, including the cubin
+for the target, so neither LLVM IR nor PTX is generated.
+
+A stale kernel would silently run the wrong code, so functions are only
+cached when everything they depend on can be hashed by value. A function is
+not cached if its closure or the globals it uses hold anything other than
+constants (numbers, strings, bytes, ``None`` and tuples of them), Numba
+types, CUDA device functions, or modules Numba provides implementations for
+(e.g. ``math`` and ``numpy``). Kernels linking other files or using
+extensions are not cached either. A global module is only allowed if
+attributes of it are immutable library functions and constants, so a kernel
+reading ``mymodule.CONSTANT`` is never cached.
+
+The cache is opt-in: it is installed by ``patch_numba_codegen_if_needed``
+when ``PTXCOMPILER_PRECODEGEN_CACHE_DIR`` names a directory to keep it in.
+"""
+
+import builtins
+import hashlib
+import logging
+import os
+import pickle
+import struct
+import sys
+import tempfile
+import threading
+import types
+from collections import Counter
+
+from ptxcompiler import _version
+from ptxcompiler.keys import compiler_version
+from ptxcompiler.tuning import TUNING_DB_ENV
+
+PRECODEGEN_CACHE_ENV = 'PTXCOMPILER_PRECODEGEN_CACHE_DIR'
+
+ENTRY_MAGIC = b'PTXCPREC'
+ENTRY_VERSION = 1
+# magic, format version
+_ENTRY_HEADER = struct.Struct('<8sI')
+
+# Modules whose attributes Numba compiles as library functions and constants
+SAFE_MODULES = ('math', 'cmath', 'operator', 'numpy', 'numba')
+
+# Limit on the depth of device function calls followed
+MAX_DEPTH = 16
+
+_SIMPLE_TYPES = (type(None), bool, int, float, complex, str, bytes)
+
+_cache = None
+_installed = False
+
+logger = logging.getLogger(__name__)
+
+
+class Uncacheable(Exception):
+    """Raised when a kernel cannot safely be cached."""
+
+
+def _constant(value):
+    """Return a representation of a constant that identifies it by value,
+    raising ``Uncacheable`` for anything else."""
+    kind = type(value)
+    if kind in _SIMPLE_TYPES:
+        return f'{kind.__name__}:{value!r}'
+    if kind is tuple:
+        return '(' + ','.join(_constant(v) for v in value) + ')'
+    if kind.__module__ == 'numpy' and getattr(value, 'shape', None) == ():
+        return f'numpy.{value.dtype}:{value.item()!r}'
+    raise Uncacheable(f'{kind.__module__}.{kind.__qualname__} value')
+
+
+def _code_names(code):
+    names = set(code.co_names)
+    for const in code.co_consts:
+        if isinstance(const, types.CodeType):
+            names |= _code_names(const)
+    return names
+
+
+class _Hasher:
+    def __init__(self):
+        self._hash = hashlib.sha256()
+        self._seen = set()
+
+    def update(self, *parts):
+        for part in parts:
+            if isinstance(part, str):
+                part = part.encode()
+            self._hash.update(struct.pack('<Q', len(part)))
+            self._hash.update(part)
+
+    def hexdigest(self):
+        return self._hash.hexdigest()
+
+    def code(self, code):
+        self.update('code', code.co_code, repr(code.co_names),
+                    repr(code.co_varnames), repr(code.co_freevars),
+                    repr(code.co_cellvars),
+                    repr((code.co_argcount, code.co_posonlyargcount,
+                          code.co_kwonlyargcount, code.co_flags)))
+        for const in code.co_consts:
+            if isinstance(const, types.CodeType):
+                self.code(const)
+            else:
+                self.update(_constant(const))
+
+    def function(self, func, depth=0):
+        if depth > MAX_DEPTH:
+            raise Uncacheable('device functions nested too deeply')
+        if func in self._seen:
+            # A recursive call - the function is already in the hash
+            self.update('recursion', func.__qualname__)
+            return
+        self._seen.add(func)
+
+        code = func.__code__
+        self.update('function', func.__module__ or '', func.__qualname__)
+        self.code(code)
+        self.update(_constant(func.__defaults__ or ()))
+        for name, value in sorted((func.__kwdefaults__ or {}).items()):
+            self.update(name, _constant(value))
+
+        for name, cell in zip(code.co_freevars, func.__closure__ or ()):
+            try:
+                value = cell.cell_contents
+            except ValueError:
+                raise Uncacheable(f'closure variable {name} is not set')
+            self.value(name, value, depth)
+
+        func_globals = func.__globals__
+        for name in sorted(_code_names(code)):
+            if name in func_globals:
+                self.value(name, func_globals[name], depth)
+            elif hasattr(builtins, name):
+                self.update('builtin', name)
+            # Otherwise the name is an attribute, which is in the bytecode
+
+    def value(self, name, value, depth):
+        self.update('name', name)
+        if isinstance(value, types.ModuleType):
+            root = value.__name__.partition('.')[0]
+            if root not in SAFE_MODULES:
+                raise Uncacheable(f'{name} refers to module {value.__name__}')
+            version = getattr(sys.modules.get(root), '__version__', '')
+            self.update('module', value.__name__, str(version))
+        elif hasattr(value, 'py_func') and hasattr(value, 'targetoptions'):
+            # A CUDA device function (or kernel) dispatcher
+            options = sorted((k, _constant(v))
+                             for k, v in value.targetoptions.items())
+            self.update('dispatcher', repr(options))
+            self.function(value.py_func, depth + 1)
+        elif type(value).__module__.startswith('numba.core.types'):
+            self.update('type', str(value))
+        elif isinstance(value, types.BuiltinFunctionType):
+            module = value.__module__ or ''
+            if module.partition('.')[0] not in SAFE_MODULES + ('builtins',):
+                raise Uncacheable(f'{name} is builtin function from {module}')
+            self.update('builtin', module, value.__name__)
+        elif type(value).__module__ == 'numpy' and \
+                type(value).__name__ == 'ufunc':
+            self.update('ufunc', value.__name__)
+        else:
+            self.update(_constant(value))
+
+
+def _tuning_state():
+    path = os.getenv(TUNING_DB_ENV)
+    if not path:
+        return ''
+    try:
+        st = os.stat(path)
+    except OSError:
+        return path
+    return f'{path}:{st.st_size}:{st.st_mtime_ns}'
+
+
+def kernel_key(py_func, argtypes, cc, targetoptions, numba_version):
+    """Return the cache key for compiling ``py_func`` as a kernel for
+    ``argtypes`` and the compute capability ``cc``, or raise
+    ``Uncacheable``."""
+    if targetoptions.get('link'):
+        raise Uncacheable('the kernel links other files')
+    if targetoptions.get('extensions'):
+        raise Uncacheable('the kernel uses extensions')
+
+    h = _Hasher()
+    h.update('versions', repr(sys.version_info[:3]), numba_version,
+             repr(tuple(compiler_version())), _version.get_versions()[
+                 'version'])
+    h.update('target', repr(tuple(cc)), _tuning_state())
+    h.update('options', repr(sorted((k, _constant(v))
+                                    for k, v in targetoptions.items())))
+    h.update('argtypes', repr([str(t) for t in argtypes]))
+    h.function(py_func)
+    return h.hexdigest()
+
+
+class PrecodegenCache:
+    """Pickled kernel states in ``directory``, one file per key."""
+
+    def __init__(self, directory):
+        self.directory = directory
+        os.makedirs(directory, exist_ok=True)
+        self._lock = threading.Lock()
+        self.counts = Counter()
+        self.uncacheable = Counter()
+
+    def _path(self, key):
+        return os.path.join(self.directory, key[:2], key)
+
+    def _count(self, event, reason=None):
+        with self._lock:
+            self.counts[event] += 1
+            if reason is not None:
+                self.uncacheable[reason] += 1
+
+    def get(self, key):
+        """Return the pickled state stored under ``key``, or ``None``."""
+        try:
+            with open(self._path(key), 'rb') as f:
+                data = f.read()
+        except FileNotFoundError:
+            return None
+        if len(data) < _ENTRY_HEADER.size:
+            return None
+        magic, version = _ENTRY_HEADER.unpack_from(data)
+        if magic != ENTRY_MAGIC or version != ENTRY_VERSION:
+            return None
+        return data[_ENTRY_HEADER.size:]
+
+    def put(self, key, state):
+        path = self._path(key)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path), prefix='.')
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(_ENTRY_HEADER.pack(ENTRY_MAGIC, ENTRY_VERSION))
+                f.write(state)
+            os.replace(tmp, path)
+        except BaseException:
+            os.unlink(tmp)
+            raise
+
+    def load(self, kernel_class, py_func, argtypes, cc, targetoptions,
+             numba_version):
+        """Return ``(kernel, key)``: the cached kernel, or ``None`` and the
+        key to store the kernel under once it is compiled (``None`` if it
+        cannot be cached)."""
+        try:
+            key = kernel_key(py_func, argtypes, cc, targetoptions,
+                             numba_version)
+        except Uncacheable as e:
+            logger.debug('Not caching %s: %s', py_func.__qualname__, e)
+            self._count('uncacheable', str(e))
+            return None, None
+
+        state = self.get(key)
+        if state is not None:
+            try:
+                kernel = kernel_class._rebuild(**pickle.loads(state))
+                if cc in kernel._codelibrary._cubin_cache:
+                    self._count('hits')
+                    return kernel, None
+            except Exception as e:
+                logger.warning('Could not load cached kernel %s: %s',
+                               py_func.__qualname__, e)
+                self._count('errors')
+        self._count('misses')
+        return None, key
+
+    def store(self, key, kernel, cc):
+        """Store a compiled kernel, if its cubin for ``cc`` has been
+        generated."""
+        library = kernel._codelibrary
+        if cc not in library._cubin_cache or library._linking_files:
+            return
+        try:
+            state = pickle.dumps(kernel._reduce_states(),
+                                 protocol=pickle.HIGHEST_PROTOCOL)
+            self.put(key, state)
+        except Exception as e:
+            logger.warning('Could not cache kernel %s: %s', kernel, e)
+            self._count('errors')
+            return
+        self._count('stores')
+
+    def stats(self):
+        with self._lock:
+            stats = dict(self.counts)
+            stats['uncacheable_reasons'] = dict(self.uncacheable)
+        return stats
+
+
+def get_cache():
+    """Return the installed cache, or ``None``."""
+    return _cache
+
+
+def install(directory=None):
+    """Install the cache in ``directory``, by default the one named by
+    ``PTXCOMPILER_PRECODEGEN_CACHE_DIR``, into Numba's CUDA dispatcher.
+    Returns whether it was installed."""
+    global _cache, _installed
+
+    directory = directory or os.getenv(PRECODEGEN_CACHE_ENV)
+    if _installed or not directory:
+        return False
+
+    import numba
+    from numba.cuda import dispatcher
+    from numba.cuda.cudadrv import devices
+
+    cache = PrecodegenCache(directory)
+    base = dispatcher._Kernel
+
+    def current_cc():
+        return devices.get_context().device.compute_capability
+
+    class PrecodegenKernel(base):
+        # The dispatcher creates kernels with _Kernel(py_func, argtypes,
+        # **targetoptions). Returning a cached kernel (an instance of the
+        # base class) from __new__ skips __init__ and with it, compilation.
+        def __new__(cls, py_func=None, argtypes=None, **targetoptions):
+            if py_func is None:
+                return super().__new__(cls)
+            cc = current_cc()
+            kernel, key = cache.load(base, py_func, argtypes, cc,
+                                     targetoptions, numba.__version__)
+            if kernel is not None:
+                return kernel
+            self = super().__new__(cls)
+            self._precodegen_key = (key, cc)
+            return self
+
+        # The dispatcher binds new kernels, which generates the cubin
+        def bind(self):
+            super().bind()
+            key, cc = self.__dict__.pop('_precodegen_key', (None, None))
+            if key is not None:
+                cache.store(key, self, cc)
+
+    dispatcher._Kernel = PrecodegenKernel
+    _cache = cache
+    _installed = True
+    logger.debug('Installed the pre-codegen kernel cache in %s', directory)
+    return True
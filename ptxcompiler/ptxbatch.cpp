@@ -0,0 +1,986 @@
+/*
+ * Copyright (c) 2022, NVIDIA CORPORATION.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ptxbatch: compile many PTX files to cubins in parallel, for build systems.
+//
+//   ptxbatch [-j N] [-o DIR] [--cache-dir DIR] [--depfile FILE]
+//            [--report FILE] INPUT... [-- OPTION...]
+//
+// Inputs are PTX files or directories, which are searched recursively for
+// .ptx files. Arguments of the form @FILE are replaced by the arguments in
+// FILE, separated by whitespace and optionally quoted. Options after -- are
+// passed to the compiler, and must include the target architecture.
+//
+// Each output is written to a temporary file and renamed into place. Compile
+// results are looked up in and stored to the same disk cache as the Python
+// package (ptxcompiler/cache.py), keyed the same way (ptxcompiler/keys.py),
+// so the two share results. The cache directory defaults to
+// $PTXCOMPILER_CACHE_DIR.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <nvPTXCompiler.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static const char usage[] =
+    "usage: ptxbatch [-j N] [-o DIR] [--cache-dir DIR] [--depfile FILE]\n"
+    "                [--report FILE] INPUT... [-- OPTION...]\n";
+
+// SHA-256, for keys that match hashlib.sha256 in ptxcompiler/keys.py
+
+class SHA256 {
+ public:
+  SHA256() { reset(); }
+
+  void update(const void *data, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    length_ += size;
+    while (size > 0) {
+      size_t n = std::min(size, sizeof(block_) - used_);
+      memcpy(block_ + used_, p, n);
+      used_ += n;
+      p += n;
+      size -= n;
+      if (used_ == sizeof(block_)) {
+        transform(block_);
+        used_ = 0;
+      }
+    }
+  }
+
+  void update(const std::string &s) { update(s.data(), s.size()); }
+
+  void digest(uint8_t out[32]) {
+    uint64_t bits = length_ * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    pad = 0;
+    while (used_ != 56)
+      update(&pad, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++)
+      length[i] = bits >> (56 - 8 * i);
+    update(length, 8);
+    for (int i = 0; i < 8; i++)
+      for (int j = 0; j < 4; j++)
+        out[4 * i + j] = state_[i] >> (24 - 8 * j);
+    reset();
+  }
+
+ private:
+  static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void reset() {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(state_, initial, sizeof(state_));
+    length_ = 0;
+    used_ = 0;
+  }
+
+  void transform(const uint8_t *block) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+        0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+        0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+        0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+        0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+        0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+        0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+             (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + k[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+  }
+
+  uint32_t state_[8];
+  uint8_t block_[64];
+  size_t used_;
+  uint64_t length_;
+};
+
+static std::string to_hex(const uint8_t *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (size_t i = 0; i < size; i++) {
+    hex += digits[data[i] >> 4];
+    hex += digits[data[i] & 15];
+  }
+  return hex;
+}
+
+// Keys, as in ptxcompiler/keys.py
+
+static bool is_line_break(char c) {
+  // The ASCII line boundaries of str.splitlines()
+  return c == '\n' || c == '\r' || c == '\v' || c == '\f' || c == '\x1c' ||
+         c == '\x1d' || c == '\x1e';
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || is_line_break(c) || c == '\x1f';
+}
+
+// Remove comments (outside string literals), trailing whitespace and blank
+// lines, as canonicalize_ptx does
+static std::string canonicalize_ptx(const std::string &ptx) {
+  std::string text;
+  text.reserve(ptx.size());
+  size_t n = ptx.size();
+  for (size_t i = 0; i < n;) {
+    char c = ptx[i];
+    if (c == '"') {
+      size_t j = i + 1;
+      while (j < n && ptx[j] != '"')
+        j += ptx[j] == '\\' && j + 1 < n ? 2 : 1;
+      if (j < n) {
+        text.append(ptx, i, j + 1 - i);
+        i = j + 1;
+        continue;
+      }
+    } else if (c == '/' && i + 1 < n && ptx[i + 1] == '/') {
+      while (i < n && ptx[i] != '\n')
+        i++;
+      continue;
+    } else if (c == '/' && i + 1 < n && ptx[i + 1] == '*') {
+      size_t end = ptx.find("*/", i + 2);
+      if (end != std::string::npos) {
+        i = end + 2;
+        continue;
+      }
+    }
+    text += c;
+    i++;
+  }
+
+  std::string canonical;
+  canonical.reserve(text.size());
+  n = text.size();
+  for (size_t start = 0; start < n;) {
+    size_t end = start;
+    while (end < n && !is_line_break(text[end]))
+      end++;
+    size_t last = end;
+    while (last > start && is_space(text[last - 1]))
+      last--;
+    if (last > start) {
+      if (!canonical.empty())
+        canonical += '\n';
+      canonical.append(text, start, last - start);
+    }
+    start = end + (end + 1 < n && text[end] == '\r' && text[end + 1] == '\n'
+                       ? 2 : 1);
+  }
+  return canonical;
+}
+
+static void split_arch(const std::vector<std::string> &options,
+                       std::string &arch, bool &has_arch,
+                       std::vector<std::string> &rest) {
+  has_arch = false;
+  for (size_t i = 0; i < options.size(); i++) {
+    const std::string &option = options[i];
+    size_t eq = option.find('=');
+    std::string name = option.substr(0, eq);
+    if (name == "--gpu-name" || name == "-arch" || name == "--arch") {
+      if (eq != std::string::npos) {
+        arch = option.substr(eq + 1);
+        has_arch = true;
+      } else if (i + 1 < options.size()) {
+        arch = options[++i];
+        has_arch = true;
+      } else {
+        has_arch = false;
+      }
+    } else {
+      rest.push_back(option);
+    }
+  }
+}
+
+static std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if (c == '\r') {
+      out += "\\r";
+    } else if (c == '\t') {
+      out += "\\t";
+    } else if (c == '\b') {
+      out += "\\b";
+    } else if (c == '\f') {
+      out += "\\f";
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+struct CompileKey {
+  std::string ptx_hash;
+  std::vector<std::string> options;
+  std::string arch;
+  bool has_arch;
+  unsigned major, minor;
+
+  // CompileKey.digest()
+  void digest(uint8_t out[32]) const {
+    SHA256 h;
+    h.update(ptx_hash);
+    h.update("", 1);
+    for (size_t i = 0; i < options.size(); i++) {
+      if (i > 0)
+        h.update("\x1f", 1);
+      h.update(options[i]);
+    }
+    h.update("", 1);
+    if (has_arch)
+      h.update(arch);
+    h.update("", 1);
+    h.update(std::to_string(major) + "." + std::to_string(minor));
+    h.digest(out);
+  }
+
+  // json.dumps(key._asdict())
+  std::string to_json() const {
+    std::string json = "{\"ptx_hash\": " + json_string(ptx_hash) +
+                       ", \"options\": [";
+    for (size_t i = 0; i < options.size(); i++)
+      json += (i > 0 ? ", " : "") + json_string(options[i]);
+    json += "], \"arch\": " + (has_arch ? json_string(arch) : "null");
+    json += ", \"compiler_version\": [" + std::to_string(major) + ", " +
+            std::to_string(minor) + "]}";
+    return json;
+  }
+};
+
+// Files
+
+static bool read_file(const std::string &path, std::string &data) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f)
+    return false;
+  data.assign(std::istreambuf_iterator<char>(f),
+              std::istreambuf_iterator<char>());
+  return !f.bad();
+}
+
+// Write a file under a temporary name in the same directory and rename it
+// into place, so that readers never see a partial file
+static bool write_file_atomic(const std::string &path, const void *data,
+                              size_t size, mode_t mode, std::string &error) {
+  fs::path target(path);
+  std::string tmp = (target.parent_path() /
+                     ("." + target.filename().string() + ".XXXXXX")).string();
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) {
+    error = path + ": " + strerror(errno);
+    return false;
+  }
+
+  const char *p = static_cast<const char *>(data);
+  size_t left = size;
+  bool ok = fchmod(fd, mode) == 0;
+  while (ok && left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    p += n;
+    left -= n;
+  }
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    error = path + ": " + strerror(errno);
+    unlink(tmp.c_str());
+  }
+  return ok;
+}
+
+// The disk cache tier of ptxcompiler/cache.py
+
+static const char entry_magic[8] = {'P', 'T', 'X', 'C', 'E', 'N', 'T', 'R'};
+static const uint32_t entry_version = 1;
+// magic, format version, metadata length, info log length, program length
+static const size_t entry_header_size = 8 + 4 + 4 + 4 + 8;
+
+static const char bloom_magic[8] = {'P', 'T', 'X', 'B', 'L', 'O', 'O', 'M'};
+// magic, format version, number of hash functions, number of bits
+static const size_t bloom_header_size = 8 + 4 + 4 + 8;
+
+template <typename T>
+static void put_le(std::string &s, T value) {
+  for (size_t i = 0; i < sizeof(T); i++)
+    s += (char)(value >> (8 * i));
+}
+
+template <typename T>
+static T get_le(const char *p) {
+  T value = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    value |= (T)(unsigned char)p[i] << (8 * i);
+  return value;
+}
+
+class DiskCache {
+ public:
+  explicit DiskCache(const std::string &directory) : directory_(directory) {
+    // Entries must be added to an existing filter, or the Python side would
+    // never look them up. A missing filter is created and seeded from the
+    // entries by the Python side when it first opens the cache.
+    std::string path = directory + "/filter.bloom";
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+      return;
+    struct stat st;
+    char header[bloom_header_size];
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= bloom_header_size &&
+        pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header, bloom_magic, 8) == 0 &&
+        get_le<uint32_t>(header + 8) == 1) {
+      n_hashes_ = get_le<uint32_t>(header + 12);
+      bits_ = get_le<uint64_t>(header + 16);
+      if (n_hashes_ > 0 && bits_ > 0 &&
+          (uint64_t)st.st_size == bloom_header_size + bits_ / 8) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+          filter_ = static_cast<uint8_t *>(p);
+          filter_size_ = st.st_size;
+        }
+      }
+    }
+    close(fd);
+  }
+
+  ~DiskCache() {
+    if (filter_ != nullptr)
+      munmap(filter_, filter_size_);
+  }
+
+  DiskCache(const DiskCache &) = delete;
+  DiskCache &operator=(const DiskCache &) = delete;
+
+  std::string entry_path(const std::string &hex) const {
+    return directory_ + "/" + hex.substr(0, 2) + "/" + hex;
+  }
+
+  bool get(const CompileKey &key, std::string &program) const {
+    uint8_t digest[32];
+    key.digest(digest);
+    std::string data;
+    if (!read_file(entry_path(to_hex(digest, 32)), data) ||
+        data.size() < entry_header_size ||
+        memcmp(data.data(), entry_magic, 8) != 0 ||
+        get_le<uint32_t>(&data[8]) != entry_version)
+      return false;
+    uint64_t n_metadata = get_le<uint32_t>(&data[12]);
+    uint64_t n_info_log = get_le<uint32_t>(&data[16]);
+    uint64_t n_program = get_le<uint64_t>(&data[20]);
+    size_t start = entry_header_size + n_metadata + n_info_log;
+    if (data.size() != start + n_program ||
+        data.compare(entry_header_size, n_metadata, key.to_json()) != 0)
+      return false;
+    program = data.substr(start);
+    return true;
+  }
+
+  bool put(const CompileKey &key, const std::string &program,
+           const std::string &info_log, std::string &error) {
+    uint8_t digest[32];
+    key.digest(digest);
+    std::string metadata = key.to_json();
+    std::string data(entry_magic, 8);
+    put_le<uint32_t>(data, entry_version);
+    put_le<uint32_t>(data, metadata.size());
+    put_le<uint32_t>(data, info_log.size());
+    put_le<uint64_t>(data, program.size());
+    data += metadata;
+    data += info_log;
+    data += program;
+
+    std::string path = entry_path(to_hex(digest, 32));
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    // The Python side creates entries with mkstemp's permissions
+    if (!write_file_atomic(path, data.data(), data.size(), 0600, error))
+      return false;
+    add_to_filter(digest);
+    return true;
+  }
+
+ private:
+  // BloomFilter.add(): double hashing over the first 16 bytes of the digest
+  void add_to_filter(const uint8_t digest[32]) {
+    if (filter_ == nullptr)
+      return;
+    const char *d = reinterpret_cast<const char *>(digest);
+    unsigned __int128 h1 = get_le<uint64_t>(d);
+    unsigned __int128 h2 = get_le<uint64_t>(d + 8);
+    for (uint32_t i = 0; i < n_hashes_; i++) {
+      uint64_t bit = (h1 + i * h2) % bits_;
+      __atomic_fetch_or(&filter_[bloom_header_size + (bit >> 3)],
+                        (uint8_t)(1 << (bit & 7)), __ATOMIC_RELAXED);
+    }
+  }
+
+  std::string directory_;
+  uint8_t *filter_ = nullptr;
+  size_t filter_size_ = 0;
+  uint32_t n_hashes_ = 0;
+  uint64_t bits_ = 0;
+};
+
+// Compilation
+
+static const char *result_name(nvPTXCompileResult res) {
+  switch (res) {
+    case NVPTXCOMPILE_ERROR_INVALID_COMPILER_HANDLE:
+      return "NVPTXCOMPILE_ERROR_INVALID_COMPILER_HANDLE";
+    case NVPTXCOMPILE_ERROR_INVALID_INPUT:
+      return "NVPTXCOMPILE_ERROR_INVALID_INPUT";
+    case NVPTXCOMPILE_ERROR_COMPILATION_FAILURE:
+      return "NVPTXCOMPILE_ERROR_COMPILATION_FAILURE";
+    case NVPTXCOMPILE_ERROR_INTERNAL:
+      return "NVPTXCOMPILE_ERROR_INTERNAL";
+    case NVPTXCOMPILE_ERROR_OUT_OF_MEMORY:
+      return "NVPTXCOMPILE_ERROR_OUT_OF_MEMORY";
+    case NVPTXCOMPILE_ERROR_UNSUPPORTED_PTX_VERSION:
+      return "NVPTXCOMPILE_ERROR_UNSUPPORTED_PTX_VERSION";
+    default:
+      return "<unknown>";
+  }
+}
+
+struct Handle {
+  nvPTXCompilerHandle handle = nullptr;
+  ~Handle() {
+    if (handle != nullptr)
+      nvPTXCompilerDestroy(&handle);
+  }
+};
+
+// Compile the PTX, returning false with the error log (or a description of
+// the failed call) in error on failure
+static bool compile(const std::string &ptx,
+                    const std::vector<const char *> &options,
+                    std::string &program, std::string &info_log,
+                    std::string &error) {
+  Handle h;
+  nvPTXCompileResult res = nvPTXCompilerCreate(&h.handle, ptx.size(),
+                                               ptx.data());
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    h.handle = nullptr;
+    error = std::string(result_name(res)) + " from nvPTXCompilerCreate";
+    return false;
+  }
+
+  res = nvPTXCompilerCompile(h.handle, options.size(), options.data());
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    size_t size;
+    if (nvPTXCompilerGetErrorLogSize(h.handle, &size) ==
+        NVPTXCOMPILE_SUCCESS) {
+      error.resize(size + 1);
+      if (nvPTXCompilerGetErrorLog(h.handle, &error[0]) ==
+          NVPTXCOMPILE_SUCCESS) {
+        error.resize(size);
+        return false;
+      }
+    }
+    error = std::string(result_name(res)) + " from nvPTXCompilerCompile";
+    return false;
+  }
+
+  size_t size;
+  res = nvPTXCompilerGetCompiledProgramSize(h.handle, &size);
+  if (res == NVPTXCOMPILE_SUCCESS) {
+    program.resize(size);
+    res = nvPTXCompilerGetCompiledProgram(h.handle, &program[0]);
+  }
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    error = std::string(result_name(res)) + " fetching the compiled program";
+    return false;
+  }
+
+  res = nvPTXCompilerGetInfoLogSize(h.handle, &size);
+  if (res == NVPTXCOMPILE_SUCCESS) {
+    info_log.resize(size + 1);
+    res = nvPTXCompilerGetInfoLog(h.handle, &info_log[0]);
+    info_log.resize(size);
+  }
+  if (res != NVPTXCOMPILE_SUCCESS) {
+    error = std::string(result_name(res)) + " fetching the info log";
+    return false;
+  }
+  return true;
+}
+
+// Command line
+
+struct Job {
+  std::string input;
+  std::string output;
+
+  // Results
+  enum { PENDING, COMPILED, CACHED, FAILED } status = PENDING;
+  double seconds = 0;
+  size_t size = 0;
+  std::string error;
+};
+
+struct Arguments {
+  unsigned jobs = 0;
+  std::string output_dir;
+  std::string cache_dir;
+  std::string depfile;
+  std::string report;
+  std::vector<std::string> inputs;
+  std::vector<std::string> options;
+  std::vector<std::string> response_files;
+};
+
+// Split the contents of a response file into arguments at whitespace outside
+// of single or double quotes
+static std::vector<std::string> split_response_file(const std::string &text) {
+  std::vector<std::string> args;
+  std::string arg;
+  bool in_arg = false;
+  char quote = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (quote) {
+      if (c == quote)
+        quote = 0;
+      else if (c == '\\' && quote == '"' && i + 1 < text.size())
+        arg += text[++i];
+      else
+        arg += c;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+      in_arg = true;
+    } else if (c == '\\' && i + 1 < text.size()) {
+      arg += text[++i];
+      in_arg = true;
+    } else if (isspace((unsigned char)c)) {
+      if (in_arg)
+        args.push_back(arg);
+      arg.clear();
+      in_arg = false;
+    } else {
+      arg += c;
+      in_arg = true;
+    }
+  }
+  if (in_arg)
+    args.push_back(arg);
+  return args;
+}
+
+static bool expand_args(const std::vector<std::string> &args,
+                        std::vector<std::string> &expanded,
+                        std::vector<std::string> &response_files,
+                        int depth = 0) {
+  for (const std::string &arg : args) {
+    if (arg.size() < 2 || arg[0] != '@') {
+      expanded.push_back(arg);
+      continue;
+    }
+    std::string path = arg.substr(1), text;
+    if (depth > 16) {
+      fprintf(stderr, "ptxbatch: %s: response files nested too deeply\n",
+              path.c_str());
+      return false;
+    }
+    if (!read_file(path, text)) {
+      fprintf(stderr, "ptxbatch: %s: %s\n", path.c_str(), strerror(errno));
+      return false;
+    }
+    response_files.push_back(path);
+    if (!expand_args(split_response_file(text), expanded, response_files,
+                     depth + 1))
+      return false;
+  }
+  return true;
+}
+
+static bool parse_args(int argc, char **argv, Arguments &args) {
+  std::vector<std::string> expanded;
+  if (!expand_args(std::vector<std::string>(argv + 1, argv + argc), expanded,
+                   args.response_files))
+    return false;
+
+  for (size_t i = 0; i < expanded.size(); i++) {
+    const std::string &arg = expanded[i];
+    std::string value;
+
+    // Flags taking a value, as "-f value", "-fvalue" or "--flag=value"
+    auto take = [&](const char *short_name, const char *long_name) {
+      std::string long_eq = std::string(long_name) + "=";
+      if ((short_name != nullptr && arg == short_name) || arg == long_name) {
+        if (i + 1 == expanded.size()) {
+          fprintf(stderr, "ptxbatch: %s requires a value\n", arg.c_str());
+          exit(2);
+        }
+        value = expanded[++i];
+        return true;
+      }
+      if (short_name != nullptr && arg.size() > 2 &&
+          arg.compare(0, 2, short_name) == 0) {
+        value = arg.substr(2);
+        return true;
+      }
+      if (arg.compare(0, long_eq.size(), long_eq) == 0) {
+        value = arg.substr(long_eq.size());
+        return true;
+      }
+      return false;
+    };
+
+    if (arg == "--") {
+      args.options.assign(expanded.begin() + i + 1, expanded.end());
+      break;
+    } else if (arg == "-h" || arg == "--help") {
+      fputs(usage, stdout);
+      exit(0);
+    } else if (take("-j", "--jobs")) {
+      char *end;
+      args.jobs = strtoul(value.c_str(), &end, 10);
+      if (*end != '\0' || value.empty()) {
+        fprintf(stderr, "ptxbatch: invalid job count %s\n", value.c_str());
+        return false;
+      }
+    } else if (take("-o", "--output-dir")) {
+      args.output_dir = value;
+    } else if (take(nullptr, "--cache-dir")) {
+      args.cache_dir = value;
+    } else if (take(nullptr, "--depfile")) {
+      args.depfile = value;
+    } else if (take(nullptr, "--report")) {
+      args.report = value;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      fprintf(stderr, "ptxbatch: unknown flag %s\n%s", arg.c_str(), usage);
+      return false;
+    } else {
+      args.inputs.push_back(arg);
+    }
+  }
+
+  if (args.inputs.empty()) {
+    fprintf(stderr, "ptxbatch: no inputs\n%s", usage);
+    return false;
+  }
+  return true;
+}
+
+// Find the .ptx files to compile and where their outputs go. Outputs are
+// placed next to their inputs, or in the output directory, keeping the layout
+// of the files under each input directory.
+static bool collect_jobs(const Arguments &args, std::vector<Job> &jobs) {
+  auto add = [&](const fs::path &input, const fs::path &relative) {
+    fs::path output = args.output_dir.empty()
+                          ? input : fs::path(args.output_dir) / relative;
+    output.replace_extension(".cubin");
+    jobs.push_back(Job{input.string(), output.string()});
+  };
+
+  for (const std::string &input : args.inputs) {
+    std::error_code ec;
+    if (fs::is_directory(input, ec)) {
+      std::vector<fs::path> files;
+      for (fs::recursive_directory_iterator it(input, ec), end;
+           !ec && it != end; it.increment(ec))
+        if (it->is_regular_file() && it->path().extension() == ".ptx")
+          files.push_back(it->path());
+      if (ec) {
+        fprintf(stderr, "ptxbatch: %s: %s\n", input.c_str(),
+                ec.message().c_str());
+        return false;
+      }
+      std::sort(files.begin(), files.end());
+      for (const fs::path &file : files)
+        add(file, file.lexically_relative(input));
+    } else {
+      add(input, fs::path(input).filename());
+    }
+  }
+
+  std::vector<std::string> outputs;
+  for (const Job &job : jobs)
+    outputs.push_back(job.output);
+  std::sort(outputs.begin(), outputs.end());
+  auto duplicate = std::adjacent_find(outputs.begin(), outputs.end());
+  if (duplicate != outputs.end()) {
+    fprintf(stderr, "ptxbatch: several inputs would be compiled to %s\n",
+            duplicate->c_str());
+    return false;
+  }
+  return true;
+}
+
+// Escape a path for a Makefile-style depfile, as read by Ninja
+static std::string depfile_path(const std::string &path) {
+  std::string escaped;
+  for (char c : path) {
+    if (c == ' ' || c == '\\' || c == '#')
+      escaped += '\\';
+    else if (c == '$')
+      escaped += '$';
+    escaped += c;
+  }
+  return escaped;
+}
+
+static bool write_depfile(const Arguments &args, const std::vector<Job> &jobs,
+                          std::string &error) {
+  std::string text;
+  for (const Job &job : jobs)
+    text += depfile_path(job.output) + " ";
+  if (!text.empty()) {
+    text.back() = ':';
+    for (const Job &job : jobs)
+      text += " \\\n  " + depfile_path(job.input);
+    for (const std::string &path : args.response_files)
+      text += " \\\n  " + depfile_path(path);
+    text += "\n";
+  }
+  return write_file_atomic(args.depfile, text.data(), text.size(), 0644,
+                           error);
+}
+
+static bool write_report(const Arguments &args, const std::vector<Job> &jobs,
+                         unsigned n_threads, unsigned major, unsigned minor,
+                         double seconds, std::string &error) {
+  static const char *statuses[] = {"pending", "compiled", "cached", "failed"};
+  size_t counts[4] = {0, 0, 0, 0};
+  std::string files;
+  char number[64];
+  for (const Job &job : jobs) {
+    counts[job.status]++;
+    snprintf(number, sizeof(number), "%.6f", job.seconds);
+    files += files.empty() ? "\n    " : ",\n    ";
+    files += "{\"input\": " + json_string(job.input) +
+             ", \"output\": " + json_string(job.output) +
+             ", \"status\": \"" + statuses[job.status] +
+             "\", \"time\": " + number +
+             ", \"size\": " + std::to_string(job.size);
+    if (job.status == Job::FAILED)
+      files += ", \"error\": " + json_string(job.error);
+    files += "}";
+  }
+
+  snprintf(number, sizeof(number), "%.6f", seconds);
+  std::string text = "{\n  \"compiler_version\": [" + std::to_string(major) +
+                     ", " + std::to_string(minor) + "],\n  \"jobs\": " +
+                     std::to_string(n_threads) + ",\n  \"wall_time\": " +
+                     number;
+  for (int i = Job::COMPILED; i <= Job::FAILED; i++)
+    text += ",\n  \"" + std::string(statuses[i]) + "\": " +
+            std::to_string(counts[i]);
+  text += ",\n  \"files\": [" + files + "\n  ]\n}\n";
+  return write_file_atomic(args.report, text.data(), text.size(), 0644,
+                           error);
+}
+
+int main(int argc, char **argv) {
+  Arguments args;
+  std::vector<Job> jobs;
+  if (!parse_args(argc, argv, args) || !collect_jobs(args, jobs))
+    return 2;
+
+  unsigned major, minor;
+  if (nvPTXCompilerGetVersion(&major, &minor) != NVPTXCOMPILE_SUCCESS) {
+    fprintf(stderr, "ptxbatch: cannot get the compiler version\n");
+    return 1;
+  }
+
+  CompileKey base_key;
+  base_key.major = major;
+  base_key.minor = minor;
+  split_arch(args.options, base_key.arch, base_key.has_arch,
+             base_key.options);
+
+  std::vector<const char *> options;
+  for (const std::string &option : args.options)
+    options.push_back(option.c_str());
+
+  if (args.cache_dir.empty() && getenv("PTXCOMPILER_CACHE_DIR") != nullptr)
+    args.cache_dir = getenv("PTXCOMPILER_CACHE_DIR");
+  std::unique_ptr<DiskCache> cache;
+  if (!args.cache_dir.empty())
+    cache.reset(new DiskCache(args.cache_dir));
+
+  std::mutex stderr_lock;
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < jobs.size();) {
+      Job &job = jobs[i];
+      auto start = std::chrono::steady_clock::now();
+      std::string ptx, program, info_log;
+
+      if (!read_file(job.input, ptx)) {
+        job.status = Job::FAILED;
+        job.error = job.input + ": " + strerror(errno);
+      } else {
+        CompileKey key = base_key;
+        if (cache) {
+          uint8_t digest[32];
+          SHA256 h;
+          h.update(canonicalize_ptx(ptx));
+          h.digest(digest);
+          key.ptx_hash = to_hex(digest, 32);
+        }
+
+        if (cache && cache->get(key, program)) {
+          job.status = Job::CACHED;
+        } else if (compile(ptx, options, program, info_log, job.error)) {
+          job.status = Job::COMPILED;
+          std::string error;
+          if (cache && !cache->put(key, program, info_log, error)) {
+            std::lock_guard<std::mutex> lock(stderr_lock);
+            fprintf(stderr, "ptxbatch: warning: cannot cache %s: %s\n",
+                    job.input.c_str(), error.c_str());
+          }
+        } else {
+          job.status = Job::FAILED;
+        }
+      }
+
+      if (job.status != Job::FAILED) {
+        std::error_code ec;
+        fs::create_directories(fs::path(job.output).parent_path(), ec);
+        if (write_file_atomic(job.output, program.data(), program.size(),
+                              0644, job.error))
+          job.size = program.size();
+        else
+          job.status = Job::FAILED;
+      }
+
+      job.seconds = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+
+      std::lock_guard<std::mutex> lock(stderr_lock);
+      if (job.status == Job::FAILED)
+        fprintf(stderr, "ptxbatch: error: %s:\n%s\n", job.input.c_str(),
+                job.error.c_str());
+      else if (!info_log.empty())
+        fprintf(stderr, "%s:\n%s\n", job.input.c_str(), info_log.c_str());
+    }
+  };
+
+  unsigned n_threads = args.jobs;
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  n_threads = std::min<size_t>(n_threads, std::max<size_t>(jobs.size(), 1));
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < n_threads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &thread : threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  bool failed = false;
+  for (const Job &job : jobs)
+    failed |= job.status == Job::FAILED;
+
+  std::string error;
+  // A depfile is only written on success, so that a failed build is rerun
+  if (!failed && !args.depfile.empty() && !write_depfile(args, jobs, error)) {
+    fprintf(stderr, "ptxbatch: %s\n", error.c_str());
+    failed = true;
+  }
+  if (!args.report.empty() &&
+      !write_report(args, jobs, n_threads, major, minor, seconds, error)) {
+    fprintf(stderr, "ptxbatch: %s\n", error.c_str());
+    failed = true;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Portable snapshots of the disk cache.
+
+A snapshot is a single file holding compressed cache entries and an index,
+for moving compile results between hosts: for example, exporting the caches
+of CI and canary nodes, merging the exports, and importing the result into
+production caches. Its layout is::
+
+    header
+    compressed entries, back to back
+    index: one record per entry, sorted by digest
+
+The header holds the compression method, the number of entries, the offset
+of the index and the SHA-256 of the index. Each index record holds an
+entry's key digest, its offset and compressed size, its uncompressed size
+and the SHA-256 of the uncompressed entry, which is checked on import.
+Entries are compressed individually, so that they can be decompressed in
+parallel and copied between snapshots without recompressing them.
+
+Exports can be filtered by architecture, compiler version and hotness. An
+entry's hotness is the last time it was accessed, taken from its file's
+access time, so it is only as precise as the file system's atime updates.
+"""
+
+import argparse
+import hashlib
+import heapq
+import lzma
+import mmap
+import os
+import struct
+import sys
+import tempfile
+import time
+import zlib
+from collections import namedtuple
+from concurrent.futures import ThreadPoolExecutor
+
+from ptxcompiler.cache import DiskCache, decode_entry
+
+SNAPSHOT_MAGIC = b'PTXCSNAP'
+SNAPSHOT_VERSION = 1
+
+# magic, format version, compression, entry count, index offset, index hash
+_HEADER = struct.Struct('<8sIIQQ32s')
+# digest, offset, compressed size, size, entry hash
+_RECORD = struct.Struct('<32sQQQ32s')
+
+# Number of entries written to the cache at a time by import_snapshot
+IMPORT_BATCH_SIZE = 64
+
+COMPRESSORS = {
+    'none': (0, lambda data: data, lambda data: data),
+    'zlib': (1, lambda data: zlib.compress(data, 6), zlib.decompress),
+    'lzma': (2, lzma.compress, lzma.decompress),
+}
+_COMPRESSION_NAMES = {code: name for name, (code, _, _)
+                      in COMPRESSORS.items()}
+
+Record = namedtuple('Record', ('digest', 'offset', 'compressed_size', 'size',
+                               'sha256'))
+
+
+class SnapshotError(Exception):
+    pass
+
+
+class Snapshot:
+    """A snapshot opened for reading."""
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            self._mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            self._read_index()
+        except BaseException:
+            self._mmap.close()
+            raise
+
+    def _read_index(self):
+        path = self.path
+        if len(self._mmap) < _HEADER.size:
+            raise SnapshotError(f'{path} is too small to be a snapshot')
+        magic, version, compression, count, index_offset, index_hash = \
+            _HEADER.unpack_from(self._mmap)
+        if magic != SNAPSHOT_MAGIC or version != SNAPSHOT_VERSION:
+            raise SnapshotError(f'{path} is not a snapshot')
+        if compression not in _COMPRESSION_NAMES:
+            raise SnapshotError(f'Unknown compression {compression}')
+        self.compression = _COMPRESSION_NAMES[compression]
+
+        index_end = index_offset + count * _RECORD.size
+        if index_end != len(self._mmap):
+            raise SnapshotError(f'{path} is truncated')
+        index = self._mmap[index_offset:index_end]
+        if hashlib.sha256(index).digest() != index_hash:
+            raise SnapshotError(f'The index of {path} is corrupt')
+        self.records = [Record(*r) for r in _RECORD.iter_unpack(index)]
+
+    def __len__(self):
+        return len(self.records)
+
+    def raw(self, record):
+        """Return the compressed entry for an index record."""
+        start = record.offset
+        return self._mmap[start:start + record.compressed_size]
+
+    def entry(self, record):
+        """Return the decompressed entry for an index record, checking its
+        size and hash."""
+        data = COMPRESSORS[self.compression][2](self.raw(record))
+        if (len(data) != record.size or
+                hashlib.sha256(data).digest() != record.sha256):
+            raise SnapshotError(f'Entry {record.digest.hex()} is corrupt')
+        return data
+
+    def close(self):
+        self._mmap.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+class SnapshotWriter:
+    """Writes a snapshot, atomically replacing ``path`` when closed."""
+
+    def __init__(self, path, compression='zlib'):
+        if compression not in COMPRESSORS:
+            raise ValueError(f'Unknown compression {compression!r}')
+        self.path = path
+        self.compression = compression
+        self._compress = COMPRESSORS[compression][1]
+        self._records = {}
+
+        directory = os.path.dirname(os.path.abspath(path))
+        fd, self._tmp = tempfile.mkstemp(dir=directory, prefix='.snapshot')
+        self._file = os.fdopen(fd, 'wb')
+        self._file.write(b'\0' * _HEADER.size)
+
+    def __contains__(self, digest):
+        return digest in self._records
+
+    def add(self, digest, data):
+        """Compress and add an encoded entry."""
+        self.add_raw(digest, self._compress(data), len(data),
+                     hashlib.sha256(data).digest())
+
+    def add_raw(self, digest, compressed, size, sha256):
+        """Add an already compressed entry."""
+        offset = self._file.tell()
+        self._file.write(compressed)
+        self._records[digest] = Record(digest, offset, len(compressed), size,
+                                       sha256)
+
+    def close(self):
+        try:
+            index = b''.join(_RECORD.pack(*self._records[digest])
+                             for digest in sorted(self._records))
+            index_offset = self._file.tell()
+            self._file.write(index)
+            self._file.seek(0)
+            self._file.write(_HEADER.pack(
+                SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                COMPRESSORS[self.compression][0], len(self._records),
+                index_offset, hashlib.sha256(index).digest()))
+            self._file.close()
+            os.replace(self._tmp, self.path)
+        except BaseException:
+            self.abort()
+            raise
+        return len(self._records)
+
+    def abort(self):
+        self._file.close()
+        if os.path.exists(self._tmp):
+            os.unlink(self._tmp)
+
+
+def _version_tuple(version):
+    return tuple(int(part) for part in version.split('.'))
+
+
+def export_snapshot(cache_dir, path, archs=None, compiler_versions=None,
+                    accessed_within=None, top=None, compression='zlib'):
+    """Export entries from the disk cache in ``cache_dir`` to a snapshot.
+
+    Only entries for the architectures in ``archs`` and the compiler
+    versions (``(major, minor)`` tuples) in ``compiler_versions`` are
+    exported, if they are given. ``accessed_within`` limits the export to
+    entries accessed within that many seconds, and ``top`` to that number of
+    most recently accessed entries. Returns the number of entries
+    exported."""
+    cache = DiskCache(cache_dir, use_filter=False)
+    candidates = []
+    cutoff = time.time() - accessed_within if accessed_within else None
+    for digest in cache.digests():
+        try:
+            atime = os.stat(cache.entry_path(digest)).st_atime
+        except FileNotFoundError:
+            continue
+        if cutoff is None or atime >= cutoff:
+            candidates.append((atime, digest))
+    if top is not None:
+        candidates = heapq.nlargest(top, candidates)
+
+    versions = None
+    if compiler_versions is not None:
+        versions = {tuple(v) for v in compiler_versions}
+
+    writer = SnapshotWriter(path, compression)
+    try:
+        for _, digest in candidates:
+            data = cache.read_entry(digest)
+            entry = decode_entry(data) if data is not None else None
+            if entry is None or entry[0].digest() != digest:
+                continue
+            key = entry[0]
+            if archs is not None and key.arch not in archs:
+                continue
+            if versions is not None and key.compiler_version not in versions:
+                continue
+            writer.add(digest, data)
+    except BaseException:
+        writer.abort()
+        raise
+    return writer.close()
+
+
+def merge_snapshots(paths, path, compression=None):
+    """Merge snapshots into one, keeping the first copy of each entry.
+    Entries are copied without recompressing them if the compression
+    matches. Returns the number of entries in the merged snapshot."""
+    snapshots = [Snapshot(p) for p in paths]
+    try:
+        if compression is None:
+            compression = snapshots[0].compression if snapshots else 'zlib'
+        writer = SnapshotWriter(path, compression)
+        try:
+            for snapshot in snapshots:
+                for record in snapshot.records:
+                    if record.digest in writer:
+                        continue
+                    if snapshot.compression == compression:
+                        writer.add_raw(record.digest, snapshot.raw(record),
+                                       record.size, record.sha256)
+                    else:
+                        writer.add(record.digest, snapshot.entry(record))
+        except BaseException:
+            writer.abort()
+            raise
+        return writer.close()
+    finally:
+        for snapshot in snapshots:
+            snapshot.close()
+
+
+ImportStats = namedtuple('ImportStats', ('imported', 'skipped', 'corrupt'))
+
+
+def import_snapshot(path, cache_dir, workers=None, overwrite=False):
+    """Import a snapshot into the disk cache in ``cache_dir``, decompressing
+    entries on ``workers`` threads and writing them in batches. Entries whose
+    hash, encoding or key digest do not match are counted as corrupt and not
+    imported. Existing entries are kept unless ``overwrite`` is true."""
+    cache = DiskCache(cache_dir)
+    if workers is None:
+        workers = os.cpu_count() or 1
+
+    def decode_one(snapshot, record):
+        if not overwrite and os.path.exists(cache.entry_path(record.digest)):
+            return 'skipped'
+        try:
+            data = snapshot.entry(record)
+        except (SnapshotError, zlib.error, lzma.LZMAError):
+            return 'corrupt'
+        entry = decode_entry(data)
+        if entry is None or entry[0].digest() != record.digest:
+            return 'corrupt'
+        return data
+
+    # Entries are decompressed on the workers and written in batches
+    counts = {'imported': 0, 'skipped': 0, 'corrupt': 0}
+    batch = []
+    with Snapshot(path) as snapshot:
+        with ThreadPoolExecutor(workers) as executor:
+            results = executor.map(lambda r: decode_one(snapshot, r),
+                                   snapshot.records)
+            for record, result in zip(snapshot.records, results):
+                if isinstance(result, str):
+                    counts[result] += 1
+                    continue
+                batch.append((record.digest, result))
+                if len(batch) == IMPORT_BATCH_SIZE:
+                    cache.put_entries(batch)
+                    counts['imported'] += len(batch)
+                    batch = []
+    if batch:
+        cache.put_entries(batch)
+        counts['imported'] += len(batch)
+    return ImportStats(**counts)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog='python -m ptxcompiler.snapshot',
+                                     description='Manage cache snapshots')
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    export = subparsers.add_parser(
+        'export', help='Export a disk cache to a snapshot')
+    export.add_argument('cache_dir')
+    export.add_argument('snapshot')
+    export.add_argument('--arch', action='append',
+                        help='Only export entries for this architecture')
+    export.add_argument('--compiler-version', action='append',
+                        type=_version_tuple,
+                        help='Only export entries from this compiler version')
+    export.add_argument('--accessed-within', type=float, metavar='DAYS',
+                        help='Only export entries accessed within DAYS days')
+    export.add_argument('--top', type=int,
+                        help='Only export the N most recently accessed '
+                             'entries')
+    export.add_argument('--compression', choices=sorted(COMPRESSORS),
+                        default='zlib')
+
+    merge = subparsers.add_parser('merge', help='Merge snapshots')
+    merge.add_argument('snapshot', help='The snapshot to write')
+    merge.add_argument('inputs', nargs='+')
+    merge.add_argument('--compression', choices=sorted(COMPRESSORS))
+
+    import_ = subparsers.add_parser(
+        'import', help='Import a snapshot into a disk cache')
+    import_.add_argument('snapshot')
+    import_.add_argument('cache_dir')
+    import_.add_argument('--workers', type=int)
+    import_.add_argument('--overwrite', action='store_true')
+
+    info = subparsers.add_parser('info', help='Describe a snapshot')
+    info.add_argument('snapshot')
+
+    args = parser.parse_args(argv)
+
+    if args.command == 'export':
+        within = (args.accessed_within * 86400 if args.accessed_within
+                  else None)
+        n = export_snapshot(args.cache_dir, args.snapshot, args.arch,
+                            args.compiler_version, within, args.top,
+                            args.compression)
+        print(f'Exported {n} entries to {args.snapshot}')
+    elif args.command == 'merge':
+        n = merge_snapshots(args.inputs, args.snapshot, args.compression)
+        print(f'Wrote {n} entries to {args.snapshot}')
+    elif args.command == 'import':
+        stats = import_snapshot(args.snapshot, args.cache_dir, args.workers,
+                                args.overwrite)
+        print(f'Imported {stats.imported} entries, skipped {stats.skipped} '
+              f'already present, {stats.corrupt} corrupt')
+        if stats.corrupt:
+            return 1
+    else:
+        with Snapshot(args.snapshot) as snapshot:
+            size = sum(r.size for r in snapshot.records)
+            print(f'{args.snapshot}: {len(snapshot)} entries, '
+                  f'{snapshot.compression} compression, {size} bytes '
+                  f'uncompressed, {os.path.getsize(args.snapshot)} bytes')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,480 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Speculative compilation of the signatures a kernel is likely to see next.
+
+Numba creates a specialization of a CUDA kernel for each new tuple of
+argument types it is called with, and workloads tend to call kernels with
+predictable sequences of types: a kernel called with ``float32`` arrays is
+soon called with ``float64`` ones, and so on. A ``Predictor`` learns these
+sequences from two models:
+
+- For each kernel, a first order Markov model of the transitions between
+  its signatures.
+- Across all kernels, how often each argument type is followed by another
+  in the same position (e.g. ``int32`` by ``int64``), so that what was
+  learned from one kernel applies to others using the same types.
+
+When a kernel is specialized, the signatures that most likely follow are
+compiled on the compile pool under the ``speculative`` tag, whose low weight
+makes it yield to other compiles. Speculative compiles are only submitted
+when no other tag has jobs waiting, and stop once they have used a budget of
+CPU time. When one of the predicted signatures is needed, the kernel
+compiled for it is used instead of compiling it again.
+
+The model is kept in the file named by ``PTXCOMPILER_SPECULATE_MODEL``,
+which enables speculation when ``patch_numba_codegen_if_needed`` is called.
+Observations are merged into the file when the process exits, under a lock
+on a ``.lock`` file beside it, so several processes can share it. Only the
+most frequent transitions of each kernel are kept, so that the model stays
+small however many runs it learns from. The CPU budget, in seconds per
+process, is set with ``PTXCOMPILER_SPECULATE_CPU_BUDGET``. Prediction and
+speculation accuracy are available from ``get_speculator().stats()`` and
+``report()``.
+"""
+
+import atexit
+import fcntl
+import logging
+import os
+import pickle
+import tempfile
+import threading
+import time
+from collections import Counter
+from concurrent.futures import CancelledError
+from contextvars import ContextVar
+
+from ptxcompiler.pool import get_pool
+
+SPECULATE_MODEL_ENV = 'PTXCOMPILER_SPECULATE_MODEL'
+SPECULATE_BUDGET_ENV = 'PTXCOMPILER_SPECULATE_CPU_BUDGET'
+
+SPECULATIVE_TAG = 'speculative'
+SPECULATIVE_WEIGHT = 0.05
+DEFAULT_CPU_BUDGET = 60.0
+# Signatures compiled after each specialization
+DEFAULT_LIMIT = 2
+# Least probability for a signature to be compiled
+DEFAULT_MIN_PROBABILITY = 0.2
+# Speculative results kept waiting to be used
+MAX_SPECULATED = 256
+# Weight of the cross-kernel type model relative to the kernel's own model
+TYPE_MODEL_WEIGHT = 0.5
+# Transitions kept per function in the saved model
+MAX_TRANSITIONS = 64
+MODEL_VERSION = 1
+
+_speculating = ContextVar('ptxcompiler_speculating', default=False)
+_speculator = None
+_installed = False
+
+logger = logging.getLogger(__name__)
+
+
+def _add(counts, delta):
+    for state, successors in delta.items():
+        counts.setdefault(state, Counter()).update(successors)
+
+
+class Predictor:
+    """Predicts the next signatures of each function from those seen so
+    far. Functions and signatures are any hashable values; the elements of
+    signatures are argument types."""
+
+    def __init__(self, state=None):
+        # function -> signature -> Counter of following signatures
+        self.transitions = {}
+        # type -> Counter of types replacing it
+        self.substitutions = {}
+        # Observations made by this process, for merging into saved state
+        self._new_transitions = {}
+        self._new_substitutions = {}
+        self._last = {}
+        self._seen = {}
+        self._predicted = {}
+        self._lock = threading.Lock()
+        self.counts = Counter()
+        if state is not None:
+            self.merge(state)
+
+    def merge(self, state):
+        with self._lock:
+            for function, transitions in state['transitions'].items():
+                _add(self.transitions.setdefault(function, {}), transitions)
+            _add(self.substitutions, state['substitutions'])
+
+    def prune(self, max_transitions=MAX_TRANSITIONS):
+        """Keep only the ``max_transitions`` most frequent transitions of
+        each function."""
+        with self._lock:
+            for function, transitions in self.transitions.items():
+                ranked = sorted(((n, previous, successor)
+                                 for previous, successors in
+                                 transitions.items()
+                                 for successor, n in successors.items()),
+                                key=lambda t: t[0], reverse=True)
+                if len(ranked) <= max_transitions:
+                    continue
+                pruned = {}
+                for n, previous, successor in ranked[:max_transitions]:
+                    pruned.setdefault(previous, Counter())[successor] = n
+                self.transitions[function] = pruned
+
+    def state(self, new_only=False):
+        with self._lock:
+            transitions = (self._new_transitions if new_only
+                           else self.transitions)
+            substitutions = (self._new_substitutions if new_only
+                             else self.substitutions)
+            return {'version': MODEL_VERSION,
+                    'transitions': {f: {s: Counter(c) for s, c in t.items()}
+                                    for f, t in transitions.items()},
+                    'substitutions': {t: Counter(c)
+                                      for t, c in substitutions.items()}}
+
+    def observe(self, function, signature):
+        """Record that ``function`` was specialized for ``signature``."""
+        with self._lock:
+            self.counts['observed'] += 1
+            predicted = self._predicted.pop(function, ())
+            if predicted:
+                self.counts['evaluated'] += 1
+                if signature in predicted:
+                    self.counts['correct'] += 1
+
+            self._seen.setdefault(function, set()).add(signature)
+            previous = self._last.get(function)
+            self._last[function] = signature
+            if previous is None or previous == signature:
+                return
+
+            for transitions in (self.transitions, self._new_transitions):
+                transitions.setdefault(function, {}).setdefault(
+                    previous, Counter())[signature] += 1
+            if len(previous) == len(signature):
+                for old, new in zip(previous, signature):
+                    if old != new:
+                        for substitutions in (self.substitutions,
+                                              self._new_substitutions):
+                            substitutions.setdefault(old, Counter())[new] += 1
+
+    def predict(self, function, signature, limit=DEFAULT_LIMIT,
+                min_probability=DEFAULT_MIN_PROBABILITY):
+        """Return up to ``limit`` ``(signature, probability)`` pairs for the
+        signatures most likely to follow ``signature``, most likely first.
+        Signatures ``function`` was already specialized for are left out."""
+        scores = Counter()
+        with self._lock:
+            successors = self.transitions.get(function, {}).get(signature)
+            if successors:
+                total = sum(successors.values())
+                for successor, n in successors.items():
+                    scores[successor] += n / total
+
+            for i, old in enumerate(signature):
+                replacements = self.substitutions.get(old)
+                if not replacements:
+                    continue
+                total = sum(replacements.values())
+                for new, n in replacements.items():
+                    successor = signature[:i] + (new,) + signature[i + 1:]
+                    scores[successor] += TYPE_MODEL_WEIGHT * n / total
+
+            seen = self._seen.get(function, set())
+            predictions = [(s, min(p, 1.0)) for s, p in scores.most_common()
+                           if p >= min_probability and s not in seen]
+            predictions = predictions[:limit]
+            self._predicted[function] = {s for s, _ in predictions}
+        return predictions
+
+    def stats(self):
+        with self._lock:
+            counts = dict(self.counts)
+        evaluated = counts.get('evaluated', 0)
+        counts['accuracy'] = (counts.get('correct', 0) / evaluated
+                              if evaluated else 0.0)
+        return counts
+
+
+def load_model(path):
+    """Return the model state saved at ``path``, or ``None``."""
+    try:
+        with open(path, 'rb') as f:
+            state = pickle.load(f)
+    except FileNotFoundError:
+        return None
+    except Exception as e:
+        logger.warning('Could not load speculation model %s: %s', path, e)
+        return None
+    if not isinstance(state, dict) or state.get('version') != MODEL_VERSION:
+        return None
+    return state
+
+
+def save_model(path, predictor):
+    """Merge what ``predictor`` learned in this process into the model saved
+    at ``path``. Processes saving at the same time take turns, so that none
+    of them overwrites what another merged."""
+    directory = os.path.dirname(os.path.abspath(path))
+    with open(path + '.lock', 'a') as lock:
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        merged = Predictor(load_model(path))
+        merged.merge(predictor.state(new_only=True))
+        merged.prune(MAX_TRANSITIONS)
+        data = pickle.dumps(merged.state(), protocol=pickle.HIGHEST_PROTOCOL)
+
+        fd, tmp = tempfile.mkstemp(dir=directory, prefix='.')
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(data)
+            os.replace(tmp, path)
+        except BaseException:
+            os.unlink(tmp)
+            raise
+
+
+class Speculator:
+    """Compiles predicted signatures on the compile pool. ``build(target,
+    signature)`` compiles one, returning the result to hand over when the
+    signature is needed.
+
+    Predictions are made for a ``function``, the name the model knows it
+    by, while builds are made for a ``target``: what is actually compiled.
+    Several targets can share a function name (e.g. closures made by the
+    same factory), so results are only handed over for the target they were
+    built for. By default, the target is the function name."""
+
+    def __init__(self, predictor, build, cpu_budget=DEFAULT_CPU_BUDGET,
+                 limit=DEFAULT_LIMIT, pool=None):
+        self.predictor = predictor
+        self.build = build
+        self.cpu_budget = cpu_budget
+        self.limit = limit
+        self.pool = pool or get_pool()
+        self.pool.set_tag_weight(SPECULATIVE_TAG, SPECULATIVE_WEIGHT)
+
+        self._lock = threading.Lock()
+        self._futures = {}
+        self._cpu_seconds = 0.0
+        self.counts = Counter()
+
+    def _count(self, name):
+        with self._lock:
+            self.counts[name] += 1
+
+    def _busy(self):
+        return any(stats['queue_depth'] for tag, stats in
+                   self.pool.stats().items() if tag != SPECULATIVE_TAG)
+
+    def _run(self, target, signature):
+        start = time.thread_time()
+        token = _speculating.set(True)
+        try:
+            return self.build(target, signature)
+        finally:
+            _speculating.reset(token)
+            with self._lock:
+                self._cpu_seconds += time.thread_time() - start
+
+    def observe(self, function, signature, target=None):
+        """Record a specialization and compile the signatures predicted to
+        follow it. Returns what was built for ``target`` and ``signature``
+        if it was compiled speculatively, and ``None`` otherwise."""
+        if _speculating.get():
+            return None
+        if target is None:
+            target = function
+
+        self.predictor.observe(function, signature)
+        result = self._take(function, target, signature)
+        self._speculate(function, target, signature)
+        return result
+
+    def _take(self, function, target, signature):
+        with self._lock:
+            future = self._futures.pop((target, signature), None)
+        if future is None or future.cancel():
+            return None
+        try:
+            result = future.result()
+        except CancelledError:
+            return None
+        except Exception as e:
+            logger.debug('Speculative compile of %s failed: %s', function, e)
+            return None
+        self._count('used')
+        return result
+
+    def _speculate(self, function, target, signature):
+        for predicted, probability in self.predictor.predict(
+                function, signature, self.limit):
+            with self._lock:
+                if (target, predicted) in self._futures:
+                    continue
+                if self._cpu_seconds >= self.cpu_budget:
+                    self.counts['over_budget'] += 1
+                    return
+            if self._busy():
+                self._count('pool_busy')
+                return
+            logger.debug('Compiling %s for %s speculatively (p=%.2f)',
+                         function, predicted, probability)
+            future = self.pool.submit(self._run, target, predicted,
+                                      tag=SPECULATIVE_TAG)
+            future.add_done_callback(self._done)
+            with self._lock:
+                self._futures[(target, predicted)] = future
+                self.counts['compiled'] += 1
+                if len(self._futures) > MAX_SPECULATED:
+                    # Forget the oldest result that has not been used
+                    oldest = next(iter(self._futures))
+                    self._futures.pop(oldest).cancel()
+
+    def _done(self, future):
+        if not future.cancelled() and future.exception() is not None:
+            self._count('failed')
+
+    def stats(self):
+        stats = self.predictor.stats()
+        with self._lock:
+            stats.update(self.counts)
+            stats['cpu_seconds'] = self._cpu_seconds
+            stats['pending'] = len(self._futures)
+        stats['cpu_budget'] = self.cpu_budget
+        compiled = stats.get('compiled', 0)
+        stats['speculation_accuracy'] = (stats.get('used', 0) / compiled
+                                         if compiled else 0.0)
+        return stats
+
+    def report(self):
+        stats = self.stats()
+        return (f'{stats.get("observed", 0)} specializations, next signature '
+                f'predicted correctly {stats["accuracy"]:.0%} of '
+                f'{stats.get("evaluated", 0)} times\n'
+                f'{stats.get("compiled", 0)} speculative compiles, '
+                f'{stats.get("used", 0)} used '
+                f'({stats["speculation_accuracy"]:.0%}), '
+                f'{stats.get("failed", 0)} failed, '
+                f'{stats["cpu_seconds"]:.1f}s of {stats["cpu_budget"]:.1f}s '
+                f'CPU budget used\n')
+
+
+def get_speculator():
+    """Return the installed speculator, or ``None``."""
+    return _speculator
+
+
+def report():
+    return _speculator.report() if _speculator is not None else ''
+
+
+def _freeze(value):
+    # A hashable equivalent of a target option value
+    if isinstance(value, dict):
+        return tuple(sorted((k, _freeze(v)) for k, v in value.items()))
+    if isinstance(value, (list, tuple)):
+        return tuple(_freeze(v) for v in value)
+    if isinstance(value, set):
+        return frozenset(_freeze(v) for v in value)
+    hash(value)
+    return value
+
+
+class _Target:
+    """What a kernel is compiled from: its Python function, target options
+    and compute capability. Targets compare equal only for the same function
+    object and equal options."""
+
+    def __init__(self, py_func, targetoptions, cc):
+        self.py_func = py_func
+        self.targetoptions = targetoptions
+        self.cc = cc
+        self._key = (id(py_func), _freeze(targetoptions), cc)
+
+    def __eq__(self, other):
+        return (isinstance(other, _Target) and self.py_func is other.py_func
+                and self._key == other._key)
+
+    def __hash__(self):
+        return hash(self._key)
+
+
+def _budget_from_env():
+    budget = os.getenv(SPECULATE_BUDGET_ENV)
+    return float(budget) if budget else DEFAULT_CPU_BUDGET
+
+
+def install(path=None):
+    """Install speculative compilation into Numba's CUDA dispatcher, with
+    the model kept at ``path`` (by default, ``PTXCOMPILER_SPECULATE_MODEL``).
+    Returns whether it was installed."""
+    global _speculator, _installed
+
+    path = path or os.getenv(SPECULATE_MODEL_ENV)
+    if _installed or not path:
+        return False
+
+    from numba.cuda import dispatcher
+    from numba.cuda.cudadrv import devices
+
+    base = dispatcher._Kernel
+
+    def build(target, argtypes):
+        kernel = base(target.py_func, argtypes, **target.targetoptions)
+        # Generate the cubin, but leave loading it to the dispatcher
+        kernel._codelibrary.get_cubin(cc=target.cc)
+        return kernel, target
+
+    speculator = Speculator(Predictor(load_model(path)), build,
+                            cpu_budget=_budget_from_env())
+
+    def speculate(py_func, argtypes, targetoptions):
+        # The model knows functions by name, but results are only used for
+        # the same function object with the same options
+        function = f'{py_func.__module__}.{py_func.__qualname__}'
+        cc = devices.get_context().device.compute_capability
+        try:
+            target = _Target(py_func, targetoptions, cc)
+        except TypeError:
+            speculator.predictor.observe(function, tuple(argtypes))
+            return None
+        result = speculator.observe(function, tuple(argtypes), target)
+        if result is None:
+            return None
+        kernel, built = result
+        if kernel.py_func is not py_func or built != target:
+            logger.debug('Discarding speculative kernel of %s built for '
+                         'another target', function)
+            return None
+        return kernel
+
+    class SpeculativeKernel(base):
+        # A kernel compiled speculatively is an instance of the base class,
+        # so returning it from __new__ skips __init__ and compilation.
+        def __new__(cls, py_func=None, argtypes=None, **targetoptions):
+            if py_func is not None and not _speculating.get():
+                kernel = speculate(py_func, argtypes, targetoptions)
+                if kernel is not None:
+                    return kernel
+            if base.__new__ is object.__new__:
+                return object.__new__(cls)
+            return super().__new__(cls, py_func, argtypes, **targetoptions)
+
+    dispatcher._Kernel = SpeculativeKernel
+    atexit.register(save_model, path, speculator.predictor)
+    _speculator = speculator
+    _installed = True
+    logger.debug('Installed speculative compilation with model %s', path)
+    return True
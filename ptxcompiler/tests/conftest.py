@@ -0,0 +1,44 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import types
+
+FAKE_NUMBA_VERSION = '0.54.1'
+FAKE_CC = (7, 5)
+
+
+@pytest.fixture
+def fake_numba(monkeypatch, fake_kernel):
+    """Install the parts of Numba's CUDA target that are patched by
+    ptxcompiler, with ``fake_kernel`` (a fixture each test module defines)
+    as ``numba.cuda.dispatcher._Kernel``. Returns the dispatcher module."""
+    modules = {}
+    for name in ('numba', 'numba.cuda', 'numba.cuda.dispatcher',
+                 'numba.cuda.cudadrv', 'numba.cuda.cudadrv.devices'):
+        modules[name] = types.ModuleType(name)
+        monkeypatch.setitem(sys.modules, name, modules[name])
+    modules['numba'].__version__ = FAKE_NUMBA_VERSION
+    modules['numba'].cuda = modules['numba.cuda']
+    modules['numba.cuda'].dispatcher = modules['numba.cuda.dispatcher']
+    modules['numba.cuda'].cudadrv = modules['numba.cuda.cudadrv']
+    modules['numba.cuda.cudadrv'].devices = \
+        modules['numba.cuda.cudadrv.devices']
+
+    device = types.SimpleNamespace(compute_capability=FAKE_CC)
+    context = types.SimpleNamespace(device=device)
+    modules['numba.cuda.cudadrv.devices'].get_context = lambda: context
+    modules['numba.cuda.dispatcher']._Kernel = fake_kernel
+    return modules['numba.cuda.dispatcher']
@@ -0,0 +1,73 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import io
+import json
+import pytest
+import sys
+
+from ptxcompiler import accounting
+from ptxcompiler.api import compile_ptx, submit_compile_ptx
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+@pytest.fixture(autouse=True)
+def reset_cpu_times():
+    accounting.reset()
+    yield
+    accounting.reset()
+
+
+def test_label_argument():
+    compile_ptx(PTX_CODE, OPTIONS, label='team-a')
+    times = accounting.cpu_times()
+    assert times['team-a']['compiles'] == 1
+    assert times['team-a']['cpu_seconds'] >= 0
+
+
+def test_default_label():
+    compile_ptx(PTX_CODE, OPTIONS)
+    assert accounting.cpu_times()['default']['compiles'] == 1
+
+
+def test_context_label():
+    with accounting.charge_to('team-b'):
+        compile_ptx(PTX_CODE, OPTIONS)
+        # The label is carried into jobs submitted to the pool
+        submit_compile_ptx(PTX_CODE, OPTIONS).result()
+        compile_ptx(PTX_CODE, OPTIONS, label='team-c')
+    assert accounting.cpu_times()['team-b']['compiles'] == 2
+    assert accounting.cpu_times()['team-c']['compiles'] == 1
+
+
+def test_failed_compiles_are_charged():
+    with pytest.raises(RuntimeError):
+        compile_ptx(PTX_CODE, ('--gpu-name=sm_75', '--bad-option'),
+                    label='failing')
+    assert accounting.cpu_times()['failing']['compiles'] == 1
+
+
+def test_exports():
+    compile_ptx(PTX_CODE, OPTIONS, label='team "a"')
+
+    f = io.StringIO()
+    accounting.export_json(f)
+    assert json.loads(f.getvalue())['team "a"']['compiles'] == 1
+
+    text = accounting.export_prometheus()
+    assert 'ptxcompiler_compiles_total{label="team \\"a\\""} 1' in text
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
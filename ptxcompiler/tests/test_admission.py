@@ -0,0 +1,221 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import hashlib
+import pytest
+import sys
+
+from ptxcompiler.admission import (MAX_COUNT, AdmissionFilter,
+                                   FrequencySketch)
+from ptxcompiler.cache import (DISK_MIN_FREQUENCY, EVICT_TARGET,
+                               CacheManager, DiskCache, MemoryCache,
+                               cache_from_env, encode_entry)
+from ptxcompiler.keys import make_key
+from ptxcompiler.tests.test_lib import PTX_CODE
+
+PROGRAM = b'\x7fELF' + bytes(96)
+
+
+def digest(i):
+    return hashlib.sha256(str(i).encode()).digest()
+
+
+def key(i):
+    return make_key(PTX_CODE, (f'--gpu-name=sm_{50 + i}',))
+
+
+def test_sketch_estimates():
+    sketch = FrequencySketch(width=1024)
+    for i in range(100):
+        for _ in range(i % 5):
+            sketch.increment(digest(i))
+    # Count-min sketches never underestimate, and rarely overestimate with
+    # so few keys
+    assert all(sketch.estimate(digest(i)) >= i % 5 for i in range(100))
+    assert sum(sketch.estimate(digest(i)) == i % 5
+               for i in range(100)) > 90
+
+
+def test_sketch_saturates_and_ages():
+    sketch = FrequencySketch(width=16)
+    for _ in range(100):
+        sketch.increment(digest(0))
+    assert sketch.estimate(digest(0)) == MAX_COUNT
+
+    # Enough other increments to trigger a halving
+    for i in range(1, sketch.sample_size):
+        sketch.increment(digest(i))
+    assert sketch.estimate(digest(0)) < MAX_COUNT
+
+
+def test_sketch_persists(tmp_path):
+    path = str(tmp_path / 'sketch')
+    sketch = FrequencySketch(width=64, path=path)
+    sketch.increment(digest(0))
+    sketch.increment(digest(0))
+    sketch.close()
+
+    sketch = FrequencySketch(width=64, path=path)
+    assert sketch.estimate(digest(0)) == 2
+    sketch.close()
+
+    # A sketch of a different width replaces the file, without disturbing
+    # one that still maps the old file
+    old = FrequencySketch(width=64, path=path)
+    sketch = FrequencySketch(width=128, path=path)
+    assert sketch.estimate(digest(0)) == 0
+    old.increment(digest(0))
+    assert old.estimate(digest(0)) == 3
+    sketch.close()
+    old.close()
+
+
+def test_filter_compares_with_victim():
+    admission = AdmissionFilter(FrequencySketch(width=64))
+    admission.record(digest(0))
+    admission.record(digest(0))
+    admission.record(digest(1))
+    assert admission.admit(digest(0), digest(1))
+    assert not admission.admit(digest(1), digest(0))
+    assert not admission.admit(digest(2), digest(1))
+    assert admission.stats() == {'admitted': 1, 'rejected': 2,
+                                 'admission_rate': pytest.approx(1 / 3)}
+
+
+def test_memory_cache_keeps_hot_entries():
+    admission = AdmissionFilter(FrequencySketch(width=1024))
+    cache = MemoryCache(capacity=len(PROGRAM) * 4, admission=admission)
+    hot = [key(i) for i in range(4)]
+    for _ in range(3):
+        for k in hot:
+            if cache.get(k) is None:
+                cache.put(k, PROGRAM)
+
+    # A stream of one-off kernels does not evict the hot ones
+    for i in range(4, 20):
+        assert cache.get(key(i)) is None
+        cache.put(key(i), PROGRAM)
+    assert all(cache.get(k) is not None for k in hot)
+    stats = cache.stats()
+    assert stats['rejected'] == 16
+    assert stats['admitted'] == 0
+
+
+def test_memory_cache_admits_new_hot_entry():
+    admission = AdmissionFilter(FrequencySketch(width=1024))
+    cache = MemoryCache(capacity=len(PROGRAM), admission=admission)
+    cache.get(key(0))
+    cache.put(key(0), PROGRAM)
+    for _ in range(3):
+        cache.get(key(1))
+    cache.put(key(1), PROGRAM)
+    assert cache.get(key(1)) is not None
+    assert cache.get(key(0)) is None
+
+
+def test_write_back_demotes_rejected_entries(tmp_path):
+    admission = AdmissionFilter(FrequencySketch(width=1024))
+    memory = MemoryCache(capacity=len(PROGRAM), admission=admission)
+    disk = DiskCache(str(tmp_path))
+    manager = CacheManager([memory, disk], write_back=True)
+    for _ in range(2):
+        manager.get(key(0))
+    manager.put(key(0), PROGRAM)
+    manager.get(key(1))
+    manager.put(key(1), PROGRAM)
+    assert memory.get(key(1)) is None
+    assert disk.get(key(1)) == (PROGRAM, '')
+
+
+def test_write_back_does_not_demote_promoted_entries(tmp_path):
+    admission = AdmissionFilter(FrequencySketch(width=1024))
+    memory = MemoryCache(capacity=len(PROGRAM), admission=admission)
+    disk = DiskCache(str(tmp_path))
+    manager = CacheManager([memory, disk], write_back=True)
+    disk.put(key(0), PROGRAM)
+    disk.put(key(1), PROGRAM)
+    demoted = []
+    memory.on_evict = lambda *item: demoted.append(item)
+
+    # key(1) is rejected from the full memory tier, but the disk already
+    # holds it
+    for _ in range(2):
+        assert manager.get(key(0)) == (PROGRAM, '')
+    assert manager.get(key(1)) == (PROGRAM, '')
+    assert memory.get(key(1)) is None
+    assert demoted == []
+
+    # Nor is key(0) written back when a new result evicts it
+    for _ in range(3):
+        manager.get(key(2))
+    manager.put(key(2), PROGRAM)
+    assert memory.get(key(2)) == (PROGRAM, '')
+    assert demoted == []
+
+
+def test_disk_cache_admits_repeated_keys(tmp_path):
+    cache = DiskCache(str(tmp_path), admission=True)
+    assert cache.get(key(0)) is None
+    cache.put(key(0), PROGRAM)
+    assert cache.get(key(0)) is None
+
+    cache.put(key(0), PROGRAM)
+    assert cache.get(key(0)) == (PROGRAM, '')
+    assert cache.stats()['admitted'] == 1
+    assert cache.stats()['rejected'] == 1
+
+    # Lookup counts persist across processes
+    other = DiskCache(str(tmp_path), admission=True)
+    for _ in range(DISK_MIN_FREQUENCY):
+        other.get_many([key(1)])
+    other.put_many([(key(1), PROGRAM, '')])
+    assert cache.get(key(1)) == (PROGRAM, '')
+    # The sketch is not mistaken for an entry
+    assert len(list(cache.digests())) == 2
+
+
+def test_disk_cache_admits_against_victim(tmp_path):
+    size = len(encode_entry(key(0), PROGRAM))
+    cache = DiskCache(str(tmp_path), admission=True,
+                      max_size=int(2 * size / EVICT_TARGET) + 1)
+    cache.put(key(0), PROGRAM)
+    cache.put(key(1), PROGRAM)
+    for _ in range(3):
+        cache.get_many([key(0), key(1)])
+
+    # A key never looked up does not displace frequently used ones
+    cache.put(key(2), PROGRAM)
+    assert cache.get_many([key(0), key(1), key(2)]) == \
+        [(PROGRAM, '')] * 2 + [None]
+    assert cache.stats()['rejected'] == 1
+
+    for _ in range(10):
+        cache.get(key(3))
+    cache.put(key(3), PROGRAM)
+    assert cache.get(key(3)) == (PROGRAM, '')
+    assert len(list(cache.digests())) == 2
+    assert cache.stats()['admitted'] == 1
+
+
+def test_admission_from_env(tmp_path, monkeypatch):
+    monkeypatch.setenv('PTXCOMPILER_CACHE_TIERS', 'memory,disk')
+    monkeypatch.setenv('PTXCOMPILER_CACHE_DIR', str(tmp_path))
+    monkeypatch.setenv('PTXCOMPILER_CACHE_ADMISSION', '1')
+    stats = cache_from_env().stats()
+    assert 'admitted' in stats['memory']
+    assert 'admitted' in stats['disk']
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
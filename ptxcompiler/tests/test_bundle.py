@@ -0,0 +1,206 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import hashlib
+import importlib
+import os
+import pytest
+import sys
+import textwrap
+
+from ptxcompiler import bundle
+from ptxcompiler.keys import CompileKey, make_key
+from ptxcompiler.tests.test_lib import PTX_CODE
+
+
+def make_entries(n):
+    return [(hashlib.sha256(str(i).encode()).digest(), b'cubin %d' % i)
+            for i in range(n)]
+
+
+@pytest.mark.parametrize('n', [1, 2, 7, 1000])
+def test_build_index_is_perfect(n):
+    digests = [d for d, _ in make_entries(n)]
+    displacements, slots = bundle.build_index(digests)
+    assert sorted(slots) == list(range(n))
+
+
+def test_lookup(tmp_path):
+    entries = make_entries(100)
+    path = tmp_path / 'kernels.bundle'
+    bundle.write_bundle(path, entries)
+
+    with bundle.CubinBundle(path) as b:
+        assert len(b) == 100
+        for digest, cubin in entries:
+            view = b.lookup(digest)
+            assert isinstance(view, memoryview)
+            assert view == cubin
+        missing = hashlib.sha256(b'missing').digest()
+        assert b.lookup(missing) is None
+
+
+def test_payloads_are_page_aligned(tmp_path):
+    path = tmp_path / 'kernels.bundle'
+    bundle.write_bundle(path, make_entries(10))
+    with bundle.CubinBundle(path) as b:
+        for digest in b.digests():
+            view = b.lookup(digest)
+            offset = view.obj.find(bytes(view))
+            assert offset % bundle.PAGE_SIZE == 0
+
+
+def test_empty_bundle(tmp_path):
+    path = tmp_path / 'empty.bundle'
+    bundle.write_bundle(path, [])
+    with bundle.CubinBundle(path) as b:
+        assert len(b) == 0
+        assert b.lookup(hashlib.sha256(b'').digest()) is None
+
+
+def test_not_a_bundle(tmp_path):
+    path = tmp_path / 'bad.bundle'
+    path.write_bytes(b'\0' * bundle.PAGE_SIZE)
+    with pytest.raises(ValueError, match='not a cubin bundle'):
+        bundle.CubinBundle(path)
+
+
+def test_build_from_results(tmp_path):
+    results = tmp_path / 'results'
+    results.mkdir()
+    key = make_key(PTX_CODE, ('--gpu-name=sm_75',))
+    bundle.save_result(results, key, b'\x7fELF')
+
+    path = tmp_path / 'kernels.bundle'
+    assert bundle.main(['build', str(results), str(path)]) == 0
+    with bundle.CubinBundle(path) as b:
+        assert b.lookup(key) == b'\x7fELF'
+        other = CompileKey(key.ptx_hash, key.options, 'sm_80',
+                           key.compiler_version)
+        assert b.lookup(other) is None
+
+
+def test_key_ignores_comments_and_whitespace():
+    commented = PTX_CODE.replace('\n', '  // comment\n\n')
+    options = ('--gpu-name=sm_75',)
+    assert make_key(commented, options) == make_key(PTX_CODE, options)
+
+
+def test_key_arch():
+    key = make_key(PTX_CODE, ('--gpu-name', 'sm_80', '-O3'))
+    assert key.arch == 'sm_80'
+    assert key.options == ('-O3',)
+
+
+def install_plugin(tmp_path, monkeypatch, name, value, module_source):
+    """Install a package registering cubin bundles through an entry point,
+    by putting its distribution metadata on sys.path."""
+    site = tmp_path / 'site'
+    dist_info = site / f'{name}-1.0.dist-info'
+    dist_info.mkdir(parents=True)
+    (dist_info / 'METADATA').write_text(
+        f'Metadata-Version: 2.1\nName: {name}\nVersion: 1.0\n')
+    (dist_info / 'entry_points.txt').write_text(
+        f'[ptxcompiler.cubin_bundles]\n{name} = {value}\n')
+    (site / f'{name}.py').write_text(textwrap.dedent(module_source))
+    monkeypatch.syspath_prepend(str(site))
+    importlib.invalidate_caches()
+
+
+@pytest.fixture
+def reset_bundles(monkeypatch):
+    monkeypatch.setattr(bundle, '_bundles', None)
+    monkeypatch.setattr(bundle, '_index', None)
+    monkeypatch.delenv(bundle.BUNDLES_ENV, raising=False)
+
+
+def test_plugin_bundles(tmp_path, monkeypatch, reset_bundles):
+    key = make_key(PTX_CODE, ['--gpu-name=sm_75'], version=(11, 6))
+    other = make_key(PTX_CODE, ['--gpu-name=sm_80'], version=(11, 6))
+    env_path = tmp_path / 'env.bundle'
+    bundle.write_bundle(env_path, [(key.digest(), b'from env')])
+    plugin_path = tmp_path / 'plugin.bundle'
+    bundle.write_bundle(plugin_path, [(key.digest(), b'from plugin'),
+                                      (other.digest(), b'plugin only')])
+
+    install_plugin(tmp_path, monkeypatch, 'kernelpkg',
+                   'kernelpkg:cubin_bundles', f"""
+                   def cubin_bundles():
+                       return [{str(plugin_path)!r}]
+                   """)
+    monkeypatch.setenv(bundle.BUNDLES_ENV, str(env_path))
+
+    assert [b.source for b in bundle.get_bundles()] == [bundle.BUNDLES_ENV,
+                                                        'kernelpkg']
+    # Bundles in the environment take precedence
+    assert bundle.lookup(key) == b'from env'
+    assert bundle.lookup(other) == b'plugin only'
+    missing = make_key(PTX_CODE, ['--gpu-name=sm_90'], version=(11, 6))
+    assert bundle.lookup(missing) is None
+
+
+def test_plugins_disabled(tmp_path, monkeypatch, reset_bundles):
+    install_plugin(tmp_path, monkeypatch, 'kernelpkg', 'kernelpkg:PATH',
+                   f"PATH = {str(tmp_path / 'plugin.bundle')!r}\n")
+    monkeypatch.setenv(bundle.PLUGINS_ENV, '0')
+    assert bundle.get_bundles() == []
+
+
+def test_broken_plugin_is_skipped(tmp_path, monkeypatch, reset_bundles,
+                                  caplog):
+    install_plugin(tmp_path, monkeypatch, 'brokenpkg', 'brokenpkg:PATHS',
+                   f"PATHS = [{str(tmp_path / 'missing.bundle')!r}]\n")
+    install_plugin(tmp_path, monkeypatch, 'brokenpkg2', 'brokenpkg2:missing',
+                   '')
+    assert bundle.get_bundles() == []
+    assert bundle.lookup(make_key(PTX_CODE, [], version=(11, 6))) is None
+    assert 'missing.bundle' in caplog.text
+    assert 'brokenpkg2' in caplog.text
+
+
+def test_missing_env_bundle_is_skipped(tmp_path, monkeypatch, reset_bundles,
+                                      caplog):
+    key = make_key(PTX_CODE, ['--gpu-name=sm_75'], version=(11, 6))
+    path = tmp_path / 'env.bundle'
+    bundle.write_bundle(path, [(key.digest(), b'from env')])
+    monkeypatch.setenv(bundle.BUNDLES_ENV, os.pathsep.join(
+        [str(tmp_path / 'missing.bundle'), str(path)]))
+    monkeypatch.setenv(bundle.PLUGINS_ENV, '0')
+    assert bundle.lookup(key) == b'from env'
+    assert 'missing.bundle' in caplog.text
+
+
+def test_plugin_discovery_failure(monkeypatch, reset_bundles, caplog):
+    def fail():
+        raise RuntimeError('bad metadata')
+
+    monkeypatch.setattr(bundle.importlib.metadata, 'entry_points', fail)
+    assert bundle.get_bundles() == []
+    assert 'bad metadata' in caplog.text
+
+
+def test_entry_points_before_select(tmp_path, monkeypatch, reset_bundles):
+    # Before Python 3.10, entry_points() returns a dict of groups
+    path = tmp_path / 'plugin.bundle'
+    bundle.write_bundle(path, [])
+    ep = importlib.metadata.EntryPoint('oldpkg', 'oldpkg:PATH',
+                                       bundle.PLUGIN_GROUP)
+    monkeypatch.setattr(ep.__class__, 'load', lambda self: str(path))
+    monkeypatch.setattr(bundle.importlib.metadata, 'entry_points',
+                        lambda: {bundle.PLUGIN_GROUP: [ep]})
+    assert [b.source for b in bundle.get_bundles()] == ['oldpkg']
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,358 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import hashlib
+import http.server
+import os
+import pytest
+import sys
+import threading
+
+from ptxcompiler import cache as ptx_cache
+from ptxcompiler.api import compile_ptx
+from ptxcompiler.bloom import BloomFilter
+from ptxcompiler.cache import (CacheManager, DiskCache, MemoryCache,
+                               RemoteCache, cache_from_env, encode_entry)
+from ptxcompiler.keys import make_key
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+def digest(i):
+    return hashlib.sha256(str(i).encode()).digest()
+
+
+def test_bloom_filter(tmp_path):
+    path = tmp_path / 'filter.bloom'
+    f = BloomFilter(path, capacity=1000, error_rate=0.01)
+    assert f.created
+    for i in range(1000):
+        f.add(digest(i))
+    assert all(digest(i) in f for i in range(1000))
+
+    false_positives = sum(digest(i) in f for i in range(1000, 11000))
+    assert false_positives < 300
+    f.close()
+
+    # Contents persist when the filter is reopened
+    f = BloomFilter(path)
+    assert not f.created
+    assert all(digest(i) in f for i in range(1000))
+    f.close()
+
+
+def test_bloom_filter_replaces_invalid_file(tmp_path):
+    path = tmp_path / 'filter.bloom'
+    path.write_bytes(b'garbage')
+    f = BloomFilter(path, capacity=10)
+    assert f.created
+    assert digest(0) not in f
+
+    # A replacement file is renamed into place, so a filter that still maps
+    # the old one keeps working
+    with open(path, 'r+b') as old:
+        old.write(b'garbage')
+    replacement = BloomFilter(path, capacity=1000)
+    assert replacement.created
+    f.add(digest(0))
+    assert digest(0) in f
+    assert digest(0) not in replacement
+    assert os.listdir(tmp_path) == ['filter.bloom']
+    replacement.close()
+    f.close()
+
+
+def test_disk_cache(tmp_path):
+    cache = DiskCache(tmp_path)
+    key = make_key(PTX_CODE, OPTIONS)
+    assert cache.get(key) is None
+
+    cache.put(key, b'\x7fELF', 'info')
+    assert cache.get(key) == (b'\x7fELF', 'info')
+
+    stats = cache.stats()
+    assert stats['hits'] == 1
+    assert stats['misses'] == 1
+    assert stats['filter_negatives'] == 1
+
+
+def test_disk_cache_rebuilds_filter(tmp_path):
+    key = make_key(PTX_CODE, OPTIONS)
+    DiskCache(tmp_path).put(key, b'\x7fELF')
+    (tmp_path / 'filter.bloom').unlink()
+
+    assert DiskCache(tmp_path).get(key) == (b'\x7fELF', '')
+
+
+def test_disk_cache_false_positive(tmp_path):
+    cache = DiskCache(tmp_path)
+    key = make_key(PTX_CODE, OPTIONS)
+    cache._filter.add(key.digest())
+
+    assert cache.get(key) is None
+    stats = cache.stats()
+    assert stats['filter_false_positives'] == 1
+    assert stats['filter_false_positive_rate'] == 1.0
+
+
+def test_compile_ptx_uses_cache(tmp_path, monkeypatch):
+    cache = DiskCache(tmp_path)
+    monkeypatch.setattr(ptx_cache, '_cache', CacheManager([cache]))
+
+    first = compile_ptx(PTX_CODE, OPTIONS)
+    assert cache.stats()['hits'] == 0
+    second = compile_ptx(PTX_CODE, OPTIONS)
+    assert cache.stats()['hits'] == 1
+    assert first == second
+
+
+def test_disk_cache_errors_are_misses(tmp_path, monkeypatch, caplog):
+    cache = DiskCache(tmp_path)
+    monkeypatch.setattr(ptx_cache, '_cache', CacheManager([cache]))
+    key = make_key(PTX_CODE, OPTIONS)
+    # A file where the entry's directory should be fails every store
+    (tmp_path / key.hexdigest()[:2]).write_bytes(b'')
+
+    result = compile_ptx(PTX_CODE, OPTIONS)
+    assert result.compiled_program[:4] == b'\x7fELF'
+    cache.put_many([(key, b'program', '')])
+    assert cache.stats()['errors'] == 2
+    assert 'Disk cache store failed' in caplog.text
+
+    # A directory in place of an entry fails lookups
+    other = make_key(PTX_CODE, OPTIONS, version=(11, 0))
+    os.makedirs(cache.entry_path(other.digest()))
+    cache._filter.add(other.digest())
+    assert cache.get(other) is None
+    assert cache.get_many([other]) == [None]
+    assert cache.stats()['errors'] == 4
+    assert 'Disk cache lookup failed' in caplog.text
+
+
+def test_disk_cache_unusable_directory(tmp_path, caplog):
+    (tmp_path / 'file').write_bytes(b'')
+    cache = DiskCache(tmp_path / 'file' / 'cache')
+    assert not cache.enabled
+    key = make_key(PTX_CODE, OPTIONS)
+    cache.put(key, b'program')
+    assert cache.get(key) is None
+    assert cache.get_many([key]) == [None]
+    assert cache.stats()['errors'] == 1
+    assert 'Disk cache setup failed' in caplog.text
+
+
+def test_memory_cache_evicts_least_recently_used():
+    cache = MemoryCache(capacity=10)
+    keys = [make_key(PTX_CODE, OPTIONS, version=(11, i)) for i in range(3)]
+    evicted = []
+    cache.on_evict = lambda key, *entry: evicted.append(key)
+
+    cache.put(keys[0], b'1234')
+    cache.put(keys[1], b'1234')
+    cache.get(keys[0])
+    cache.put(keys[2], b'1234')
+
+    assert evicted == [keys[1]]
+    assert cache.get(keys[1]) is None
+    assert cache.get(keys[0]) == (b'1234', '')
+
+
+def test_manager_promotes(tmp_path):
+    memory = MemoryCache()
+    disk = DiskCache(tmp_path)
+    manager = CacheManager([memory, disk])
+    key = make_key(PTX_CODE, OPTIONS)
+
+    disk.put(key, b'\x7fELF')
+    assert manager.get(key) == (b'\x7fELF', '')
+    stats = manager.stats()
+    assert stats['memory']['hits'] == 0
+    assert stats['disk']['hits'] == 1
+    assert stats['disk']['hit_rate'] == 1.0
+
+    assert manager.get(key) == (b'\x7fELF', '')
+    assert manager.stats()['memory']['hits'] == 1
+
+
+def test_manager_write_back(tmp_path):
+    memory = MemoryCache(capacity=4)
+    disk = DiskCache(tmp_path)
+    manager = CacheManager([memory, disk], write_back=True)
+    first = make_key(PTX_CODE, OPTIONS, version=(11, 1))
+    second = make_key(PTX_CODE, OPTIONS, version=(11, 2))
+
+    manager.put(first, b'1234')
+    assert disk.get(first) is None
+    manager.put(second, b'1234')
+    assert disk.get(first) == (b'1234', '')
+
+
+def test_manager_write_back_flush(tmp_path):
+    memory = MemoryCache()
+    disk = DiskCache(tmp_path)
+    manager = CacheManager([memory, disk], write_back=True)
+    new = make_key(PTX_CODE, OPTIONS, version=(11, 1))
+    promoted = make_key(PTX_CODE, OPTIONS, version=(11, 2))
+    disk.put(promoted, b'1234')
+    manager.get(promoted)
+    manager.put(new, b'5678')
+
+    writes = []
+    disk.put_many = writes.extend
+    manager.flush()
+    assert writes == [(new, b'5678', '')]
+    # Flushed entries are not written again
+    manager.flush()
+    assert len(writes) == 1
+
+
+def entry_files(directory):
+    return sorted(p.name for p in directory.glob('??/*'))
+
+
+def test_disk_cache_size_limit(tmp_path):
+    keys = [make_key(PTX_CODE, OPTIONS, version=(11, i)) for i in range(4)]
+    entry_size = len(encode_entry(keys[0], b'\x7fELF' * 10))
+    # Room for two entries
+    cache = DiskCache(tmp_path, max_size=int(entry_size * 2.5))
+
+    cache.put(keys[0], b'\x7fELF' * 10)
+    cache.put(keys[1], b'\x7fELF' * 10)
+    os.utime(cache.entry_path(keys[0].digest()), (0, 0))
+    os.utime(cache.entry_path(keys[1].digest()), (1, 1))
+    # A hit makes keys[0] the most recently used
+    assert cache.get(keys[0]) is not None
+    cache.put(keys[2], b'\x7fELF' * 10)
+    assert cache.get(keys[1]) is None
+    assert cache.get(keys[0]) is not None
+    assert cache.get(keys[2]) is not None
+    assert cache.stats()['evictions'] == 1
+    assert len(entry_files(tmp_path)) == 2
+
+
+def test_disk_cache_eviction_demotes(tmp_path):
+    keys = [make_key(PTX_CODE, OPTIONS, version=(11, i)) for i in range(3)]
+    shm = DiskCache(tmp_path / 'shm', use_filter=False, name='shm',
+                    max_size=1)
+    disk = DiskCache(tmp_path / 'disk')
+    manager = CacheManager([shm, disk], write_back=True)
+    disk.put(keys[0], b'1234')
+    manager.get(keys[0])
+    demoted = []
+    shm.on_evict = lambda key, *entry: demoted.append(key)
+
+    # Only the new result is written to the disk tier; the entry promoted
+    # from it is just removed
+    manager.put(keys[1], b'5678')
+    assert sorted(demoted) == [keys[1]]
+    assert entry_files(tmp_path / 'shm') == []
+
+
+def test_cache_from_env_flushes_at_exit(tmp_path, monkeypatch):
+    registered = []
+    monkeypatch.setattr(ptx_cache.atexit, 'register', registered.append)
+    monkeypatch.setenv('PTXCOMPILER_CACHE_TIERS', 'memory,disk')
+    monkeypatch.setenv('PTXCOMPILER_CACHE_DIR', str(tmp_path))
+    monkeypatch.setenv('PTXCOMPILER_CACHE_WRITE_POLICY', 'back')
+    monkeypatch.setenv('PTXCOMPILER_CACHE_DISK_SIZE', '1000')
+    manager = cache_from_env()
+    assert registered == [manager.flush]
+    assert manager.tiers[1].max_size == 1000
+
+
+def test_shm_directory_must_be_private(tmp_path, monkeypatch, caplog):
+    monkeypatch.setenv('PTXCOMPILER_CACHE_TIERS', 'memory,shm')
+    shm = tmp_path / 'shm'
+    monkeypatch.setenv('PTXCOMPILER_CACHE_SHM_DIR', str(shm))
+    assert [t.name for t in cache_from_env().tiers] == ['memory', 'shm']
+    assert shm.stat().st_mode & 0o777 == 0o700
+
+    shm.chmod(0o777)
+    assert [t.name for t in cache_from_env().tiers] == ['memory']
+    assert 'Not using cache directory' in caplog.text
+
+    shm.rmdir()
+    os.symlink(tmp_path, shm)
+    assert [t.name for t in cache_from_env().tiers] == ['memory']
+
+
+class CacheRequestHandler(http.server.BaseHTTPRequestHandler):
+    entries = {}
+
+    def do_GET(self):
+        data = self.entries.get(self.path)
+        if data is None:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_PUT(self):
+        length = int(self.headers['Content-Length'])
+        self.entries[self.path] = self.rfile.read(length)
+        self.send_response(201)
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+@pytest.fixture
+def cache_server():
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0),
+                                             CacheRequestHandler)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    yield f'http://127.0.0.1:{server.server_address[1]}/cache'
+    server.shutdown()
+    CacheRequestHandler.entries.clear()
+
+
+def test_remote_cache(cache_server):
+    remote = RemoteCache(cache_server)
+    key = make_key(PTX_CODE, OPTIONS)
+    assert remote.get(key) is None
+
+    remote.put(key, b'\x7fELF', 'info')
+    assert remote.get(key) == (b'\x7fELF', 'info')
+    assert remote.stats() == {'hits': 1, 'misses': 1, 'errors': 0}
+
+
+def test_remote_cache_unreachable():
+    remote = RemoteCache('http://127.0.0.1:1', timeout=0.1)
+    assert remote.get(make_key(PTX_CODE, OPTIONS)) is None
+    assert remote.stats()['errors'] == 1
+
+
+def test_cache_from_env(tmp_path, monkeypatch):
+    monkeypatch.delenv('PTXCOMPILER_CACHE_TIERS', raising=False)
+    monkeypatch.delenv('PTXCOMPILER_CACHE_DIR', raising=False)
+    assert cache_from_env() is None
+
+    monkeypatch.setenv('PTXCOMPILER_CACHE_DIR', str(tmp_path / 'disk'))
+    assert [t.name for t in cache_from_env().tiers] == ['disk']
+
+    monkeypatch.setenv('PTXCOMPILER_CACHE_TIERS', 'memory,shm,disk')
+    monkeypatch.setenv('PTXCOMPILER_CACHE_SHM_DIR', str(tmp_path / 'shm'))
+    manager = cache_from_env()
+    assert [t.name for t in manager.tiers] == ['memory', 'shm', 'disk']
+
+    monkeypatch.setenv('PTXCOMPILER_CACHE_TIERS', 'tape')
+    with pytest.raises(ValueError, match='Unknown cache tier'):
+        cache_from_env()
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,180 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import errno
+import os
+import pytest
+import sys
+import threading
+
+from ptxcompiler import cache as ptx_cache
+from ptxcompiler import cacheio
+from ptxcompiler.api import compile_ptxes
+from ptxcompiler.cache import CacheManager, DiskCache, MemoryCache
+from ptxcompiler.cacheio import ThreadPoolIO, UringIO
+from ptxcompiler.keys import make_key
+from ptxcompiler.tests.test_lib import OPTIONS, PTX_CODE
+
+uring = pytest.param(UringIO, marks=pytest.mark.skipif(
+    not UringIO.available(), reason='io_uring is not available'))
+
+
+@pytest.fixture(params=[uring, ThreadPoolIO])
+def io(request):
+    io = request.param()
+    yield io
+    if hasattr(io, 'shutdown'):
+        io.shutdown()
+
+
+def test_read_write(io, tmp_path):
+    # More files than fit in one batch of the ring
+    paths = [str(tmp_path / f'file{i}') for i in range(100)]
+    data = [os.urandom(i * 100) for i in range(100)]
+    assert io.write_files(list(zip(paths, data))) == [None] * 100
+    assert io.read_files(paths) == data
+    assert not [p for p in os.listdir(tmp_path) if p.startswith('.')]
+
+
+def test_overwrite(io, tmp_path):
+    path = str(tmp_path / 'file')
+    io.write_files([(path, b'old contents')])
+    io.write_files([(path, memoryview(b'new'))])
+    assert io.read_files([path]) == [b'new']
+
+
+def test_missing_files(io, tmp_path):
+    assert io.read_files([str(tmp_path / 'missing'),
+                          str(tmp_path / 'missing' / 'file')]) == \
+        [None, None]
+
+
+def test_errors(io, tmp_path):
+    with pytest.raises(IsADirectoryError):
+        io.read_files([str(tmp_path)])
+
+    path = str(tmp_path / 'file')
+    errors = io.write_files([(str(tmp_path / 'missing' / 'file'), b'a'),
+                             (path, b'b')])
+    assert isinstance(errors[0], FileNotFoundError)
+    assert errors[1] is None
+    assert io.read_files([path]) == [b'b']
+
+
+def test_thread_without_ring(monkeypatch, tmp_path):
+    # A thread that cannot set up a ring uses blocking I/O instead
+    monkeypatch.setattr(cacheio._ptxcompilerlib, 'uring_thread_ready',
+                        lambda: False)
+    io = UringIO()
+    path = str(tmp_path / 'file')
+    results = []
+
+    def run():
+        results.append(io.write_files([(path, b'data')]))
+        results.append(io.read_files([path]))
+
+    thread = threading.Thread(target=run)
+    thread.start()
+    thread.join()
+    io.shutdown()
+    assert results == [[None], [b'data']]
+    assert io._fallback is not None
+
+
+def test_failed_batch_falls_back(monkeypatch, tmp_path):
+    def fail(*args):
+        raise OSError(errno.EAGAIN, 'Resource temporarily unavailable')
+
+    monkeypatch.setattr(cacheio._ptxcompilerlib, 'uring_thread_ready',
+                        lambda: True)
+    monkeypatch.setattr(cacheio._ptxcompilerlib, 'read_files', fail)
+    monkeypatch.setattr(cacheio._ptxcompilerlib, 'write_files', fail)
+    io = UringIO()
+    path = str(tmp_path / 'file')
+    assert io.write_files([(path, b'data')]) == [None]
+    assert io.read_files([path, str(tmp_path / 'missing')]) == \
+        [b'data', None]
+    io.shutdown()
+
+
+def test_environment(monkeypatch):
+    monkeypatch.setenv(cacheio.IO_ENV, 'threads')
+    assert cacheio.io_from_env().name == 'threads'
+    monkeypatch.setenv(cacheio.IO_ENV, 'auto')
+    expected = 'io_uring' if UringIO.available() else 'threads'
+    assert cacheio.io_from_env().name == expected
+    monkeypatch.setenv(cacheio.IO_ENV, 'bogus')
+    with pytest.raises(ValueError):
+        cacheio.io_from_env()
+
+
+def keys(n):
+    return [make_key(PTX_CODE, OPTIONS, version=(11, i)) for i in range(n)]
+
+
+def test_disk_cache_many(io, tmp_path):
+    cache = DiskCache(str(tmp_path), io=io)
+    cache.put_many([(key, b'program %d' % i, 'log')
+                    for i, key in enumerate(keys(50))])
+    assert cache.get(keys(50)[7]) == (b'program 7', 'log')
+
+    results = cache.get_many(keys(60))
+    assert results[:50] == [(b'program %d' % i, 'log') for i in range(50)]
+    assert results[50:] == [None] * 10
+    stats = cache.stats()
+    assert (stats['hits'], stats['misses']) == (51, 10)
+    # The keys that were never stored are rejected by the filter
+    assert stats['filter_false_positives'] == 0
+
+
+def test_disk_cache_many_without_filter(io, tmp_path):
+    cache = DiskCache(str(tmp_path), use_filter=False, io=io)
+    cache.put_many([(key, b'program', '') for key in keys(2)])
+    assert cache.get_many(keys(3)) == [(b'program', '')] * 2 + [None]
+
+
+def test_manager_get_many(tmp_path):
+    memory = MemoryCache()
+    disk = DiskCache(str(tmp_path))
+    manager = CacheManager([memory, disk])
+    memory.put(keys(3)[0], b'memory')
+    disk.put_many([(key, b'disk', '') for key in keys(3)[1:]])
+
+    assert manager.get_many(keys(4)) == [(b'memory', ''), (b'disk', ''),
+                                         (b'disk', ''), None]
+    # Disk hits were promoted, and only the misses went to the disk
+    assert memory.get(keys(3)[2]) == (b'disk', '')
+    assert disk.stats()['hits'] + disk.stats()['misses'] == 3
+
+
+def test_compile_ptxes_batches_lookups(tmp_path, monkeypatch):
+    cache = DiskCache(str(tmp_path))
+    monkeypatch.setattr(ptx_cache, '_cache', CacheManager([cache]))
+    ptxes = [PTX_CODE, PTX_CODE.replace('_Z1kPf', '_Z6kernelPf')]
+    compile_ptxes(ptxes[:1], OPTIONS)
+
+    batches = []
+    get_many = cache.get_many
+    monkeypatch.setattr(cache, 'get_many',
+                        lambda keys: batches.append(keys) or get_many(keys))
+    results = compile_ptxes(ptxes, OPTIONS)
+    assert len(batches) == 1
+    assert all(r.compiled_program[:4] == b'\x7fELF' for r in results)
+    # The miss was not looked up again before compiling
+    assert cache.stats()['hits'] == 1
+    assert cache.stats()['misses'] == 2
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,115 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import io
+import pytest
+import sys
+
+from ptxcompiler import cache as ptx_cache
+from ptxcompiler import callsites, dispatch
+from ptxcompiler.api import compile_ptx, compile_ptxes, submit_compile_ptx
+from ptxcompiler.cache import CacheManager, MemoryCache
+from ptxcompiler.dispatch import InlinePolicy
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+@pytest.fixture(autouse=True)
+def tracking():
+    callsites.reset()
+    callsites.enable()
+    yield
+    callsites.disable()
+    callsites.reset()
+
+
+def only_site():
+    sites = callsites.call_sites()
+    assert len(sites) == 1
+    return next(iter(sites.items()))
+
+
+def compile_from_helper():
+    return compile_ptx(PTX_CODE, OPTIONS)
+
+
+def test_compile_ptx_is_attributed_to_caller():
+    compile_from_helper()
+    site, totals = only_site()
+    frames = site.split(';')
+    assert frames[-1].startswith(f'{__name__}.compile_from_helper:')
+    assert frames[-2].startswith(
+        f'{__name__}.test_compile_ptx_is_attributed_to_caller:')
+    assert not any(f.startswith('ptxcompiler.api') for f in frames)
+    assert totals['compiled'] == 1
+    assert totals['requests'] == 1
+    assert totals['ptx_bytes'] == len(PTX_CODE)
+    assert totals['cubin_bytes'] > 0
+    assert totals['seconds'] > 0
+
+
+def test_depth_is_limited():
+    callsites.enable(depth=1)
+    compile_from_helper()
+    site, _ = only_site()
+    assert ';' not in site
+    assert site.startswith(f'{__name__}.compile_from_helper:')
+
+
+def test_pool_compiles_are_attributed_to_submitter(monkeypatch):
+    monkeypatch.setattr(dispatch, '_policy', InlinePolicy('never'))
+    submit_compile_ptx(PTX_CODE, OPTIONS).result()
+    site, totals = only_site()
+    assert f'{__name__}.test_pool_compiles' in site
+    assert totals['compiled'] == 1
+
+
+def test_cache_outcomes(monkeypatch):
+    monkeypatch.setattr(ptx_cache, '_cache', CacheManager([MemoryCache()]))
+    for _ in range(2):
+        compile_from_helper()
+    compile_ptxes([PTX_CODE] * 3, OPTIONS)
+
+    sites = callsites.call_sites()
+    assert len(sites) == 2
+    totals = [t for site, t in sites.items()
+              if 'compile_from_helper' in site][0]
+    assert (totals['compiled'], totals['cache']) == (1, 1)
+    totals = [t for site, t in sites.items()
+              if 'compile_from_helper' not in site][0]
+    assert (totals['compiled'], totals['cache']) == (0, 3)
+
+
+def test_disabled():
+    callsites.disable()
+    compile_from_helper()
+    assert callsites.call_sites() == {}
+
+
+def test_report_and_folded_stacks():
+    for _ in range(2):
+        compile_from_helper()
+    report = callsites.report()
+    header, row = report.splitlines()
+    assert 'call site' in header
+    assert row.split()[1] == '2'
+    assert row.split()[-1].startswith(f'{__name__}.compile_from_helper:')
+
+    f = io.StringIO()
+    callsites.export_folded(f, weight='requests')
+    site, _ = only_site()
+    assert f.getvalue() == f'{site} 2\n'
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
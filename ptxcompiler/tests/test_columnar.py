@@ -0,0 +1,88 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+
+from ptxcompiler.api import compile_ptx, compile_ptxes
+from ptxcompiler.columnar import ColumnarResults
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+def test_columnar_results():
+    results = ColumnarResults()
+    results.append(b'first', 'log 1')
+    results.append(b'', '')
+    results.append(b'third', 'lög 3')
+
+    assert len(results) == 3
+    assert results.programs == b'firstthird'
+    assert list(results.program_offsets) == [0, 5, 5, 10]
+    assert list(results.program_lengths) == [5, 0, 5]
+    assert list(results.info_log_lengths) == [5, 0, 6]
+    assert results.programs.readonly
+
+    assert results[2].compiled_program == b'third'
+    assert results[2].info_log == 'lög 3'
+    assert results[-2].compiled_program == b''
+    assert [r.info_log for r in results] == ['log 1', '', 'lög 3']
+    with pytest.raises(IndexError):
+        results[3]
+
+
+def test_take():
+    results = ColumnarResults()
+    results.append(b'first', 'log 1')
+    results.append(b'', '')
+    results.append(b'third', 'lög 3')
+
+    assert results.take([0, 1, 2]) is results
+    taken = results.take([2, 0, 1])
+    assert taken.programs == b'thirdfirst'
+    assert [r.info_log for r in taken] == ['lög 3', 'log 1', '']
+    assert list(taken.program_offsets) == [0, 5, 10, 10]
+
+
+def test_compile_ptxes_columnar():
+    ptxes = [PTX_CODE, PTX_CODE + '\n// second\n']
+    results = compile_ptxes(ptxes, OPTIONS, columnar=True)
+    assert isinstance(results, ColumnarResults)
+    assert len(results) == 2
+    for ptx, result in zip(ptxes, results):
+        assert bytes(result.compiled_program) == \
+            compile_ptx(ptx, OPTIONS).compiled_program
+    assert results.programs == b''.join(
+        r.compiled_program for r in compile_ptxes(ptxes, OPTIONS))
+
+
+def test_compile_ptxes_columnar_keeps_input_order():
+    ptxes = [PTX_CODE + f'\n// {i}\n' for i in range(16)]
+    results = compile_ptxes(ptxes, OPTIONS, columnar=True)
+    assert [bytes(r.compiled_program) for r in results] == [
+        r.compiled_program for r in compile_ptxes(ptxes, OPTIONS)]
+
+
+def test_to_arrow():
+    pa = pytest.importorskip('pyarrow')
+    results = ColumnarResults()
+    results.append(b'first', 'log 1')
+    results.append(b'second', '')
+    batch = results.to_arrow()
+    assert batch.schema.field('compiled_program').type == pa.large_binary()
+    assert batch.column(0).to_pylist() == [b'first', b'second']
+    assert batch.column(1).to_pylist() == ['log 1', '']
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,133 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import pytest
+import shutil
+import subprocess
+import sys
+
+from ptxcompiler import _ptxcompilerlib, compilers
+from ptxcompiler.api import compile_ptx
+from ptxcompiler.compilers import (Compiler, compiler_stats, ptx_isa_version,
+                                   select_compiler)
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+COMPILERS = [
+    Compiler(0, None, (11, 6)),
+    Compiler(1, '/opt/cuda-11.2/libnvptxcompiler.so', (11, 2)),
+    Compiler(2, '/opt/cuda-12.1/libnvptxcompiler.so', (12, 1)),
+]
+
+
+def with_version(version):
+    return PTX_CODE.replace('.version 7.4', f'.version {version}')
+
+
+@pytest.fixture
+def fake_compilers(monkeypatch):
+    monkeypatch.setattr(compilers, '_compilers', COMPILERS)
+    monkeypatch.setattr(compilers, '_policy', 'matching')
+
+
+@pytest.fixture(scope='module')
+def compiler_library(tmp_path_factory):
+    """A loadable compiler library built from the static one."""
+    cuda_home = os.getenv('CUDA_HOME')
+    archive = cuda_home and os.path.join(cuda_home, 'lib64',
+                                         'libnvptxcompiler_static.a')
+    cxx = shutil.which('g++')
+    if not archive or not os.path.exists(archive) or cxx is None:
+        pytest.skip('Requires CUDA_HOME and g++ to build a compiler library')
+    path = str(tmp_path_factory.mktemp('lib') / 'libnvptxcompiler.so')
+    subprocess.run([cxx, '-shared', '-o', path, '-Wl,--whole-archive',
+                    archive, '-Wl,--no-whole-archive', '-lpthread'],
+                   check=True)
+    return path
+
+
+def test_ptx_isa_version():
+    assert ptx_isa_version(PTX_CODE) == (7, 4)
+    assert ptx_isa_version('// .version 9.9\n  .version 8.0\n') == (8, 0)
+    assert ptx_isa_version('.target sm_52') is None
+
+
+@pytest.mark.parametrize('version, index', [
+    ('7.0', 1),     # Oldest compiler supporting it
+    ('7.2', 1),
+    ('7.3', 0),
+    ('8.1', 2),
+    ('8.8', 2),     # Not supported by any, so the newest
+    ('9.9', 2),     # Unknown, so the newest
+])
+def test_matching_policy(fake_compilers, version, index):
+    assert select_compiler(with_version(version)).index == index
+
+
+def test_newest_policy(fake_compilers):
+    compilers.set_compiler_policy('newest')
+    assert select_compiler(with_version('7.0')).index == 2
+
+
+def test_callable_policy(fake_compilers):
+    seen = []
+
+    def policy(isa_version, available):
+        seen.append(isa_version)
+        return available[0]
+
+    compilers.set_compiler_policy(policy)
+    assert select_compiler(PTX_CODE).index == 0
+    assert seen == [(7, 4)]
+
+
+def test_unknown_policy():
+    with pytest.raises(ValueError):
+        compilers.set_compiler_policy('oldest')
+
+
+def test_load_missing_library():
+    with pytest.raises(OSError, match='Could not load'):
+        _ptxcompilerlib.load_compiler('/nonexistent/libnvptxcompiler.so')
+
+
+def test_compile_with_unknown_index():
+    with pytest.raises(IndexError):
+        _ptxcompilerlib.compile_ptx(PTX_CODE, OPTIONS, None, 1000)
+
+
+def test_load_compiler(compiler_library, monkeypatch):
+    monkeypatch.setattr(compilers, '_compilers', None)
+    compiler = compilers.load_compiler(compiler_library)
+    assert compiler.index > 0
+    assert compiler.version == _ptxcompilerlib.get_version()
+    assert compiler in compilers.get_compilers()
+
+    # Both compilers have the same version, so route to the loaded one
+    monkeypatch.setattr(compilers, '_policy', lambda isa, available: compiler)
+
+    before = compiler_stats()[compiler.index]
+    result = compile_ptx(PTX_CODE, OPTIONS)
+    assert result.compiled_program[:4] == b'\x7fELF'
+    with pytest.raises(RuntimeError):
+        compile_ptx('.target sm_52', OPTIONS)
+
+    stats = compiler_stats()[compiler.index]
+    assert stats['path'] == compiler_library
+    assert stats['compiles'] == before['compiles'] + 2
+    assert stats['failures'] == before['failures'] + 1
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,206 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import textwrap
+import types
+
+from ptxcompiler import compilers, cupy_patch
+from ptxcompiler.tests.test_compilers import COMPILERS
+from ptxcompiler.tests.test_lib import PTX_CODE
+
+CUDADEVRT = '/cuda/lib/libcudadevrt.a'
+
+# The parts of cupy/cuda/compiler.py that turn NVRTC output into a loaded
+# module, as in CuPy 9 to 13: NVRTC produces PTX when the driver is older
+# than NVRTC, which is only linked when relocatable device code needs
+# cudadevrt. Otherwise it is loaded, and cached, as it is.
+COMPILER_SOURCE = textwrap.dedent(f"""
+    from cupy.cuda import function
+
+    def compile_using_nvrtc(source, options):
+        return _nvrtc_output
+
+    def _compile_with_cache_cuda(source, options, cache):
+        mod = function.Module()
+        if source in cache:
+            mod.load(cache[source])
+            return mod
+
+        ptx = compile_using_nvrtc(source, options)
+        if '-rdc=true' in options:
+            ls = function.LinkState()
+            ls.add_ptr_data(ptx, 'cupy.ptx')
+            ls.add_ptr_file({CUDADEVRT!r})
+            cubin = ls.complete()
+        else:
+            cubin = ptx
+        cache[source] = cubin
+        mod.load(cubin)
+        return mod
+""")
+
+
+class DriverLinkState:
+    """Records what the driver's linker was asked to do."""
+    links = []
+
+    def __init__(self):
+        self.inputs = []
+
+    def add_ptr_data(self, data, name):
+        self.inputs.append((data, name))
+
+    def add_ptr_file(self, path):
+        self.inputs.append((path,))
+
+    def complete(self):
+        DriverLinkState.links.append(self.inputs)
+        return b'\x7fELF driver cubin'
+
+
+class DriverModule:
+    """Records the images the driver was asked to load."""
+    loaded = []
+
+    def load(self, image):
+        DriverModule.loaded.append(image)
+        self.image = image
+
+    def load_file(self, path):
+        DriverModule.loaded.append(path)
+        self.image = path
+
+
+class RawModule:
+    def __init__(self, path, **kwargs):
+        with open(path, 'rb') as f:
+            self.cubin = f.read()
+        self.kwargs = kwargs
+
+
+@pytest.fixture
+def fake_cupy(monkeypatch):
+    modules = {}
+    for name in ('cupy', 'cupy.cuda', 'cupy.cuda.compiler',
+                 'cupy.cuda.device', 'cupy.cuda.function'):
+        modules[name] = types.ModuleType(name)
+        monkeypatch.setitem(sys.modules, name, modules[name])
+    cuda = modules['cupy.cuda']
+    modules['cupy'].cuda = cuda
+    modules['cupy'].RawModule = RawModule
+    cuda.compiler = modules['cupy.cuda.compiler']
+    cuda.device = modules['cupy.cuda.device']
+    cuda.function = modules['cupy.cuda.function']
+
+    cuda.function.LinkState = DriverLinkState
+    cuda.function.Module = DriverModule
+    exec(COMPILER_SOURCE, vars(cuda.compiler))
+    cuda.compiler._nvrtc_output = PTX_CODE.encode()
+    device = types.SimpleNamespace(compute_capability='75')
+    cuda.device.Device = lambda: device
+
+    monkeypatch.setattr(DriverLinkState, 'links', [])
+    monkeypatch.setattr(DriverModule, 'loaded', [])
+    return modules['cupy']
+
+
+def compile_kernel(cupy, options=(), cache=None):
+    return cupy.cuda.compiler._compile_with_cache_cuda(
+        'kernel source', options, {} if cache is None else cache)
+
+
+def test_patch_cupy(fake_cupy):
+    assert cupy_patch.patch_cupy()
+    assert not cupy_patch.patch_cupy()
+    function = fake_cupy.cuda.compiler.function
+    assert issubclass(function.Module, DriverModule)
+    assert function.LinkState is DriverLinkState
+    # The function module itself is left alone
+    assert fake_cupy.cuda.function.Module is DriverModule
+
+
+def test_nvrtc_ptx_is_compiled_statically(fake_cupy):
+    cache = {}
+    compile_kernel(fake_cupy, cache=cache)
+    assert DriverModule.loaded == [PTX_CODE.encode()]
+
+    cupy_patch.patch_cupy()
+    mod = compile_kernel(fake_cupy)
+    assert mod.image[:4] == b'\x7fELF'
+    assert DriverModule.loaded[1:] == [mod.image]
+
+    # PTX in CuPy's kernel cache is compiled when it is loaded, too
+    mod = compile_kernel(fake_cupy, cache=cache)
+    assert mod.image[:4] == b'\x7fELF'
+
+
+def test_cubins_are_loaded_unchanged(fake_cupy, monkeypatch):
+    cupy_patch.patch_cupy()
+    monkeypatch.setattr(fake_cupy.cuda.compiler, '_nvrtc_output',
+                        b'\x7fELF nvrtc cubin')
+    assert compile_kernel(fake_cupy).image == b'\x7fELF nvrtc cubin'
+
+
+def test_cudadevrt_links_use_driver(fake_cupy):
+    cupy_patch.patch_cupy()
+    mod = compile_kernel(fake_cupy, options=('-rdc=true',))
+    assert mod.image == b'\x7fELF driver cubin'
+    assert DriverLinkState.links == [[(PTX_CODE.encode(), 'cupy.ptx'),
+                                      (CUDADEVRT,)]]
+
+
+def test_compile_errors_fall_back_to_driver(fake_cupy, monkeypatch):
+    cupy_patch.patch_cupy()
+
+    def fail(ptx, options):
+        raise RuntimeError('compile failed')
+
+    monkeypatch.setattr(cupy_patch, 'compile_ptx', fail)
+    assert compile_kernel(fake_cupy).image == PTX_CODE.encode()
+
+
+def test_ptx_files_are_compiled_statically(fake_cupy, tmp_path):
+    cupy_patch.patch_cupy()
+    path = tmp_path / 'kernel.ptx'
+    path.write_text(PTX_CODE)
+    mod = fake_cupy.cuda.compiler.function.Module()
+    mod.load_file(str(path))
+    assert mod.image[:4] == b'\x7fELF'
+
+
+def test_raw_module_from_ptx(fake_cupy):
+    module = cupy_patch.raw_module_from_ptx(PTX_CODE, name_expressions=())
+    assert module.cubin[:4] == b'\x7fELF'
+    assert module.kwargs == {'name_expressions': ()}
+
+
+def test_bundle_key_uses_selected_compiler(monkeypatch):
+    monkeypatch.setattr(compilers, '_compilers', COMPILERS)
+    monkeypatch.setattr(compilers, '_policy', 'newest')
+    keys = []
+
+    def lookup(key):
+        keys.append(key)
+        return b'\x7fELF bundled'
+
+    monkeypatch.setattr(cupy_patch.bundle, 'lookup', lookup)
+    cubin = cupy_patch.compile_ptx_to_cubin(PTX_CODE, arch='sm_80')
+    assert cubin == b'\x7fELF bundled'
+    assert keys[0].compiler_version == (12, 1)
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,165 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import threading
+
+from ptxcompiler import api, dispatch
+from ptxcompiler.api import submit_compile_ptx
+from ptxcompiler.dispatch import MAX_HANDOFF, PROBE_INTERVAL, InlinePolicy
+from ptxcompiler.pool import CompilePool
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+def test_pool_until_observed():
+    policy = InlinePolicy()
+    assert not policy.run_inline(10)
+    policy.observe_compile(1000, 1e-3)
+    assert not policy.run_inline(10)
+    assert policy.stats()['threshold'] is None
+
+
+def test_threshold():
+    policy = InlinePolicy(factor=2)
+    # 1 us per byte, and 100 us to hand off to the pool
+    policy.observe_compile(1000, 1e-3)
+    policy.observe_handoff(1e-4)
+    assert policy.threshold() == pytest.approx(200)
+    assert policy.run_inline(100)
+    assert not policy.run_inline(1000)
+
+    stats = policy.stats()
+    assert stats['inline'] == 1
+    assert stats['pool'] == 1
+    assert stats['inline_bytes'] == 100
+    assert stats['pool_bytes'] == 1000
+
+
+def test_moving_average():
+    policy = InlinePolicy(smoothing=0.5)
+    policy.observe_handoff(1e-3)
+    policy.observe_handoff(3e-3)
+    assert policy.stats()['handoff_latency'] == pytest.approx(2e-3)
+
+
+def test_handoff_is_capped():
+    policy = InlinePolicy()
+    policy.observe_handoff(10.0)
+    assert policy.stats()['handoff_latency'] == MAX_HANDOFF
+
+
+def test_probe():
+    policy = InlinePolicy()
+    policy.observe_compile(1, 0)
+    policy.observe_handoff(1)
+    decisions = [policy.run_inline(1) for _ in range(PROBE_INTERVAL)]
+    assert decisions.count(False) == 1
+
+
+@pytest.mark.parametrize('mode', ['always', 'never'])
+def test_fixed_modes(mode):
+    policy = InlinePolicy(mode)
+    assert policy.run_inline(1) == (mode == 'always')
+
+
+def test_unknown_mode():
+    with pytest.raises(ValueError):
+        InlinePolicy('sometimes')
+
+
+def test_submit_inline(monkeypatch):
+    monkeypatch.setattr(dispatch, '_policy', InlinePolicy('always'))
+    future = submit_compile_ptx(PTX_CODE, OPTIONS)
+    assert future.done()
+    assert future.result().compiled_program[:4] == b'\x7fELF'
+
+    future = submit_compile_ptx('.target sm_52', OPTIONS)
+    with pytest.raises(RuntimeError, match='Missing .version directive'):
+        future.result()
+
+
+@pytest.fixture
+def pool(monkeypatch):
+    pool = CompilePool(workers=1)
+    monkeypatch.setattr(api, 'get_pool', lambda: pool)
+    yield pool
+    pool.shutdown()
+
+
+def wait_until_idle(pool):
+    while not pool.idle():
+        threading.Event().wait(0.001)
+
+
+def test_submit_pool(monkeypatch, pool):
+    policy = InlinePolicy('never')
+    monkeypatch.setattr(dispatch, '_policy', policy)
+    wait_until_idle(pool)
+    result = submit_compile_ptx(PTX_CODE, OPTIONS).result()
+    assert result.compiled_program[:4] == b'\x7fELF'
+
+    stats = policy.stats()
+    assert stats['pool'] == 1
+    assert stats['handoff_latency'] > 0
+    assert stats['seconds_per_byte'] >= 0
+
+
+def test_queued_jobs_are_not_handoffs(monkeypatch, pool):
+    policy = InlinePolicy('never')
+    monkeypatch.setattr(dispatch, '_policy', policy)
+    started = threading.Event()
+    release = threading.Event()
+
+    def block():
+        started.set()
+        release.wait()
+
+    pool.submit(block)
+    started.wait()
+    future = submit_compile_ptx(PTX_CODE, OPTIONS)
+    release.set()
+    future.result()
+    assert policy.stats()['handoff_latency'] is None
+
+
+def test_submit_inline_runs_on_caller(monkeypatch):
+    monkeypatch.setattr(dispatch, '_policy', InlinePolicy('always'))
+    threads = []
+    monkeypatch.setattr('ptxcompiler.api._compile_ptx',
+                        lambda *args: threads.append(threading.get_ident()))
+    submit_compile_ptx(PTX_CODE, OPTIONS).result()
+    assert threads == [threading.get_ident()]
+
+
+def test_batches_go_to_pool(monkeypatch, pool):
+    policy = InlinePolicy('always')
+    monkeypatch.setattr(dispatch, '_policy', policy)
+    threads = []
+
+    def compile(*args):
+        threads.append(threading.get_ident())
+        return PTX_CODE.encode(), ''
+
+    monkeypatch.setattr('ptxcompiler.api._compile_ptx', compile)
+    api.compile_ptxes([PTX_CODE] * 3, OPTIONS)
+    assert len(threads) == 3
+    assert threading.get_ident() not in threads
+    # A batch of one module can still run inline
+    api.compile_ptxes([PTX_CODE], OPTIONS)
+    assert threads[-1] == threading.get_ident()
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
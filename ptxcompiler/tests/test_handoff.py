@@ -0,0 +1,88 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import pytest
+import socket
+import sys
+import threading
+
+from ptxcompiler.handoff import (CompileWorker, map_sealed, recv_message,
+                                 seal_buffer, send_message)
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+def test_seal_and_map():
+    data = os.urandom(100000)
+    fd = seal_buffer(data)
+    with pytest.raises(PermissionError):
+        os.write(fd, b'x')
+    view = map_sealed(fd)
+    assert view.readonly
+    assert view == data
+
+
+def test_map_empty():
+    assert map_sealed(seal_buffer(b'')) == b''
+
+
+def test_map_unsealed():
+    fd = os.memfd_create('unsealed')
+    os.write(fd, b'data')
+    with pytest.raises(ValueError):
+        map_sealed(fd)
+
+
+def test_messages():
+    a, b = socket.socketpair()
+
+    def send():
+        fd = seal_buffer(b'program')
+        send_message(a, 0, 'log', fd)
+        os.close(fd)
+        # Larger than the socket buffer
+        send_message(a, 1, {'big': 'x' * 1000000})
+
+    with a, b:
+        sender = threading.Thread(target=send)
+        sender.start()
+
+        status, payload, fd = recv_message(b)
+        assert (status, payload) == (0, 'log')
+        assert map_sealed(fd) == b'program'
+
+        status, payload, fd = recv_message(b)
+        assert status == 1
+        assert len(payload['big']) == 1000000
+        assert fd is None
+        sender.join()
+
+
+def test_compile_worker():
+    with CompileWorker() as worker:
+        result = worker.compile_ptx(PTX_CODE, OPTIONS)
+        assert isinstance(result.compiled_program, memoryview)
+        assert result.compiled_program[:4] == b'\x7fELF'
+        assert result.info_log == ''
+
+        with pytest.raises(RuntimeError, match='Missing .version directive'):
+            worker.compile_ptx('.target sm_52', OPTIONS)
+
+        # The worker is still usable after an error
+        result = worker.compile_ptx(PTX_CODE, OPTIONS)
+        assert result.compiled_program[:4] == b'\x7fELF'
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
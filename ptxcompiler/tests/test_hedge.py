@@ -0,0 +1,179 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import threading
+import time
+
+from ptxcompiler import cache as ptx_cache
+from ptxcompiler.api import compile_ptx, compile_ptxes
+from ptxcompiler.cache import CacheManager, MemoryCache
+from ptxcompiler.hedge import MIN_SAMPLES, Hedge
+from ptxcompiler.keys import make_key
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+ENTRY = (b'\x7fELF', 'log')
+
+
+class SlowTier(MemoryCache):
+    """A memory tier that takes ``delay`` seconds to answer lookups."""
+
+    name = 'remote'
+    hedged = True
+
+    def __init__(self, delay):
+        super().__init__()
+        self.delay = delay
+
+    def get(self, key):
+        time.sleep(self.delay)
+        return super().get(key)
+
+
+def slow(seconds, result):
+    def run():
+        time.sleep(seconds)
+        return result
+    return run
+
+
+@pytest.fixture
+def hedge():
+    return Hedge(initial_delay=0.02)
+
+
+def test_delay_follows_percentile():
+    hedge = Hedge(percentile=90, initial_delay=0.05, max_delay=0.5)
+    assert hedge.delay() == 0.05
+    for i in range(100):
+        hedge.observe(i / 1000)
+    assert hedge.delay() == pytest.approx(0.089)
+
+    for i in range(MIN_SAMPLES * 16):
+        hedge.observe(10)
+    assert hedge.delay() == 0.5
+
+
+def test_fast_fetch_is_not_hedged(hedge):
+    compiles = []
+    entry, compiled = hedge.run(lambda: ENTRY, lambda: compiles.append(1))
+    assert (entry, compiled) == (ENTRY, False)
+    assert not compiles
+    assert hedge.stats()['hedged'] == 0
+
+
+def test_fast_miss_compiles(hedge):
+    entry, compiled = hedge.run(lambda: None, lambda: ENTRY)
+    assert (entry, compiled) == (ENTRY, True)
+    assert hedge.stats()['hedged'] == 0
+
+
+def test_slow_fetch_is_hedged(hedge):
+    threads = []
+
+    def compile():
+        threads.append(threading.get_ident())
+        return ENTRY
+
+    start = time.perf_counter()
+    entry, compiled = hedge.run(slow(1, None), compile)
+    assert time.perf_counter() - start < 0.5
+    assert (entry, compiled) == (ENTRY, True)
+    # The compile runs on the calling thread
+    assert threads == [threading.get_ident()]
+    stats = hedge.stats()
+    assert stats['hedged'] == 1
+    assert stats['hedge_rate'] == 1.0
+
+
+def test_queued_fetch_is_cancelled():
+    hedge = Hedge(initial_delay=0.02, fetch_threads=1)
+    release = threading.Event()
+    fetched = []
+
+    def blocked():
+        release.wait()
+
+    def fetch():
+        fetched.append(True)
+        return ENTRY
+
+    # The only fetch thread is busy, so the second lookup stays queued
+    assert hedge.run(blocked, lambda: ENTRY) == (ENTRY, True)
+    assert hedge.run(fetch, lambda: ENTRY) == (ENTRY, True)
+    release.set()
+    hedge._fetch_executor.shutdown()
+    assert fetched == []
+    stats = hedge.stats()
+    assert (stats['hedged'], stats['cancelled_fetches']) == (2, 1)
+
+
+def test_late_hits_are_counted(hedge):
+    entry, compiled = hedge.run(slow(0.05, ENTRY), slow(0.1, (b'', '')))
+    assert (entry, compiled) == ((b'', ''), True)
+    deadline = time.monotonic() + 10
+    while hedge.stats()['late_hits'] != 1:
+        assert time.monotonic() < deadline
+        time.sleep(0.001)
+
+
+def test_manager_hedges_slow_tier(hedge):
+    memory = MemoryCache()
+    remote = SlowTier(1)
+    manager = CacheManager([memory, remote], hedge=hedge)
+    assert manager.hedged_tier == 1
+
+    key = make_key(PTX_CODE, OPTIONS)
+    start = time.perf_counter()
+    assert manager.get_or_compile(key, lambda: ENTRY) == ENTRY
+    assert time.perf_counter() - start < 0.5
+    # The compiled result is stored in every tier
+    assert memory.get(key) == ENTRY
+    assert manager.stats()['remote']['hedge']['hedged'] == 1
+
+
+def test_manager_without_hedge():
+    remote = SlowTier(0)
+    manager = CacheManager([remote])
+    key = make_key(PTX_CODE, OPTIONS)
+    assert manager.get_or_compile(key, lambda: ENTRY) == ENTRY
+    assert manager.get_or_compile(key, lambda: None) == ENTRY
+    assert 'hedge' not in manager.stats()['remote']
+
+
+def test_compile_ptx_hedged(monkeypatch, hedge):
+    remote = SlowTier(1)
+    monkeypatch.setattr(ptx_cache, '_cache',
+                        CacheManager([MemoryCache(), remote], hedge=hedge))
+    threads = set()
+    remote_get = remote.get
+
+    def get(key):
+        threads.add(threading.get_ident())
+        return remote_get(key)
+
+    monkeypatch.setattr(remote, 'get', get)
+    start = time.perf_counter()
+    result = compile_ptx(PTX_CODE, OPTIONS)
+    assert result.compiled_program[:4] == b'\x7fELF'
+    results = compile_ptxes([PTX_CODE] * 2, OPTIONS)
+    assert all(r.compiled_program == result.compiled_program
+               for r in results)
+    assert time.perf_counter() - start < 1
+    assert threading.get_ident() not in threads
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -12,7 +12,9 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import os
 import pytest
+import subprocess
 import sys
 
 from ptxcompiler import _ptxcompilerlib
@@ -112,5 +114,95 @@ def test_get_compiled_program():
     assert compiled_program[:4] == b'\x7fELF'
 
 
+def test_cpu_times():
+    _ptxcompilerlib.reset_cpu_times()
+    handle = _ptxcompilerlib.create(PTX_CODE)
+    try:
+        _ptxcompilerlib.compile(handle, OPTIONS, 'test')
+    finally:
+        _ptxcompilerlib.destroy(handle)
+    compiles, nanoseconds = _ptxcompilerlib.get_cpu_times()['test']
+    assert compiles == 1
+    assert nanoseconds >= 0
+
+
+def test_compile_ptx():
+    compiled_program, info_log = _ptxcompilerlib.compile_ptx(PTX_CODE,
+                                                             OPTIONS)
+    assert compiled_program[:4] == b'\x7fELF'
+    assert info_log == ''
+
+
+def test_compile_ptx_error():
+    with pytest.raises(RuntimeError, match="Missing .version directive"):
+        _ptxcompilerlib.compile_ptx(".target sm_52", OPTIONS)
+
+
+def test_compile_ptx_scratch_reuse():
+    # Once the scratch buffers have grown, further compiles reuse them
+    options = OPTIONS + ('--device-debug',)
+    _ptxcompilerlib.compile_ptx(PTX_CODE, options)
+    before = _ptxcompilerlib.get_scratch_stats()
+    for _ in range(10):
+        _ptxcompilerlib.compile_ptx(PTX_CODE, options)
+    assert _ptxcompilerlib.get_scratch_stats() == before
+
+
+PREINIT_CMD = """\
+from ptxcompiler import _ptxcompilerlib
+assert not _ptxcompilerlib.preinitialize()
+handle = _ptxcompilerlib.create(PTX_CODE)
+_ptxcompilerlib.compile(handle, OPTIONS)
+print(_ptxcompilerlib.wait_for_preinitialization())
+"""
+
+
+def test_preinitialize():
+    # Run in a new process, since pre-initialization happens once
+    env = dict(os.environ, PTXCOMPILER_PREINITIALIZE='1')
+    cmd = (f'PTX_CODE = {PTX_CODE!r}\nOPTIONS = {OPTIONS!r}\n'
+           'import ptxcompiler\n' + PREINIT_CMD)
+    cp = subprocess.run([sys.executable, '-c', cmd], env=env,
+                        capture_output=True, check=True)
+    assert float(cp.stdout) >= 0
+
+
+def test_wait_without_preinitialize():
+    cmd = ('from ptxcompiler import _ptxcompilerlib\n'
+           'print(_ptxcompilerlib.wait_for_preinitialization())')
+    cp = subprocess.run([sys.executable, '-c', cmd], capture_output=True,
+                        check=True)
+    assert cp.stdout.strip() == b'None'
+
+
+PREINIT_THREADS_CMD = """\
+import threading
+from ptxcompiler import _ptxcompilerlib
+
+def compile():
+    for _ in range(20):
+        _ptxcompilerlib.compile_ptx(PTX_CODE, OPTIONS)
+        _ptxcompilerlib.wait_for_preinitialization()
+
+threads = [threading.Thread(target=compile) for _ in range(8)]
+for thread in threads:
+    thread.start()
+_ptxcompilerlib.preinitialize()
+for thread in threads:
+    thread.join()
+print(_ptxcompilerlib.wait_for_preinitialization())
+"""
+
+
+def test_preinitialize_while_compiling():
+    # Compiles and waits on other threads must not deadlock against the
+    # pre-initialization thread
+    cmd = (f'PTX_CODE = {PTX_CODE!r}\nOPTIONS = {OPTIONS!r}\n'
+           + PREINIT_THREADS_CMD)
+    cp = subprocess.run([sys.executable, '-c', cmd], capture_output=True,
+                        check=True, timeout=60)
+    assert float(cp.stdout) >= 0
+
+
 if __name__ == '__main__':
     sys.exit(pytest.main())
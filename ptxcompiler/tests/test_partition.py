@@ -0,0 +1,212 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import re
+import sys
+
+from ptxcompiler import cache as ptx_cache
+from ptxcompiler import partition
+from ptxcompiler.cache import CacheManager, MemoryCache
+from ptxcompiler.partition import (PartitionError, compile_ptx_partitioned,
+                                   partition_ptx)
+from ptxcompiler.tests.test_lib import OPTIONS, PTX_CODE
+
+
+PTX_MODULE = """\
+.version 7.4
+.target sm_52
+.address_size 64
+
+.global .align 4 .u32 counter;
+.extern .func (.param .b32 func_retval0) vprintf(
+        .param .b64 vprintf_param_0,
+        .param .b64 vprintf_param_1
+);
+
+.func (.param .b32 func_retval0) shared_helper(.param .b32 p0)
+{
+        .reg .b32 %r<3>;
+        ld.param.u32 %r1, [p0];
+        add.s32 %r2, %r1, 1;
+        st.param.b32 [func_retval0+0], %r2;
+        ret;
+}
+
+.func (.param .b32 func_retval0) private_helper(.param .b32 p0)
+{
+        .reg .b32 %r<3>;
+        ld.param.u32 %r1, [p0];
+        {
+        .param .b32 param0;
+        st.param.b32 [param0+0], %r1;
+        .param .b32 retval0;
+        call.uni (retval0), shared_helper, (param0);
+        ld.param.b32 %r2, [retval0+0];
+        }
+        st.param.b32 [func_retval0+0], %r2;
+        ret;
+}
+
+.visible .entry kernel_a(.param .u32 kernel_a_param_0)
+{
+        .reg .b32 %r<3>;
+        ld.param.u32 %r1, [kernel_a_param_0];
+        {
+        .param .b32 param0;
+        st.param.b32 [param0+0], %r1;
+        .param .b32 retval0;
+        call.uni (retval0), private_helper, (param0);
+        ld.param.b32 %r2, [retval0+0];
+        }
+        ret;
+}
+
+.visible .entry kernel_b(.param .u32 kernel_b_param_0)
+{
+        .reg .b32 %r<3>;
+        ld.param.u32 %r1, [kernel_b_param_0];
+        {
+        .param .b32 param0;
+        st.param.b32 [param0+0], %r1;
+        .param .b32 retval0;
+        call.uni (retval0), shared_helper, (param0);
+        ld.param.b32 %r2, [retval0+0];
+        }
+        ret;
+}
+
+.visible .entry kernel_c()
+{
+        .reg .b32 %r<2>;
+        atom.global.add.u32 %r1, [counter], 1;
+        ret;
+}
+
+.visible .entry kernel_d()
+{
+        .reg .b32 %r<2>;
+        atom.global.add.u32 %r1, [counter], 2;
+        ret;
+}
+"""
+
+
+def defined_in(unit):
+    return set(re.findall(r'\.(?:entry|func)\s*(?:\([^)]*\)\s*)?(\w+)\([^;]*'
+                          r'\)\s*\{', unit))
+
+
+def unit_defining(units, name):
+    return next(u for u in units if name in defined_in(u))
+
+
+def test_partition():
+    units = partition_ptx(PTX_MODULE, 8)
+    assert len(units) == 4
+
+    names = ['shared_helper', 'private_helper', 'kernel_a', 'kernel_b',
+             'kernel_c', 'kernel_d']
+    for name in names:
+        assert sum(name in defined_in(u) for u in units) == 1
+
+    for unit in units:
+        assert unit.startswith('.version 7.4\n.target sm_52\n')
+        assert '.extern .func (.param .b32 func_retval0) vprintf(' in unit
+
+    # A helper called from only one function stays with its caller
+    assert unit_defining(units, 'private_helper') == \
+        unit_defining(units, 'kernel_a')
+
+    # Functions sharing a variable stay together with it
+    unit = unit_defining(units, 'kernel_c')
+    assert 'kernel_d' in defined_in(unit)
+    assert '.global .align 4 .u32 counter;' in unit
+    assert sum('counter;' in u for u in units) == 1
+
+    # Helpers called from other units get external linkage
+    helper_unit = unit_defining(units, 'shared_helper')
+    assert '.visible .func (.param .b32 func_retval0) shared_helper' in \
+        helper_unit
+    for name in ('kernel_a', 'kernel_b'):
+        unit = unit_defining(units, name)
+        assert unit != helper_unit
+        assert '.extern .func (.param .b32 func_retval0) shared_helper' in \
+            unit
+
+
+def test_partition_limits_units():
+    assert len(partition_ptx(PTX_MODULE, 2)) == 2
+
+
+def test_single_cluster_is_not_partitioned():
+    assert partition_ptx(PTX_CODE, 8) == [PTX_CODE]
+
+
+def test_debug_sections_are_not_partitioned():
+    ptx = PTX_MODULE + '.section .debug_abbrev\n{\n.b8 17\n}\n'
+    with pytest.raises(PartitionError):
+        partition_ptx(ptx, 8)
+
+
+def test_compile_ptx_partitioned():
+    linked = []
+
+    def linker(objects, arch):
+        linked.append((objects, arch))
+        return b'linked'
+
+    result = compile_ptx_partitioned(PTX_MODULE, OPTIONS, units=4,
+                                     linker=linker, min_size=0)
+    assert result.compiled_program == b'linked'
+    objects, arch = linked[0]
+    assert arch == 'sm_75'
+    assert len(objects) == 4
+
+
+def test_compile_ptx_partitioned_is_cached(monkeypatch):
+    monkeypatch.setattr(ptx_cache, '_cache', CacheManager([MemoryCache()]))
+    linked = []
+
+    def linker(objects, arch):
+        linked.append(objects)
+        return b'linked'
+
+    for _ in range(2):
+        result = compile_ptx_partitioned(PTX_MODULE, OPTIONS, units=4,
+                                         linker=linker, min_size=0)
+        assert result.compiled_program == b'linked'
+    assert len(linked) == 1
+
+
+def test_compile_ptx_partitioned_without_nvlink(monkeypatch, caplog):
+    monkeypatch.setattr(partition, 'find_nvlink', lambda: None)
+    monkeypatch.setattr(partition, '_warned_no_nvlink', False)
+    for _ in range(2):
+        result = compile_ptx_partitioned(PTX_MODULE, OPTIONS, units=4,
+                                         min_size=0)
+        assert result.compiled_program[:4] == b'\x7fELF'
+    assert caplog.text.count('nvlink was not found') == 1
+
+
+def test_compile_ptx_partitioned_small_module():
+    def linker(objects, arch):
+        raise AssertionError('Small modules should not be linked')
+
+    result = compile_ptx_partitioned(PTX_MODULE, OPTIONS, linker=linker)
+    assert result.compiled_program[:4] == b'\x7fELF'
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,113 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import threading
+
+from ptxcompiler.api import compile_ptxes, submit_compile_ptx
+from ptxcompiler.pool import TAG_WEIGHTS_ENV, CompilePool, _weights_from_env
+from ptxcompiler.tests.test_lib import PTX_CODE, OPTIONS
+
+
+@pytest.fixture
+def pool():
+    pool = CompilePool(workers=1)
+    yield pool
+    pool.shutdown()
+
+
+def run_blocked(pool, submissions):
+    """Submit jobs while the single worker is blocked, then release it and
+    return the tags in the order their jobs ran."""
+    order = []
+    started = threading.Event()
+    release = threading.Event()
+
+    def block():
+        started.set()
+        release.wait()
+
+    pool.submit(block)
+    started.wait()
+
+    futures = [pool.submit(order.append, tag, tag=tag, **kwargs)
+               for tag, kwargs in submissions]
+    release.set()
+    for future in futures:
+        future.result()
+    return order
+
+
+def test_small_caller_is_not_starved(pool):
+    submissions = [('bulk', {})] * 100 + [('interactive', {})] * 5
+    order = run_blocked(pool, submissions)
+    last = max(i for i, tag in enumerate(order) if tag == 'interactive')
+    assert last < 10
+
+
+def test_weights(pool):
+    pool.set_tag_weight('heavy', 3)
+    submissions = [('heavy', {})] * 40 + [('light', {})] * 40
+    order = run_blocked(pool, submissions)
+    assert order[:40].count('heavy') == 30
+
+
+@pytest.mark.parametrize('weight', [0, -1, float('inf'), float('nan')])
+def test_invalid_weights(pool, weight):
+    with pytest.raises(ValueError, match='finite numbers greater than 0'):
+        pool.set_tag_weight('a', weight)
+
+
+@pytest.mark.parametrize('weights', ['a=0', 'a=fast', 'b=1,a=nan'])
+def test_invalid_weights_from_env(monkeypatch, weights):
+    monkeypatch.setenv(TAG_WEIGHTS_ENV, weights)
+    with pytest.raises(ValueError, match=TAG_WEIGHTS_ENV):
+        _weights_from_env()
+
+
+def test_cost(pool):
+    submissions = [('big', {'cost': 10})] * 10 + [('small', {})] * 10
+    order = run_blocked(pool, submissions)
+    assert order[:11].count('small') == 10
+
+
+def test_stats(pool):
+    run_blocked(pool, [('a', {})] * 3 + [('b', {})])
+    stats = pool.stats()
+    assert stats['a']['submitted'] == 3
+    assert stats['a']['completed'] == 3
+    assert stats['a']['queue_depth'] == 0
+    assert stats['b']['max_wait'] > 0
+
+
+def test_exceptions_propagate(pool):
+    future = pool.submit(int, 'not a number')
+    with pytest.raises(ValueError):
+        future.result()
+
+
+def test_submit_compile_ptx():
+    result = submit_compile_ptx(PTX_CODE, OPTIONS, tag='test').result()
+    assert result.compiled_program[:4] == b'\x7fELF'
+
+
+def test_compile_ptxes():
+    results = compile_ptxes([PTX_CODE] * 4, OPTIONS)
+    assert len(results) == 4
+    assert all(r.compiled_program[:4] == b'\x7fELF' for r in results)
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,227 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import math
+import os
+import pytest
+import sys
+
+from ptxcompiler import precodegen
+from ptxcompiler.precodegen import PrecodegenCache, Uncacheable, kernel_key
+from ptxcompiler.tests.conftest import FAKE_CC as CC, FAKE_NUMBA_VERSION
+
+LIMIT = 4
+OFFSET = (1, 2.5)
+STATE = object()
+
+
+def key(func, argtypes=('float32[::1]',), cc=CC, **options):
+    return kernel_key(func, argtypes, cc, options, FAKE_NUMBA_VERSION)
+
+
+def kernel(x):
+    x[0] = math.sqrt(x[0]) + LIMIT
+
+
+def same_kernel(x):
+    x[0] = math.sqrt(x[0]) + LIMIT
+
+
+def other_kernel(x):
+    x[0] = math.sqrt(x[0]) - LIMIT
+
+
+def test_key_is_stable():
+    assert key(kernel) == key(kernel)
+
+
+def test_key_depends_on_bytecode():
+    assert key(kernel) != key(other_kernel)
+    # The qualified name is part of the key, so identical code in
+    # different functions is not confused
+    assert key(kernel) != key(same_kernel)
+
+
+def test_key_depends_on_target():
+    assert key(kernel) != key(kernel, argtypes=('float64[::1]',))
+    assert key(kernel) != key(kernel, cc=(8, 0))
+    assert key(kernel) != key(kernel, fastmath=True)
+    assert key(kernel) != kernel_key(kernel, ('float32[::1]',), CC, {},
+                                     '0.55.0')
+
+
+def test_key_depends_on_globals(monkeypatch):
+    before = key(kernel)
+    monkeypatch.setitem(globals(), 'LIMIT', 5)
+    assert key(kernel) != before
+
+
+def make_closure(value):
+    def closure(x):
+        x[0] = value
+    return closure
+
+
+def test_key_depends_on_closure():
+    assert key(make_closure(1)) == key(make_closure(1))
+    assert key(make_closure(1)) != key(make_closure(2))
+    assert key(make_closure(OFFSET)) != key(make_closure((1, 2.0)))
+
+
+class FakeDispatcher:
+    def __init__(self, py_func, **targetoptions):
+        self.py_func = py_func
+        self.targetoptions = targetoptions
+
+
+def device_add(x):
+    return x + LIMIT
+
+
+def device_sub(x):
+    return x - LIMIT
+
+
+def test_key_follows_device_functions(monkeypatch):
+    def calls_device(x):
+        x[0] = device(x[0])
+
+    monkeypatch.setitem(globals(), 'device',
+                        FakeDispatcher(device_add, device=True))
+    add = key(calls_device)
+    monkeypatch.setitem(globals(), 'device',
+                        FakeDispatcher(device_sub, device=True))
+    assert key(calls_device) != add
+
+
+def uses_object(x):
+    x[0] = STATE
+
+
+def uses_module(x):
+    x[0] = os.sep
+
+
+def uses_function(x):
+    x[0] = make_closure(1)
+
+
+@pytest.mark.parametrize('func', [uses_object, uses_module, uses_function])
+def test_uncacheable_globals(func):
+    with pytest.raises(Uncacheable):
+        key(func)
+
+
+def test_uncacheable_options():
+    with pytest.raises(Uncacheable):
+        key(kernel, link=['foo.cu'])
+
+
+def test_store_and_load(tmp_path):
+    cache = PrecodegenCache(str(tmp_path))
+    assert cache.get('ab' * 32) is None
+    cache.put('ab' * 32, b'state')
+    assert cache.get('ab' * 32) == b'state'
+    assert not [f for f in os.listdir(tmp_path / 'ab') if f.startswith('.')]
+
+    # Entries from another format version are ignored
+    with open(tmp_path / 'ab' / ('ab' * 32), 'r+b') as f:
+        f.seek(8)
+        f.write(b'\xff')
+    assert cache.get('ab' * 32) is None
+
+
+class FakeCodeLibrary:
+    def __init__(self, cubins):
+        self._cubin_cache = cubins
+        self._linking_files = set()
+
+
+class FakeKernel:
+    compiles = 0
+
+    def __init__(self, py_func, argtypes, **targetoptions):
+        FakeKernel.compiles += 1
+        self.py_func = py_func
+        self._codelibrary = FakeCodeLibrary({})
+
+    def bind(self):
+        self._codelibrary._cubin_cache[CC] = b'\x7fELF'
+
+    def _reduce_states(self):
+        return {'name': self.py_func.__qualname__,
+                'cubins': self._codelibrary._cubin_cache}
+
+    @classmethod
+    def _rebuild(cls, name, cubins):
+        kernel = object.__new__(cls)
+        kernel.name = name
+        kernel._codelibrary = FakeCodeLibrary(cubins)
+        return kernel
+
+
+@pytest.fixture
+def fake_kernel(monkeypatch):
+    monkeypatch.setattr(precodegen, '_installed', False)
+    monkeypatch.setattr(precodegen, '_cache', None)
+    monkeypatch.setattr(FakeKernel, 'compiles', 0)
+    return FakeKernel
+
+
+def compile_and_bind(dispatcher, func):
+    k = dispatcher._Kernel(func, ('float32[::1]',))
+    k.bind()
+    return k
+
+
+def test_install(tmp_path, fake_numba):
+    assert precodegen.install(str(tmp_path))
+    assert not precodegen.install(str(tmp_path))
+
+    compile_and_bind(fake_numba, kernel)
+    assert FakeKernel.compiles == 1
+
+    cached = compile_and_bind(fake_numba, kernel)
+    assert FakeKernel.compiles == 1
+    assert cached.name == 'kernel'
+    assert cached._codelibrary._cubin_cache[CC] == b'\x7fELF'
+
+    compile_and_bind(fake_numba, uses_object)
+    compile_and_bind(fake_numba, uses_object)
+    assert FakeKernel.compiles == 3
+
+    stats = precodegen.get_cache().stats()
+    assert stats['hits'] == 1
+    assert stats['misses'] == 1
+    assert stats['stores'] == 1
+    assert stats['uncacheable'] == 2
+    assert len(stats['uncacheable_reasons']) == 1
+
+
+def test_corrupt_entries_are_misses(tmp_path, fake_numba):
+    precodegen.install(str(tmp_path))
+    compile_and_bind(fake_numba, kernel)
+    for root, _, files in os.walk(tmp_path):
+        for name in files:
+            with open(os.path.join(root, name), 'r+b') as f:
+                f.seek(12)
+                f.write(b'garbage')
+
+    compile_and_bind(fake_numba, kernel)
+    assert FakeKernel.compiles == 2
+    assert precodegen.get_cache().stats()['errors'] == 1
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
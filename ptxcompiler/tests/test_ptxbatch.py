@@ -0,0 +1,111 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import json
+import os
+import pytest
+import subprocess
+import sys
+
+import ptxcompiler
+from ptxcompiler.cache import DiskCache
+from ptxcompiler.keys import make_key
+from ptxcompiler.tests.test_lib import OPTIONS, PTX_CODE
+
+PTXBATCH = os.path.join(os.path.dirname(ptxcompiler.__file__), 'ptxbatch')
+
+pytestmark = pytest.mark.skipif(not os.path.exists(PTXBATCH),
+                                reason='ptxbatch has not been built')
+
+OTHER_PTX = '/* header */\n' + PTX_CODE.replace('_Z1kPf', '_Z6kernelPf')
+
+
+def run(*args, cwd):
+    return subprocess.run([PTXBATCH, *args], cwd=cwd, capture_output=True,
+                          text=True)
+
+
+@pytest.fixture
+def sources(tmp_path):
+    (tmp_path / 'src' / 'sub').mkdir(parents=True)
+    (tmp_path / 'src' / 'a.ptx').write_text(PTX_CODE)
+    (tmp_path / 'src' / 'sub' / 'b.ptx').write_text(OTHER_PTX)
+    return tmp_path
+
+
+def test_directory(sources):
+    cp = run('-j2', '-o', 'out', 'src', '--', *OPTIONS, cwd=sources)
+    assert cp.returncode == 0, cp.stderr
+    assert (sources / 'out' / 'a.cubin').read_bytes()[:4] == b'\x7fELF'
+    assert (sources / 'out' / 'sub' / 'b.cubin').exists()
+
+
+def test_shares_python_cache(sources):
+    cache_dir = sources / 'cache'
+    # Open the cache first, so that ptxbatch has to update its filter
+    cache = DiskCache(str(cache_dir))
+    cp = run('--cache-dir', 'cache', 'src/sub/b.ptx', '--', *OPTIONS,
+             cwd=sources)
+    assert cp.returncode == 0, cp.stderr
+    key = make_key(OTHER_PTX, OPTIONS)
+    compiled_program, _ = cache.get(key)
+    assert compiled_program == (sources / 'src' / 'sub' /
+                                'b.cubin').read_bytes()
+
+    # And results stored by Python are used by ptxbatch
+    cache.put(make_key(PTX_CODE, OPTIONS), b'from python')
+    cp = run('--cache-dir', 'cache', '--report', 'report.json', 'src/a.ptx',
+             '--', *OPTIONS, cwd=sources)
+    assert cp.returncode == 0, cp.stderr
+    assert (sources / 'src' / 'a.cubin').read_bytes() == b'from python'
+    report = json.loads((sources / 'report.json').read_text())
+    assert report['cached'] == 1
+
+
+def test_response_file_and_depfile(sources):
+    (sources / 'args.rsp').write_text('-o out "src/a.ptx"\nsrc/sub/b.ptx\n'
+                                      f'-- {" ".join(OPTIONS)}\n')
+    cp = run('--depfile', 'out.d', '@args.rsp', cwd=sources)
+    assert cp.returncode == 0, cp.stderr
+    assert (sources / 'out.d').read_text() == (
+        'out/a.cubin out/b.cubin: \\\n  src/a.ptx \\\n  src/sub/b.ptx \\\n'
+        '  args.rsp\n')
+
+
+def test_failures(sources):
+    (sources / 'src' / 'bad.ptx').write_text('not PTX')
+    cp = run('-o', 'out', '--report', 'report.json', '--depfile', 'out.d',
+             'src', '--', *OPTIONS, cwd=sources)
+    assert cp.returncode == 1
+    assert 'Missing .version directive' in cp.stderr
+    assert not (sources / 'out.d').exists()
+
+    report = json.loads((sources / 'report.json').read_text())
+    assert (report['compiled'], report['failed']) == (2, 1)
+    statuses = {f['input']: f['status'] for f in report['files']}
+    assert statuses['src/bad.ptx'] == 'failed'
+    assert not (sources / 'out' / 'bad.cubin').exists()
+    assert not [p for p in (sources / 'out').iterdir()
+                if p.name.startswith('.')]
+
+
+def test_duplicate_outputs(sources):
+    (sources / 'src' / 'sub' / 'a.ptx').write_text(PTX_CODE)
+    cp = run('-o', 'out', 'src/a.ptx', 'src/sub/a.ptx', cwd=sources)
+    assert cp.returncode == 2
+    assert 'several inputs' in cp.stderr
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
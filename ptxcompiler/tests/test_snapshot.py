@@ -0,0 +1,159 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import pytest
+import sys
+import time
+
+from ptxcompiler.cache import DiskCache
+from ptxcompiler.keys import make_key
+from ptxcompiler.snapshot import (Snapshot, SnapshotError, export_snapshot,
+                                  import_snapshot, main, merge_snapshots)
+from ptxcompiler.tests.test_lib import PTX_CODE
+
+
+def make_cache(directory, n, arch='sm_75', version=(11, 6), start=0):
+    cache = DiskCache(str(directory))
+    keys = []
+    for i in range(start, start + n):
+        key = make_key(f'{PTX_CODE}\n// {i}\n.global .u32 v{i};',
+                       [f'--gpu-name={arch}'], version=version)
+        cache.put(key, b'\x7fELF' + bytes([i % 256]) * 1000, f'log {i}')
+        keys.append(key)
+    return keys
+
+
+@pytest.mark.parametrize('compression', ['none', 'zlib', 'lzma'])
+def test_round_trip(tmp_path, compression):
+    keys = make_cache(tmp_path / 'source', 20)
+    path = str(tmp_path / 'cache.snap')
+    assert export_snapshot(str(tmp_path / 'source'), path,
+                           compression=compression) == 20
+
+    with Snapshot(path) as snapshot:
+        assert len(snapshot) == 20
+        assert snapshot.compression == compression
+
+    stats = import_snapshot(path, str(tmp_path / 'target'), workers=4)
+    assert stats.imported == 20
+    target = DiskCache(str(tmp_path / 'target'))
+    for i, key in enumerate(keys):
+        compiled_program, info_log = target.get(key)
+        assert info_log == f'log {i}'
+        assert compiled_program[4:] == bytes([i]) * 1000
+
+    # Importing again skips what is already there
+    stats = import_snapshot(path, str(tmp_path / 'target'))
+    assert stats.skipped == 20
+    assert stats.imported == 0
+
+
+def test_export_filters(tmp_path):
+    source = tmp_path / 'source'
+    make_cache(source, 4, arch='sm_75', version=(11, 6))
+    make_cache(source, 3, arch='sm_80', version=(11, 6), start=10)
+    make_cache(source, 2, arch='sm_80', version=(12, 0), start=20)
+    path = str(tmp_path / 'cache.snap')
+
+    assert export_snapshot(str(source), path, archs=['sm_80']) == 5
+    assert export_snapshot(str(source), path,
+                           compiler_versions=[(12, 0)]) == 2
+    assert export_snapshot(str(source), path, archs=['sm_80'],
+                           compiler_versions=[(11, 6)]) == 3
+
+
+def test_export_hotness(tmp_path):
+    source = tmp_path / 'source'
+    keys = make_cache(source, 5)
+    cache = DiskCache(str(source))
+    now = time.time()
+    for i, key in enumerate(keys):
+        # Entry i was last accessed i days ago
+        t = now - i * 86400
+        os.utime(cache.entry_path(key.digest()), (t, t))
+    path = str(tmp_path / 'cache.snap')
+
+    assert export_snapshot(str(source), path, top=2) == 2
+    with Snapshot(path) as snapshot:
+        exported = {r.digest for r in snapshot.records}
+    assert exported == {keys[0].digest(), keys[1].digest()}
+
+    assert export_snapshot(str(source), path,
+                           accessed_within=2.5 * 86400) == 3
+
+
+def test_merge(tmp_path):
+    make_cache(tmp_path / 'a', 10)
+    make_cache(tmp_path / 'b', 10, start=5)
+    a = str(tmp_path / 'a.snap')
+    b = str(tmp_path / 'b.snap')
+    export_snapshot(str(tmp_path / 'a'), a)
+    export_snapshot(str(tmp_path / 'b'), b, compression='lzma')
+
+    merged = str(tmp_path / 'merged.snap')
+    assert merge_snapshots([a, b], merged) == 15
+    with Snapshot(merged) as snapshot:
+        assert snapshot.compression == 'zlib'
+        digests = [r.digest for r in snapshot.records]
+        assert digests == sorted(digests)
+        for record in snapshot.records:
+            snapshot.entry(record)
+
+    assert import_snapshot(merged, str(tmp_path / 'c')).imported == 15
+
+
+def test_corrupt_entry(tmp_path):
+    make_cache(tmp_path / 'source', 3)
+    path = str(tmp_path / 'cache.snap')
+    export_snapshot(str(tmp_path / 'source'), path, compression='none')
+    with Snapshot(path) as snapshot:
+        offset = snapshot.records[1].offset + 50
+    with open(path, 'r+b') as f:
+        f.seek(offset)
+        f.write(b'\xff\xfe')
+
+    stats = import_snapshot(path, str(tmp_path / 'target'))
+    assert stats.imported == 2
+    assert stats.corrupt == 1
+
+
+def test_corrupt_index(tmp_path):
+    make_cache(tmp_path / 'source', 3)
+    path = str(tmp_path / 'cache.snap')
+    export_snapshot(str(tmp_path / 'source'), path)
+    with open(path, 'r+b') as f:
+        f.seek(-10, os.SEEK_END)
+        f.write(b'\0')
+    with pytest.raises(SnapshotError, match='corrupt'):
+        Snapshot(path)
+    # The file is not left mapped
+    with open('/proc/self/maps') as f:
+        assert path not in f.read()
+
+
+def test_cli(tmp_path, capsys):
+    make_cache(tmp_path / 'source', 3)
+    path = str(tmp_path / 'cache.snap')
+    assert main(['export', str(tmp_path / 'source'), path,
+                 '--compiler-version', '11.6']) == 0
+    assert main(['import', path, str(tmp_path / 'target')]) == 0
+    assert main(['info', path]) == 0
+    out = capsys.readouterr().out
+    assert 'Exported 3 entries' in out
+    assert 'Imported 3 entries' in out
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
@@ -0,0 +1,272 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import sys
+import threading
+import time
+import types
+
+from ptxcompiler import speculate
+from ptxcompiler.pool import CompilePool
+from ptxcompiler.speculate import (SPECULATIVE_TAG, Predictor, Speculator,
+                                   load_model, save_model)
+from ptxcompiler.tests.conftest import FAKE_CC
+
+F32 = ('float32[::1]', 'int64')
+F64 = ('float64[::1]', 'int64')
+I32 = ('int32[::1]', 'int64')
+I64 = ('int64[::1]', 'int64')
+
+
+@pytest.fixture
+def pool():
+    pool = CompilePool(workers=1)
+    yield pool
+    pool.shutdown()
+
+
+def test_predicts_function_transitions():
+    predictor = Predictor()
+    for sig in (F32, F64):
+        predictor.observe('a', sig)
+
+    fresh = Predictor(predictor.state())
+    assert fresh.predict('a', F32) == [(F64, 1.0)]
+    # Signatures the function has already seen are not predicted
+    fresh.observe('a', F64)
+    assert fresh.predict('a', F32) == []
+
+
+def test_type_model_applies_across_functions():
+    predictor = Predictor()
+    for sig in (F32, F64, I32, I64):
+        predictor.observe('a', sig)
+
+    # 'b' was never seen, but float32 has been followed by float64
+    assert predictor.predict('b', F32) == [(F64, 0.5)]
+    assert predictor.predict('b', F32, min_probability=0.6) == []
+
+
+def test_accuracy():
+    predictor = Predictor()
+    for sig in (F32, F64, I32):
+        predictor.observe('a', sig)
+
+    predictor = Predictor(predictor.state())
+    predictor.observe('a', F32)
+    predictor.predict('a', F32)
+    predictor.observe('a', F64)
+    predictor.predict('a', F64)
+    predictor.observe('a', I64)
+    stats = predictor.stats()
+    assert stats['observed'] == 3
+    assert stats['evaluated'] == 2
+    assert stats['correct'] == 1
+    assert stats['accuracy'] == 0.5
+
+
+def test_save_merges_processes(tmp_path):
+    path = str(tmp_path / 'model')
+    assert load_model(path) is None
+    for sigs in ((F32, F64), (F32, F64), (F32, I32)):
+        predictor = Predictor(load_model(path))
+        for sig in sigs:
+            predictor.observe('a', sig)
+        save_model(path, predictor)
+
+    state = load_model(path)
+    assert state['transitions']['a'][F32] == {F64: 2, I32: 1}
+    (tmp_path / 'model').write_bytes(b'garbage')
+    assert load_model(path) is None
+
+
+def test_concurrent_saves_are_merged(tmp_path):
+    path = str(tmp_path / 'model')
+    predictors = []
+    for i in range(8):
+        predictor = Predictor()
+        for sig in (F32, F64):
+            predictor.observe(f'f{i}', sig)
+        predictors.append(predictor)
+
+    threads = [threading.Thread(target=save_model, args=(path, predictor))
+               for predictor in predictors]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert len(load_model(path)['transitions']) == 8
+
+
+def test_saved_model_is_capped(tmp_path, monkeypatch):
+    monkeypatch.setattr(speculate, 'MAX_TRANSITIONS', 2)
+    path = str(tmp_path / 'model')
+    predictor = Predictor()
+    for sig in (F32, F64, F32, F64, F32, I32):
+        predictor.observe('a', sig)
+    save_model(path, predictor)
+
+    transitions = load_model(path)['transitions']['a']
+    assert transitions == {F32: {F64: 2}, F64: {F32: 2}}
+
+
+def wait_for_speculation(pool, completed=1):
+    deadline = time.monotonic() + 10
+    while pool.stats().get(SPECULATIVE_TAG, {}).get('completed') != completed:
+        assert time.monotonic() < deadline
+        time.sleep(0.001)
+
+
+def trained_predictor():
+    predictor = Predictor()
+    for sig in (F32, F64):
+        predictor.observe('a', sig)
+    return Predictor(predictor.state())
+
+
+def test_speculator_compiles_predictions(pool):
+    built = []
+
+    def build(function, signature):
+        built.append((function, signature))
+        return f'kernel {signature[0]}'
+
+    speculator = Speculator(trained_predictor(), build, pool=pool)
+    assert speculator.observe('a', F32) is None
+    wait_for_speculation(pool)
+    assert built == [('a', F64)]
+
+    assert speculator.observe('a', F64) == 'kernel float64[::1]'
+    stats = speculator.stats()
+    assert stats['compiled'] == 1
+    assert stats['used'] == 1
+    assert stats['speculation_accuracy'] == 1.0
+    assert stats['accuracy'] == 1.0
+    assert stats['cpu_seconds'] >= 0
+    assert pool.stats()[SPECULATIVE_TAG]['completed'] == 1
+    assert 'used (100%)' in speculator.report()
+
+
+def test_speculator_respects_budget(pool):
+    speculator = Speculator(trained_predictor(), lambda *args: None,
+                            cpu_budget=0, pool=pool)
+    speculator.observe('a', F32)
+    stats = speculator.stats()
+    assert stats.get('compiled', 0) == 0
+    assert stats['over_budget'] == 1
+
+
+def test_speculator_yields_to_busy_pool(pool):
+    release = threading.Event()
+    started = threading.Event()
+
+    def block():
+        started.set()
+        release.wait()
+
+    pool.submit(block)
+    started.wait()
+    pool.submit(lambda: None)
+    speculator = Speculator(trained_predictor(), lambda *args: None,
+                            pool=pool)
+    speculator.observe('a', F32)
+    release.set()
+    assert speculator.stats()['pool_busy'] == 1
+    assert speculator.stats().get('compiled', 0) == 0
+
+
+class FakeKernel:
+    compiles = []
+
+    def __init__(self, py_func, argtypes, **targetoptions):
+        FakeKernel.compiles.append(argtypes)
+        self.py_func = py_func
+        self.argtypes = argtypes
+        self.cubins = {}
+        self._codelibrary = types.SimpleNamespace(
+            get_cubin=lambda cc: self.cubins.setdefault(cc, b'\x7fELF'))
+
+
+@pytest.fixture
+def fake_kernel(monkeypatch, pool):
+    monkeypatch.setattr(speculate, '_installed', False)
+    monkeypatch.setattr(speculate, '_speculator', None)
+    monkeypatch.setattr(speculate, 'get_pool', lambda: pool)
+    monkeypatch.setattr(speculate.atexit, 'register', lambda *args: None)
+    monkeypatch.setattr(FakeKernel, 'compiles', [])
+    return FakeKernel
+
+
+def kernel(x, n):
+    pass
+
+
+def test_install(tmp_path, fake_numba, pool):
+    path = str(tmp_path / 'model')
+    predictor = Predictor()
+    predictor.observe(f'{__name__}.kernel', F32)
+    predictor.observe(f'{__name__}.kernel', F64)
+    save_model(path, predictor)
+
+    assert speculate.install(path)
+    assert not speculate.install(path)
+
+    first = fake_numba._Kernel(kernel, F32, link=[])
+    assert isinstance(first, fake_numba._Kernel)
+    wait_for_speculation(pool)
+    # The likely next signature was compiled, with its cubin
+    assert FakeKernel.compiles == [F32, F64]
+
+    second = fake_numba._Kernel(kernel, F64, link=[])
+    assert FakeKernel.compiles == [F32, F64]
+    assert second.argtypes == F64
+    assert second.cubins == {FAKE_CC: b'\x7fELF'}
+    assert speculate.get_speculator().stats()['used'] == 1
+
+
+def make_closure(value):
+    def closure(x, n):
+        x[0] = value
+    return closure
+
+
+def test_install_closures_share_model(tmp_path, fake_numba, pool):
+    first, second = make_closure(1), make_closure(2)
+    path = str(tmp_path / 'model')
+    predictor = Predictor()
+    predictor.observe(f'{__name__}.{first.__qualname__}', F32)
+    predictor.observe(f'{__name__}.{first.__qualname__}', F64)
+    save_model(path, predictor)
+    speculate.install(path)
+
+    fake_numba._Kernel(first, F32, link=[])
+    wait_for_speculation(pool)
+    assert FakeKernel.compiles == [F32, F64]
+
+    # The closures share a qualified name, so the model applies to both,
+    # but the kernel compiled for the first is not used for the second
+    kernel = fake_numba._Kernel(second, F64, link=[])
+    assert FakeKernel.compiles == [F32, F64, F64]
+    assert kernel.py_func is second
+
+    # Nor is it used for the same function with different options
+    kernel = fake_numba._Kernel(first, F64, link=[], fastmath=True)
+    assert kernel.py_func is first
+    assert FakeKernel.compiles == [F32, F64, F64, F64]
+    assert speculate.get_speculator().stats().get('used', 0) == 0
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
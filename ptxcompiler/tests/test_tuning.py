@@ -0,0 +1,135 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import json
+import pytest
+import sys
+
+from ptxcompiler import tuning
+from ptxcompiler.keys import ptx_hash
+from ptxcompiler.tests.test_lib import PTX_CODE
+from ptxcompiler.tuning import (TuningDatabase, add_entry, add_pattern,
+                                build_database, import_results, load_source,
+                                main, merge_options)
+
+OTHER_PTX = PTX_CODE.replace('_Z1kPf', '_Z6kernelPf')
+
+
+def test_merge_options():
+    options = ['--gpu-name=sm_75', '--maxrregcount=32', '-O3']
+    tuned = ['--maxrregcount=64', '--opt-level=2']
+    assert merge_options(options, tuned) == [
+        '--gpu-name=sm_75', '--maxrregcount=64', '--opt-level=2']
+    assert merge_options(options, []) == options
+
+
+@pytest.fixture
+def database(tmp_path):
+    source = load_source(str(tmp_path / 'missing.json'))
+    add_entry(source, ptx_hash(PTX_CODE), ['--maxrregcount=64'], 'sm_80')
+    add_entry(source, ptx_hash(PTX_CODE), ['--maxrregcount=48'])
+    add_pattern(source, '*kernel*', ['-O2'])
+    path = str(tmp_path / 'tuning.db')
+    assert build_database(source, path) == (2, 1)
+    with TuningDatabase(path) as database:
+        yield database
+
+
+def test_lookup(database):
+    assert database.lookup(PTX_CODE, 'sm_80') == ['--maxrregcount=64']
+    # Falls back to the entry for any architecture
+    assert database.lookup(PTX_CODE, 'sm_75') == ['--maxrregcount=48']
+    # Comments do not change the hash
+    assert database.lookup(PTX_CODE + '// comment\n', 'sm_80') == \
+        ['--maxrregcount=64']
+
+
+def test_lookup_pattern(database):
+    assert database.lookup(OTHER_PTX, 'sm_80') == ['-O2']
+    assert database.lookup('.version 7.4\n', 'sm_80') == []
+
+
+def test_pattern_arch(tmp_path):
+    source = load_source(str(tmp_path / 'source.json'))
+    add_pattern(source, '_Z1kPf', ['-O1'], arch='sm_70')
+    path = str(tmp_path / 'tuning.db')
+    build_database(source, path)
+    with TuningDatabase(path) as database:
+        assert database.lookup(PTX_CODE, 'sm_70') == ['-O1']
+        assert database.lookup(PTX_CODE, 'sm_80') == []
+
+
+def test_replace_entry():
+    source = {'entries': [], 'patterns': []}
+    add_entry(source, 'abc', ['-O1'], 'sm_80')
+    add_entry(source, 'abc', ['-O2'], 'sm_80')
+    assert len(source['entries']) == 1
+    assert source['entries'][0]['options'] == ['-O2']
+
+
+def test_import_results():
+    source = {'entries': [], 'patterns': []}
+    results = [
+        {'ptx': PTX_CODE, 'arch': 'sm_80', 'options': ['-O1'], 'time': 3.0},
+        {'ptx': PTX_CODE, 'arch': 'sm_80', 'options': ['-O3'], 'time': 1.0},
+        {'ptx_hash': 'abc', 'arch': 'sm_80', 'options': ['-O2'],
+         'time': 2.0},
+    ]
+    assert import_results(source, results) == 2
+    best = {e['ptx_hash']: e for e in source['entries']}
+    assert best[ptx_hash(PTX_CODE)]['options'] == ['-O3']
+    assert best[ptx_hash(PTX_CODE)]['time'] == 1.0
+
+
+def test_environment(database, tmp_path, monkeypatch):
+    monkeypatch.setenv(tuning.TUNING_DB_ENV, str(tmp_path / 'tuning.db'))
+    assert tuning.lookup(PTX_CODE, 'sm_80') == ['--maxrregcount=64']
+    monkeypatch.delenv(tuning.TUNING_DB_ENV)
+    assert tuning.lookup(PTX_CODE, 'sm_80') == []
+
+
+def test_unreadable_database(tmp_path, monkeypatch, caplog):
+    missing = str(tmp_path / 'missing.db')
+    corrupt = tmp_path / 'corrupt.db'
+    corrupt.write_bytes(b'not a bundle')
+    for path in (missing, str(corrupt)):
+        caplog.clear()
+        monkeypatch.setenv(tuning.TUNING_DB_ENV, path)
+        assert tuning.lookup(PTX_CODE, 'sm_80') == []
+        assert tuning.lookup(PTX_CODE, 'sm_80') == []
+        # The failure is reported once, and not retried on every lookup
+        assert len(caplog.records) == 1
+        assert 'Could not open tuning database' in caplog.text
+
+
+def test_cli(tmp_path, capsys):
+    ptx = tmp_path / 'kernel.ptx'
+    ptx.write_text(PTX_CODE)
+    results = tmp_path / 'results.jsonl'
+    results.write_text(json.dumps({'ptx': OTHER_PTX, 'arch': 'sm_80',
+                                   'options': ['-O1'], 'time': 1.0}) + '\n')
+    source = str(tmp_path / 'tuning.json')
+    database = str(tmp_path / 'tuning.db')
+
+    assert main(['add', source, str(ptx), '--maxrregcount=40 -O2']) == 0
+    assert main(['add-pattern', source, 'gemm_*', '--', '-O3']) == 0
+    assert main(['import-results', source, str(results)]) == 0
+    assert main(['build', source, database]) == 0
+    assert main(['lookup', database, str(ptx), '--arch', 'sm_80']) == 0
+    assert capsys.readouterr().out.splitlines()[-1] == \
+        '--maxrregcount=40 -O2'
+
+
+if __name__ == '__main__':
+    sys.exit(pytest.main())
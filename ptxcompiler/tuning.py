@@ -0,0 +1,304 @@
+# Copyright (c) 2022, NVIDIA CORPORATION.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""A database of tuned compile options for individual kernels.
+
+Tuned options, such as ``--maxrregcount`` or ``--opt-level``, are recorded in
+a JSON source file with two kinds of entries:
+
+- Exact entries, keyed by the canonical hash of the PTX (see
+  ``ptxcompiler.keys.ptx_hash``) and optionally an architecture.
+- Pattern entries, matching the names of the kernels (``.entry``s) in the PTX
+  against a glob pattern, optionally for one architecture.
+
+The source is compiled into a read-only database file for lookups, which is
+a cubin bundle (see ``ptxcompiler.bundle``) whose payloads are the options as
+JSON: exact entries are found in constant time through its perfect hash
+index, and the pattern entries are stored under a reserved key. The
+database named by ``PTXCOMPILER_TUNING_DB`` is consulted by the Numba patch
+when it builds the options for a compile.
+
+Lookups try an exact entry for the PTX and architecture, then an exact entry
+for the PTX on any architecture, then the patterns in order. Tuned options
+replace options of the same name, and are otherwise added.
+"""
+
+import argparse
+import fnmatch
+import hashlib
+import json
+import logging
+import os
+import re
+import shlex
+import sys
+import tempfile
+
+from ptxcompiler.bundle import CubinBundle, write_bundle
+from ptxcompiler.keys import ptx_hash
+
+TUNING_DB_ENV = 'PTXCOMPILER_TUNING_DB'
+
+logger = logging.getLogger(__name__)
+
+_PATTERNS_DIGEST = hashlib.sha256(b'ptxcompiler tuning patterns').digest()
+_ENTRY_NAME_RE = re.compile(r'\.entry\s+([A-Za-z_$%][\w$]*)')
+
+_database = None
+_database_path = None
+
+
+def entry_digest(hashed, arch=None):
+    """Return the database key for a PTX hash and architecture."""
+    return hashlib.sha256(f'{hashed}\0{arch or ""}'.encode()).digest()
+
+
+def kernel_names(ptx):
+    return _ENTRY_NAME_RE.findall(ptx)
+
+
+def _option_name(option):
+    name = option.split('=', 1)[0].lstrip('-')
+    if name == 'opt-level' or re.fullmatch(r'O\d?', name):
+        return 'opt-level'
+    return name
+
+
+def merge_options(options, tuned):
+    """Return ``options`` with the ``tuned`` options replacing those of the
+    same name, and the rest added."""
+    tuned_names = {_option_name(option) for option in tuned}
+    return [option for option in options
+            if _option_name(option) not in tuned_names] + list(tuned)
+
+
+class TuningDatabase:
+    """A compiled tuning database, mapped into memory."""
+
+    def __init__(self, path):
+        self._bundle = CubinBundle(path)
+        patterns = self._bundle.lookup(_PATTERNS_DIGEST)
+        try:
+            self.patterns = json.loads(bytes(patterns)) if patterns else []
+        except ValueError:
+            self.close()
+            raise
+
+    def lookup(self, ptx, arch=None, hashed=None):
+        """Return the tuned options for the PTX on ``arch`` as a list, or an
+        empty list if there are none. ``hashed`` may give the PTX's
+        ``ptx_hash``, if it has already been computed."""
+        # The patterns take up one entry of the bundle
+        if len(self._bundle) > bool(self.patterns):
+            if hashed is None:
+                hashed = ptx_hash(ptx)
+            for key_arch in (arch, None):
+                options = self._bundle.lookup(entry_digest(hashed, key_arch))
+                if options is not None:
+                    return json.loads(bytes(options))
+
+        if self.patterns:
+            names = kernel_names(ptx)
+            for pattern in self.patterns:
+                if pattern.get('arch') not in (None, arch):
+                    continue
+                if any(fnmatch.fnmatchcase(name, pattern['kernel'])
+                       for name in names):
+                    return pattern['options']
+        return []
+
+    def close(self):
+        self._bundle.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+
+def get_database():
+    """Return the database named by ``PTXCOMPILER_TUNING_DB``, or ``None``
+    if it is not set or cannot be opened."""
+    global _database, _database_path
+
+    path = os.getenv(TUNING_DB_ENV)
+    if path != _database_path:
+        _database = None
+        if path:
+            try:
+                _database = TuningDatabase(path)
+            except (OSError, ValueError) as e:
+                logger.warning('Could not open tuning database %s: %s',
+                               path, e)
+        _database_path = path
+    return _database
+
+
+def lookup(ptx, arch=None, hashed=None):
+    database = get_database()
+    if database is None:
+        return []
+    return database.lookup(ptx, arch, hashed)
+
+
+# Editing and building the source file
+
+
+def load_source(path):
+    """Load a tuning database source file, or return an empty one if it
+    does not exist."""
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except FileNotFoundError:
+        return {'entries': [], 'patterns': []}
+
+
+def save_source(path, source):
+    directory = os.path.dirname(os.path.abspath(path))
+    fd, tmp = tempfile.mkstemp(dir=directory, prefix='.tuning-')
+    try:
+        with os.fdopen(fd, 'w') as f:
+            json.dump(source, f, indent=2, sort_keys=True)
+            f.write('\n')
+        os.replace(tmp, path)
+    except BaseException:
+        os.unlink(tmp)
+        raise
+
+
+def add_entry(source, hashed, options, arch=None, **info):
+    """Record tuned options for a PTX hash, replacing any existing entry for
+    the same hash and architecture. ``info`` is stored alongside for
+    reference."""
+    source['entries'] = [e for e in source['entries']
+                         if (e['ptx_hash'], e.get('arch')) != (hashed, arch)]
+    source['entries'].append(dict(info, ptx_hash=hashed, arch=arch,
+                                  options=list(options)))
+
+
+def add_pattern(source, kernel, options, arch=None):
+    """Record tuned options for kernels whose names match ``kernel``."""
+    source['patterns'] = [p for p in source['patterns']
+                          if (p['kernel'], p.get('arch')) != (kernel, arch)]
+    source['patterns'].append({'kernel': kernel, 'arch': arch,
+                               'options': list(options)})
+
+
+def import_results(source, results):
+    """Add the best options from tuning runs. ``results`` is an iterable of
+    dicts with ``ptx_hash`` (or ``ptx``, the source), ``arch``, ``options``
+    and ``time``, the measured run time of the kernel. For each PTX hash and
+    architecture, the options with the lowest time are recorded. Returns the
+    number of entries added."""
+    best = {}
+    for result in results:
+        hashed = result.get('ptx_hash') or ptx_hash(result['ptx'])
+        key = (hashed, result.get('arch'))
+        if key not in best or result['time'] < best[key]['time']:
+            best[key] = result
+    for (hashed, arch), result in best.items():
+        add_entry(source, hashed, result['options'], arch,
+                  time=result['time'])
+    return len(best)
+
+
+def build_database(source, path):
+    """Compile a source into a database file at ``path``."""
+    entries = [(entry_digest(e['ptx_hash'], e.get('arch')),
+                json.dumps(e['options']).encode())
+               for e in source['entries']]
+    if source['patterns']:
+        entries.append((_PATTERNS_DIGEST,
+                        json.dumps(source['patterns']).encode()))
+    # Payloads are small, so they are only aligned to 8 bytes
+    write_bundle(path, entries, alignment=8)
+    return len(source['entries']), len(source['patterns'])
+
+
+def _read_ptx(path):
+    with open(path) as f:
+        return f.read()
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog='python -m ptxcompiler.tuning',
+                                     description='Manage tuning databases')
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    add = subparsers.add_parser(
+        'add', help='Record tuned options for a PTX file')
+    add.add_argument('source', help='The database source file')
+    add.add_argument('ptx', help='The PTX file')
+    add.add_argument('options', help='The options, e.g. "--maxrregcount=64"')
+    add.add_argument('--arch')
+
+    pattern = subparsers.add_parser(
+        'add-pattern', help='Record tuned options for kernels by name')
+    pattern.add_argument('source')
+    pattern.add_argument('kernel', help='A glob pattern for kernel names')
+    pattern.add_argument('options')
+    pattern.add_argument('--arch')
+
+    results = subparsers.add_parser(
+        'import-results', help='Record the best options from tuning runs')
+    results.add_argument('source')
+    results.add_argument('results', help='A file of JSON results, one per '
+                                         'line')
+
+    build = subparsers.add_parser(
+        'build', help='Compile a database source into a database')
+    build.add_argument('source')
+    build.add_argument('database')
+
+    show = subparsers.add_parser(
+        'lookup', help='Show the tuned options for a PTX file')
+    show.add_argument('database')
+    show.add_argument('ptx')
+    show.add_argument('--arch')
+
+    args = parser.parse_args(argv)
+
+    if args.command == 'lookup':
+        with TuningDatabase(args.database) as database:
+            print(shlex.join(database.lookup(_read_ptx(args.ptx),
+                                             args.arch)))
+        return 0
+
+    source = load_source(args.source)
+    if args.command == 'add':
+        hashed = ptx_hash(_read_ptx(args.ptx))
+        add_entry(source, hashed, shlex.split(args.options), args.arch)
+        save_source(args.source, source)
+        print(f'Recorded options for {hashed}')
+    elif args.command == 'add-pattern':
+        add_pattern(source, args.kernel, shlex.split(args.options),
+                    args.arch)
+        save_source(args.source, source)
+    elif args.command == 'import-results':
+        with open(args.results) as f:
+            n = import_results(source, (json.loads(line) for line in f
+                                        if line.strip()))
+        save_source(args.source, source)
+        print(f'Recorded options for {n} kernels')
+    else:
+        n_entries, n_patterns = build_database(source, args.database)
+        print(f'Wrote {n_entries} entries and {n_patterns} patterns to '
+              f'{args.database}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
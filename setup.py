@@ -43,15 +43,39 @@ module = Extension(
     'ptxcompiler._ptxcompilerlib',
     sources=['ptxcompiler/_ptxcompilerlib.cpp'],
     include_dirs=include_dirs,
-    libraries=['nvptxcompiler_static'],
+    libraries=['nvptxcompiler_static', 'dl'],
     library_dirs=library_dirs,
-    extra_compile_args=['-Wall', '-Werror'],
+    extra_compile_args=['-Wall', '-Werror', '-pthread'],
+    extra_link_args=['-pthread'],
 )
 
+cmdclass = versioneer.get_cmdclass()
+
+
+class build_ext(cmdclass['build_ext']):
+    """Also build the ptxbatch executable, next to the extension module."""
+
+    def run(self):
+        super().run()
+
+        ext_path = self.get_ext_fullpath(module.name)
+        output = os.path.join(os.path.dirname(ext_path), 'ptxbatch')
+        objects = self.compiler.compile(
+            ['ptxcompiler/ptxbatch.cpp'], output_dir=self.build_temp,
+            include_dirs=include_dirs, extra_postargs=['-std=c++17', '-O2',
+                                                       '-Wall', '-Werror',
+                                                       '-pthread'])
+        self.compiler.link_executable(
+            objects, output, libraries=['nvptxcompiler_static', 'pthread'],
+            library_dirs=library_dirs, target_lang='c++')
+
+
+cmdclass['build_ext'] = build_ext
+
 setup(
     name='ptxcompiler',
     version=versioneer.get_version(),
-    cmdclass=versioneer.get_cmdclass(),
+    cmdclass=cmdclass,
     description='NVIDIA PTX Compiler binding',
     ext_modules=[module],
     packages=['ptxcompiler', 'ptxcompiler.tests'],